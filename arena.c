@@ -0,0 +1,165 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Arena allocator
+ *
+ * Description:
+ *   Allocations larger than a block get a block of their own, which is
+ *   chained behind the current one so its free space stays in use.
+ *
+ * Build instructions:
+ *   gcc -c arena.c
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define ALIGN         (sizeof(max_align_t))
+#define ALIGN_UP(n)   (((n) + ALIGN - 1) & ~(ALIGN - 1))
+/* The header is padded so the data of a block is aligned */
+#define HDR_SIZE      ALIGN_UP(sizeof(arena_block_t))
+#define BLOCK_DATA(b) ((char *)(b) + HDR_SIZE)
+
+
+static arena_block_t *new_block(size_t size)
+{
+   arena_block_t *b = malloc(HDR_SIZE + size);
+
+   if (b != NULL)
+   {
+      b->next = NULL;
+      b->size = size;
+      b->used = 0;
+   }
+   return b;
+}
+
+void arena_init_fixed(arena_t *a, void *buf, size_t size)
+{
+   memset(a, 0, sizeof(*a));
+   a->fixed = 1;
+   if (buf == NULL || size < HDR_SIZE)
+      return;
+   a->head = buf;
+   a->head->next = NULL;
+   a->head->size = size - HDR_SIZE;
+   a->head->used = 0;
+}
+
+void *arena_alloc(arena_t *a, size_t size)
+{
+   size_t block_size = a->block_size ? a->block_size : ARENA_BLOCK_SIZE;
+   arena_block_t *b = a->head;
+   void *p;
+
+   size = ALIGN_UP(size ? size : 1);
+   if (b == NULL || b->size - b->used < size)
+   {
+      if (a->fixed)
+         b = NULL;
+      else if (size > block_size / 4 && b != NULL)
+      {
+         /* Large object: own block behind the current one */
+         if ((b = new_block(size)) != NULL)
+         {
+            b->next = a->head->next;
+            a->head->next = b;
+         }
+      }
+      else if ((b = new_block((size > block_size) ? size : block_size)) != NULL)
+      {
+         b->next = a->head;
+         a->head = b;
+      }
+      if (b == NULL)
+      {
+         a->failures++;
+         return NULL;
+      }
+   }
+   p = BLOCK_DATA(b) + b->used;
+   b->used += size;
+   a->used += size;
+   if (a->used > a->peak)
+      a->peak = a->used;
+   memset(p, 0, size);
+   return p;
+}
+
+char *arena_strdup(arena_t *a, const char *s)
+{
+   size_t len;
+   char *p;
+
+   if (s == NULL)
+      return NULL;
+   len = strlen(s) + 1;
+   if ((p = arena_alloc(a, len)) != NULL)
+      memcpy(p, s, len);
+   return p;
+}
+
+void arena_reset(arena_t *a)
+{
+   arena_block_t *b, *next;
+   size_t size = 0;
+
+   a->used = 0;
+   if (a->head == NULL)
+      return;
+   if (a->head->next == NULL)
+   {
+      a->head->used = 0;
+      return;
+   }
+   /* Replace the chain by one block that holds all of it, so the
+      same work does not allocate the next time */
+   for (b = a->head; b != NULL; b = next)
+   {
+      next = b->next;
+      size += b->size;
+      free(b);
+   }
+   a->head = new_block(size);
+}
+
+void arena_free(arena_t *a)
+{
+   arena_block_t *b, *next;
+
+   for (b = a->fixed ? NULL : a->head; b != NULL; b = next)
+   {
+      next = b->next;
+      free(b);
+   }
+   a->head = NULL;
+   a->used = 0;
+}
+
+size_t arena_capacity(const arena_t *a)
+{
+   const arena_block_t *b;
+   size_t size = 0;
+
+   for (b = a->head; b != NULL; b = b->next)
+      size += b->size;
+   return size;
+}
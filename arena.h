@@ -0,0 +1,122 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Arena allocator
+ *
+ * Description:
+ *   Bump allocator over a chain of blocks. Objects are never freed one
+ *   by one, the whole arena is released (or reset for reuse) at once.
+ *   A zeroed arena_t is a valid empty arena. A fixed arena lives in one
+ *   buffer given by the caller and refuses the allocations that don't
+ *   fit instead of growing.
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef arena_h
+#define arena_h
+
+#include <stddef.h>
+
+/* Size of the blocks when arena_t.block_size is 0 */
+#define ARENA_BLOCK_SIZE 4096
+
+typedef struct arena_block
+{
+   struct arena_block *next;
+   size_t size;
+   size_t used;
+} arena_block_t;
+
+typedef struct
+{
+   arena_block_t *head;      /* current block, first of the chain */
+   size_t block_size;        /* 0 = ARENA_BLOCK_SIZE */
+   int fixed;                /* never grows, see arena_init_fixed() */
+   size_t used;              /* bytes allocated since the last reset */
+   size_t peak;              /* high-water mark of used */
+   unsigned long failures;   /* allocations refused */
+} arena_t;
+
+/**********************************************************
+ * Function arena_init_fixed()
+ * 
+ * Description: Make a fixed arena of a buffer, which stays
+ *              owned by the caller
+ * 
+ * Parameters: a (out)    - arena
+ *             buf (in)   - buffer, aligned for any type
+ *             size (in)  - size of buf
+ *********************************************************/
+void arena_init_fixed(arena_t *a, void *buf, size_t size);
+
+/**********************************************************
+ * Function arena_alloc()
+ *
+ * Description: Allocate zeroed memory, aligned for any type
+ *
+ * Parameters: a (in/out) - arena
+ *             size (in)  - number of bytes
+ *
+ * Return:   memory, NULL if out of memory
+ *********************************************************/
+void *arena_alloc(arena_t *a, size_t size);
+
+/**********************************************************
+ * Function arena_strdup()
+ *
+ * Description: Copy a string into the arena
+ *
+ * Parameters: a (in/out) - arena
+ *             s (in)     - string, can be NULL
+ *
+ * Return:   copy, NULL if s is NULL or out of memory
+ *********************************************************/
+char *arena_strdup(arena_t *a, const char *s);
+
+/**********************************************************
+ * Function arena_reset()
+ *
+ * Description: Release all the objects and keep one block
+ *              as large as the whole chain was, so a recurring
+ *              workload allocates from the heap only until
+ *              its peak size is reached. The statistics are
+ *              kept.
+ *
+ * Parameters: a (in/out) - arena
+ *********************************************************/
+void arena_reset(arena_t *a);
+
+/**********************************************************
+ * Function arena_free()
+ *
+ * Description: Release all the blocks, the buffer of a
+ *              fixed arena is left to its owner
+ *
+ * Parameters: a (in/out) - arena
+ *********************************************************/
+void arena_free(arena_t *a);
+
+/**********************************************************
+ * Function arena_capacity()
+ * 
+ * Description: Size of the blocks of the arena
+ * 
+ * Parameters: a (in) - arena
+ *********************************************************/
+size_t arena_capacity(const arena_t *a);
+
+#endif
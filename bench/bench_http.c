@@ -0,0 +1,394 @@
+/******************************************************************************
+ *
+ * Relay card control utility: HTTP request handling micro benchmarks
+ *
+ * Description:
+ *   Measures the per-request CPU cost of the HTTP server code paths
+ *   of crelay.c: URL parsing, GET/POST form data reading, the JSON
+ *   formatters, the web UI page and the complete request dispatch of
+ *   new_process_http_request().
+ *
+ *   Requests are served over in-memory sockets (socketpair), the
+ *   relay cards are provided by the simulated driver without latency,
+ *   so the numbers contain no network or USB time. For every case the
+ *   wall time, the CPU cycles (user space, if perf events are
+ *   available) and the heap allocations per operation are reported.
+ *
+ * Build instructions:
+ *   make bench
+ *
+ * Usage:
+ *   bench/bench_http [-n <iterations>] [-f <case name filter>]
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "data_types.h"
+#include "relay_drv.h"
+
+#define DEFAULT_ITERATIONS 2000
+#define SIM_SERIAL "SIM0001"
+
+/* Functions of crelay.c built with CRELAY_NO_MAIN */
+extern config_t config;
+int count_occurrence(char * str, int c);
+int isNumeric(const char *str);
+int read_httppost_data(FILE* f, char* data, size_t datalen);
+int read_httpget_data(char* buf, char* data, size_t datalen);
+void webui(int sock);
+void send_json_info(int sock, relay_info_t *relay_info);
+void send_json_card(int sock, char * com_port, uint8_t first_relay, uint8_t last_relay, char * serial);
+void send_json_no_device(int sock);
+void send_json_invalid_param(int sock);
+int new_process_http_request(int sock);
+
+/* Benchmark case, run() performs one timed operation */
+typedef struct
+{
+   const char *name;
+   void (*run)(const void *arg);
+   const void *arg;
+   int connection;          /* served over a new in-memory connection */
+} bench_case_t;
+
+/* Heap allocation counters, see the malloc() wrappers below */
+static uint64_t alloc_count = 0;
+static uint64_t alloc_bytes = 0;
+
+static int cycles_fd = -1;
+static int client_fd = -1;
+static int server_fd = -1;
+static char com_port[MAX_COM_PORT_NAME_LEN];
+static uint8_t last_relay;
+static char response[65536];
+
+
+#ifdef __GLIBC__
+/* Count the heap allocations, including the ones done inside libc
+   (fdopen buffers, strdup), by interposing the allocator entry points */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+   alloc_count++;
+   alloc_bytes += size;
+   return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+   alloc_count++;
+   alloc_bytes += nmemb*size;
+   return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+   alloc_count++;
+   alloc_bytes += size;
+   return __libc_realloc(ptr, size);
+}
+#endif
+
+
+static uint64_t now_ns()
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cycles()
+{
+   uint64_t c = 0;
+
+   if (cycles_fd >= 0 && read(cycles_fd, &c, sizeof(c)) != sizeof(c)) c = 0;
+   return c;
+}
+
+static void open_cycle_counter()
+{
+   struct perf_event_attr attr;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = PERF_TYPE_HARDWARE;
+   attr.config = PERF_COUNT_HW_CPU_CYCLES;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   cycles_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+   if (cycles_fd < 0)
+      fprintf(stderr, "CPU cycle counter not available, reporting time only\n");
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t *)a;
+   uint64_t y = *(const uint64_t *)b;
+
+   return (x > y) - (x < y);
+}
+
+
+/**********************************************************
+ * Socket helpers: every response handler closes its socket,
+ * so each operation gets a new in-memory connection
+ *********************************************************/
+static void new_connection(const char *request)
+{
+   int sv[2];
+
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+   {
+      perror("socketpair");
+      exit(1);
+   }
+   client_fd = sv[0];
+   server_fd = sv[1];
+   if (request != NULL && write(client_fd, request, strlen(request)) < 0)
+      perror("write");
+}
+
+static void end_connection()
+{
+   /* Drain the response so the socket buffer never fills up */
+   while (read(client_fd, response, sizeof(response)) > 0)
+      ;
+   close(client_fd);
+   client_fd = -1;
+   server_fd = -1;
+}
+
+
+/**********************************************************
+ * Benchmark cases
+ *********************************************************/
+static void run_url_parse(const void *arg)
+{
+   char url[128];
+   char *nvalue, *nrelay;
+   volatile int vrelay = 0, value = 0;
+
+   /* Same parsing as new_process_http_request() for /api/serial */
+   strcpy(url, arg);
+   switch (count_occurrence(url, '/'))
+   {
+      case 5:
+         nvalue = strrchr(url, '/');
+         nvalue[0] = '\0';
+         nvalue = &(nvalue[1]);
+         value = (isNumeric(nvalue)) ? atoi(nvalue) : -1;
+      case 4:
+         nrelay = strrchr(url, '/');
+         nrelay[0] = '\0';
+         nrelay = &(nrelay[1]);
+         vrelay = atoi(nrelay);
+      case 3:
+         strrchr(url, '/')[0] = '\0';
+         break;
+   }
+   (void)vrelay;
+   (void)value;
+}
+
+static void run_httpget(const void *arg)
+{
+   char url[256];
+   char formdata[64];
+
+   strcpy(url, arg);
+   read_httpget_data(url, formdata, sizeof(formdata));
+}
+
+static void run_httppost(const void *arg)
+{
+   char formdata[64];
+   FILE *f;
+
+   f = fmemopen((void *)arg, strlen(arg), "r");
+   read_httppost_data(f, formdata, sizeof(formdata));
+   fclose(f);
+}
+
+static void run_json_no_device(const void *arg)
+{
+   send_json_no_device(server_fd);
+}
+
+static void run_json_invalid_param(const void *arg)
+{
+   send_json_invalid_param(server_fd);
+}
+
+static void run_json_card(const void *arg)
+{
+   send_json_card(server_fd, com_port, FIRST_RELAY, last_relay, SIM_SERIAL);
+}
+
+static void run_json_info(const void *arg)
+{
+   relay_info_t *relay_info;
+
+   crelay_detect_all_relay_cards(&relay_info);
+   send_json_info(server_fd, relay_info);
+   crelay_free_relay_info(relay_info);
+}
+
+static void run_webui(const void *arg)
+{
+   webui(server_fd);
+}
+
+static void run_request(const void *arg)
+{
+   new_process_http_request(server_fd);
+}
+
+static const char post_request[] =
+   "POST / HTTP/1.1\r\nHost: localhost:8000\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+   "Content-Length: 14\r\n\r\npin=2&status=1";
+
+static const bench_case_t cases[] =
+{
+   { "parse /api/serial/<s>",       run_url_parse, "/api/serial/" SIM_SERIAL },
+   { "parse /api/serial/<s>/<r>/<v>", run_url_parse, "/api/serial/" SIM_SERIAL "/2/1" },
+   { "httpget_data",                run_httpget, "/?pin=2&status=1" },
+   { "httppost_data",               run_httppost, post_request },
+   { "json_no_device",              run_json_no_device, NULL, 1 },
+   { "json_invalid_param",          run_json_invalid_param, NULL, 1 },
+   { "json_card",                   run_json_card, NULL, 1 },
+   { "json_info",                   run_json_info, NULL, 1 },
+   { "webui",                       run_webui, NULL, 1 },
+   { "GET /",                       run_request, "GET / HTTP/1.1\r\n\r\n", 1 },
+   { "GET /api/info",               run_request, "GET /api/info HTTP/1.1\r\n\r\n", 1 },
+   { "GET /api/serial/<s>",         run_request, "GET /api/serial/" SIM_SERIAL " HTTP/1.1\r\n\r\n", 1 },
+   { "GET /api/serial/<s>/<r>",     run_request, "GET /api/serial/" SIM_SERIAL "/2 HTTP/1.1\r\n\r\n", 1 },
+   { "GET /api/serial/<s>/<r>/<v>", run_request, "GET /api/serial/" SIM_SERIAL "/2/1 HTTP/1.1\r\n\r\n", 1 },
+   { "GET /api/card/<r>/<v>",       run_request, "GET /api/card/2/1 HTTP/1.1\r\n\r\n", 1 },
+   { "POST /",                      run_request, post_request, 1 },
+   { "GET /unknown",                run_request, "GET /unknown HTTP/1.1\r\n\r\n", 1 },
+};
+
+
+static void run_case(const bench_case_t *bc, int iterations, uint64_t *ns)
+{
+   uint64_t t, c, cyc = 0, allocs = 0, bytes = 0, sum = 0;
+   uint64_t a0, b0;
+   int i;
+
+   /* Warm up (first detection, libc buffers) */
+   for (i=0; i<10; i++)
+   {
+      if (bc->connection) new_connection(bc->arg);
+      bc->run(bc->arg);
+      if (bc->connection) end_connection();
+   }
+
+   for (i=0; i<iterations; i++)
+   {
+      if (bc->connection) new_connection(bc->arg);
+      a0 = alloc_count;
+      b0 = alloc_bytes;
+      c = cycles();
+      t = now_ns();
+      bc->run(bc->arg);
+      ns[i] = now_ns() - t;
+      cyc += cycles() - c;
+      allocs += alloc_count - a0;
+      bytes += alloc_bytes - b0;
+      if (bc->connection) end_connection();
+   }
+
+   qsort(ns, iterations, sizeof(uint64_t), cmp_u64);
+   for (i=0; i<iterations; i++) sum += ns[i];
+
+   printf("%-30s avg=%8.2fus p50=%8.2fus p99=%8.2fus", bc->name,
+          (double)sum/iterations/1000.0, ns[iterations/2]/1000.0, ns[(iterations*99)/100]/1000.0);
+   if (cycles_fd >= 0)
+      printf(" cycles=%9.0f", (double)cyc/iterations);
+   printf(" allocs=%5.1f bytes=%7.0f\n", (double)allocs/iterations, (double)bytes/iterations);
+}
+
+int main(int argc, char *argv[])
+{
+   const char *filter = NULL;
+   int iterations = DEFAULT_ITERATIONS;
+   uint64_t *ns;
+   int opt, i, k;
+
+   while ((opt = getopt(argc, argv, "n:f:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'n': iterations = atoi(optarg); break;
+         case 'f': filter = optarg; break;
+         default:
+            fprintf(stderr, "Usage: %s [-n <iterations>] [-f <case name filter>]\n", argv[0]);
+            return 1;
+      }
+   }
+   if (iterations <= 0) iterations = DEFAULT_ITERATIONS;
+
+   /* Card mode with one simulated card and relay labels as in a
+      typical configuration */
+   memset((void*)&config, 0, sizeof(config_t));
+   config.sample_cards = 1;
+   config.pulse_duration = 1;
+   config.relay_label.label = arena_alloc(&config.arena, MAX_NUM_RELAYS * sizeof(char *));
+   config.relay_label.num = MAX_NUM_RELAYS;
+   for (k=0; k<MAX_NUM_RELAYS; k++)
+   {
+      char label[16];
+
+      snprintf(label, sizeof(label), "Relay %d", k+1);
+      config.relay_label.label[k] = arena_strdup(&config.arena, label);
+   }
+   if (crelay_detect_relay_card(com_port, &last_relay, SIM_SERIAL, NULL, NO_RELAY_TYPE) != 0)
+   {
+      fprintf(stderr, "Simulated relay card not available\n");
+      return 1;
+   }
+
+   open_cycle_counter();
+   printf("%d iterations per case\n", iterations);
+
+   ns = malloc(iterations*sizeof(uint64_t));
+   for (i=0; i<sizeof(cases)/sizeof(cases[0]); i++)
+   {
+      if (filter == NULL || strstr(cases[i].name, filter) != NULL)
+         run_case(&cases[i], iterations, ns);
+   }
+   free(ns);
+
+   crelay_free_static_mem();
+   crelay_close();
+   return 0;
+}
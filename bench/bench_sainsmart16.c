@@ -0,0 +1,221 @@
+/******************************************************************************
+ * 
+ * Relay card control utility: Sainsmart16 driver micro benchmark
+ * 
+ * Description:
+ *   Measures the latency of single get/set operations of the Sainsmart
+ *   16-channel USB-HID driver on the first (or given) card.
+ *   With -r the device is closed before each operation, which gives the
+ *   cost of opening the device. With -o the driver is bypassed and the
+ *   sequence of the former driver is replayed for comparison: open, read
+ *   command, 1 ms sleep, read, write (set only), close.
+ * 
+ * Build instructions:
+ *   make bench_sainsmart16
+ * 
+ * Usage:
+ *   bench/bench_sainsmart16 [-n <iterations>] [-p <hid path>] [-r|-o]
+ * 
+ * This file is part of crelay.
+ * 
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ * 
+ *****************************************************************************/ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <hidapi/hidapi.h>
+
+#include "relay_drv.h"
+#include "relay_drv_sainsmart16.h"
+
+#define DEFAULT_ITERATIONS 1000
+
+/* Protocol of the former driver, see relay_drv_sainsmart16.c */
+#define CMD_READ  0xD2
+#define CMD_WRITE 0xC3
+#define CMD_SIGNATURE "HIDC"
+
+typedef struct
+{
+   uint8_t  cmd;
+   uint8_t  len;
+   uint16_t bitmap;
+   uint8_t  reserved[6];
+   uint8_t  signature[4];
+   uint16_t chksum;
+} hid_msg_t;
+
+
+static uint64_t now_ns()
+{
+   struct timespec ts;
+   
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t *)a;
+   uint64_t y = *(const uint64_t *)b;
+   
+   return (x > y) - (x < y);
+}
+
+static void init_hid_msg(hid_msg_t *hid_msg, uint8_t cmd, uint16_t bitmap)
+{
+   uint16_t checksum = 0;
+   int i;
+   
+   memset(hid_msg, (cmd == CMD_READ) ? 0x11 : 0x00, sizeof(hid_msg_t));
+   hid_msg->cmd = cmd;
+   hid_msg->len = sizeof(hid_msg_t) - 2;
+   hid_msg->bitmap = bitmap;
+   memcpy(hid_msg->signature, CMD_SIGNATURE, 4);
+   for (i=0; i<hid_msg->len; i++) checksum += *(((uint8_t*)hid_msg)+i);
+   hid_msg->chksum = checksum;
+}
+
+/* The benchmark does not link relay_drv.o, the card list of the
+   detection is allocated on the heap */
+relay_info_t *crelay_new_relay_info()
+{
+   return calloc(1, sizeof(relay_info_t));
+}
+
+/* Get or set relay 1 the way the former driver did: open the device,
+   read the states after a fixed 1 ms sleep, write the new states and
+   close the device again */
+static int old_sequence(char *portname, int set, relay_state_t state)
+{
+   hid_device *hid_dev;
+   hid_msg_t hid_msg;
+   uint16_t bitmap;
+   int r = 0;
+   
+   if ((hid_dev = hid_open_path(portname)) == NULL)
+      return -1;
+   init_hid_msg(&hid_msg, CMD_READ, 0x1111);
+   if (hid_write(hid_dev, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
+      r = -1;
+   usleep(1000);
+   if (r == 0 && hid_read(hid_dev, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
+      r = -1;
+   if (r == 0 && set)
+   {
+      /* Relay 1 is bit 7 of the read bitmap and bit 0 of the written one */
+      bitmap = 0;
+      if (hid_msg.bitmap & (1 << 7)) bitmap |= 1;
+      bitmap = (state == ON) ? (bitmap | 1) : (bitmap & ~1);
+      init_hid_msg(&hid_msg, CMD_WRITE, bitmap);
+      if (hid_write(hid_dev, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
+         r = -1;
+   }
+   hid_close(hid_dev);
+   return r;
+}
+
+static void report(const char *name, uint64_t *samples, int n)
+{
+   uint64_t sum = 0;
+   int i;
+   
+   qsort(samples, n, sizeof(uint64_t), cmp_u64);
+   for (i=0; i<n; i++) sum += samples[i];
+   
+   printf("%-4s n=%-6d min=%8.1fus avg=%8.1fus p50=%8.1fus p99=%8.1fus max=%8.1fus\n",
+          name, n,
+          samples[0]/1000.0, (double)sum/n/1000.0,
+          samples[n/2]/1000.0, samples[(n*99)/100]/1000.0,
+          samples[n-1]/1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+   char portname[MAX_COM_PORT_NAME_LEN*4];
+   char *path = NULL;
+   uint8_t num_relays;
+   relay_state_t rstate;
+   uint64_t *get_ns, *set_ns, t;
+   int iterations = DEFAULT_ITERATIONS;
+   int reopen = 0;
+   int old = 0;
+   int errors = 0;
+   int opt, i;
+   
+   while ((opt = getopt(argc, argv, "n:p:ro")) != -1)
+   {
+      switch (opt)
+      {
+         case 'n': iterations = atoi(optarg); break;
+         case 'p': path = optarg; break;
+         case 'r': reopen = 1; break;
+         case 'o': old = 1; break;
+         default:
+            fprintf(stderr, "Usage: %s [-n <iterations>] [-p <hid path>] [-r|-o]\n", argv[0]);
+            return 1;
+      }
+   }
+   if (iterations <= 0) iterations = DEFAULT_ITERATIONS;
+   
+   if (detect_relay_card_sainsmart_16chan(portname, &num_relays, path, NULL) != 0)
+   {
+      fprintf(stderr, "No Sainsmart 16-channel card detected\n");
+      return 1;
+   }
+   printf("Card %s, %d relays, %d iterations%s\n", portname, num_relays, iterations,
+          old ? ", former driver sequence" : reopen ? ", reopen before each operation" : "");
+   
+   get_ns = malloc(iterations*sizeof(uint64_t));
+   set_ns = malloc(iterations*sizeof(uint64_t));
+   
+   for (i=0; i<iterations; i++)
+   {
+      if (old)
+      {
+         t = now_ns();
+         if (old_sequence(portname, 1, (i & 1) ? OFF : ON) != 0) errors++;
+         set_ns[i] = now_ns() - t;
+         
+         t = now_ns();
+         if (old_sequence(portname, 0, OFF) != 0) errors++;
+         get_ns[i] = now_ns() - t;
+         continue;
+      }
+      
+      if (reopen) close_sainsmart_16chan();
+      t = now_ns();
+      if (set_relay_sainsmart_16chan(portname, FIRST_RELAY, (i & 1) ? OFF : ON, NULL) != 0) errors++;
+      set_ns[i] = now_ns() - t;
+      
+      if (reopen) close_sainsmart_16chan();
+      t = now_ns();
+      if (get_relay_sainsmart_16chan(portname, FIRST_RELAY, &rstate, NULL) != 0) errors++;
+      get_ns[i] = now_ns() - t;
+   }
+   
+   report("set", set_ns, iterations);
+   report("get", get_ns, iterations);
+   printf("errors=%d\n", errors);
+   
+   free(get_ns);
+   free(set_ns);
+   free_static_mem_sainsmart_16chan();
+   return errors ? 1 : 0;
+}
@@ -0,0 +1,612 @@
+/******************************************************************************
+ *
+ * Relay card control utility: HTTP load generator and latency reporter
+ *
+ * Description:
+ *   Replays a weighted mix of HTTP API and web UI requests against a
+ *   running crelay daemon and reports throughput, latency percentiles,
+ *   error counts and a per-endpoint breakdown, optionally as JSON.
+ *
+ *   The daemon closes the connection after each response, so every
+ *   request uses its own non-blocking connection, all of them are
+ *   driven by one epoll loop.
+ *
+ *   Without -r each of the -c connections sends its next request as
+ *   soon as the previous one completed (closed loop). With -r requests
+ *   are started on a fixed schedule (open loop) using at most -c
+ *   connections, the latency is measured from the scheduled start so
+ *   queueing delay caused by a slow daemon is not hidden.
+ *
+ *   Endpoints (weights given with -m, e.g. -m card=4,set=2,webui=1):
+ *     card   /api/card
+ *     relay  /api/card/<r>
+ *     board  /api/board/<c>/<r>
+ *     set    /api/board/<c>/<r>/<v> with -b, /api/card/<r>/<v> without
+ *     info   /api/info
+ *     webui  /
+ *   With -s card, relay and set address the card by serial number
+ *   (/api/serial/<s>, /api/serial/<s>/<r>, /api/serial/<s>/<r>/<v>).
+ *   A request fails on a connect/IO error, a timeout, an HTTP status
+ *   other than 200 or an API error in the JSON response.
+ *
+ * Build instructions:
+ *   make crelay-bench
+ *
+ * Usage:
+ *   bench/crelay-bench [-H <host>] [-p <port>] [-c <connections>]
+ *                      [-r <requests/s>] [-d <seconds> | -n <requests>]
+ *                      [-m <mix>] [-b <boards>] [-s <serial>] [-R <relays>]
+ *                      [-t <timeout ms>] [-j <json file|->]
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define DEFAULT_HOST        "127.0.0.1"
+#define DEFAULT_PORT        "8000"
+#define DEFAULT_CONNECTIONS 8
+#define DEFAULT_DURATION    10
+#define DEFAULT_TIMEOUT_MS  5000
+#define DEFAULT_RELAYS      8
+#define DEFAULT_MIX         "card=4,relay=2,set=2,webui=1"
+#define DEFAULT_BOARD_MIX   "board=4,set=2,webui=1"
+
+#define REQ_LEN   256
+#define RESP_HEAD 512
+
+enum { EP_CARD, EP_RELAY, EP_BOARD, EP_SET, EP_INFO, EP_WEBUI, EP_NUM };
+
+static const char *ep_name[EP_NUM] = { "card", "relay", "board", "set", "info", "webui" };
+
+/* Latency samples and counters of one endpoint */
+typedef struct
+{
+   uint32_t *lat_us;
+   int n, size;
+   int errors;
+   int timeouts;
+   int weight;
+} ep_stats_t;
+
+/* One in-flight request */
+typedef struct
+{
+   int fd;
+   int ep;
+   uint64_t start_ns;
+   char req[REQ_LEN];
+   int req_len, req_sent;
+   char head[RESP_HEAD];
+   int head_len;
+   int api_error;           /* '"error"' seen in the body */
+   char tail[8];            /* body bytes of the previous read, for matches across reads */
+   int tail_len;
+} conn_t;
+
+static ep_stats_t stats[EP_NUM];
+static struct addrinfo *server;
+static char host_hdr[128];
+static int boards = 0;
+static const char *serial = NULL;
+static int relays = DEFAULT_RELAYS;
+static unsigned short rnd[3];
+
+
+static uint64_t now_ns()
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+   uint32_t x = *(const uint32_t *)a;
+   uint32_t y = *(const uint32_t *)b;
+
+   return (x > y) - (x < y);
+}
+
+static int parse_mix(const char *mix)
+{
+   char buf[256], *tok, *save, *eq;
+   int i, total = 0;
+
+   for (i=0; i<EP_NUM; i++) stats[i].weight = 0;
+   snprintf(buf, sizeof(buf), "%s", mix);
+   for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+   {
+      if ((eq = strchr(tok, '=')) == NULL) return -1;
+      *eq = '\0';
+      for (i=0; i<EP_NUM; i++)
+         if (!strcmp(tok, ep_name[i])) break;
+      if (i == EP_NUM || atoi(eq+1) < 0) return -1;
+      stats[i].weight = atoi(eq+1);
+      total += stats[i].weight;
+   }
+   return total > 0 ? 0 : -1;
+}
+
+static int pick_endpoint()
+{
+   int i, total = 0, x;
+
+   for (i=0; i<EP_NUM; i++) total += stats[i].weight;
+   x = nrand48(rnd) % total;
+   for (i=0; i<EP_NUM; i++)
+   {
+      if (x < stats[i].weight) return i;
+      x -= stats[i].weight;
+   }
+   return EP_CARD;
+}
+
+static void build_request(conn_t *c)
+{
+   char url[128];
+   int r = nrand48(rnd) % relays + 1;
+   int b = boards > 0 ? nrand48(rnd) % boards + 1 : 1;
+   int v = nrand48(rnd) & 1;
+
+   if (serial != NULL && (c->ep == EP_CARD || c->ep == EP_RELAY || c->ep == EP_SET))
+   {
+      if (c->ep == EP_CARD) snprintf(url, sizeof(url), "/api/serial/%s", serial);
+      else if (c->ep == EP_RELAY) snprintf(url, sizeof(url), "/api/serial/%s/%d", serial, r);
+      else snprintf(url, sizeof(url), "/api/serial/%s/%d/%d", serial, r, v);
+   }
+   else switch (c->ep)
+   {
+      case EP_CARD:  strcpy(url, "/api/card"); break;
+      case EP_RELAY: sprintf(url, "/api/card/%d", r); break;
+      case EP_BOARD: sprintf(url, "/api/board/%d/%d", b, r); break;
+      case EP_SET:
+         if (boards > 0) sprintf(url, "/api/board/%d/%d/%d", b, r, v);
+         else sprintf(url, "/api/card/%d/%d", r, v);
+         break;
+      case EP_INFO:  strcpy(url, "/api/info"); break;
+      default:       strcpy(url, "/"); break;
+   }
+   c->req_len = snprintf(c->req, REQ_LEN, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                         url, host_hdr);
+   c->req_sent = 0;
+   c->head_len = 0;
+   c->api_error = 0;
+   c->tail_len = 0;
+}
+
+static void record(int ep, uint64_t start_ns, int error, int timeout)
+{
+   ep_stats_t *s = &stats[ep];
+
+   if (error)
+   {
+      s->errors++;
+      if (timeout) s->timeouts++;
+      return;
+   }
+   if (s->n == s->size)
+   {
+      s->size = s->size ? s->size*2 : 4096;
+      s->lat_us = realloc(s->lat_us, s->size*sizeof(uint32_t));
+   }
+   s->lat_us[s->n++] = (now_ns() - start_ns) / 1000;
+}
+
+/**********************************************************
+ * Function start_request()
+ *
+ * Description: Open a non-blocking connection for a new
+ *              request and register it with epoll
+ *
+ * Return:   0 - success
+ *          -1 - failure, recorded as error
+ *********************************************************/
+static int start_request(int epfd, conn_t *c, uint64_t start_ns)
+{
+   struct epoll_event ev;
+   int one = 1;
+
+   c->ep = pick_endpoint();
+   c->start_ns = start_ns;
+   build_request(c);
+
+   c->fd = socket(server->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+   if (c->fd < 0) goto fail;
+   setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   if (connect(c->fd, server->ai_addr, server->ai_addrlen) < 0 && errno != EINPROGRESS) goto fail;
+
+   ev.events = EPOLLOUT;
+   ev.data.ptr = c;
+   if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) goto fail;
+   return 0;
+
+fail:
+   if (c->fd >= 0) close(c->fd);
+   c->fd = -1;
+   record(c->ep, start_ns, 1, 0);
+   return -1;
+}
+
+static void finish_request(conn_t *c, int error, int timeout)
+{
+   int status = 0;
+
+   if (!error)
+   {
+      c->head[c->head_len] = '\0';
+      if (sscanf(c->head, "HTTP/%*d.%*d %d", &status) != 1 || status != 200 || c->api_error) error = 1;
+   }
+   record(c->ep, c->start_ns, error, timeout);
+   close(c->fd);
+   c->fd = -1;
+}
+
+static void scan_body(conn_t *c, const char *buf, int len)
+{
+   char win[sizeof(c->tail) + 64];
+   int n, w;
+
+   /* Look for the API error member, also across read boundaries */
+   while (len > 0 && !c->api_error)
+   {
+      n = len < 64 ? len : 64;
+      memcpy(win, c->tail, c->tail_len);
+      memcpy(win + c->tail_len, buf, n);
+      w = c->tail_len + n;
+      if (memmem(win, w, "\"error\"", 7)) c->api_error = 1;
+      c->tail_len = w < 6 ? w : 6;
+      memcpy(c->tail, win + w - c->tail_len, c->tail_len);
+      buf += n;
+      len -= n;
+   }
+}
+
+/**********************************************************
+ * Function handle_event()
+ *
+ * Description: Progress a request: send the request once
+ *              connected, then read the response until the
+ *              daemon closes the connection
+ *
+ * Return:   1 - request completed
+ *           0 - still in flight
+ *********************************************************/
+static int handle_event(int epfd, conn_t *c, uint32_t events)
+{
+   struct epoll_event ev;
+   char buf[4096], *p;
+   int n, err = 0;
+   socklen_t len = sizeof(err);
+
+   if (c->req_sent < c->req_len)
+   {
+      if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+      {
+         finish_request(c, 1, 0);
+         return 1;
+      }
+      n = write(c->fd, c->req + c->req_sent, c->req_len - c->req_sent);
+      if (n < 0)
+      {
+         if (errno == EAGAIN) return 0;
+         finish_request(c, 1, 0);
+         return 1;
+      }
+      c->req_sent += n;
+      if (c->req_sent == c->req_len)
+      {
+         ev.events = EPOLLIN;
+         ev.data.ptr = c;
+         epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+      }
+      return 0;
+   }
+
+   for (;;)
+   {
+      n = read(c->fd, buf, sizeof(buf));
+      if (n == 0)
+      {
+         finish_request(c, c->head_len == 0, 0);
+         return 1;
+      }
+      if (n < 0)
+      {
+         if (errno == EAGAIN) return 0;
+         finish_request(c, 1, 0);
+         return 1;
+      }
+      p = buf;
+      if (c->head_len < RESP_HEAD - 1)
+      {
+         int keep = RESP_HEAD - 1 - c->head_len;
+         char *eoh;
+
+         if (keep > n) keep = n;
+         memcpy(c->head + c->head_len, buf, keep);
+         c->head_len += keep;
+         c->head[c->head_len] = '\0';
+         if ((eoh = strstr(c->head, "\r\n\r\n")) != NULL)
+         {
+            /* Body starts behind the header, scan only that part */
+            int body_off = (eoh + 4 - c->head) - (c->head_len - keep);
+
+            if (body_off < 0) body_off = 0;
+            p = buf + body_off;
+            n -= body_off;
+         }
+         else
+         {
+            n -= keep;
+            p = buf + keep;
+         }
+      }
+      scan_body(c, p, n);
+   }
+}
+
+static void report_line(FILE *f, const char *name, uint32_t *lat, int n, int errors)
+{
+   uint64_t sum = 0;
+   int i;
+
+   for (i=0; i<n; i++) sum += lat[i];
+   if (n == 0)
+   {
+      fprintf(f, "%-6s n=%-7d errors=%d\n", name, n, errors);
+      return;
+   }
+   fprintf(f, "%-6s n=%-7d min=%8.3fms avg=%8.3fms p50=%8.3fms p99=%8.3fms p999=%8.3fms max=%8.3fms errors=%d\n",
+           name, n, lat[0]/1000.0, (double)sum/n/1000.0, lat[n/2]/1000.0,
+           lat[(int)((uint64_t)n*99/100)]/1000.0, lat[(int)((uint64_t)n*999/1000)]/1000.0,
+           lat[n-1]/1000.0, errors);
+}
+
+static void json_latency(FILE *f, uint32_t *lat, int n)
+{
+   uint64_t sum = 0;
+   int i;
+
+   for (i=0; i<n; i++) sum += lat[i];
+   if (n == 0)
+   {
+      fprintf(f, "{ \"min\": null, \"avg\": null, \"p50\": null, \"p99\": null, \"p999\": null, \"max\": null }");
+      return;
+   }
+   fprintf(f, "{ \"min\": %u, \"avg\": %.1f, \"p50\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u }",
+           lat[0], (double)sum/n, lat[n/2], lat[(int)((uint64_t)n*99/100)],
+           lat[(int)((uint64_t)n*999/1000)], lat[n-1]);
+}
+
+static void usage(const char *prog)
+{
+   fprintf(stderr, "Usage: %s [-H <host>] [-p <port>] [-c <connections>] [-r <requests/s>]\n", prog);
+   fprintf(stderr, "       [-d <seconds> | -n <requests>] [-m <mix>] [-b <boards>] [-s <serial>]\n");
+   fprintf(stderr, "       [-R <relays>] [-t <timeout ms>] [-j <json file|->]\n");
+   fprintf(stderr, "  mix: comma separated <endpoint>=<weight>, endpoints card, relay, board, set, info, webui\n");
+   fprintf(stderr, "       default %s (%s with -b)\n", DEFAULT_MIX, DEFAULT_BOARD_MIX);
+}
+
+int main(int argc, char *argv[])
+{
+   struct addrinfo hints;
+   struct epoll_event events[256];
+   conn_t *conns;
+   const char *host = DEFAULT_HOST;
+   const char *port = DEFAULT_PORT;
+   const char *mix = NULL;
+   const char *json = NULL;
+   int connections = DEFAULT_CONNECTIONS;
+   double rate = 0;
+   double duration = 0;
+   long max_requests = 0;
+   int timeout_ms = DEFAULT_TIMEOUT_MS;
+   long started = 0, inflight = 0, late = 0;
+   uint64_t t0, t_end, t_run, next_ns, interval_ns = 0, now;
+   uint32_t *all;
+   int total_n = 0, total_err = 0, total_to = 0;
+   int opt, i, n, wait_ms;
+   FILE *f;
+
+   while ((opt = getopt(argc, argv, "H:p:c:r:d:n:m:b:s:R:t:j:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'H': host = optarg; break;
+         case 'p': port = optarg; break;
+         case 'c': connections = atoi(optarg); break;
+         case 'r': rate = atof(optarg); break;
+         case 'd': duration = atof(optarg); break;
+         case 'n': max_requests = atol(optarg); break;
+         case 'm': mix = optarg; break;
+         case 'b': boards = atoi(optarg); break;
+         case 's': serial = optarg; break;
+         case 'R': relays = atoi(optarg); break;
+         case 't': timeout_ms = atoi(optarg); break;
+         case 'j': json = optarg; break;
+         default:
+            usage(argv[0]);
+            return 1;
+      }
+   }
+   if (connections <= 0 || relays <= 0 || boards < 0 || rate < 0 || timeout_ms <= 0)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+   if (duration <= 0 && max_requests <= 0) duration = DEFAULT_DURATION;
+   if (mix == NULL) mix = boards > 0 ? DEFAULT_BOARD_MIX : DEFAULT_MIX;
+   if (parse_mix(mix) != 0)
+   {
+      fprintf(stderr, "Invalid mix '%s'\n", mix);
+      usage(argv[0]);
+      return 1;
+   }
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   if ((i = getaddrinfo(host, port, &hints, &server)) != 0)
+   {
+      fprintf(stderr, "Unable to resolve %s:%s (%s)\n", host, port, gai_strerror(i));
+      return 1;
+   }
+   snprintf(host_hdr, sizeof(host_hdr), "%s:%s", host, port);
+
+   rnd[0] = 0x1234;
+   rnd[1] = (unsigned short)getpid();
+   rnd[2] = (unsigned short)time(NULL);
+
+   conns = calloc(connections, sizeof(conn_t));
+   for (i=0; i<connections; i++) conns[i].fd = -1;
+   int epfd = epoll_create1(0);
+
+   printf("Target %s, %d connections, %s", host_hdr, connections, rate > 0 ? "" : "closed loop");
+   if (rate > 0) printf("%.1f requests/s", rate);
+   if (max_requests > 0) printf(", %ld requests", max_requests);
+   else printf(", %.1fs", duration);
+   printf(", mix %s\n", mix);
+
+   t0 = now_ns();
+   t_end = duration > 0 ? t0 + (uint64_t)(duration*1e9) : UINT64_MAX;
+   if (rate > 0) interval_ns = (uint64_t)(1e9 / rate);
+   next_ns = t0;
+
+   for (;;)
+   {
+      now = now_ns();
+
+      /* Start new requests on free connections */
+      int more = (max_requests <= 0 || started < max_requests);
+      for (i=0; i<connections && more; i++)
+      {
+         if (conns[i].fd >= 0) continue;
+         if (rate > 0)
+         {
+            if (next_ns > now || next_ns >= t_end) break;
+            if (now - next_ns > interval_ns) late++;
+            if (start_request(epfd, &conns[i], next_ns) == 0) inflight++;
+            next_ns += interval_ns;
+         }
+         else
+         {
+            if (now >= t_end) break;
+            if (start_request(epfd, &conns[i], now) == 0) inflight++;
+         }
+         started++;
+         more = (max_requests <= 0 || started < max_requests);
+      }
+
+      if (inflight == 0 && (!more || now >= t_end || (rate > 0 && next_ns >= t_end))) break;
+
+      /* Wait for IO, the next scheduled start or the next timeout */
+      wait_ms = 100;
+      if (rate > 0 && next_ns > now && (next_ns - now) / 1000000 < (uint64_t)wait_ms)
+         wait_ms = (next_ns - now) / 1000000;
+      n = epoll_wait(epfd, events, 256, wait_ms);
+      for (i=0; i<n; i++)
+      {
+         if (handle_event(epfd, events[i].data.ptr, events[i].events)) inflight--;
+      }
+
+      /* Expire requests that did not complete in time */
+      now = now_ns();
+      for (i=0; i<connections; i++)
+      {
+         if (conns[i].fd >= 0 && now - conns[i].start_ns > (uint64_t)timeout_ms*1000000)
+         {
+            finish_request(&conns[i], 1, 1);
+            inflight--;
+         }
+      }
+   }
+   t_run = now_ns() - t0;
+
+   /* Text report */
+   all = malloc((started + 1) * sizeof(uint32_t));
+   for (i=0; i<EP_NUM; i++)
+   {
+      qsort(stats[i].lat_us, stats[i].n, sizeof(uint32_t), cmp_u32);
+      memcpy(all + total_n, stats[i].lat_us, stats[i].n * sizeof(uint32_t));
+      total_n += stats[i].n;
+      total_err += stats[i].errors;
+      total_to += stats[i].timeouts;
+   }
+   qsort(all, total_n, sizeof(uint32_t), cmp_u32);
+
+   printf("Requests %ld in %.2fs, %.1f requests/s, %d errors (%d timeouts)",
+          started, t_run/1e9, total_n/(t_run/1e9), total_err, total_to);
+   if (rate > 0) printf(", %ld started late", late);
+   printf("\n");
+   for (i=0; i<EP_NUM; i++)
+   {
+      if (stats[i].n + stats[i].errors > 0)
+         report_line(stdout, ep_name[i], stats[i].lat_us, stats[i].n, stats[i].errors);
+   }
+   report_line(stdout, "total", all, total_n, total_err);
+
+   /* Machine readable report, latencies in us */
+   if (json != NULL)
+   {
+      f = strcmp(json, "-") ? fopen(json, "w") : stdout;
+      if (f == NULL)
+      {
+         perror(json);
+      }
+      else
+      {
+         fprintf(f, "{\n  \"target\": \"%s\", \"connections\": %d, \"rate\": %.1f, \"mix\": \"%s\",\n",
+                 host_hdr, connections, rate, mix);
+         fprintf(f, "  \"duration_s\": %.3f, \"requests\": %ld, \"completed\": %d, \"errors\": %d, \"timeouts\": %d, \"late\": %ld,\n",
+                 t_run/1e9, started, total_n, total_err, total_to, late);
+         fprintf(f, "  \"throughput_rps\": %.1f,\n  \"latency_us\": ", total_n/(t_run/1e9));
+         json_latency(f, all, total_n);
+         fprintf(f, ",\n  \"endpoints\": {");
+         for (n=0, i=0; i<EP_NUM; i++)
+         {
+            if (stats[i].n + stats[i].errors == 0) continue;
+            fprintf(f, "%s\n    \"%s\": { \"completed\": %d, \"errors\": %d, \"timeouts\": %d, \"latency_us\": ",
+                    n++ ? "," : "", ep_name[i], stats[i].n, stats[i].errors, stats[i].timeouts);
+            json_latency(f, stats[i].lat_us, stats[i].n);
+            fprintf(f, " }");
+         }
+         fprintf(f, "\n  }\n}\n");
+         if (f != stdout) fclose(f);
+      }
+   }
+
+   for (i=0; i<EP_NUM; i++) free(stats[i].lat_us);
+   free(all);
+   free(conns);
+   close(epfd);
+   freeaddrinfo(server);
+   return total_err ? 1 : 0;
+}
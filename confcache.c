@@ -0,0 +1,286 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Compiled configuration image
+ *
+ * Description:
+ *   Builder and loader of the binary configuration image. The image is
+ *   only trusted when it is newer than the configuration file and its
+ *   checksum matches, otherwise the daemon parses the text file.
+ *
+ * Build instructions:
+ *   gcc -c confcache.c
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "confcache.h"
+
+/* Limit of the image size, offsets are 32 bits */
+#define CONFCACHE_MAX_SIZE (256u*1024*1024)
+
+
+uint32_t confcache_hash(uint32_t h, const void *data, size_t len)
+{
+   const uint8_t *p = data;
+
+   if (h == 0) h = 2166136261u;
+   while (len--)
+   {
+      h ^= *p++;
+      h *= 16777619u;
+   }
+   return h;
+}
+
+static void *grow(confcache_t *cc, void *p, uint32_t n, size_t elem)
+{
+   void *np;
+
+   /* Start with 16 entries, double the capacity when it is reached */
+   if (n != 0 && (n < 16 || (n & (n-1)) != 0))
+      return p;
+   if ((np = realloc(p, (n ? 2*n : 16) * elem)) == NULL)
+      cc->error = 1;
+   return np;
+}
+
+uint32_t confcache_add_str(confcache_t *cc, const char *s)
+{
+   uint32_t len, ref;
+   char *np;
+
+   if (s == NULL || cc->error)
+      return CONFCACHE_NULL;
+   len = strlen(s) + 1;
+   if (cc->strings_size + len > cc->strings_alloc)
+   {
+      uint32_t alloc = cc->strings_alloc ? cc->strings_alloc : 4096;
+
+      while (alloc < cc->strings_size + len) alloc *= 2;
+      if (alloc > CONFCACHE_MAX_SIZE || (np = realloc(cc->strings, alloc)) == NULL)
+      {
+         cc->error = 1;
+         return CONFCACHE_NULL;
+      }
+      cc->strings = np;
+      cc->strings_alloc = alloc;
+   }
+   ref = cc->strings_size;
+   memcpy(cc->strings + ref, s, len);
+   cc->strings_size += len;
+   return ref;
+}
+
+uint32_t confcache_add_labels(confcache_t *cc, const char **label, uint32_t num)
+{
+   uint32_t first = cc->num_labels;
+   uint32_t *labels;
+   uint32_t i;
+
+   for (i=0; i<num && !cc->error; i++)
+   {
+      uint32_t ref = confcache_add_str(cc, label[i]);
+
+      if ((labels = grow(cc, cc->labels, cc->num_labels, sizeof(*labels))) == NULL)
+         break;
+      cc->labels = labels;
+      cc->labels[cc->num_labels++] = ref;
+   }
+   return first;
+}
+
+void confcache_add_slot(confcache_t *cc, uint64_t v)
+{
+   uint64_t *slots;
+
+   if (cc->error || (slots = grow(cc, cc->slots, cc->num_slots, sizeof(*slots))) == NULL)
+      return;
+   cc->slots = slots;
+   cc->slots[cc->num_slots++] = v;
+}
+
+void confcache_add_board(confcache_t *cc, const confcache_board_t *b)
+{
+   confcache_board_t *boards;
+
+   if (cc->error || (boards = grow(cc, cc->boards, cc->num_boards, sizeof(*boards))) == NULL)
+      return;
+   cc->boards = boards;
+   cc->boards[cc->num_boards++] = *b;
+}
+
+static void confcache_free(confcache_t *cc)
+{
+   free(cc->slots);
+   free(cc->boards);
+   free(cc->labels);
+   free(cc->strings);
+   memset(cc, 0, sizeof(*cc));
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+   const char *p = data;
+   ssize_t n;
+
+   while (len > 0)
+   {
+      if ((n = write(fd, p, len)) < 0)
+      {
+         if (errno == EINTR) continue;
+         return -1;
+      }
+      p += n;
+      len -= n;
+   }
+   return 0;
+}
+
+int confcache_write(confcache_t *cc, uint32_t layout, const char *path)
+{
+   confcache_hdr_t hdr;
+   char tmp[4096];
+   size_t slots_len = cc->num_slots * sizeof(uint64_t);
+   size_t boards_len = cc->num_boards * sizeof(confcache_board_t);
+   size_t labels_len = cc->num_labels * sizeof(uint32_t);
+   int fd, ret = -1;
+
+   if (cc->error)
+   {
+      confcache_free(cc);
+      errno = ENOMEM;
+      return -1;
+   }
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, CONFCACHE_MAGIC, sizeof(hdr.magic));
+   hdr.version = CONFCACHE_VERSION;
+   hdr.layout = layout;
+   hdr.size = sizeof(hdr) + slots_len + boards_len + labels_len + cc->strings_size;
+   hdr.num_slots = cc->num_slots;
+   hdr.num_boards = cc->num_boards;
+   hdr.num_labels = cc->num_labels;
+   hdr.strings_size = cc->strings_size;
+   hdr.checksum = confcache_hash(0, cc->slots, slots_len);
+   hdr.checksum = confcache_hash(hdr.checksum, cc->boards, boards_len);
+   hdr.checksum = confcache_hash(hdr.checksum, cc->labels, labels_len);
+   hdr.checksum = confcache_hash(hdr.checksum, cc->strings, cc->strings_size);
+
+   snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+   if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0)
+   {
+      if (write_all(fd, &hdr, sizeof(hdr)) == 0 &&
+          write_all(fd, cc->slots, slots_len) == 0 &&
+          write_all(fd, cc->boards, boards_len) == 0 &&
+          write_all(fd, cc->labels, labels_len) == 0 &&
+          write_all(fd, cc->strings, cc->strings_size) == 0 &&
+          fsync(fd) == 0)
+      {
+         ret = 0;
+      }
+      close(fd);
+      if (ret == 0 && rename(tmp, path) != 0)
+         ret = -1;
+      if (ret != 0)
+         unlink(tmp);
+   }
+   confcache_free(cc);
+   return ret;
+}
+
+static int check_ref(const confcache_hdr_t *h, uint32_t ref)
+{
+   return ref == CONFCACHE_NULL || ref < h->strings_size;
+}
+
+const confcache_hdr_t *confcache_map(const char *path, const char *conf, uint32_t layout, size_t *size)
+{
+   const confcache_hdr_t *h;
+   const confcache_board_t *b;
+   struct stat st, cst;
+   uint32_t i, k;
+   void *p;
+   int fd;
+
+   if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+      return NULL;
+   if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(confcache_hdr_t) || st.st_size > CONFCACHE_MAX_SIZE)
+   {
+      close(fd);
+      return NULL;
+   }
+   /* An edited configuration file invalidates the image */
+   if (stat(conf, &cst) == 0 &&
+       (st.st_mtim.tv_sec < cst.st_mtim.tv_sec ||
+        (st.st_mtim.tv_sec == cst.st_mtim.tv_sec && st.st_mtim.tv_nsec <= cst.st_mtim.tv_nsec)))
+   {
+      close(fd);
+      return NULL;
+   }
+   p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED)
+      return NULL;
+
+   h = p;
+   if (memcmp(h->magic, CONFCACHE_MAGIC, sizeof(h->magic)) || h->version != CONFCACHE_VERSION ||
+       h->layout != layout || h->size != (uint64_t)st.st_size ||
+       (uint64_t)sizeof(*h) + (uint64_t)h->num_slots * sizeof(uint64_t) +
+       (uint64_t)h->num_boards * sizeof(confcache_board_t) +
+       (uint64_t)h->num_labels * sizeof(uint32_t) + h->strings_size != h->size ||
+       confcache_hash(0, (const char *)p + sizeof(*h), h->size - sizeof(*h)) != h->checksum ||
+       (h->strings_size > 0 && CONFCACHE_STRINGS(h)[h->strings_size-1] != '\0'))
+   {
+      munmap(p, st.st_size);
+      return NULL;
+   }
+   for (i=0, b=CONFCACHE_BOARDS(h); i<h->num_boards; i++, b++)
+   {
+      if (!check_ref(h, b->serial) || !check_ref(h, b->comment) ||
+          (uint64_t)b->labels + b->num_labels > h->num_labels)
+      {
+         munmap(p, st.st_size);
+         return NULL;
+      }
+   }
+   for (k=0; k<h->num_labels; k++)
+   {
+      if (!check_ref(h, CONFCACHE_LABELS(h)[k]))
+      {
+         munmap(p, st.st_size);
+         return NULL;
+      }
+   }
+   *size = st.st_size;
+   return h;
+}
+
+void confcache_unmap(const void *image, size_t size)
+{
+   if (image != NULL)
+      munmap((void *)image, size);
+}
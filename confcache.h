@@ -0,0 +1,193 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Compiled configuration image
+ *
+ * Description:
+ *   Binary image of the configuration written by "crelay --compile-config"
+ *   and mapped read-only by the daemon, so labels and board data are
+ *   used in place without parsing or allocating them.
+ *
+ *   Layout (native byte order):
+ *     confcache_hdr_t
+ *     uint64_t slots[num_slots]          values of the global keys
+ *     confcache_board_t boards[num_boards]
+ *     uint32_t labels[num_labels]        string references of the labels
+ *     char strings[strings_size]         NUL terminated strings
+ *
+ *   Strings are referenced by their offset in the string table,
+ *   CONFCACHE_NULL stands for a missing string. A label list is a
+ *   range of the label table, as a slot its first entry is in the low
+ *   and its length in the high 32 bits. The layout id is
+ *   computed by the caller from its key table, an image written with
+ *   another key table is ignored.
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef confcache_h
+#define confcache_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONFCACHE_MAGIC   "CRLYCONF"
+#define CONFCACHE_VERSION 2
+#define CONFCACHE_NULL    0xffffffffu
+
+typedef struct
+{
+   char     magic[8];
+   uint32_t version;
+   uint32_t layout;         /* key table id of the writer */
+   uint32_t size;           /* size of the whole image */
+   uint32_t checksum;       /* FNV-1a of everything after the header */
+   uint32_t num_slots;
+   uint32_t num_boards;
+   uint32_t num_labels;
+   uint32_t strings_size;
+} confcache_hdr_t;
+
+typedef struct
+{
+   uint16_t card_id;
+   uint8_t  serial_type;
+   uint8_t  num_relays;
+   uint8_t  model;
+   uint8_t  num_labels;
+   uint8_t  reserved[2];
+   uint32_t serial;
+   uint32_t comment;
+   uint32_t labels;         /* first entry in the label table */
+} confcache_board_t;
+
+/* Image under construction */
+typedef struct
+{
+   uint64_t          *slots;
+   uint32_t           num_slots;
+   confcache_board_t *boards;
+   uint32_t           num_boards;
+   uint32_t          *labels;
+   uint32_t           num_labels;
+   char              *strings;
+   uint32_t           strings_size;
+   uint32_t           strings_alloc;
+   int                error;
+} confcache_t;
+
+/* Parts of a mapped image */
+#define CONFCACHE_SLOTS(h)   ((const uint64_t *)((const char *)(h) + sizeof(confcache_hdr_t)))
+#define CONFCACHE_BOARDS(h)  ((const confcache_board_t *)(CONFCACHE_SLOTS(h) + (h)->num_slots))
+#define CONFCACHE_LABELS(h)  ((const uint32_t *)(CONFCACHE_BOARDS(h) + (h)->num_boards))
+#define CONFCACHE_STRINGS(h) ((const char *)(CONFCACHE_LABELS(h) + (h)->num_labels))
+#define CONFCACHE_STR(h, r)  (((r) == CONFCACHE_NULL) ? NULL : CONFCACHE_STRINGS(h) + (r))
+
+/**********************************************************
+ * Function confcache_add_str()
+ *
+ * Description: Append a string to the string table
+ *
+ * Parameters: cc (in/out) - image under construction
+ *             s (in)      - string, can be NULL
+ *
+ * Return:   string reference
+ *********************************************************/
+uint32_t confcache_add_str(confcache_t *cc, const char *s);
+
+/**********************************************************
+ * Function confcache_add_labels()
+ *
+ * Description: Append a label list to the label table
+ *
+ * Parameters: cc (in/out) - image under construction
+ *             label (in)  - labels, NULL entries allowed
+ *             num (in)    - number of labels
+ *
+ * Return:   index of the first label in the label table
+ *********************************************************/
+uint32_t confcache_add_labels(confcache_t *cc, const char **label, uint32_t num);
+
+/**********************************************************
+ * Function confcache_add_slot()
+ *
+ * Description: Append the value of a global key
+ *
+ * Parameters: cc (in/out) - image under construction
+ *             v (in)      - value or string reference
+ *********************************************************/
+void confcache_add_slot(confcache_t *cc, uint64_t v);
+
+/**********************************************************
+ * Function confcache_add_board()
+ *
+ * Description: Append a board record
+ *
+ * Parameters: cc (in/out) - image under construction
+ *             b (in)      - board record
+ *********************************************************/
+void confcache_add_board(confcache_t *cc, const confcache_board_t *b);
+
+/**********************************************************
+ * Function confcache_write()
+ *
+ * Description: Write the image, the file is replaced
+ *              atomically. The image is freed.
+ *
+ * Parameters: cc (in)     - image
+ *             layout (in) - key table id
+ *             path (in)   - image file
+ *
+ * Return:   0 - success, -1 - failure (errno set)
+ *********************************************************/
+int confcache_write(confcache_t *cc, uint32_t layout, const char *path);
+
+/**********************************************************
+ * Function confcache_map()
+ *
+ * Description: Map an image read-only if it is newer than
+ *              the configuration file and passes the
+ *              version, layout, size and checksum checks
+ *
+ * Parameters: path (in)   - image file
+ *             conf (in)   - configuration file
+ *             layout (in) - expected key table id
+ *             size (out)  - size of the mapping
+ *
+ * Return:   mapped header, NULL if the image can't be used
+ *********************************************************/
+const confcache_hdr_t *confcache_map(const char *path, const char *conf, uint32_t layout, size_t *size);
+
+/**********************************************************
+ * Function confcache_unmap()
+ *
+ * Description: Unmap an image returned by confcache_map()
+ *********************************************************/
+void confcache_unmap(const void *image, size_t size);
+
+/**********************************************************
+ * Function confcache_hash()
+ *
+ * Description: FNV-1a hash, used for the checksum and the
+ *              layout id
+ *
+ * Parameters: h (in)    - previous hash, 0 to start
+ *             data (in) - data
+ *             len (in)  - length of data
+ *********************************************************/
+uint32_t confcache_hash(uint32_t h, const void *data, size_t len);
+
+#endif
@@ -40,21 +40,38 @@
  
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <limits.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
 #include <signal.h>
 #include <syslog.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/inotify.h>
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
 
 #include "data_types.h"
 #include "config.h"
+#include "confcache.h"
+#include "metrics.h"
+#include "trace.h"
+#include "logger.h"
+#include "ctl.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "crelay_shm.h"
+#include "handoff.h"
+#include "crelay_probes.h"
 #include "relay_drv.h"
 
 #define VERSION "0.30"
@@ -65,6 +82,8 @@
 #define PROTOCOL "HTTP/1.1"
 #define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
 #define DEFAULT_SERVER_PORT 8000
+/* Bound of each read and write of a request, the signals wait for it */
+#define HTTP_IO_TIMEOUT_MS 5000
 
 /* HTML tag definitions */
 #define RELAY_TAG "pin"
@@ -73,15 +92,363 @@
 #define CARDID_TAG "cardid"
 
 #define CONFIG_FILE "/etc/crelay.conf"
+/* Compiled image of CONFIG_FILE, see --compile-config */
+#define CONFIG_CACHE CONFIG_FILE ".bin"
+
+/* Operations of the command line mode */
+#define CLI_MAX_OPS          256
+#define CLI_DEFAULT_PULSE_MS 1000
+
+/* Pool sizes of the [Memory] fixed mode */
+#define DEFAULT_CONFIG_POOL_KB  64
+#define DEFAULT_REQUEST_POOL_KB 16
+/* Buffer of a request socket stream */
+#define STREAM_BUF_SIZE 4096
+
+/* Relay state journal, "none" disables it */
+#define DEFAULT_STATE_JOURNAL  "/var/lib/crelay/state.journal"
+#define DEFAULT_STATE_SYNC_MS  1000
+/* Shared memory segment of the state snapshot, "none" disables it */
+#define DEFAULT_STATE_SNAPSHOT CRELAY_SHM_DEFAULT_NAME
+
+/* First socket passed by systemd socket activation */
+#define SD_LISTEN_FDS_START 3
 
 /* Global variables */
 config_t config;
 int portHttp;
 int global_s = -1 ;
+static int ctl_sock = -1 ;
+static volatile sig_atomic_t reload_pending = 0 ;
+static volatile sig_atomic_t upgrade_pending = 0 ;
+static volatile sig_atomic_t quit_pending = 0 ;
+/* [State] reapply: restored states not written to the cards yet */
+static int reapply_pending = 0 ;
+/* Control socket passed by systemd, its file belongs to the socket unit */
+static int ctl_activated = 0 ;
+/* Binary executed again by an upgrade */
+static char exe_path[PATH_MAX];
 
 FILE *fin = NULL ;
 FILE *fout = NULL ;
 
+/* Transient allocations of a request, reset when it completes */
+static arena_t request_arena;
+
+/* [Memory] fixed: the config generations alternate between two pools
+   and the request arena lives in a third one, all allocated once */
+static int fixed_memory = 0;
+static void *config_pool[2];
+static size_t config_pool_size;
+static void *request_pool;
+/* High-water mark and refused allocations of the freed generations */
+static size_t config_peak;
+static unsigned long config_failures;
+
+/* Sections of the config file */
+enum
+{
+   SECT_UNKNOWN = 0,
+   SECT_HTTP,
+   SECT_LOGGING,
+   SECT_CONTROL,
+   SECT_MEMORY,
+   SECT_STATE,
+   SECT_GPIO,
+   SECT_SAINSMART,
+   SECT_SAMPLE,
+   SECT_BOARDS,
+   SECT_BOARD            /* [Board <n>] */
+};
+
+/* Value types of the config keys */
+enum
+{
+   KEY_STR = 0,
+   KEY_U8,
+   KEY_U16,
+   KEY_U32,
+   KEY_DOUBLE,
+   KEY_SERIAL,           /* board serial, NULL, AUTO or fixed */
+   KEY_LABEL             /* relay label, label_list_t */
+};
+
+/* A config key, "#" in the name stands for a number 1..count. The
+   offset is in config_t, or in card_info_t for the board sections. */
+typedef struct
+{
+   uint8_t     section;
+   const char *name;
+   uint8_t     type;
+   uint8_t     count;
+   size_t      offset;
+} config_key_t;
+
+#define CFG(f) offsetof(config_t, f)
+#define BRD(f) offsetof(card_info_t, f)
+
+static const config_key_t config_keys[] =
+{
+   { SECT_HTTP,      "server_iface",     KEY_STR,    0,  CFG(server_iface) },
+   { SECT_HTTP,      "server_port",      KEY_U16,    0,  CFG(server_port) },
+   { SECT_HTTP,      "pulse_duration",   KEY_U8,     0,  CFG(pulse_duration) },
+   { SECT_HTTP,      "slow_log_ms",      KEY_U32,    0,  CFG(slow_log_ms) },
+   { SECT_HTTP,      "slow_log_file",    KEY_STR,    0,  CFG(slow_log_file) },
+   { SECT_HTTP,      "relay#_label",     KEY_LABEL,  MAX_NUM_RELAYS, CFG(relay_label) },
+   { SECT_LOGGING,   "output",           KEY_STR,    0,  CFG(log_output) },
+   { SECT_LOGGING,   "file",             KEY_STR,    0,  CFG(log_file) },
+   { SECT_LOGGING,   "level",            KEY_STR,    0,  CFG(log_level) },
+   { SECT_LOGGING,   "modules",          KEY_STR,    0,  CFG(log_modules) },
+   { SECT_CONTROL,   "socket",           KEY_STR,    0,  CFG(ctl_socket) },
+   { SECT_MEMORY,    "fixed",            KEY_U8,     0,  CFG(mem_fixed) },
+   { SECT_MEMORY,    "config_pool_kb",   KEY_U32,    0,  CFG(config_pool_kb) },
+   { SECT_MEMORY,    "request_pool_kb",  KEY_U32,    0,  CFG(request_pool_kb) },
+   { SECT_STATE,     "journal",          KEY_STR,    0,  CFG(state_journal) },
+   { SECT_STATE,     "journal_kb",       KEY_U32,    0,  CFG(state_journal_kb) },
+   { SECT_STATE,     "sync_ms",          KEY_U32,    0,  CFG(state_sync_ms) },
+   { SECT_STATE,     "reapply",          KEY_U8,     0,  CFG(state_reapply) },
+   { SECT_STATE,     "snapshot",         KEY_STR,    0,  CFG(state_snapshot) },
+   { SECT_GPIO,      "num_relays",       KEY_U8,     0,  CFG(gpio_num_relays) },
+   { SECT_GPIO,      "active_value",     KEY_U8,     0,  CFG(gpio_active_value) },
+   /* relay1_gpio_pin .. relay8_gpio_pin are consecutive uint8_t */
+   { SECT_GPIO,      "relay#_gpio_pin",  KEY_U8,     8,  CFG(relay1_gpio_pin) },
+   { SECT_SAINSMART, "num_relays",       KEY_U8,     0,  CFG(sainsmart_num_relays) },
+   { SECT_SAINSMART, "coalesce_ms",      KEY_U16,    0,  CFG(sainsmart_coalesce_ms) },
+   { SECT_SAMPLE,    "cards",            KEY_U8,     0,  CFG(sample_cards) },
+   { SECT_SAMPLE,    "num_relays",       KEY_U8,     0,  CFG(sample_num_relays) },
+   { SECT_SAMPLE,    "latency_us",       KEY_U32,    0,  CFG(sample_latency_us) },
+   { SECT_SAMPLE,    "jitter_us",        KEY_U32,    0,  CFG(sample_jitter_us) },
+   { SECT_SAMPLE,    "latency_dist",     KEY_STR,    0,  CFG(sample_latency_dist) },
+   { SECT_SAMPLE,    "fail_rate",        KEY_DOUBLE, 0,  CFG(sample_fail_rate) },
+   { SECT_SAMPLE,    "unplug_rate",      KEY_DOUBLE, 0,  CFG(sample_unplug_rate) },
+   { SECT_SAMPLE,    "unplug_ms",        KEY_U32,    0,  CFG(sample_unplug_ms) },
+   { SECT_SAMPLE,    "card#_serial",     KEY_STR,    SAMPLE_MAX_CARDS, CFG(sample_serial) },
+   { SECT_SAMPLE,    "card#_num_relays", KEY_U8,     SAMPLE_MAX_CARDS, CFG(sample_card_num_relays) },
+   { SECT_BOARDS,    "number",           KEY_U16,    0,  CFG(number) },
+   { SECT_BOARD,     "serial",           KEY_SERIAL, 0,  BRD(serial) },
+   { SECT_BOARD,     "num_relays",       KEY_U8,     0,  BRD(num_relays) },
+   { SECT_BOARD,     "comment",          KEY_STR,    0,  BRD(comment) },
+   { SECT_BOARD,     "model",            KEY_U8,     0,  BRD(model) },
+   { SECT_BOARD,     "relay#_label",     KEY_LABEL,  MAX_NUM_RELAYS, BRD(relay_label) },
+};
+
+/* Open addressing hash table of config_keys, power of 2 */
+#define KEY_TABLE_SIZE 128
+static const config_key_t *key_table[KEY_TABLE_SIZE];
+static int key_table_ready = 0;
+
+/* Parser state, the section of the current line is resolved once
+   when the section changes */
+typedef struct
+{
+   config_t     *config;
+   char          section[64];
+   int           sect;
+   int           sect_index;
+   card_info_t **boards;        /* indexed by board number */
+   int           num_boards;    /* size of boards */
+   arena_t      *scratch;       /* arena of boards, NULL = heap */
+   card_info_t  *last_board;    /* tail of config->card_list */
+} config_parse_t;
+
+/* FNV-1a of the section and the key name pattern */
+static uint32_t key_hash(int sect, const char *name)
+{
+   uint32_t h = 2166136261u ^ (uint32_t)sect;
+   
+   h *= 16777619u;
+   while (*name)
+   {
+      h ^= (uint8_t)*name++;
+      h *= 16777619u;
+   }
+   return h;
+}
+
+static void init_key_table()
+{
+   unsigned int i, h;
+   
+   for (i=0; i<sizeof(config_keys)/sizeof(config_keys[0]); i++)
+   {
+      h = key_hash(config_keys[i].section, config_keys[i].name);
+      while (key_table[h & (KEY_TABLE_SIZE-1)] != NULL) h++;
+      key_table[h & (KEY_TABLE_SIZE-1)] = &config_keys[i];
+   }
+   key_table_ready = 1;
+}
+
+/**********************************************************
+ * Function: find_key()
+ * 
+ * Description:
+ *           Look up a key, a number in the name (relay3_label)
+ *           is replaced by "#" and returned in index
+ * 
+ * Returns:  key, NULL if unknown
+ *********************************************************/
+static const config_key_t *find_key(int sect, const char *name, int *index)
+{
+   char pattern[64];
+   const config_key_t *key;
+   unsigned int h, n = 0;
+   
+   if (!key_table_ready)
+      init_key_table();
+   
+   *index = 0;
+   while (*name && n < sizeof(pattern)-1)
+   {
+      if (*name >= '0' && *name <= '9' && *index == 0)
+      {
+         while (*name >= '0' && *name <= '9')
+         {
+            if (*index < 100000) *index = *index * 10 + (*name - '0');
+            name++;
+         }
+         pattern[n++] = '#';
+         continue;
+      }
+      pattern[n++] = *name++;
+   }
+   if (*name) return NULL;
+   pattern[n] = '\0';
+   
+   for (h = key_hash(sect, pattern); (key = key_table[h & (KEY_TABLE_SIZE-1)]) != NULL; h++)
+   {
+      if (key->section == sect && !strcmp(key->name, pattern))
+      {
+         if (key->count == 0) return (*index == 0) ? key : NULL;
+         return (*index >= 1 && *index <= key->count) ? key : NULL;
+      }
+   }
+   return NULL;
+}
+
+static void parse_section(config_parse_t *p, const char* section)
+{
+   static const struct { const char *name; int sect; } sections[] =
+   {
+      { "HTTP server", SECT_HTTP }, { "Logging", SECT_LOGGING }, { "Control", SECT_CONTROL },
+      { "Memory", SECT_MEMORY }, { "State", SECT_STATE }, { "GPIO drv", SECT_GPIO }, { "Sainsmart drv", SECT_SAINSMART }, { "Sample drv", SECT_SAMPLE },
+      { "Boards", SECT_BOARDS }
+   };
+   unsigned int i;
+   char *end;
+   
+   snprintf(p->section, sizeof(p->section), "%s", section);
+   p->sect = SECT_UNKNOWN;
+   p->sect_index = 0;
+   
+   if (!strncmp(section, "Board ", 6))
+   {
+      p->sect_index = strtol(section+6, &end, 10);
+      if (end != section+6 && *end == '\0')
+         p->sect = SECT_BOARD;
+      return;
+   }
+   for (i=0; i<sizeof(sections)/sizeof(sections[0]); i++)
+   {
+      if (!strcmp(section, sections[i].name))
+      {
+         p->sect = sections[i].sect;
+         return;
+      }
+   }
+}
+
+/* Board of the current [Board <n>] section, created at first use */
+static card_info_t *get_board(config_parse_t *p)
+{
+   config_t *pconfig = p->config;
+   int i = p->sect_index;
+   card_info_t *board;
+   
+   if (i < 1 || i > pconfig->number)
+      return NULL;
+   if (i >= p->num_boards)
+   {
+      card_info_t **boards;
+      
+      if (p->scratch != NULL)
+      {
+         if ((boards = arena_alloc(p->scratch, (pconfig->number+1) * sizeof(card_info_t *))) == NULL)
+            return NULL;
+         if (p->num_boards > 0)
+            memcpy(boards, p->boards, p->num_boards * sizeof(card_info_t *));
+      }
+      else if ((boards = realloc(p->boards, (pconfig->number+1) * sizeof(card_info_t *))) == NULL)
+      {
+         return NULL;
+      }
+      memset(&boards[p->num_boards], 0, (pconfig->number+1 - p->num_boards) * sizeof(card_info_t *));
+      p->boards = boards;
+      p->num_boards = pconfig->number+1;
+   }
+   if (p->boards[i] != NULL)
+      return p->boards[i];
+   
+   if ((board = arena_alloc(&pconfig->arena, sizeof(card_info_t))) == NULL)
+      return NULL;
+   board->card_id = i ;
+   board->serial_type = SERIAL_FIRST;
+   board->model = NO_RELAY_TYPE ;
+   if (p->last_board == NULL)
+      pconfig->card_list = board ;
+   else
+      p->last_board->next = board ;
+   p->last_board = board ;
+   p->boards[i] = board ;
+   return board;
+}
+
+/**********************************************************
+ * Function: set_label()
+ * 
+ * Description:
+ *           Set the label of a relay, the label array grows
+ *           to the highest relay labelled
+ * 
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+static int set_label(arena_t *arena, label_list_t *l, int relay, const char *value)
+{
+   if (relay < FIRST_RELAY || relay > MAX_NUM_RELAYS)
+      return -1;
+   if (relay > l->num)
+   {
+      int num = (l->num*2 > relay) ? l->num*2 : relay;
+      const char **label;
+      
+      if (num < 8) num = 8;
+      if (num > MAX_NUM_RELAYS) num = MAX_NUM_RELAYS;
+      if ((label = arena_alloc(arena, num * sizeof(char *))) == NULL)
+         return -1;
+      if (l->num > 0) memcpy(label, l->label, l->num * sizeof(char *));
+      l->label = label;
+      l->num = num;
+   }
+   l->label[relay-1] = value;
+   return 0;
+}
+
+/**********************************************************
+ * Function: get_label()
+ * 
+ * Description:
+ *           Label of a relay, "My appliance <n>" if it has
+ *           none
+ * 
+ * Returns:  label, in buf for the default label
+ *********************************************************/
+static const char *get_label(const label_list_t *l, int relay, char *buf, size_t len)
+{
+   if (relay >= FIRST_RELAY && relay <= l->num && l->label[relay-1] != NULL)
+      return l->label[relay-1];
+   snprintf(buf, len, "My appliance %d", relay);
+   return buf;
+}
+
 /**********************************************************
  * Function: config_cb()
  * 
@@ -93,215 +460,942 @@ FILE *fout = NULL ;
  *********************************************************/
 static int config_cb(void* user, const char* section, const char* name, const char* value)
 {
-   config_t* pconfig = (config_t*)user;
-   char buf[256];
-   char template[256] ;
-   card_info_t * current;
+   config_parse_t *p = (config_parse_t *)user;
+   arena_t *arena = &p->config->arena;
+   const config_key_t *key;
+   card_info_t *board = NULL;
+   char *field;
+   int index;
    
-   #define MATCH(s, n) strcmp(section, s) == 0 && strcmp(name, n) == 0
+   if (strcmp(section, p->section))
+      parse_section(p, section);
    
-   if (MATCH("HTTP server", "server_iface")) 
-   {
-      pconfig->server_iface = strdup(value);
-   } 
-   else if (MATCH("HTTP server", "server_port")) 
+   if ((key = find_key(p->sect, name, &index)) == NULL ||
+       (p->sect == SECT_BOARD && (board = get_board(p)) == NULL))
    {
-      pconfig->server_port = atoi(value);
-   } 
-   else if (MATCH("HTTP server", "pulse_duration")) 
-   {
-      pconfig->pulse_duration = atoi(value);
+      crelay_log(LOGGER_CONFIG, LOG_WARNING, "unknown config parameter %s/%s\n", section, name);
+      return -1;  /* unknown section/name, error */
    }
-   else if (MATCH("GPIO drv", "num_relays")) 
+   
+   field = (board != NULL) ? (char *)board : (char *)p->config;
+   field += key->offset;
+   if (index > 0) index--;
+   
+   switch (key->type)
    {
-      pconfig->gpio_num_relays = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "active_value")) 
+      case KEY_STR:
+         field += index * sizeof(char *);
+         *(char **)field = arena_strdup(arena, value);
+         break;
+      case KEY_LABEL:
+         set_label(arena, (label_list_t *)field, index+1, arena_strdup(arena, value));
+         break;
+      case KEY_U8:
+         ((uint8_t *)field)[index] = atoi(value);
+         break;
+      case KEY_U16:
+         ((uint16_t *)field)[index] = atoi(value);
+         break;
+      case KEY_U32:
+         ((uint32_t *)field)[index] = atoi(value);
+         break;
+      case KEY_DOUBLE:
+         ((double *)field)[index] = atof(value);
+         break;
+      case KEY_SERIAL:
+         if (!strcmp(value,"NULL"))
+         {
+            board->serial_type = SERIAL_FIRST;
+         }
+         else if (!strcmp(value,"AUTO"))
+         {
+            board->serial_type = SERIAL_AUTO;
+         }
+         else
+         {
+            board->serial_type = SERIAL_FIXE;
+            board->serial = arena_strdup(arena, value);
+         }
+         break;
+   }
+   return 0;
+}
+
+/* Strings, labels and boards are in the arena or in the image */
+static void free_config_gen(config_t *c)
+{
+   if (c->arena.peak > config_peak) config_peak = c->arena.peak;
+   config_failures += c->arena.failures;
+   arena_free(&c->arena);
+   confcache_unmap(c->image, c->image_size);
+   memset((void*)c, 0, sizeof(config_t));
+}
+
+static void free_config()
+{
+   free_config_gen(&config);
+   trace_close();
+}
+
+/* Relay labels given on the daemon command line */
+static int num_cmd_labels = 0 ;
+static char **cmd_labels = NULL ;
+
+/**********************************************************
+ * Function: find_unchanged_board()
+ * 
+ * Description:
+ *           Search the previous generation for a board with
+ *           the same definition whose serial was already
+ *           resolved
+ * 
+ * Returns:  board of prev, NULL if not found
+ *********************************************************/
+static card_info_t *find_unchanged_board(const config_t *prev, const card_info_t *board)
+{
+   card_info_t *old;
+   
+   if (prev == NULL) return NULL;
+   for (old = prev->card_list; old != NULL; old = old->next)
    {
-      pconfig->gpio_active_value = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay1_gpio_pin")) 
+      if (old->card_id == board->card_id && old->serial_type == board->serial_type &&
+          old->num_relays == board->num_relays && old->model == board->model)
+      {
+         return (old->serial != NULL) ? old : NULL;
+      }
+   }
+   return NULL;
+}
+
+/* Serial of an AUTO or FIRST board, kept in the board so it can be
+   resolved again on the request path without allocating */
+static void set_board_serial(card_info_t *board, const char *serial)
+{
+   snprintf(board->resolved_serial, sizeof(board->resolved_serial), "%s", serial);
+   board->serial = board->resolved_serial;
+}
+
+/* Arena of a new generation, in the pool the current one doesn't use */
+static void init_config_arena(config_t *c)
+{
+   if (fixed_memory)
+      arena_init_fixed(&c->arena, ((void *)config.arena.head == config_pool[0]) ? config_pool[1] : config_pool[0],
+                       config_pool_size);
+}
+
+/**********************************************************
+ * Function: parse_config()
+ * 
+ * Description:
+ *           Parse CONFIG_FILE into c
+ * 
+ * Returns:  result of conf_parse()
+ *********************************************************/
+static int parse_config(config_t *c)
+{
+   config_parse_t parse;
+   int ret;
+   
+   memset((void*)c, 0, sizeof(config_t));
+   init_config_arena(c);
+   memset((void*)&parse, 0, sizeof(parse));
+   parse.config = c;
+   /* The board index is only needed while parsing */
+   parse.scratch = fixed_memory ? &request_arena : NULL;
+   ret = conf_parse(CONFIG_FILE, config_cb, &parse);
+   if (parse.scratch == NULL) free(parse.boards);
+   return ret;
+}
+
+static size_t key_size(int type)
+{
+   switch (type)
    {
-      pconfig->relay1_gpio_pin = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay2_gpio_pin")) 
+      case KEY_U8:     return sizeof(uint8_t);
+      case KEY_U16:    return sizeof(uint16_t);
+      case KEY_U32:    return sizeof(uint32_t);
+      case KEY_DOUBLE: return sizeof(double);
+      case KEY_LABEL:  return sizeof(label_list_t);
+      default:         return sizeof(char *);
+   }
+}
+
+/* Id of config_keys, the slots of an image follow its order */
+static uint32_t config_layout()
+{
+   uint32_t h = 0;
+   unsigned int i;
+   
+   for (i=0; i<sizeof(config_keys)/sizeof(config_keys[0]); i++)
    {
-      pconfig->relay2_gpio_pin = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay3_gpio_pin")) 
+      h = confcache_hash(h, config_keys[i].name, strlen(config_keys[i].name));
+      h = confcache_hash(h, &config_keys[i].section, 1);
+      h = confcache_hash(h, &config_keys[i].type, 1);
+      h = confcache_hash(h, &config_keys[i].count, 1);
+   }
+   return confcache_hash(h, &(uint32_t){ sizeof(confcache_board_t) }, sizeof(uint32_t));
+}
+
+/**********************************************************
+ * Function: compile_config()
+ * 
+ * Description:
+ *           Write the compiled image of CONFIG_FILE to
+ *           CONFIG_CACHE
+ * 
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+static int compile_config()
+{
+   confcache_t cc;
+   confcache_board_t rec;
+   config_t c;
+   card_info_t *board;
+   unsigned int i, k, n;
+   int ret;
+   
+   if (parse_config(&c) < 0)
    {
-      pconfig->relay3_gpio_pin = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay4_gpio_pin")) 
+      fprintf(stderr, "Can't read %s\n", CONFIG_FILE);
+      return -1;
+   }
+   
+   memset(&cc, 0, sizeof(cc));
+   for (i=0; i<sizeof(config_keys)/sizeof(config_keys[0]); i++)
    {
-      pconfig->relay4_gpio_pin = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay5_gpio_pin")) 
+      const config_key_t *key = &config_keys[i];
+      
+      if (key->section == SECT_BOARD) continue;
+      for (k=0, n=(key->count && key->type != KEY_LABEL) ? key->count : 1; k<n; k++)
+      {
+         const char *field = (const char *)&c + key->offset + k * key_size(key->type);
+         const label_list_t *l = (const label_list_t *)field;
+         uint64_t v = 0;
+         
+         switch (key->type)
+         {
+            case KEY_STR:    v = confcache_add_str(&cc, *(const char **)field); break;
+            case KEY_LABEL:  v = confcache_add_labels(&cc, l->label, l->num) | ((uint64_t)l->num << 32); break;
+            case KEY_U8:     v = *(const uint8_t *)field; break;
+            case KEY_U16:    v = *(const uint16_t *)field; break;
+            case KEY_U32:    v = *(const uint32_t *)field; break;
+            case KEY_DOUBLE: memcpy(&v, field, sizeof(double)); break;
+         }
+         confcache_add_slot(&cc, v);
+      }
+   }
+   for (board = c.card_list; board != NULL; board = board->next)
    {
-      pconfig->relay5_gpio_pin = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay6_gpio_pin")) 
+      memset(&rec, 0, sizeof(rec));
+      rec.card_id = board->card_id;
+      rec.serial_type = board->serial_type;
+      rec.num_relays = board->num_relays;
+      rec.model = board->model;
+      rec.serial = confcache_add_str(&cc, board->serial);
+      rec.comment = confcache_add_str(&cc, board->comment);
+      rec.num_labels = board->relay_label.num;
+      rec.labels = confcache_add_labels(&cc, board->relay_label.label, board->relay_label.num);
+      confcache_add_board(&cc, &rec);
+   }
+   n = cc.num_boards;
+   
+   if ((ret = confcache_write(&cc, config_layout(), CONFIG_CACHE)) != 0)
+      fprintf(stderr, "Can't write %s: %s\n", CONFIG_CACHE, strerror(errno));
+   else
+      printf("%s compiled to %s (%u boards)\n", CONFIG_FILE, CONFIG_CACHE, n);
+   free_config_gen(&c);
+   return ret;
+}
+
+/* Label list of an image, the pointer array is allocated in the arena */
+static int map_labels(config_t *c, const confcache_hdr_t *h, uint32_t first, uint32_t num, label_list_t *l)
+{
+   uint32_t k;
+   
+   if (num == 0)
+      return 0;
+   if (num > MAX_NUM_RELAYS || (uint64_t)first + num > h->num_labels ||
+       (l->label = arena_alloc(&c->arena, num * sizeof(char *))) == NULL)
+      return -1;
+   for (k=0; k<num; k++)
+      l->label[k] = CONFCACHE_STR(h, CONFCACHE_LABELS(h)[first+k]);
+   l->num = num;
+   return 0;
+}
+
+/**********************************************************
+ * Function: map_config()
+ * 
+ * Description:
+ *           Use CONFIG_CACHE if it is valid and newer than
+ *           CONFIG_FILE. The strings stay in the read-only
+ *           mapping, the boards and label arrays are
+ *           allocated in the arena of the generation.
+ * 
+ * Returns:  0 on success, -1 if the text file must be parsed
+ *********************************************************/
+static int map_config(config_t *c)
+{
+   const confcache_hdr_t *h;
+   const confcache_board_t *rec;
+   const uint64_t *slot;
+   card_info_t *boards = NULL;
+   unsigned int i, k, n;
+   size_t size;
+   
+   memset((void*)c, 0, sizeof(config_t));
+   if ((h = confcache_map(CONFIG_CACHE, CONFIG_FILE, config_layout(), &size)) == NULL)
+      return -1;
+   init_config_arena(c);
+   /* Unmapped by free_config_gen() from now on */
+   c->image = h;
+   c->image_size = size;
+   
+   /* Global keys, in the order of config_keys */
+   slot = CONFCACHE_SLOTS(h);
+   for (i=0; i<sizeof(config_keys)/sizeof(config_keys[0]); i++)
    {
-      pconfig->relay6_gpio_pin = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay7_gpio_pin")) 
+      const config_key_t *key = &config_keys[i];
+      
+      if (key->section == SECT_BOARD) continue;
+      for (k=0, n=(key->count && key->type != KEY_LABEL) ? key->count : 1; k<n; k++, slot++)
+      {
+         char *field = (char *)c + key->offset + k * key_size(key->type);
+         
+         if (slot >= CONFCACHE_SLOTS(h) + h->num_slots ||
+             (key->type == KEY_STR && *slot != CONFCACHE_NULL && *slot >= h->strings_size) ||
+             (key->type == KEY_LABEL &&
+              map_labels(c, h, (uint32_t)*slot, *slot >> 32, (label_list_t *)field) != 0))
+         {
+            free_config_gen(c);
+            return -1;
+         }
+         switch (key->type)
+         {
+            case KEY_STR:    *(const char **)field = CONFCACHE_STR(h, (uint32_t)*slot); break;
+            case KEY_U8:     *(uint8_t *)field = *slot; break;
+            case KEY_U16:    *(uint16_t *)field = *slot; break;
+            case KEY_U32:    *(uint32_t *)field = *slot; break;
+            case KEY_DOUBLE: memcpy(field, slot, sizeof(double)); break;
+         }
+      }
+   }
+   
+   if (h->num_boards > 0 && (boards = arena_alloc(&c->arena, h->num_boards * sizeof(card_info_t))) == NULL)
    {
-      pconfig->relay7_gpio_pin = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay8_gpio_pin")) 
+      free_config_gen(c);
+      return -1;
+   }
+   for (i=0, rec=CONFCACHE_BOARDS(h); i<h->num_boards; i++, rec++)
    {
-      pconfig->relay8_gpio_pin = atoi(value);
-   } 
-   else if (MATCH("Sainsmart drv", "num_relays")) 
+      boards[i].card_id = rec->card_id;
+      boards[i].serial_type = rec->serial_type;
+      boards[i].num_relays = rec->num_relays;
+      boards[i].model = rec->model;
+      boards[i].serial = CONFCACHE_STR(h, rec->serial);
+      boards[i].comment = CONFCACHE_STR(h, rec->comment);
+      if (map_labels(c, h, rec->labels, rec->num_labels, &boards[i].relay_label) != 0)
+      {
+         free_config_gen(c);
+         return -1;
+      }
+      boards[i].next = (i+1 < h->num_boards) ? &boards[i+1] : NULL;
+   }
+   c->card_list = boards;
+   return 0;
+}
+
+/**********************************************************
+ * Function: load_config()
+ * 
+ * Description:
+ *           Build a configuration generation from CONFIG_FILE.
+ *           AUTO and FIRST boards keep the serial resolved by
+ *           the previous generation when their definition did
+ *           not change, the cards are only enumerated for the
+ *           added or changed boards, later by probe_boards().
+ * 
+ * Parameters: c (out)   - new generation
+ *             prev (in) - current generation, NULL at startup
+ * 
+ * Returns:  result of conf_parse(), <0 if the file could
+ *           not be loaded (c holds the defaults)
+ *********************************************************/
+static int load_config(config_t *c, const config_t *prev)
+{
+   card_info_t * current;
+   card_info_t * old;
+   const char *source = CONFIG_CACHE;
+   int ret, i;
+   
+   /* The compiled image if it is up to date, else the text file */
+   if ((ret = map_config(c)) != 0)
    {
-      pconfig->sainsmart_num_relays = atoi(value);
-   } 
-   else if (MATCH("Boards","number"))
+      source = CONFIG_FILE;
+      ret = parse_config(c);
+   }
+   if (ret >= 0 && c->arena.failures != 0)
    {
-      pconfig->number = atoi(value);
+      crelay_log(LOGGER_CONFIG, LOG_ERR, "Config pool full, raise [Memory] config_pool_kb\n");
+      ret = -2;
    }
-   else
+   if (ret >= 0) 
    {
-      /* traitement Board list */
-      int match_found = 0 ;
+      if (logger_configure(c->log_output, c->log_file, c->log_level, c->log_modules) != 0)
+         crelay_log(LOGGER_CONFIG, LOG_WARNING, "Invalid [Logging] parameter, check output, level and modules\n");
+      crelay_log(LOGGER_MAIN, LOG_NOTICE, "Config parameters read from %s:\n", source);
+      crelay_log(LOGGER_MAIN, LOG_NOTICE, "***************************\n");
+      if (c->server_iface != NULL) crelay_log(LOGGER_MAIN, LOG_NOTICE, "server_iface: %s\n", c->server_iface);
+      if (c->server_port != 0)     crelay_log(LOGGER_MAIN, LOG_NOTICE, "server_port: %u\n", c->server_port);
+      for (int k=0; k<c->relay_label.num; k++)
+      {
+         if (c->relay_label.label[k] != NULL) crelay_log(LOGGER_MAIN, LOG_NOTICE, "relay_label %d: %s\n",k+1, c->relay_label.label[k]);
+      }
       
-      for (int k=0 ; k<16; k++)
+      if (c->pulse_duration != 0)  crelay_log(LOGGER_MAIN, LOG_NOTICE, "pulse_duration: %u\n", c->pulse_duration);
+      if (c->slow_log_ms != 0)     crelay_log(LOGGER_MAIN, LOG_NOTICE, "slow_log_ms: %u\n", c->slow_log_ms);
+      if (c->slow_log_file != NULL) crelay_log(LOGGER_MAIN, LOG_NOTICE, "slow_log_file: %s\n", c->slow_log_file);
+      if (c->log_output != NULL)   crelay_log(LOGGER_MAIN, LOG_NOTICE, "log output: %s\n", c->log_output);
+      if (c->log_file != NULL)     crelay_log(LOGGER_MAIN, LOG_NOTICE, "log file: %s\n", c->log_file);
+      if (c->log_level != NULL)    crelay_log(LOGGER_MAIN, LOG_NOTICE, "log level: %s\n", c->log_level);
+      if (c->log_modules != NULL)  crelay_log(LOGGER_MAIN, LOG_NOTICE, "log modules: %s\n", c->log_modules);
+      if (c->ctl_socket != NULL)   crelay_log(LOGGER_MAIN, LOG_NOTICE, "control socket: %s\n", c->ctl_socket);
+      if (c->mem_fixed != 0)       crelay_log(LOGGER_MAIN, LOG_NOTICE, "memory fixed: %u\n", c->mem_fixed);
+      if (c->config_pool_kb != 0)  crelay_log(LOGGER_MAIN, LOG_NOTICE, "config_pool_kb: %u\n", c->config_pool_kb);
+      if (c->request_pool_kb != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "request_pool_kb: %u\n", c->request_pool_kb);
+      if (c->state_journal != NULL) crelay_log(LOGGER_MAIN, LOG_NOTICE, "state journal: %s\n", c->state_journal);
+      if (c->state_journal_kb != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "state journal_kb: %u\n", c->state_journal_kb);
+      if (c->state_sync_ms != 0)   crelay_log(LOGGER_MAIN, LOG_NOTICE, "state sync_ms: %u\n", c->state_sync_ms);
+      if (c->state_reapply != 0)   crelay_log(LOGGER_MAIN, LOG_NOTICE, "state reapply: %u\n", c->state_reapply);
+      if (c->state_snapshot != NULL) crelay_log(LOGGER_MAIN, LOG_NOTICE, "state snapshot: %s\n", c->state_snapshot);
+      if (c->gpio_num_relays != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "gpio_num_relays: %u\n", c->gpio_num_relays);
+      if (c->gpio_active_value >= 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "gpio_active_value: %u\n", c->gpio_active_value);
+      if (c->relay1_gpio_pin != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "relay1_gpio_pin: %u\n", c->relay1_gpio_pin);
+      if (c->relay2_gpio_pin != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "relay2_gpio_pin: %u\n", c->relay2_gpio_pin);
+      if (c->relay3_gpio_pin != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "relay3_gpio_pin: %u\n", c->relay3_gpio_pin);
+      if (c->relay4_gpio_pin != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "relay4_gpio_pin: %u\n", c->relay4_gpio_pin);
+      if (c->relay5_gpio_pin != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "relay5_gpio_pin: %u\n", c->relay5_gpio_pin);
+      if (c->relay6_gpio_pin != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "relay6_gpio_pin: %u\n", c->relay6_gpio_pin);
+      if (c->relay7_gpio_pin != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "relay7_gpio_pin: %u\n", c->relay7_gpio_pin);
+      if (c->relay8_gpio_pin != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "relay8_gpio_pin: %u\n", c->relay8_gpio_pin);
+      if (c->sainsmart_num_relays != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "sainsmart_num_relays: %u\n", c->sainsmart_num_relays);
+      if (c->sainsmart_coalesce_ms != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "sainsmart_coalesce_ms: %u\n", c->sainsmart_coalesce_ms);
+      if (c->sample_cards != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "sample_cards: %u\n", c->sample_cards);
+      if (c->number != 0)
       {
-         sprintf(template,"relay%d_label",k+1) ;
-         if (MATCH("HTTP server", template))
+         crelay_log(LOGGER_MAIN, LOG_NOTICE, "Number Card in List: %u\n", c->number);
+         
+         /* Boards unchanged since the previous generation keep their serial */
+         for (current = c->card_list; current != NULL; current = current->next)
          {
-            pconfig->relay_label[k] = strdup(value) ;
-            match_found = 1 ;
+            if ((current->serial_type == SERIAL_AUTO || current->serial_type == SERIAL_FIRST) &&
+                current->serial == NULL && (old = find_unchanged_board(prev, current)) != NULL)
+            {
+               set_board_serial(current, old->serial);
+            }
+         }
+         
+         current = c->card_list ;
+         while ( current != NULL ) 
+         {
+            crelay_log(LOGGER_MAIN, LOG_NOTICE, "card_id: %u\n", current->card_id);
+            if (current->serial != NULL) crelay_log(LOGGER_MAIN, LOG_NOTICE, "serial: %s\n", current->serial);
+            if (current->num_relays != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "num_relays: %u\n", current->num_relays);
+            for (int k=0; k<current->relay_label.num; k++)
+            {
+               if (current->relay_label.label[k] != NULL)
+                  crelay_log(LOGGER_MAIN, LOG_NOTICE, "relay%d_label : %s\n",k+1, current->relay_label.label[k]);
+            }
+            if (current->model != 0) crelay_log(LOGGER_MAIN, LOG_NOTICE, "model: %u\n", current->model);
+            if (current->comment != NULL) crelay_log(LOGGER_MAIN, LOG_NOTICE, "comment: %s\n", current->comment);
+            
+            if ((current->serial_type == SERIAL_AUTO || current->serial_type == SERIAL_FIRST) && current->serial == NULL)
+            {
+               /* Resolved by probe_boards() once the daemon answers */
+               crelay_log(LOGGER_MAIN, LOG_NOTICE, "type serial: %d (not probed yet)\n", current->serial_type);
+               c->probe_pending = 1;
+            }
+            
+            current = current->next ;
          }
       }
+      else
+      {
+         crelay_log(LOGGER_MAIN, LOG_NOTICE, "No card list\n");
+      }
+      
+      crelay_log(LOGGER_MAIN, LOG_NOTICE, "***************************\n");
+   }
+   else
+   {
+      crelay_log(LOGGER_MAIN, LOG_NOTICE, "Can't load %s, using default parameters\n", CONFIG_FILE);
+   }
+
+   /* Ensure pulse duration is valid **/
+   if (c->pulse_duration == 0)
+   {
+      c->pulse_duration = 1;
+   }
+   
+   /* Parse command line for relay labels (overrides config file)*/
+   for (i=0; i<num_cmd_labels && i<MAX_NUM_RELAYS; i++)
+   {
+      set_label(&c->arena, &c->relay_label, i+1, arena_strdup(&c->arena, cmd_labels[i]));
+   }
+   
+   return ret;
+}
+
+/**********************************************************
+ * Function: probe_boards()
+ * 
+ * Description:
+ *           Enumerate the cards and give the AUTO and FIRST
+ *           boards without a serial the first unused card
+ *           with their number of relays. Called from the
+ *           main loop when no request is waiting, so the
+ *           daemon answers before the cards are probed.
+ * 
+ * Parameters: c - configuration generation
+ *********************************************************/
+static void probe_boards(config_t *c)
+{
+   relay_info_t *relay_info = NULL;
+   relay_info_t *current_relay_info;
+   card_info_t * current;
+   card_info_t * search;
+   int serial_in_use ;
+   
+   for (current = c->card_list; current != NULL; current = current->next)
+   {
+      if ((current->serial_type != SERIAL_AUTO && current->serial_type != SERIAL_FIRST) || current->serial != NULL)
+         continue;
+      
+      /* Enumerate the cards once, for the first board to resolve */
+      if (relay_info == NULL) crelay_detect_all_relay_cards(&relay_info) ;
       
-      if (match_found == 0 && pconfig->number > 0)
+      current_relay_info = relay_info ;
+      while (current_relay_info->next != NULL)
       {
-         for (int i=1;i<=pconfig->number;i++)
+         if (current_relay_info->num_relays == current->num_relays)
          {
-            sprintf((char *)&buf,"Board %d",i) ;
-            if ((MATCH(buf,"serial")) || (MATCH(buf,"num_relays")) || (MATCH(buf,"comment")) || (MATCH(buf,"model")) || (MATCH(buf,"relay1_label")) || (MATCH(buf,"relay2_label")) || (MATCH(buf,"relay3_label")) || (MATCH(buf,"relay4_label")) || (MATCH(buf,"relay5_label")) || (MATCH(buf,"relay6_label")) || (MATCH(buf,"relay7_label")) || (MATCH(buf,"relay8_label")) || (MATCH(buf,"relay9_label")) || (MATCH(buf,"relay10_label")) || (MATCH(buf,"relay11_label")) || (MATCH(buf,"relay12_label")) || (MATCH(buf,"relay13_label")) || (MATCH(buf,"relay14_label")) || (MATCH(buf,"relay15_label")) || (MATCH(buf,"relay16_label")))
+            serial_in_use = 0 ;
+            search = c->card_list ;
+            while ( search != NULL ) 
             {
-               if (pconfig->card_list == NULL)
+               if (search->serial != NULL && !strcmp(search->serial ,current_relay_info->serial) && (search->model ==0 || search->model == current_relay_info->relay_type) )
                {
-                  pconfig->card_list = malloc(sizeof(card_info_t)) ;
-                  pconfig->card_list->next = NULL ;
-                  pconfig->card_list->card_id = i ;
-                  pconfig->card_list->serial_type = SERIAL_FIRST;
-                  pconfig->card_list->serial = NULL ;
-                  pconfig->card_list->comment = NULL ;
-                  pconfig->card_list->model = NO_RELAY_TYPE ;
-                  for (int k=0 ; k<16; k++)
-                  {
-                     pconfig->card_list->relay_label[k] = NULL ;
-                  }
-                  current = pconfig->card_list ;
-               }
-               else
-               {
-                  current = pconfig->card_list ;
-                  while ( current->card_id != i ) 
-                  {
-                     if (current->next == NULL)
-                     {
-                        current->next = malloc(sizeof(card_info_t)) ;
-                        current->next->next = NULL ;
-                        current->next->card_id = i ;
-                        current->next->serial_type = SERIAL_FIRST;
-                        current->next->serial = NULL ;
-                        current->next->comment = NULL ;
-                        current->next->model = NO_RELAY_TYPE ;
-                        for (int k=0 ; k<16; k++)
-                        {
-                           current->next->relay_label[k] = NULL ;
-                        }
-                        current = current->next ;
-                     }
-                     else
-                     {
-                        current = current->next ;
-                     }
-                  }
-               }
-               if (MATCH(buf,"serial"))
-               {
-                  if (!strcmp(value,"NULL"))
-                  {
-                     current->serial_type = SERIAL_FIRST;
-                  }
-                  else if (!strcmp(value,"AUTO"))
-                  {
-                     current->serial_type = SERIAL_AUTO;
-                  }
-                  else
-                  {
-                     current->serial_type = SERIAL_FIXE;
-                     current->serial = strdup(value);
-                  }
-               }
-               else if (MATCH(buf,"num_relays")) 
-               {
-                  current->num_relays = atoi(value);
-               }
-               else if (MATCH(buf,"comment"))
-               {
-                  current->comment = strdup(value);
-               }
-               else if (MATCH(buf,"model"))
-               {
-                  current->model = atoi(value);
-               }
-               else 
-               {
-                  for (int k=0 ; k<16; k++)
-                  {
-                     sprintf(template,"relay%d_label",k+1) ;
-                     if (MATCH(buf, template))
-                     {
-                        current->relay_label[k] = strdup(value) ;
-                     }
-                  }
+                  serial_in_use = 1 ;
+                  break ;
                }
-               match_found = 1 ;
+               search = search->next ;
+            }
+            if (serial_in_use == 0)
+            {
+               set_board_serial(current, current_relay_info->serial) ;
+               crelay_log(LOGGER_MAIN, LOG_NOTICE, "board %u: serial affected : %s (%i)\n", current->card_id, current->serial, current_relay_info->relay_type);
+               break ;
             }
          }
+         current_relay_info = current_relay_info->next ;
       }
-      
-      if (match_found == 0 )
-      {
-         syslog(LOG_DAEMON | LOG_WARNING, "unknown config parameter %s/%s\n", section, name);
-         return -1;  /* unknown section/name, error */
-      }
+      if (current->serial == NULL) crelay_log(LOGGER_MAIN, LOG_NOTICE, "board %u: serial NOT FOUND\n", current->card_id);
+   }
+   
+   if (relay_info != NULL) crelay_free_relay_info(relay_info) ;
+   c->probe_pending = 0;
+}
+
+/* Board whose card is not probed yet */
+static int board_initializing(const card_info_t *board)
+{
+   return config.probe_pending && board->serial == NULL &&
+          (board->serial_type == SERIAL_AUTO || board->serial_type == SERIAL_FIRST);
+}
+
+static int str_changed(const char *a, const char *b)
+{
+   if (a == NULL || b == NULL) return a != b;
+   return strcmp(a, b) != 0;
+}
+
+/* Bind the cards of the state snapshot to the boards of the
+   current configuration */
+static void publish_boards()
+{
+   card_info_t *board;
+   
+   snapshot_clear_boards();
+   for (board = config.card_list; board != NULL; board = board->next)
+      snapshot_board(board->card_id, board->model, board->serial, board->num_relays);
+}
+
+/**********************************************************
+ * Function: reload_config()
+ * 
+ * Description:
+ *           Build a new configuration generation and publish
+ *           it. Called from the main loop between two
+ *           requests, so no request still uses the previous
+ *           generation when it is freed. A file that can't be
+ *           loaded leaves the current generation in place.
+ * 
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+static int reload_config()
+{
+   config_t next, old;
+   
+   crelay_log(LOGGER_MAIN, LOG_NOTICE, "Reloading %s\n", CONFIG_FILE);
+   if (load_config(&next, &config) < 0)
+   {
+      crelay_log(LOGGER_MAIN, LOG_WARNING, "Reload failed, keeping the current configuration\n");
+      free_config_gen(&next);
+      return -1;
    }
+   
+   if (str_changed(next.server_iface, config.server_iface) || next.server_port != config.server_port ||
+       str_changed(next.ctl_socket, config.ctl_socket))
+   {
+      crelay_log(LOGGER_MAIN, LOG_WARNING, "Listen address and control socket changes need a restart\n");
+   }
+   if (next.mem_fixed != config.mem_fixed || next.config_pool_kb != config.config_pool_kb ||
+       next.request_pool_kb != config.request_pool_kb)
+   {
+      crelay_log(LOGGER_MAIN, LOG_WARNING, "[Memory] changes need a restart\n");
+   }
+   if (str_changed(next.state_journal, config.state_journal) || next.state_journal_kb != config.state_journal_kb ||
+       next.state_sync_ms != config.state_sync_ms || str_changed(next.state_snapshot, config.state_snapshot))
+   {
+      crelay_log(LOGGER_MAIN, LOG_WARNING, "[State] journal and snapshot changes need a restart\n");
+   }
+   
+   /* Publish the new generation, then free the previous one */
+   old = config;
+   config = next;
+   free_config_gen(&old);
+   
+   trace_set_slow_log(config.slow_log_ms, config.slow_log_file);
+   publish_boards();
    return 0;
 }
 
-static void free_config()
+/**********************************************************
+ * Function: init_fixed_memory()
+ * 
+ * Description:
+ *           [Memory] fixed: allocate the config and request
+ *           pools from the configured sizes and rebuild the
+ *           startup configuration in a config pool. The
+ *           pools never grow afterwards, an allocation that
+ *           does not fit fails.
+ * 
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+static int init_fixed_memory()
 {
-   free((void *)config.server_iface); config.server_iface = NULL ;
-   for (int k=0 ; k<16 ; k++)
+   size_t request_size;
+   int ret;
+   
+   config_pool_size = (size_t)(config.config_pool_kb ? config.config_pool_kb : DEFAULT_CONFIG_POOL_KB) * 1024;
+   request_size = (size_t)(config.request_pool_kb ? config.request_pool_kb : DEFAULT_REQUEST_POOL_KB) * 1024;
+   config_pool[0] = malloc(config_pool_size);
+   config_pool[1] = malloc(config_pool_size);
+   request_pool = malloc(request_size);
+   if (config_pool[0] == NULL || config_pool[1] == NULL || request_pool == NULL)
    {
-      free((void *)config.relay_label[k]); config.relay_label[k] = NULL ;
+      crelay_log(LOGGER_MAIN, LOG_ERR, "Can't allocate the memory pools, using the heap\n");
+      free(config_pool[0]);
+      free(config_pool[1]);
+      free(request_pool);
+      config_pool[0] = config_pool[1] = request_pool = NULL;
+      return -1;
    }
+   arena_free(&request_arena);
+   arena_init_fixed(&request_arena, request_pool, request_size);
+   fixed_memory = 1;
    
-   if (config.number != 0)
+   crelay_set_info_arena(&request_arena);
+   ret = reload_config();
+   crelay_set_info_arena(NULL);
+   arena_reset(&request_arena);
+   crelay_log(LOGGER_MAIN, LOG_NOTICE, "Fixed memory: 2 x %zu bytes config pools, %zu bytes request pool\n",
+              config_pool_size, request_size);
+   return ret;
+}
+
+/**********************************************************
+ * Function: init_snapshot()
+ * 
+ * Description:
+ *           Create the shared memory state snapshot, local
+ *           readers get the boards and relay states from it
+ *           instead of polling the HTTP API. After an upgrade
+ *           the table of the previous process is kept.
+ *********************************************************/
+static void init_snapshot(int upgraded)
+{
+   const char *name = (config.state_snapshot != NULL) ? config.state_snapshot : DEFAULT_STATE_SNAPSHOT;
+   
+   if (!strcmp(name, "none"))
+      return;
+   if (snapshot_open(name, upgraded) != 0)
    {
-      card_info_t * current;
-      card_info_t * prev;
-      current = config.card_list ;
-      while ( current != NULL ) 
+      crelay_log(LOGGER_MAIN, LOG_WARNING, "Can't create state snapshot %s: %s\n", name, strerror(errno));
+      return;
+   }
+   crelay_log(LOGGER_MAIN, LOG_NOTICE, "State snapshot in shared memory %s\n", name);
+   publish_boards();
+}
+
+/* journal_foreach() callback, writes a restored state to its card */
+static void reapply_state(relay_type_t type, const char *serial, relay_mask_t state, void *user_data)
+{
+   char com_port[MAX_COM_PORT_NAME_LEN];
+   char card_serial[MAX_SERIAL_LEN];
+   uint8_t num_relays;
+   
+   snprintf(card_serial, sizeof(card_serial), "%s", serial);
+   if (crelay_detect_relay_card(com_port, &num_relays, card_serial, NULL, type) != 0)
+   {
+      crelay_log(LOGGER_MAIN, LOG_NOTICE, "Card %s not found, relay states not reapplied\n", serial);
+      return;
+   }
+   if (crelay_set_relay_mask(com_port, RELAY_MASK_ALL(num_relays), state, card_serial) != 0)
+      crelay_log(LOGGER_MAIN, LOG_WARNING, "Failed to reapply the relay states of card %s\n", serial);
+   else
+      crelay_log(LOGGER_MAIN, LOG_NOTICE, "Relay states of card %s reapplied\n", serial);
+}
+
+/**********************************************************
+ * Function: init_state_journal()
+ * 
+ * Description:
+ *           Open the relay state journal, the drivers which
+ *           can't read the relays back restore their state
+ *           from it. Without a journal file the states are
+ *           only kept in memory, for an upgrade. With [State]
+ *           reapply the restored states are also written to
+ *           the cards, by probe_cards().
+ * 
+ * Parameters: reapply - 0 after an upgrade, the cards kept
+ *                       their states
+ *********************************************************/
+static void init_state_journal(int reapply)
+{
+   const char *path = (config.state_journal != NULL) ? config.state_journal : DEFAULT_STATE_JOURNAL;
+   int sync_ms = config.state_sync_ms ? config.state_sync_ms : DEFAULT_STATE_SYNC_MS;
+   int n;
+   
+   if (!strcmp(path, "none"))
+   {
+      journal_open(NULL, 0, 0);
+      return;
+   }
+   if ((n = journal_open(path, (size_t)config.state_journal_kb * 1024, sync_ms)) < 0)
+   {
+      crelay_log(LOGGER_MAIN, LOG_WARNING, "Can't open state journal %s: %s, relay states are not kept over restarts\n",
+                 path, strerror(errno));
+      journal_open(NULL, 0, 0);
+      return;
+   }
+   crelay_log(LOGGER_MAIN, LOG_NOTICE, "State journal %s: %d card(s) restored\n", path, n);
+   reapply_pending = (reapply && config.state_reapply);
+}
+
+/**********************************************************
+ * Function: probe_cards()
+ * 
+ * Description:
+ *           Hardware initialization deferred until the
+ *           daemon answers: resolve the AUTO and FIRST boards
+ *           and write the restored relay states. Called from
+ *           the main loop when no request is waiting.
+ *********************************************************/
+static void probe_cards()
+{
+   crelay_set_info_arena(&request_arena);
+   if (config.probe_pending)
+   {
+      probe_boards(&config);
+      publish_boards();
+   }
+   if (reapply_pending)
+   {
+      reapply_pending = 0;
+      journal_foreach(reapply_state, NULL);
+   }
+   crelay_set_info_arena(NULL);
+   arena_reset(&request_arena);
+}
+
+/**********************************************************
+ * Function: activated_sockets()
+ * 
+ * Description:
+ *           systemd socket activation: take the listening
+ *           sockets passed from fd 3 on (LISTEN_FDS), the TCP
+ *           one serves HTTP and the Unix one the control
+ *           clients
+ * 
+ * Parameters: http_sock (out) - HTTP socket, -1 if none
+ * 
+ * Returns:  number of sockets taken
+ *********************************************************/
+static int activated_sockets(int *http_sock)
+{
+   const char *pid = getenv("LISTEN_PID");
+   const char *num = getenv("LISTEN_FDS");
+   struct sockaddr_storage addr;
+   socklen_t len;
+   int fd, n, taken = 0;
+   
+   *http_sock = -1;
+   if (pid == NULL || num == NULL || atoi(pid) != getpid())
+      return 0;
+   n = atoi(num);
+   unsetenv("LISTEN_PID");
+   unsetenv("LISTEN_FDS");
+   unsetenv("LISTEN_FDNAMES");
+   
+   for (fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + n; fd++)
+   {
+      len = sizeof(addr);
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      if (getsockname(fd, (struct sockaddr *)&addr, &len) != 0)
+         continue;
+      if ((addr.ss_family == AF_INET || addr.ss_family == AF_INET6) && *http_sock < 0)
+         *http_sock = fd;
+      else if (addr.ss_family == AF_UNIX && ctl_sock < 0)
       {
-         free((void *)current->serial); current->serial = NULL ;
-         for (int k=0 ; k<16 ; k++)
-         {
-            free((void *)current->relay_label[k]); current->relay_label[k] = NULL ;
-         }
-         free((void *)current->comment); current->comment = NULL ;
-         prev = current ;
-         current = current->next ;
-         free(prev) ;
+         ctl_sock = fd;
+         ctl_activated = 1;
+      }
+      else
+      {
+         crelay_log(LOGGER_MAIN, LOG_WARNING, "Ignoring activated socket %d\n", fd);
+         close(fd);
+         continue;
       }
+      taken++;
    }
+   return taken;
+}
+
+/* Relay states handed over by an upgrade */
+typedef struct
+{
+   handoff_state_t state[HANDOFF_MAX_STATES];
+   int num;
+} handoff_list_t;
+
+/* journal_foreach() callback, adds a state to the handoff list */
+static void save_handoff_state(relay_type_t type, const char *serial, relay_mask_t state, void *user_data)
+{
+   handoff_list_t *list = user_data;
+   handoff_state_t *s;
+   
+   if (list->num == HANDOFF_MAX_STATES)
+      return;
+   s = &list->state[list->num++];
+   memset(s, 0, sizeof(*s));
+   s->type = type;
+   s->state = state;
+   snprintf(s->serial, sizeof(s->serial), "%s", serial);
+}
+
+/**********************************************************
+ * Function: start_upgrade()
+ * 
+ * Description:
+ *           Execute the binary again and hand the listening
+ *           sockets and the relay states over to the new
+ *           process. Called from the main loop between two
+ *           requests, the coalesced relay changes are
+ *           written first so the states are final.
+ * 
+ * Returns:  handoff socket once the new process is ready,
+ *           closed when this process released everything,
+ *           -1 if the upgrade failed and this process goes on
+ *********************************************************/
+static int start_upgrade(int sock, char *argv[])
+{
+   handoff_list_t list;
+   int fds[HANDOFF_MAX_FDS];
+   pid_t pid;
+   int hs;
+   
+   crelay_log(LOGGER_MAIN, LOG_NOTICE, "Upgrading to %s\n", exe_path);
+   crelay_flush(1);
+   journal_sync(1);
+   list.num = 0;
+   journal_foreach(save_handoff_state, &list);
+   
+   fds[0] = sock;
+   fds[1] = ctl_sock;
+   if ((hs = handoff_exec(exe_path, argv, &pid)) < 0)
+   {
+      crelay_log(LOGGER_MAIN, LOG_ERR, "Can't start %s: %s, upgrade cancelled\n", exe_path, strerror(errno));
+      return -1;
+   }
+   if (handoff_send(hs, fds, HANDOFF_MAX_FDS, list.state, list.num) != 0 || handoff_wait(hs) != 0)
+   {
+      crelay_log(LOGGER_MAIN, LOG_ERR, "Process %d did not take over, upgrade cancelled\n", (int)pid);
+      close(hs);
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+      return -1;
+   }
+   crelay_log(LOGGER_MAIN, LOG_NOTICE, "Handing over to process %d\n", (int)pid);
+   return hs;
+}
+
+/**********************************************************
+ * Function: take_over()
+ * 
+ * Description:
+ *           Started by an upgrade: receive the listening
+ *           sockets and relay states of the previous process
+ *           and wait until it released the state journal and
+ *           snapshot. The previous process goes on if this
+ *           fails before it is told to release them.
+ * 
+ * Returns:  HTTP socket, -1 on failure
+ *********************************************************/
+static int take_over(int hs, handoff_list_t *list)
+{
+   int fds[HANDOFF_MAX_FDS];
+   pid_t old_pid;
+   int i;
+   
+   if (handoff_receive(hs, fds, list->state, &list->num, &old_pid) != 0 || fds[0] < 0 ||
+       handoff_ready(hs) != 0)
+   {
+      crelay_log(LOGGER_MAIN, LOG_ERR, "Upgrade handoff failed: %s\n", strerror(errno));
+      for (i=0; i<HANDOFF_MAX_FDS; i++)
+         if (fds[i] >= 0) close(fds[i]);
+      close(hs);
+      return -1;
+   }
+   if (handoff_wait_release(hs) != 0)
+      crelay_log(LOGGER_MAIN, LOG_WARNING, "Process %d did not release the journal in time\n", (int)old_pid);
+   close(hs);
+   
+   ctl_sock = fds[1];
+   crelay_log(LOGGER_MAIN, LOG_NOTICE, "Took over from process %d: listening sockets and %d relay state(s)\n",
+              (int)old_pid, list->num);
+   return fds[0];
+}
+
+/* Stream of a request socket, buffered in the request arena */
+static FILE *open_stream(int sock, const char *mode)
+{
+   FILE *f = fdopen(sock, mode);
+   char *buf;
+   
+   if (f != NULL && (buf = arena_alloc(&request_arena, STREAM_BUF_SIZE)) != NULL)
+      setvbuf(f, buf, _IOFBF, STREAM_BUF_SIZE);
+   return f;
 }
 
 int count_occurrence(char * str, int c)
@@ -332,38 +1426,123 @@ int isNumeric(const char *str)
  * Function: exit_handler()
  * 
  * Description:
- *           Handles the cleanup at reception of the 
- *           TERM signal.
+ *           Handles the TERM and INT signals, the main loop
+ *           exits and does the cleanup. The journal, the
+ *           snapshot and the log thread can't be released
+ *           from a signal handler.
  * 
  * Returns:  -
  *********************************************************/
 static void exit_handler(int signum)
 {
-   syslog(LOG_DAEMON | LOG_NOTICE, "Exit crelay daemon\n");
+   quit_pending = 1 ;
+}
+
+/**********************************************************
+ * Function: reload_handler()
+ * 
+ * Description:
+ *           Handles the HUP signal, the configuration is
+ *           reloaded by the main loop.
+ * 
+ * Returns:  -
+ *********************************************************/
+static void reload_handler(int signum)
+{
+   reload_pending = 1 ;
+}
+
+/**********************************************************
+ * Function: upgrade_handler()
+ * 
+ * Description:
+ *           Handles the USR2 signal, the main loop hands over
+ *           to a new process started from the binary.
+ * 
+ * Returns:  -
+ *********************************************************/
+static void upgrade_handler(int signum)
+{
+   upgrade_pending = 1 ;
+}
+
+/**********************************************************
+ * Function: set_io_timeout()
+ * 
+ * Description:
+ *           Bound the blocking reads and writes of a request
+ *           socket, a client which sends nothing must not
+ *           hold the main loop and the deferred signals.
+ * 
+ * Returns:  -
+ *********************************************************/
+static void set_io_timeout(int sock, int timeout_ms)
+{
+   struct timeval tv;
    
-   free_config() ;
-   crelay_close() ;
-   crelay_free_static_mem() ;
+   tv.tv_sec = timeout_ms / 1000;
+   tv.tv_usec = (timeout_ms % 1000) * 1000;
+   setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/**********************************************************
+ * Function: watch_config()
+ * 
+ * Description:
+ *           Watch the directory of CONFIG_FILE, editors
+ *           usually replace the file instead of writing it.
+ *           A created file is only read once it is closed.
+ * 
+ * Returns:  inotify fd, -1 on failure
+ *********************************************************/
+static int watch_config()
+{
+   char dir[] = CONFIG_FILE;
+   int fd;
    
-   if (portHttp != 0)
+   if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+      return -1;
+   if (inotify_add_watch(fd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
    {
-      syslog(LOG_DAEMON | LOG_NOTICE, "Trying Close port HTTP\n");
-      if (global_s != -1) close(global_s) ; 
-      close(portHttp);
-      syslog(LOG_DAEMON | LOG_NOTICE, "Confirm Close port HTTP\n");
+      crelay_log(LOGGER_MAIN, LOG_WARNING, "Can't watch %s : %s", CONFIG_FILE, strerror(errno));
+      close(fd);
+      return -1;
    }
-   if (fout != NULL)
-   {
-      syslog(LOG_DAEMON | LOG_NOTICE, "Close fout\n");
-      fclose(fout);
-   }
-   if (fin != NULL)
+   return fd;
+}
+
+/**********************************************************
+ * Function: config_changed()
+ * 
+ * Description:
+ *           Read the pending inotify events
+ * 
+ * Returns:  1 if one of them concerns CONFIG_FILE or
+ *           CONFIG_CACHE, 0 otherwise
+ *********************************************************/
+static int config_changed(int fd)
+{
+   char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+   char file[] = CONFIG_FILE;
+   char cache[] = CONFIG_CACHE;
+   const char *name = basename(file);
+   const char *cache_name = basename(cache);
+   const struct inotify_event *ev;
+   ssize_t len;
+   char *p;
+   int changed = 0;
+   
+   while ((len = read(fd, buf, sizeof(buf))) > 0)
    {
-      syslog(LOG_DAEMON | LOG_NOTICE, "Close fin\n");
-      fclose(fin);
+      for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len)
+      {
+         ev = (const struct inotify_event *)p;
+         if (ev->len > 0 && (!strcmp(ev->name, name) || !strcmp(ev->name, cache_name)))
+            changed = 1;
+      }
    }
-   syslog(LOG_DAEMON | LOG_NOTICE, "Bye\n");
-   exit(EXIT_SUCCESS);
+   return changed;
 }
 
                                            
@@ -380,6 +1559,7 @@ void send_headers(FILE *f, int status, char *title, char *extra, char *mime,
 {
    time_t now;
    char timebuf[128];
+   CRELAY_PROBE1(response__write, status);
    fprintf(f, "%s %d %s\r\n", PROTOCOL, status, title);
    fprintf(f, "Server: %s\r\n", SERVER);
    //fprintf(f, "Access-Control-Allow-Origin: *\r\n"); // TEST For test only
@@ -640,7 +1820,7 @@ int read_httpget_data(char* buf, char* data, size_t datalen)
 void exit_page(int sock)
 {
    
-   fout = fdopen(sock, "w");
+   fout = open_stream(sock, "w");
    web_page_header(fout);
    fprintf(fout, "Program stopped<BR><BR>");
    web_page_footer(fout);
@@ -651,7 +1831,8 @@ void exit_page(int sock)
 
 void error_page(int sock, char * texte)
 {
-   fout = fdopen(sock, "w");
+   metrics_http_error();
+   fout = open_stream(sock, "w");
    //web_page_header(fout);
    send_headers(fout, 500, "Internal Error", NULL, "text/html", -1, -1);
    fprintf(fout, "ERROR: %s \r\n",texte);
@@ -666,14 +1847,15 @@ void webui(int sock)
 
    int  i, serial_in_use, not_found;
    relay_info_t *relay_info;
-   relay_info_t *prev_relay_info;
+   relay_info_t *first_relay_info;
    relay_info_t *current_relay_info ;
    card_info_t *search ;
    char com_port[MAX_COM_PORT_NAME_LEN];
    relay_state_t rstate[MAX_NUM_RELAYS];
    uint8_t last_relay=FIRST_RELAY;
+   char label[32];
    
-   fout = fdopen(sock, "w");
+   fout = open_stream(sock, "w");
    /* Web request */
    web_page_header(fout);
    
@@ -685,9 +1867,11 @@ void webui(int sock)
       char cname[MAX_RELAY_CARD_NAME_LEN];
       crelay_get_relay_card_name(crelay_get_relay_card_type(), cname);
       
-      syslog(LOG_DAEMON | LOG_NOTICE, "Step 12 no list");
+      crelay_log(LOGGER_HTTP, LOG_DEBUG, "Step 12 no list");
       
-      if (crelay_detect_all_relay_cards(&relay_info) != -1)
+      crelay_detect_all_relay_cards(&relay_info) ;
+      first_relay_info = relay_info ;
+      if (relay_info->next != NULL)
       { 
          while (relay_info->next != NULL)
          {
@@ -706,21 +1890,19 @@ void webui(int sock)
                
                fprintf(fout, "<tr style=\"vertical-align: top; background-color: rgb(230, 230, 255);\">\r\n");
                fprintf(fout, "<td style=\"width: 300px;\">Relay %d<br><span style=\"font-style: italic; font-size: 16px; color: grey;\">%s</span></td>\r\n", 
-                          i, config.relay_label[i-1]);
+                          i, get_label(&config.relay_label, i, label, sizeof(label)));
                fprintf(fout, "<td style=\"text-align: center; vertical-align: middle; width: 100px; background-color: white;\"><label class=\"switch\"><input type=\"checkbox\" %s id=%d serial=\"%s\" onchange=\"switch_relay(this)\"><span class=\"slider\"></span></label></td>\r\n", 
                        rstate[i-1]==ON?"checked":"",i,relay_info->serial);
             }
             
-            prev_relay_info = relay_info ;
             relay_info = relay_info->next;
-            free(prev_relay_info) ;
          }
       }
       else
       {
          fprintf(fout, "<td style=\"text-align: center; vertical-align: middle; width: 100px; background-color: white;\">No compatible device detected</td>\r\n") ;
       }
-      free(relay_info) ;
+      crelay_free_relay_info(first_relay_info) ;
    }
    else
    {
@@ -728,7 +1910,7 @@ void webui(int sock)
       card_info_t * current;
       current = config.card_list ;
       
-      syslog(LOG_DAEMON | LOG_NOTICE, "Step 12 List");
+      crelay_log(LOGGER_HTTP, LOG_DEBUG, "Step 12 List");
       
       crelay_detect_all_relay_cards(&relay_info) ;
       
@@ -740,7 +1922,7 @@ void webui(int sock)
             not_found = 0 ;
             if (current->serial_type == SERIAL_AUTO)
                {
-                  syslog(LOG_DAEMON | LOG_NOTICE, "type serial: %d\n", current->serial_type);
+                  crelay_log(LOGGER_HTTP, LOG_DEBUG, "type serial: %d\n", current->serial_type);
                   current_relay_info = relay_info ;
                   while (current_relay_info->next != NULL)
                   {
@@ -759,17 +1941,16 @@ void webui(int sock)
                         }
                         if (serial_in_use == 0)
                         {
-                           free((void *)current->serial) ;
-                           current->serial = strdup(current_relay_info->serial) ;
+                           set_board_serial(current, current_relay_info->serial) ;
                            crelay_detect_relay_card(com_port, &last_relay, (char *)current->serial, NULL, current->model) ;
                            not_found = 1 ;
-                           syslog(LOG_DAEMON | LOG_NOTICE, "serial affected : %s\n", current->serial);
+                           crelay_log(LOGGER_HTTP, LOG_INFO, "serial affected : %s\n", current->serial);
                            break ;
                         }
                      }
                      current_relay_info = current_relay_info->next ;
                   }
-                  if (current->serial == NULL) syslog(LOG_DAEMON | LOG_NOTICE, "serial: NOT FOUND\n");
+                  if (current->serial == NULL) crelay_log(LOGGER_HTTP, LOG_INFO, "serial: NOT FOUND\n");
                }
          }
             
@@ -782,7 +1963,8 @@ void webui(int sock)
             fprintf(fout, "<td style=\"width: 200px;\">board : %u<br><span style=\"font-style: italic; font-size: 12px; color: grey; font-weight: normal;\">Serial : %s</span></td>\r\n", 
                   current->card_id, current->serial);
                   
-            fprintf(fout, "</tr><tr><td col=2 style=\"text-align: center; vertical-align: middle; width: 100px; background-color: white;\">Card not found</td>\r\n</tr>") ;
+            fprintf(fout, "</tr><tr><td col=2 style=\"text-align: center; vertical-align: middle; width: 100px; background-color: white;\">%s</td>\r\n</tr>",
+                    board_initializing(current) ? "Card initializing" : "Card not found") ;
          }
          else
          {
@@ -798,8 +1980,8 @@ void webui(int sock)
             {
                fprintf(fout, "<tr style=\"vertical-align: top; background-color: rgb(230, 230, 255);\">\r\n");
                fprintf(fout, "<td style=\"width: 300px;\">Relay %d<br><span style=\"font-style: italic; font-size: 16px; color: grey;\">%s</span></td>\r\n", 
-                     i, current->relay_label[i-1]);
-               syslog(LOG_DAEMON | LOG_NOTICE, "Step 13 : com_port : %s / serial : %s",com_port,current->serial);
+                     i, get_label(&current->relay_label, i, label, sizeof(label)));
+               crelay_log(LOGGER_HTTP, LOG_DEBUG, "Step 13 : com_port : %s / serial : %s",com_port,current->serial);
                if (crelay_get_relay(com_port, i, &rstate[i-1], (char *)(current->serial)) == 0)
                {
                   fprintf(fout, "<td style=\"text-align: center; vertical-align: middle; width: 100px; background-color: white;\"><label class=\"switch\"><input type=\"checkbox\" %s id=%d serial=\"%s\" onchange=\"switch_relay(this)\"><span class=\"slider\"></span></label></td>\r\n", 
@@ -810,20 +1992,14 @@ void webui(int sock)
                   fprintf(fout, "<td style=\"text-align: center; vertical-align: middle; width: 100px; background-color: white;\">Not Avalaible</td>\r\n") ;
                }
                
-               syslog(LOG_DAEMON | LOG_NOTICE, "Step 14");
+               crelay_log(LOGGER_HTTP, LOG_DEBUG, "Step 14");
             }
          }
          
          current = current->next ;
       }
-      
-      while (relay_info->next != NULL)
-      {
-         prev_relay_info = relay_info ;
-         relay_info = relay_info->next;
-         free(prev_relay_info) ;
-      }
-      free(relay_info) ;
+      
+      crelay_free_relay_info(relay_info) ;
    }
    
    fprintf(fout, "</tbody></table><br>\r\n");
@@ -834,28 +2010,25 @@ void webui(int sock)
    fout = NULL ;
 }
 
-void send_json_info(int sock, relay_info_t **relay_info)
+void send_json_info(int sock, relay_info_t *relay_info)
 {
-   relay_info_t *prev_relay_info;
    int i = 1 ;
    char cname[MAX_RELAY_CARD_NAME_LEN];
    
-   fout = fdopen(sock, "w");
+   fout = open_stream(sock, "w");
    
    send_headers(fout, 200, "OK", NULL, "text/plain", -1, -1);
    
    /* Detect all cards connected to the system */
    
    fprintf(fout, "{ \"meta\": { }, \"data\": [ ");
-   while ((*relay_info)->next != NULL)
+   while (relay_info->next != NULL)
    {
-      crelay_get_relay_card_name((*relay_info)->relay_type, cname);
-      fprintf(fout, "{ \"num\" : \"%d\", \"relay_type\": \"%s\", \"serial\": \"%s\" }", i++, cname, (*relay_info)->serial);
-      prev_relay_info = (*relay_info) ;
-      (*relay_info) = (*relay_info)->next;
-      free(prev_relay_info) ;
+      crelay_get_relay_card_name(relay_info->relay_type, cname);
+      fprintf(fout, "{ \"num\" : \"%d\", \"relay_type\": \"%s\", \"serial\": \"%s\" }", i++, cname, relay_info->serial);
+      relay_info = relay_info->next;
       
-      if ((*relay_info)->next != NULL) fprintf(fout, " , ") ;
+      if (relay_info->next != NULL) fprintf(fout, " , ") ;
    }
    fprintf(fout, " ] }");
 
@@ -870,17 +2043,17 @@ void send_json_card(int sock, char * com_port, uint8_t first_relay, uint8_t last
    
    for (i=first_relay; i<=last_relay; i++)
    {
-      syslog(LOG_DAEMON | LOG_NOTICE, "Step 10-%d",i);
+      crelay_log(LOGGER_HTTP, LOG_DEBUG, "Step 10-%d",i);
       if (crelay_get_relay(com_port, i, &rstate[i-1], serial) != 0)
       {
          rstate[i-1] = INVALID ;
       }
    }
    
-   syslog(LOG_DAEMON | LOG_NOTICE, "Step 11");
+   crelay_log(LOGGER_HTTP, LOG_DEBUG, "Step 11");
    
    /* HTTP API request, send response */
-   fout = fdopen(sock, "w");
+   fout = open_stream(sock, "w");
    send_headers(fout, 200, "OK", NULL, "text/plain", -1, -1);
    
    fprintf(fout, "{ \"meta\": { }, \"data\": [ ");
@@ -906,7 +2079,7 @@ void send_json_board(int sock, relay_info_t *relay_info)
    
    relay_info_origine = relay_info ;
    
-   fout = fdopen(sock, "w");
+   fout = open_stream(sock, "w");
    send_headers(fout, 200, "OK", NULL, "text/plain", -1, -1);
    
    fprintf(fout, "{ \"meta\": { }, \"data\": [ ");
@@ -918,7 +2091,7 @@ void send_json_board(int sock, relay_info_t *relay_info)
       
       while (relay_info->next != NULL)
       {
-         if (!strcmp(relay_info->serial, current->serial) && (current->model == NO_RELAY_TYPE || current->model == relay_info->relay_type))
+         if (current->serial != NULL && !strcmp(relay_info->serial, current->serial) && (current->model == NO_RELAY_TYPE || current->model == relay_info->relay_type))
          {
             crelay_get_relay_card_name(relay_info->relay_type, cname) ;
             found_card = 1 ;
@@ -947,10 +2120,9 @@ void send_json_board(int sock, relay_info_t *relay_info)
                      }
                      if (serial_in_use == 0)
                      {
-                        free((void *)current->serial) ;
-                        current->serial = strdup(current_relay_info->serial) ;
+                        set_board_serial(current, current_relay_info->serial) ;
                         not_found = 1 ;
-                        syslog(LOG_DAEMON | LOG_NOTICE, "serial affected : %s\n", current->serial);
+                        crelay_log(LOGGER_HTTP, LOG_INFO, "serial affected : %s\n", current->serial);
                         break ;
                      }
                   }
@@ -967,7 +2139,8 @@ void send_json_board(int sock, relay_info_t *relay_info)
          relay_info = relay_info->next;
       }
       
-      fprintf(fout, "{ \"board\" : \"%d\", \"comment\" : \"%s\", \"relay_type\": \"%s\", \"serial\": \"%s\" }", current->card_id,current->comment, (found_card == 1)?cname:"NOT FOUND", current->serial);          
+      fprintf(fout, "{ \"board\" : \"%d\", \"comment\" : \"%s\", \"relay_type\": \"%s\", \"serial\": \"%s\" }", current->card_id,current->comment,
+              (found_card == 1)?cname:(board_initializing(current)?"INITIALIZING":"NOT FOUND"), current->serial);          
 
       current = current->next ;
       if (current != NULL) fprintf(fout, " , ") ;
@@ -989,7 +2162,8 @@ void send_json_setrelay(int sock, char * com_port, uint8_t nrelay, uint8_t nstat
 void send_json_no_device(int sock)
 {
    
-   fout = fdopen(sock, "w");
+   metrics_http_error();
+   fout = open_stream(sock, "w");
    send_headers(fout, 200, "OK", NULL, "text/plain", -1, -1);
    fprintf(fout, "{ \"meta\": { \"error\" : 1001, \"message\": \"No compatible device detected.\" }, \"data\": { } }");
    fclose(fout) ;
@@ -999,23 +2173,107 @@ void send_json_no_device(int sock)
 void send_json_unavailable(int sock)
 {
    
-   fout = fdopen(sock, "w");
+   metrics_http_error();
+   fout = open_stream(sock, "w");
    send_headers(fout, 200, "OK", NULL, "text/plain", -1, -1);
    fprintf(fout, "{ \"meta\": { \"error\" : 1002, \"message\": \"function unavailable in this context.\" }, \"data\": { } }");
    fclose(fout) ;
    fout = NULL ;
 }
 
+void send_json_initializing(int sock)
+{
+   
+   metrics_http_error();
+   fout = open_stream(sock, "w");
+   send_headers(fout, 200, "OK", NULL, "text/plain", -1, -1);
+   fprintf(fout, "{ \"meta\": { \"error\" : 1004, \"message\": \"Card initializing, retry later.\" }, \"data\": { } }");
+   fclose(fout) ;
+   fout = NULL ;
+}
+
+void send_json_pool_full(int sock)
+{
+   
+   metrics_http_error();
+   fout = open_stream(sock, "w");
+   send_headers(fout, 200, "OK", NULL, "text/plain", -1, -1);
+   fprintf(fout, "{ \"meta\": { \"error\" : 1005, \"message\": \"Request memory pool full, retry later.\" }, \"data\": { } }");
+   fclose(fout) ;
+   fout = NULL ;
+}
+
 void send_json_invalid_param(int sock)
 {
    
-   fout = fdopen(sock, "w");
+   metrics_http_error();
+   fout = open_stream(sock, "w");
    send_headers(fout, 200, "OK", NULL, "text/plain", -1, -1);
    fprintf(fout, "{ \"meta\": { \"error\" : 1003, \"message\": \"Invalid value.\" }, \"data\": { } }");
    fclose(fout) ;
    fout = NULL ;
 }
 
+void send_metrics(int sock)
+{
+   
+   fout = open_stream(sock, "w");
+   send_headers(fout, 200, "OK", NULL, "text/plain; version=0.0.4", -1, -1);
+   metrics_write(fout);
+   fclose(fout) ;
+   fout = NULL ;
+}
+
+void send_json_trace(int sock)
+{
+   
+   fout = open_stream(sock, "w");
+   send_headers(fout, 200, "OK", NULL, "text/plain", -1, -1);
+   trace_write_json(fout);
+   fclose(fout) ;
+   fout = NULL ;
+}
+
+static void write_pool_json(FILE *f, const char *name, const arena_t *a, size_t peak, unsigned long failures)
+{
+   fprintf(f, "{ \"pool\": \"%s\", \"size\": %zu, \"used\": %zu, \"peak\": %zu, \"failures\": %lu }",
+           name, arena_capacity(a), a->used, (a->peak > peak) ? a->peak : peak, a->failures + failures);
+}
+
+void send_json_memory(int sock)
+{
+   
+   fout = open_stream(sock, "w");
+   send_headers(fout, 200, "OK", NULL, "text/plain", -1, -1);
+   fprintf(fout, "{ \"meta\": { \"mode\": \"%s\", \"image\": %zu }, \"data\": [ ",
+           fixed_memory ? "fixed" : "heap", config.image_size);
+   write_pool_json(fout, "config", &config.arena, config_peak, config_failures);
+   fprintf(fout, " , ");
+   write_pool_json(fout, "request", &request_arena, 0, 0);
+   fprintf(fout, " ] }");
+   fclose(fout) ;
+   fout = NULL ;
+}
+
+/**********************************************************
+ * Function url_route()
+ * 
+ * Description: Route of an URL for the request metrics
+ * 
+ *********************************************************/
+static metrics_route_t url_route(const char *url)
+{
+   if (!strcmp(url,"/")) return METRICS_ROUTE_WEBUI;
+   if (!strcmp(url,"/quit")) return METRICS_ROUTE_QUIT;
+   if (!strcmp(url,"/api/info")) return METRICS_ROUTE_INFO;
+   if (!strcmp(url,"/api/metrics")) return METRICS_ROUTE_METRICS;
+   if (!strncmp(url,"/api/card",9)) return METRICS_ROUTE_CARD;
+   if (!strncmp(url,"/api/board",10)) return METRICS_ROUTE_BOARD;
+   if (!strncmp(url,"/api/serial",11)) return METRICS_ROUTE_SERIAL;
+   if (!strncmp(url,"/api/debug/",11)) return METRICS_ROUTE_DEBUG;
+   return METRICS_ROUTE_OTHER;
+}
+
 /**********************************************************
  * Function new_process_http_request()
  * 
@@ -1038,20 +2296,24 @@ int new_process_http_request(int sock)
    char *nrelay = NULL ;
    char *nvalue = NULL ;
    char *ncard_id = NULL ;
-   int vrelay ;
-   int value ;
+   int vrelay = 0 ;
+   int value = 0 ;
    int vcard_id ;
    relay_info_t *relay_info;
-   relay_info_t *prev_relay_info;
    relay_info_t *current_relay_info;
    int action, serial_in_use ;
+   int r ;
    card_info_t *search ;
+   metrics_route_t route = METRICS_ROUTE_OTHER;
 
    fin = NULL ;
    fout = NULL ;
 
+   metrics_http_begin();
+   CRELAY_PROBE1(request__start, sock);
+
    /* Open file for input */
-   fin = fdopen(sock, "r");
+   fin = open_stream(sock, "r");
    
    /* Read  first line of request header which contains 
     * the request method and url seperated by a space
@@ -1079,6 +2341,10 @@ int new_process_http_request(int sock)
       goto new_done;
    }
    //printf("url: %s\n", url);
+   route = url_route(url);
+   metrics_http_route(route);
+   trace_request_url(url);
+   CRELAY_PROBE2(route, url, route);
    
    /* Check the request method we are dealing with */
    if (strcasecmp(method, "POST") == 0)
@@ -1096,8 +2362,8 @@ int new_process_http_request(int sock)
       goto new_done;
    }
 
-//syslog(LOG_DAEMON | LOG_NOTICE, "formdatalen : %d",formdatalen);
-//syslog(LOG_DAEMON | LOG_NOTICE, "Formdata : %s",formdata);
+//crelay_log(LOGGER_MAIN, LOG_NOTICE, "formdatalen : %d",formdatalen);
+//crelay_log(LOGGER_MAIN, LOG_NOTICE, "Formdata : %s",formdata);
 
    /* Send an error if we failed to read the form data properly */
    if (formdatalen < 0) {
@@ -1105,7 +2371,7 @@ int new_process_http_request(int sock)
      goto new_done ;
    }
    
-//syslog(LOG_DAEMON | LOG_NOTICE, "URL : %s",url);
+//crelay_log(LOGGER_MAIN, LOG_NOTICE, "URL : %s",url);
 
    if (!strcmp(url,"/quit"))
    {
@@ -1120,17 +2386,40 @@ int new_process_http_request(int sock)
       goto new_done ;
    }
 
+   if (!strcmp(url,"/api/metrics"))
+   {
+      send_metrics(sock) ;
+      goto new_done ;
+   }
+
+   if (!strcmp(url,"/api/debug/trace"))
+   {
+      send_json_trace(sock) ;
+      goto new_done ;
+   }
+
+   if (!strcmp(url,"/api/debug/memory"))
+   {
+      send_json_memory(sock) ;
+      goto new_done ;
+   }
+
    if (!strcmp(url,"/api/info") || !strcmp(url,"/api/serial"))   // Attention si config.number !=0, faire la liste des cartes config
    {
-      if (crelay_detect_all_relay_cards(&relay_info) == -1)
+      r = crelay_detect_all_relay_cards(&relay_info) ;
+      if (r == -1)
       {
          send_json_no_device(sock) ;
       }
+      else if (r == -2)
+      {
+         send_json_pool_full(sock) ;
+      }
       else
       {
-         send_json_info(sock,&relay_info) ;
+         send_json_info(sock,relay_info) ;
       }
-      free(relay_info) ;
+      crelay_free_relay_info(relay_info) ;
       goto new_done ;
    }
 
@@ -1143,16 +2432,11 @@ int new_process_http_request(int sock)
    
    if (!strcmp(url,"/api/board"))      // Attention se limiter à liste des cartes
    {
-      crelay_detect_all_relay_cards(&relay_info) ;
-      send_json_board(sock,relay_info) ;
-      
-      while (relay_info->next != NULL)
-      {
-         prev_relay_info = relay_info ;
-         relay_info = relay_info->next;
-         free(prev_relay_info) ;
-      }
-      free(relay_info) ;
+      if (crelay_detect_all_relay_cards(&relay_info) == -2)
+         send_json_pool_full(sock) ;
+      else
+         send_json_board(sock,relay_info) ;
+      crelay_free_relay_info(relay_info) ;
       goto new_done ;
    }
 
@@ -1203,7 +2487,7 @@ int new_process_http_request(int sock)
             break ;
          
          case 1:
-            if (vrelay <= 0 || vrelay > 16)
+            if (vrelay <= 0 || vrelay > MAX_NUM_RELAYS)
             {
                send_json_invalid_param(sock) ;
             }
@@ -1214,7 +2498,7 @@ int new_process_http_request(int sock)
             break ;
             
          case 2:
-            if ((value != 0 && value != 1) || vrelay <= 0 || vrelay > 16)
+            if ((value != 0 && value != 1) || vrelay <= 0 || vrelay > MAX_NUM_RELAYS)
             {
                send_json_invalid_param(sock) ;
             }
@@ -1247,6 +2531,11 @@ int new_process_http_request(int sock)
             {
                if (current->card_id == vcard_id)
                {
+                  if (board_initializing(current))
+                  {
+                     send_json_initializing(sock) ;
+                     goto new_done ;
+                  }
                   if (crelay_detect_relay_card(com_port, &last_relay, (char *)current->serial, NULL, current->model) == -1)
                   {
                      if (current->serial_type == SERIAL_AUTO)
@@ -1271,23 +2560,15 @@ int new_process_http_request(int sock)
                               }
                               if (serial_in_use == 0)
                               {
-
-                                 free((void *)current->serial) ;
-                                 current->serial = strdup(current_relay_info->serial) ;
-                                 syslog(LOG_DAEMON | LOG_NOTICE, "serial affected : %s\n", current->serial);
+                                 set_board_serial(current, current_relay_info->serial) ;
+                                 crelay_log(LOGGER_HTTP, LOG_INFO, "serial affected : %s\n", current->serial);
                                  break ;
                               }
                            }
                            current_relay_info = current_relay_info->next ;
                         }
                         
-                        while (relay_info->next != NULL)
-                        {
-                           prev_relay_info = relay_info ;
-                           relay_info = relay_info->next;
-                           free(prev_relay_info) ;
-                        }
-                        free(relay_info) ;
+                        crelay_free_relay_info(relay_info) ;
                         relay_info = NULL ;
                      }
                   }
@@ -1326,7 +2607,7 @@ int new_process_http_request(int sock)
             break ;
       }
 
-      syslog(LOG_DAEMON | LOG_NOTICE, "serial B : %s\n", serial);      
+      crelay_log(LOGGER_HTTP, LOG_DEBUG, "serial B : %s\n", serial);      
       if (config.number !=0)
       {
 
@@ -1374,104 +2655,446 @@ int new_process_http_request(int sock)
             break ;
             
          case 2:
-            if (vrelay <= 0 || vrelay > 16)
+            if (vrelay <= 0 || vrelay > MAX_NUM_RELAYS)
+            {
+               send_json_invalid_param(sock) ;
+            }
+            else
+            {
+               send_json_card(sock, com_port, vrelay, vrelay, serial) ;
+            }
+            break ;
+            
+         case 3:
+            if ((value != 0 && value != 1) || vrelay <= 0 || vrelay > MAX_NUM_RELAYS)
+            {
+               send_json_invalid_param(sock) ;
+            }
+            else
+            {
+               send_json_setrelay(sock, com_port, vrelay, value, serial) ;
+            }
+            break ;
+      }
+      
+      goto new_done ;
+   }
+
+   error_page(sock,"PAGE INTROUVABLE") ;
+
+ new_done:
+   if (exit_value < 0) metrics_http_error();
+   metrics_http_end();
+   CRELAY_PROBE3(request__end, sock, route, exit_value);
+   if (fout) fclose(fout);
+   fout = NULL ;
+   if (fin) fclose(fin);
+   fin = NULL ;
+
+   return exit_value ;
+
+}
+
+/**********************************************************
+ * Function print_usage()
+ * 
+ * Description:
+ * 
+ * Parameters:
+ * 
+ *********************************************************/
+void print_usage()
+{
+   relay_type_t rtype;
+   char cname[60];
+   
+   printf("crelay, version %s\n\n", VERSION);
+   printf("This utility provides a unified way of controlling different types of relay cards.\n");
+   printf("Supported relay cards:\n");
+   for(rtype=NO_RELAY_TYPE+1; rtype<LAST_RELAY_TYPE; rtype++)
+   {
+      crelay_get_relay_card_name(rtype, cname);
+      printf("  - %s\n", cname);
+   }
+   printf("\n");
+   printf("The program can be run in interactive (command line) mode or in daemon mode with\n");
+   printf("built-in web server.\n\n");
+   printf("Interactive mode:\n");
+   printf("    crelay -i | [-s <serial number>] <operation>... | [-s <serial number>] -f <file>\n\n");
+   printf("       -i print relay information\n");
+   printf("       -f|--from-file read the operations from a file (- for stdin)\n\n");
+   printf("       The state of any relay can be read or it can be changed to a new state.\n");
+   printf("       If only the relay number is provided then the current state is returned,\n");
+   printf("       otherwise the relays state is set to the new value provided as second parameter.\n");
+   printf("       Several operations are executed in order on the same card:\n");
+   printf("         <r>               print the state of relay <r>\n");
+   printf("         <r> ON|OFF        switch relay <r>\n");
+   printf("         <r> pulse[:<ms>]  switch relay <r> on for <ms> (default %d) ms\n", CLI_DEFAULT_PULSE_MS);
+   printf("         all?              print the state of all relays\n");
+   printf("         all ON|OFF        switch all relays\n");
+   printf("       The USB communication port is auto detected. The first compatible device\n");
+   printf("       found will be used, unless -s switch and a serial number is passed.\n");
+   printf("       When a daemon is running the command is executed by the daemon through\n");
+   printf("       its control socket %s (or $%s).\n\n", CTL_DEFAULT_PATH, CTL_PATH_ENV);
+   printf("Daemon mode:\n");
+   printf("    crelay -d|-D [<relay1_label> [<relay2_label> [<relay3_label> [<relay4_label>]]]] \n\n");
+   printf("       -d use daemon mode, run in foreground\n");
+   printf("       -D use daemon mode, run in background\n\n");
+   printf("       In daemon mode the built-in web server will be started and the relays\n");
+   printf("       can be completely controlled via a Web browser GUI or HTTP API.\n");
+   printf("       The config file %s will be used, if present.\n", CONFIG_FILE);
+   printf("       It is reloaded when it changes or on SIGHUP, a new listen address,\n");
+   printf("       port or control socket needs a restart.\n");
+   printf("       On SIGUSR2 the daemon starts its binary again and hands the listening\n");
+   printf("       sockets and relay states over to it, for an upgrade without downtime.\n");
+   printf("       Under systemd socket activation (LISTEN_FDS) the passed TCP and Unix sockets\n");
+   printf("       replace the listen address and the control socket. The cards are probed\n");
+   printf("       once the daemon answers, boards are reported initializing until then.\n");
+   printf("       Optionally a personal label for each relay can be supplied as command\n");
+   printf("       line parameter which will be displayed next to the relay name on the\n");
+   printf("       web page.\n\n");
+   printf("       To access the web interface point your Web browser to the following address:\n");
+   printf("       http://<my-ip-address>:%d\n\n", DEFAULT_SERVER_PORT);
+   printf("       To use the HTTP API send a GET request (response JSON format) from the client to this URL:\n");
+   printf("       http://<my-ip-address>:%d/api/info\n", DEFAULT_SERVER_PORT );
+   printf("       http://<my-ip-address>:%d/api/card\n", DEFAULT_SERVER_PORT );
+   printf("       http://<my-ip-address>:%d/api/card/<r>\n", DEFAULT_SERVER_PORT );
+   printf("       http://<my-ip-address>:%d/api/card/<r>/<v>\n", DEFAULT_SERVER_PORT );
+   printf("       http://<my-ip-address>:%d/api/serial/<s>\n", DEFAULT_SERVER_PORT );
+   printf("       http://<my-ip-address>:%d/api/serial/<s>/<v>\n", DEFAULT_SERVER_PORT );
+   printf("       http://<my-ip-address>:%d/api/board\n", DEFAULT_SERVER_PORT );
+   printf("       http://<my-ip-address>:%d/api/board/<c>\n", DEFAULT_SERVER_PORT );
+   printf("       http://<my-ip-address>:%d/api/board/<c>/<r>\n", DEFAULT_SERVER_PORT );
+   printf("       http://<my-ip-address>:%d/api/board/<c>/<r>/<v>\n", DEFAULT_SERVER_PORT );
+   printf("       http://<my-ip-address>:%d/api/metrics (Prometheus text format)\n", DEFAULT_SERVER_PORT );
+   printf("       http://<my-ip-address>:%d/api/debug/trace\n", DEFAULT_SERVER_PORT );
+   printf("       http://<my-ip-address>:%d/api/debug/memory\n", DEFAULT_SERVER_PORT );
+   printf("       http://<my-ip-address>:%d/quit\n\n", DEFAULT_SERVER_PORT ); 
+   printf("       With <r> : relay (between 1 and %d)\n", MAX_NUM_RELAYS); 
+   printf("            <v> : status (0 : OFF / 1 : ON)\n"); 
+   printf("            <s> : card serial number\n"); 
+   printf("            <c> : board (from the file crelay.conf)\n\n");
+   printf("Config compilation:\n");
+   printf("    crelay --compile-config\n\n");
+   printf("       Compile the config file to %s. The daemon maps this image\n", CONFIG_CACHE);
+   printf("       instead of parsing the config file as long as it is newer.\n\n");
+   
+}
+
+
+/* The HTTP micro benchmarks (make bench) link this module without main() */
+#ifndef CRELAY_NO_MAIN
+
+/* Control socket of the daemon */
+static const char *ctl_path = CTL_DEFAULT_PATH ;
+
+typedef enum
+{
+   CLI_GET = 0,
+   CLI_SET,
+   CLI_PULSE
+} cli_op_kind_t;
+
+typedef struct
+{
+   cli_op_kind_t kind;
+   uint8_t relay;                 /* 0 = all relays */
+   relay_state_t state;
+   unsigned int pulse_ms;
+} cli_op_t;
+
+/* Card used by the command line mode, locally or through the daemon */
+typedef struct
+{
+   int sock;                      /* control socket, -1 = local access */
+   char com_port[MAX_COM_PORT_NAME_LEN];
+   char serial[MAX_SERIAL_LEN];
+   uint8_t num_relays;
+} cli_session_t;
+
+static int info_num ;
+static char *info_first ;
+
+static void print_card_line(const char *line)
+{
+   const char *tab = strchr(line, '\t');
+   
+   if (strncmp(line, "card ", 5) || tab == NULL) return;
+   if (info_num == 1) printf("\nDetected relay cards:\n");
+   printf("  #%d\t%.*s (serial %s)\n", info_num++, (int)(tab-line-5), line+5, tab+1);
+}
+
+static void first_card_line(const char *line)
+{
+   const char *tab = strchr(line, '\t');
+   
+   if (!strncmp(line, "card ", 5) && tab != NULL && info_first[0] == '\0')
+      snprintf(info_first, MAX_SERIAL_LEN, "%s", tab+1);
+}
+
+/**********************************************************
+ * Function parse_cli_op()
+ * 
+ * Description: Parse one operation of the command line:
+ *              <r>, <r> on|off, <r> pulse[:<ms>], all?,
+ *              all on|off
+ * 
+ * Parameters: tok (in)  - remaining tokens
+ *             ntok (in) - number of remaining tokens
+ *             op (out)  - operation
+ * 
+ * Return:   number of tokens used, -1 - invalid operation
+ *********************************************************/
+static int parse_cli_op(char **tok, int ntok, cli_op_t *op)
+{
+   char *state = (ntok > 1) ? tok[1] : NULL;
+   
+   memset(op, 0, sizeof(*op));
+   if (!strcmp(tok[0], "all?"))
+   {
+      op->kind = CLI_GET;
+      return 1;
+   }
+   if (strcmp(tok[0], "all"))
+   {
+      if (!isNumeric(tok[0]) || atoi(tok[0]) < FIRST_RELAY || atoi(tok[0]) > MAX_NUM_RELAYS)
+         return -1;
+      op->relay = atoi(tok[0]);
+   }
+   
+   if (state != NULL && (!strcmp(state, "on") || !strcmp(state, "ON")))
+   {
+      op->kind = CLI_SET;
+      op->state = ON;
+      return 2;
+   }
+   if (state != NULL && (!strcmp(state, "off") || !strcmp(state, "OFF")))
+   {
+      op->kind = CLI_SET;
+      op->state = OFF;
+      return 2;
+   }
+   if (state != NULL && op->relay != 0 && !strncmp(state, "pulse", 5) && 
+       (state[5] == '\0' || (state[5] == ':' && isNumeric(&state[6]))))
+   {
+      op->kind = CLI_PULSE;
+      op->pulse_ms = (state[5] == ':') ? atoi(&state[6]) : CLI_DEFAULT_PULSE_MS;
+      return 2;
+   }
+   
+   /* "all" alone is no valid operation */
+   if (op->relay == 0)
+      return -1;
+   op->kind = CLI_GET;
+   return 1;
+}
+
+/**********************************************************
+ * Function read_cli_script()
+ * 
+ * Description: Read the operations of a script file, one or
+ *              more per line, '#' starts a comment
+ * 
+ * Parameters: fname (in)   - file name, "-" for stdin
+ *             tok (in/out) - token array
+ *             ntok (in/out)- number of tokens
+ * 
+ * Return:   0 - success, -1 - fail
+ *********************************************************/
+static int read_cli_script(const char *fname, char ***tok, int *ntok)
+{
+   FILE *f;
+   char line[256];
+   char *t, *save;
+   
+   if (!strcmp(fname, "-"))
+      f = stdin;
+   else if ((f = fopen(fname, "r")) == NULL)
+   {
+      fprintf(stderr, "unable to open %s: %s\n", fname, strerror(errno));
+      return -1;
+   }
+   
+   while (fgets(line, sizeof(line), f) != NULL)
+   {
+      if ((t = strchr(line, '#')) != NULL) *t = '\0';
+      for (t = strtok_r(line, " \t\r\n", &save); t != NULL; t = strtok_r(NULL, " \t\r\n", &save))
+      {
+         *tok = realloc(*tok, (*ntok+1) * sizeof(char *));
+         (*tok)[(*ntok)++] = strdup(t);
+      }
+   }
+   
+   if (f != stdin) fclose(f);
+   return 0;
+}
+
+/* Operations on the card of the session */
+static int cli_get(cli_session_t *sess, uint8_t relay, relay_state_t *state)
+{
+   char cmd[CTL_LINE_LEN], reply[CTL_LINE_LEN];
+   
+   if (sess->sock < 0)
+      return crelay_get_relay(sess->com_port, relay, state, sess->serial);
+   
+   snprintf(cmd, sizeof(cmd), "get %s %d", sess->serial, relay);
+   if (ctl_command(sess->sock, cmd, NULL, reply, sizeof(reply)) != 0)
+   {
+      printf("crelay daemon: %s\n", reply+4);
+      return -1;
+   }
+   *state = strcmp(strrchr(reply, ' ')+1, "on") ? OFF : ON;
+   return 0;
+}
+
+static int cli_set(cli_session_t *sess, uint8_t relay, relay_state_t state)
+{
+   char cmd[CTL_LINE_LEN], reply[CTL_LINE_LEN];
+   
+   if (sess->sock < 0)
+   {
+      if (relay == 0)
+         return crelay_set_all_relays(sess->com_port, sess->num_relays, state, sess->serial);
+      return crelay_set_relay(sess->com_port, relay, state, sess->serial);
+   }
+   
+   if (relay == 0)
+      snprintf(cmd, sizeof(cmd), "set %s all %s", sess->serial, (state == ON) ? "on" : "off");
+   else
+      snprintf(cmd, sizeof(cmd), "set %s %d %s", sess->serial, relay, (state == ON) ? "on" : "off");
+   if (ctl_command(sess->sock, cmd, NULL, reply, sizeof(reply)) != 0)
+   {
+      printf("crelay daemon: %s\n", reply+4);
+      return -1;
+   }
+   return 0;
+}
+
+static int cli_get_all(cli_session_t *sess, relay_mask_t *values)
+{
+   char cmd[CTL_LINE_LEN], reply[CTL_LINE_LEN];
+   unsigned int num;
+   uint64_t mask;
+   
+   if (sess->sock < 0)
+      return crelay_get_relay_mask(sess->com_port, sess->num_relays, values, sess->serial);
+   
+   snprintf(cmd, sizeof(cmd), "get %s all", sess->serial);
+   if (ctl_command(sess->sock, cmd, NULL, reply, sizeof(reply)) != 0 ||
+       sscanf(reply, "ok %u %" SCNx64, &num, &mask) != 2)
+   {
+      printf("crelay daemon: %s\n", reply+4);
+      return -1;
+   }
+   sess->num_relays = num;
+   *values = mask;
+   return 0;
+}
+
+/**********************************************************
+ * Function run_cli_ops()
+ * 
+ * Description: Execute the operations in order, stops at
+ *              the first failure
+ * 
+ * Return:   0 - success, -1 - fail
+ *********************************************************/
+static int run_cli_ops(cli_session_t *sess, cli_op_t *ops, int nops)
+{
+   relay_state_t rstate;
+   relay_mask_t values;
+   int i, k;
+   
+   for (i=0; i<nops; i++)
+   {
+      switch (ops[i].kind)
+      {
+         case CLI_GET:
+            if (ops[i].relay == 0)
             {
-               send_json_invalid_param(sock) ;
+               if (cli_get_all(sess, &values) != 0) return -1;
+               for (k=0; k<sess->num_relays; k++)
+                  printf("Relay %d is %s\n", k+FIRST_RELAY, (values & RELAY_BIT(k+FIRST_RELAY)) ? "on" : "off");
             }
             else
             {
-               send_json_card(sock, com_port, vrelay, vrelay, serial) ;
+               if (cli_get(sess, ops[i].relay, &rstate) != 0) return -1;
+               printf("Relay %d is %s\n", ops[i].relay, (rstate==ON)?"on":"off");
             }
-            break ;
+            break;
             
-         case 3:
-            if ((value != 0 && value != 1) || vrelay <= 0 || vrelay > 16)
-            {
-               send_json_invalid_param(sock) ;
-            }
-            else
-            {
-               send_json_setrelay(sock, com_port, vrelay, value, serial) ;
-            }
-            break ;
+         case CLI_SET:
+            if (cli_set(sess, ops[i].relay, ops[i].state) != 0) return -1;
+            break;
+            
+         case CLI_PULSE:
+            if (cli_set(sess, ops[i].relay, ON) != 0) return -1;
+            /* Coalesced writes must reach the card first */
+            if (sess->sock < 0)
+               crelay_flush(1);
+            usleep(ops[i].pulse_ms * 1000);
+            if (cli_set(sess, ops[i].relay, OFF) != 0) return -1;
+            break;
       }
-      
-      goto new_done ;
    }
-
-   error_page(sock,"PAGE INTROUVABLE") ;
-
- new_done:
-   if (fout) fclose(fout);
-   fout = NULL ;
-   if (fin) fclose(fin);
-   fin = NULL ;
-
-   return exit_value ;
-
+   if (sess->sock < 0) crelay_flush(1);
+   return 0;
 }
 
 /**********************************************************
- * Function print_usage()
+ * Function open_cli_session()
  * 
- * Description:
+ * Description: Connect to a running daemon, so the daemon 
+ *              stays the only user of the cards, or detect
+ *              the card locally. The card is detected once
+ *              for all operations.
  * 
- * Parameters:
+ * Parameters: sess (out)  - session
+ *             serial (in) - serial number, NULL = first card
  * 
+ * Return:   0 - success, -1 - no card found
  *********************************************************/
-void print_usage()
+static int open_cli_session(cli_session_t *sess, char *serial)
 {
-   relay_type_t rtype;
-   char cname[60];
+   char reply[CTL_LINE_LEN];
    
-   printf("crelay, version %s\n\n", VERSION);
-   printf("This utility provides a unified way of controlling different types of relay cards.\n");
-   printf("Supported relay cards:\n");
-   for(rtype=NO_RELAY_TYPE+1; rtype<LAST_RELAY_TYPE; rtype++)
+   memset(sess, 0, sizeof(*sess));
+   sess->num_relays = FIRST_RELAY;
+   
+   if ((sess->sock = ctl_connect()) >= 0)
    {
-      crelay_get_relay_card_name(rtype, cname);
-      printf("  - %s\n", cname);
+      if (serial != NULL)
+      {
+         snprintf(sess->serial, MAX_SERIAL_LEN, "%s", serial);
+         return 0;
+      }
+      /* The first card, in the order of the daemon's card list */
+      info_first = sess->serial;
+      if (ctl_command(sess->sock, "info", first_card_line, reply, sizeof(reply)) == 0 && sess->serial[0] != '\0')
+         return 0;
+      printf("No compatible device detected.\n");
+      return -1;
+   }
+   
+   if (serial != NULL)
+   {
+      snprintf(sess->serial, MAX_SERIAL_LEN, "%s", serial);
+      if (crelay_detect_relay_card(sess->com_port, &sess->num_relays, sess->serial, NULL, 0) == 0)
+         return 0;
+   }
+   else if (crelay_detect_first_relay_card(sess->com_port, &sess->num_relays, sess->serial) == 0)
+   {
+      return 0;
    }
-   printf("\n");
-   printf("The program can be run in interactive (command line) mode or in daemon mode with\n");
-   printf("built-in web server.\n\n");
-   printf("Interactive mode:\n");
-   printf("    crelay -i | [-s <serial number>] <relay number> [ON|OFF]\n\n");
-   printf("       -i print relay information\n\n");
-   printf("       The state of any relay can be read or it can be changed to a new state.\n");
-   printf("       If only the relay number is provided then the current state is returned,\n");
-   printf("       otherwise the relays state is set to the new value provided as second parameter.\n");
-   printf("       The USB communication port is auto detected. The first compatible device\n");
-   printf("       found will be used, unless -s switch and a serial number is passed.\n\n");
-   printf("Daemon mode:\n");
-   printf("    crelay -d|-D [<relay1_label> [<relay2_label> [<relay3_label> [<relay4_label>]]]] \n\n");
-   printf("       -d use daemon mode, run in foreground\n");
-   printf("       -D use daemon mode, run in background\n\n");
-   printf("       In daemon mode the built-in web server will be started and the relays\n");
-   printf("       can be completely controlled via a Web browser GUI or HTTP API.\n");
-   printf("       The config file %s will be used, if present.\n", CONFIG_FILE);
-   printf("       Optionally a personal label for each relay can be supplied as command\n");
-   printf("       line parameter which will be displayed next to the relay name on the\n");
-   printf("       web page.\n\n");
-   printf("       To access the web interface point your Web browser to the following address:\n");
-   printf("       http://<my-ip-address>:%d\n\n", DEFAULT_SERVER_PORT);
-   printf("       To use the HTTP API send a GET request (response JSON format) from the client to this URL:\n");
-   printf("       http://<my-ip-address>:%d/api/info\n", DEFAULT_SERVER_PORT );
-   printf("       http://<my-ip-address>:%d/api/card\n", DEFAULT_SERVER_PORT );
-   printf("       http://<my-ip-address>:%d/api/card/<r>\n", DEFAULT_SERVER_PORT );
-   printf("       http://<my-ip-address>:%d/api/card/<r>/<v>\n", DEFAULT_SERVER_PORT );
-   printf("       http://<my-ip-address>:%d/api/serial/<s>\n", DEFAULT_SERVER_PORT );
-   printf("       http://<my-ip-address>:%d/api/serial/<s>/<v>\n", DEFAULT_SERVER_PORT );
-   printf("       http://<my-ip-address>:%d/api/board\n", DEFAULT_SERVER_PORT );
-   printf("       http://<my-ip-address>:%d/api/board/<c>\n", DEFAULT_SERVER_PORT );
-   printf("       http://<my-ip-address>:%d/api/board/<c>/<r>\n", DEFAULT_SERVER_PORT );
-   printf("       http://<my-ip-address>:%d/api/board/<c>/<r>/<v>\n", DEFAULT_SERVER_PORT );
-   printf("       http://<my-ip-address>:%d/quit\n\n", DEFAULT_SERVER_PORT ); 
-   printf("       With <r> : relay (between 1 and 16)\n"); 
-   printf("            <v> : status (0 : OFF / 1 : ON)\n"); 
-   printf("            <s> : card serial number\n"); 
-   printf("            <c> : board (from the file crelay.conf)\n\n");
    
+   printf("No compatible device detected.\n");
+   if(geteuid() != 0)
+   {
+      printf("\nWarning: this program is currently not running with root privileges !\n");
+      printf("Therefore it might not be able to access your relay card communication port.\n");
+      printf("Consider invoking the program from the root account or use \"sudo ...\"\n");
+   }
+   return -1;
 }
 
 
@@ -1485,20 +3108,18 @@ void print_usage()
  *********************************************************/
 int main(int argc, char *argv[])
 {
-      relay_state_t rstate;
-      char com_port[MAX_COM_PORT_NAME_LEN];
       char cname[MAX_RELAY_CARD_NAME_LEN];
-      char template[255] ;
       char *serial = NULL;
-      uint8_t num_relays=FIRST_RELAY;
       relay_info_t *relay_info;
-      relay_info_t *prev_relay_info;
       relay_info_t *current_relay_info;
       int argn = 1;
       int err;
       int i = 1;
-      card_info_t * current;
-      card_info_t * search;
+      cli_session_t sess;
+      cli_op_t *ops = NULL;
+      char **tok = NULL;
+      int ntok = 0;
+      int nops = 0;
 
    portHttp = 0 ;
 
@@ -1515,141 +3136,56 @@ int main(int argc, char *argv[])
       struct sockaddr_in sin;
       struct in_addr iface;
       int port=DEFAULT_SERVER_PORT;
-      int sock;
-      int i;
-      int serial_in_use ;
+      int sock = -1;
+      int watch_fd;
+      int quit;
+      int handoff_sock;
+      int upgraded = 0;
+      int timeout, ready;
+      handoff_list_t handed;
+      sigset_t sigs, wait_mask;
+      struct timespec ts;
+      ssize_t len;
       
       iface.s_addr = INADDR_ANY;
+      handed.num = 0;
 
       
       openlog("crelay", LOG_PID|LOG_CONS, LOG_USER);
-      syslog(LOG_DAEMON | LOG_NOTICE, "Starting crelay daemon (version %s)\n", VERSION);
+      crelay_log(LOGGER_MAIN, LOG_NOTICE, "Starting crelay daemon (version %s)\n", VERSION);
    
       /* Setup signal handlers */
       signal(SIGINT, exit_handler);   /* Ctrl-C */
       signal(SIGTERM, exit_handler);  /* "regular" kill */
+      signal(SIGHUP, reload_handler); /* reload configuration */
+      signal(SIGUSR2, upgrade_handler); /* hand over to a new binary */
+      
+      /* The main loop takes these signals only while it waits, a
+         process started by an upgrade inherits them blocked */
+      sigemptyset(&sigs);
+      sigaddset(&sigs, SIGINT);
+      sigaddset(&sigs, SIGTERM);
+      sigaddset(&sigs, SIGHUP);
+      sigaddset(&sigs, SIGUSR2);
+      sigprocmask(SIG_UNBLOCK, &sigs, NULL);
+      
+      /* An upgrade executes the binary found at the same path again */
+      if ((len = readlink("/proc/self/exe", exe_path, sizeof(exe_path)-1)) > 0)
+         exe_path[len] = '\0';
+      else
+         snprintf(exe_path, sizeof(exe_path), "%s", argv[0]);
    
       /* Load configuration from .conf file */
-      memset((void*)&config, 0, sizeof(config_t));
-      config.number = 0 ;
-      config.card_list = NULL ;
-      for (int k=0;k<16;k++)
-      {
-         config.relay_label[k] = NULL ;
-      }
-      
-      if (conf_parse(CONFIG_FILE, config_cb, &config) >= 0) 
+      num_cmd_labels = argc-2;
+      cmd_labels = &argv[2];
+      if (load_config(&config, NULL) >= 0)
       {
-         syslog(LOG_DAEMON | LOG_NOTICE, "Config parameters read from %s:\n", CONFIG_FILE);
-         syslog(LOG_DAEMON | LOG_NOTICE, "***************************\n");
-         if (config.server_iface != NULL) syslog(LOG_DAEMON | LOG_NOTICE, "server_iface: %s\n", config.server_iface);
-         if (config.server_port != 0)     syslog(LOG_DAEMON | LOG_NOTICE, "server_port: %u\n", config.server_port);
-         for (int k=0; k<16; k++)
-         {
-            if (config.relay_label[k] != NULL) syslog(LOG_DAEMON | LOG_NOTICE, "relay_label %d: %s\n",k+1, config.relay_label[k]);
-         }
-         
-         if (config.pulse_duration != 0)  syslog(LOG_DAEMON | LOG_NOTICE, "pulse_duration: %u\n", config.pulse_duration);
-         if (config.gpio_num_relays != 0) syslog(LOG_DAEMON | LOG_NOTICE, "gpio_num_relays: %u\n", config.gpio_num_relays);
-         if (config.gpio_active_value >= 0) syslog(LOG_DAEMON | LOG_NOTICE, "gpio_active_value: %u\n", config.gpio_active_value);
-         if (config.relay1_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay1_gpio_pin: %u\n", config.relay1_gpio_pin);
-         if (config.relay2_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay2_gpio_pin: %u\n", config.relay2_gpio_pin);
-         if (config.relay3_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay3_gpio_pin: %u\n", config.relay3_gpio_pin);
-         if (config.relay4_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay4_gpio_pin: %u\n", config.relay4_gpio_pin);
-         if (config.relay5_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay5_gpio_pin: %u\n", config.relay5_gpio_pin);
-         if (config.relay6_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay6_gpio_pin: %u\n", config.relay6_gpio_pin);
-         if (config.relay7_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay7_gpio_pin: %u\n", config.relay7_gpio_pin);
-         if (config.relay8_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay8_gpio_pin: %u\n", config.relay8_gpio_pin);
-         if (config.sainsmart_num_relays != 0) syslog(LOG_DAEMON | LOG_NOTICE, "sainsmart_num_relays: %u\n", config.sainsmart_num_relays);
-         if (config.number != 0)
-         {
-            syslog(LOG_DAEMON | LOG_NOTICE, "Number Card in List: %u\n", config.number);
-            current = config.card_list ;
-            crelay_detect_all_relay_cards(&relay_info) ;
-            
-            while ( current != NULL ) 
-            {
-               syslog(LOG_DAEMON | LOG_NOTICE, "card_id: %u\n", current->card_id);
-               if (current->serial != NULL) syslog(LOG_DAEMON | LOG_NOTICE, "serial: %s\n", current->serial);
-               if (current->num_relays != 0) syslog(LOG_DAEMON | LOG_NOTICE, "num_relays: %u\n", current->num_relays);
-               for (int k=0; k<16; k++)
-               {
-                  if (current->relay_label[k] != NULL)
-                  {
-                     syslog(LOG_DAEMON | LOG_NOTICE, "relay%d_label : %s\n",k+1, current->relay_label[k]);
-                  }
-                  else
-                  {
-                     /* Set default relay labels if no exist in config file */
-                     sprintf(template,"My appliance %d",k+1) ;
-                     current->relay_label[k] = strdup(template);
-                  }
-               }
-               if (current->model != 0) syslog(LOG_DAEMON | LOG_NOTICE, "model: %u\n", current->model);
-               if (current->comment != NULL) syslog(LOG_DAEMON | LOG_NOTICE, "comment: %s\n", current->comment);
-               
-               if (current->serial_type == SERIAL_AUTO || current->serial_type == SERIAL_FIRST)
-               {
-                  syslog(LOG_DAEMON | LOG_NOTICE, "type serial: %d\n", current->serial_type);
-                  current_relay_info = relay_info ;
-                  while (current_relay_info->next != NULL)
-                  {
-                     if (current_relay_info->num_relays == current->num_relays)
-                     {
-                        serial_in_use = 0 ;
-                        search = config.card_list ;
-                        while ( search != NULL ) 
-                        {
-                           if (search->serial != NULL && !strcmp(search->serial ,current_relay_info->serial) && (search->model ==0 || search->model == current_relay_info->relay_type) )
-                           {
-                              serial_in_use = 1 ;
-                              break ;
-                           }
-                           search = search->next ;
-                        }
-                        if (serial_in_use == 0)
-                        {
-                           current->serial = strdup(current_relay_info->serial) ;
-                           syslog(LOG_DAEMON | LOG_NOTICE, "serial affected : %s (%i)\n", current->serial, current_relay_info->relay_type);
-                           break ;
-                        }
-                     }
-                     current_relay_info = current_relay_info->next ;
-                  }
-                  if (current->serial == NULL) syslog(LOG_DAEMON | LOG_NOTICE, "serial: NOT FOUND\n");
-               }
-               
-               current = current->next ;
-            }
-            
-            while (relay_info->next != NULL)
-            {
-               prev_relay_info = relay_info ;
-               relay_info = relay_info->next;
-               free(prev_relay_info) ;
-            }
-            free(relay_info) ;
-         }
-         else
-         {
-            syslog(LOG_DAEMON | LOG_NOTICE, "No card list\n");
-         }
-         
-         syslog(LOG_DAEMON | LOG_NOTICE, "***************************\n");
-         
-         /* Set default relay labels if no exist in config file */
-         for (int k=0; k<16; k++)
-         {
-            sprintf(template,"My appliance %d",k+1) ;
-            if (config.relay_label[k] == NULL) config.relay_label[k] = strdup(template); 
-         }
-         
          /* Get listen interface from config file */
          if (config.server_iface != NULL)
          {
             if (inet_aton(config.server_iface, &iface) == 0)
             {
-               syslog(LOG_DAEMON | LOG_NOTICE, "Invalid iface address in config file, using default value");
+               crelay_log(LOGGER_MAIN, LOG_NOTICE, "Invalid iface address in config file, using default value");
             }
          }
          
@@ -1658,105 +3194,268 @@ int main(int argc, char *argv[])
          {
             port = config.server_port;
          }
-
       }
-      else
+      
+      /* Preallocate the memory pools before serving requests */
+      if (config.mem_fixed)
+         init_fixed_memory();
+      
+      /* Started by an upgrade: take the sockets and the relay states
+         over once the previous process released them */
+      if ((handoff_sock = handoff_fd()) >= 0)
       {
-         syslog(LOG_DAEMON | LOG_NOTICE, "Can't load %s, using default parameters\n", CONFIG_FILE);
+         if ((sock = take_over(handoff_sock, &handed)) < 0)
+         {
+            free_config();
+            crelay_free_static_mem() ;
+            crelay_close() ;
+            exit(EXIT_FAILURE);
+         }
+         handoff_sock = -1;
+         portHttp = sock ;
+         upgraded = 1;
       }
-
-      /* Ensure pulse duration is valid **/
-      if (config.pulse_duration == 0)
+      else if (activated_sockets(&sock) > 0)
       {
-         config.pulse_duration = 1;
+         /* systemd listens for us, answer as soon as possible */
+         if (sock >= 0)
+         {
+            portHttp = sock ;
+            crelay_log(LOGGER_MAIN, LOG_NOTICE, "HTTP server listening on the socket passed by systemd\n");
+         }
+         if (ctl_activated)
+            crelay_log(LOGGER_MAIN, LOG_NOTICE, "Control socket passed by systemd\n");
       }
       
-      /* Parse command line for relay labels (overrides config file)*/
-      for (i=0; i<argc-2 && i<MAX_NUM_RELAYS; i++)
-      {
-         free((void *)config.relay_label[i]);
-         config.relay_label[i] = strdup(argv[i+2]);
-      }         
+      /* Publish the states for local readers, then restore those of
+         the cards which can't be read */
+      init_snapshot(upgraded);
+      init_state_journal(!upgraded);
+      for (i=0; i<handed.num; i++)
+         journal_record(handed.state[i].type, handed.state[i].serial, ~(relay_mask_t)0, handed.state[i].state);
+      
+      /* Log requests slower than slow_log_ms with their phases */
+      trace_set_slow_log(config.slow_log_ms, config.slow_log_file);
       
       /* Start build-in web server */
-      sock = socket(AF_INET, SOCK_STREAM, 0);
-      struct linger lin;
-      lin.l_onoff = 0;
-      lin.l_linger = 0;
-      setsockopt(sock, SOL_SOCKET, SO_LINGER, (const char *)&lin, sizeof(int));
-      setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) ;
-
-      sin.sin_family = AF_INET;
-      sin.sin_addr.s_addr = iface.s_addr;
-      sin.sin_port = htons(port);
-      if (bind(sock, (struct sockaddr *) &sin, sizeof(sin)) != 0)
-      {
-         syslog(LOG_DAEMON | LOG_ERR, "Failed to bind socket to port %d : %s", port, strerror(errno));
-         free_config();
-         crelay_free_static_mem() ;
-         crelay_close() ;
-         exit(EXIT_FAILURE);         
-      }
-      if (listen(sock, 5) != 0)
+      if (sock < 0)
       {
-         syslog(LOG_DAEMON | LOG_ERR, "Failed to listen to port %d : %s", port, strerror(errno));
-         free_config();
-         crelay_free_static_mem() ;
-         crelay_close() ;
-         exit(EXIT_FAILURE);         
-      }
+         sock = socket(AF_INET, SOCK_STREAM, 0);
+         struct linger lin;
+         lin.l_onoff = 0;
+         lin.l_linger = 0;
+         setsockopt(sock, SOL_SOCKET, SO_LINGER, (const char *)&lin, sizeof(int));
+         setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) ;
+
+         sin.sin_family = AF_INET;
+         sin.sin_addr.s_addr = iface.s_addr;
+         sin.sin_port = htons(port);
+         if (bind(sock, (struct sockaddr *) &sin, sizeof(sin)) != 0)
+         {
+            crelay_log(LOGGER_MAIN, LOG_ERR, "Failed to bind socket to port %d : %s", port, strerror(errno));
+            free_config();
+            crelay_free_static_mem() ;
+            crelay_close() ;
+            exit(EXIT_FAILURE);         
+         }
+         if (listen(sock, 5) != 0)
+         {
+            crelay_log(LOGGER_MAIN, LOG_ERR, "Failed to listen to port %d : %s", port, strerror(errno));
+            free_config();
+            crelay_free_static_mem() ;
+            crelay_close() ;
+            exit(EXIT_FAILURE);         
+         }
       
-      portHttp = sock ;
+         portHttp = sock ;
       
-      syslog(LOG_DAEMON | LOG_NOTICE, "HTTP server listening on %s:%d\n", inet_ntoa(iface), port);      
+         crelay_log(LOGGER_MAIN, LOG_NOTICE, "HTTP server listening on %s:%d\n", inet_ntoa(iface), port);
+      }
+
+      /* Control socket for the command line mode */
+      if (config.ctl_socket != NULL)
+         ctl_path = strdup(config.ctl_socket);
+      if (ctl_sock < 0)
+         ctl_sock = ctl_listen(ctl_path);
 
-      if (!strcmp(argv[1],"-D"))
+      /* A process started by an upgrade runs in the background already */
+      if (!strcmp(argv[1],"-D") && !upgraded)
       {
          /* Daemonise program (send to background) */
          if (daemon(0, 0) == -1) 
          {
-            syslog(LOG_DAEMON | LOG_ERR, "Failed to daemonize: %s", strerror(errno));
+            crelay_log(LOGGER_MAIN, LOG_ERR, "Failed to daemonize: %s", strerror(errno));
             close(sock);
             free_config();
             crelay_free_static_mem() ;
             crelay_close() ;
             exit(EXIT_FAILURE);
          }
-         syslog(LOG_DAEMON | LOG_NOTICE, "Program is now running as system daemon");
+         crelay_log(LOGGER_MAIN, LOG_NOTICE, "Program is now running as system daemon");
       }
+      
+      /* Block the signals before the log thread inherits the mask,
+         they are delivered to the main loop in ppoll() */
+      sigprocmask(SIG_BLOCK, &sigs, &wait_mask);
+      
+      /* Write the log from a background thread from now on */
+      if (logger_start() != 0)
+         crelay_log(LOGGER_MAIN, LOG_WARNING, "Can't start log thread, logging synchronously");
 
+      /* Reload the configuration when the file changes */
+      watch_fd = watch_config();
+      
       /* Init GPIO pins in case they have been configured */
 //      crelay_detect_relay_card(com_port, &num_relays, NULL, NULL,0);
       
       while (1)
       {
-         int s;
+         int s, n;
+         struct pollfd pfd[3+CTL_MAX_CLIENTS];
+         
+         if (quit_pending)
+         {
+            crelay_log(LOGGER_MAIN, LOG_NOTICE, "Exit crelay daemon\n");
+            break;
+         }
+         
+         /* No request is in progress here, the previous configuration
+            can be freed once the new one is published */
+         if (reload_pending)
+         {
+            reload_pending = 0;
+            crelay_set_info_arena(&request_arena);
+            reload_config();
+            crelay_set_info_arena(NULL);
+            arena_reset(&request_arena);
+         }
+         
+         /* Likewise the previous requests are complete when the
+            sockets are handed over */
+         if (upgrade_pending)
+         {
+            upgrade_pending = 0;
+            if ((handoff_sock = start_upgrade(sock, argv)) >= 0)
+               break;
+         }
+         
+         /* Wait for request from web client or control clients, write 
+            coalesced relay changes when they are due. Negative fds
+            are ignored by poll(). The deferred card probing only
+            waits for the pending requests. A signal interrupts the
+            wait, it is handled at the top of the loop. */
+         timeout = crelay_flush(0);
+         if (config.probe_pending || reapply_pending)
+            timeout = 0;
+         pfd[0].fd = sock;
+         pfd[0].events = POLLIN;
+         pfd[1].fd = ctl_sock;
+         pfd[1].events = POLLIN;
+         pfd[1].revents = 0;
+         pfd[2].fd = watch_fd;
+         pfd[2].events = POLLIN;
+         pfd[2].revents = 0;
+         n = 3 + ctl_poll_fds(&pfd[3]);
+         ts.tv_sec = timeout / 1000;
+         ts.tv_nsec = (timeout % 1000) * 1000000L;
+         if ((ready = ppoll(pfd, n, (timeout < 0) ? NULL : &ts, &wait_mask)) < 0)
+         {
+            if (errno == EINTR) continue;
+            break;
+         }
+         if (ready == 0 && (config.probe_pending || reapply_pending))
+         {
+            probe_cards();
+            continue;
+         }
+         if ((pfd[2].revents & POLLIN) && config_changed(watch_fd))
+            reload_pending = 1;
+         if (n > 3)
+            ctl_serve(&pfd[3], n-3, &request_arena);
+         if (pfd[1].revents & POLLIN)
+            ctl_accept(ctl_sock);
+         if (!(pfd[0].revents & POLLIN)) continue;
          
-         /* Wait for request from web client */
          global_s = s = accept(sock, NULL, NULL);
          if (s < 0) break;
+         set_io_timeout(s, HTTP_IO_TIMEOUT_MS);
+         metrics_connection(1);
          
          /* Process request */
-         if (new_process_http_request(s) == 1)
+         crelay_set_info_arena(&request_arena);
+         quit = (new_process_http_request(s) == 1);
+         crelay_set_info_arena(NULL);
+         arena_reset(&request_arena);
+         if (quit)
          {
-            syslog(LOG_DAEMON | LOG_NOTICE, "Program quit by URL");
+            crelay_log(LOGGER_MAIN, LOG_NOTICE, "Program quit by URL");
             close(s);
             global_s = -1 ;
+            metrics_connection(-1);
             break ;
          }
          
          close(s);
          global_s = -1 ;
+         metrics_connection(-1);
       }
       
       close(sock);
+      arena_free(&request_arena);
+      if (watch_fd >= 0) close(watch_fd);
+      
+      /* Release the cards before the new process probes them, the
+         pending relay changes are still journalled */
+      crelay_close() ;
+      crelay_free_static_mem() ;
+      free_config();
+      if (handoff_sock >= 0)
+      {
+         /* The new process serves the control socket and reuses the
+            cards, the journal and the snapshot as soon as the handoff
+            socket is closed. The connected control clients are
+            dropped. */
+         ctl_close(ctl_sock, NULL);
+         journal_close();
+         snapshot_detach();
+         close(handoff_sock);
+         crelay_log(LOGGER_MAIN, LOG_NOTICE, "Upgrade handed over, exit\n");
+      }
+      else
+      {
+         ctl_close(ctl_sock, ctl_activated ? NULL : ctl_path);
+         journal_close();
+         snapshot_close();
+      }
+      ctl_sock = -1;
+      logger_stop();
    }
    else
    {
       /*****  Command line mode *****/
       
+      if (!strcmp(argv[argn],"--compile-config"))
+      {
+         exit((compile_config() == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+      }
+      
       if (!strcmp(argv[argn],"-i"))
       {
+         char reply[CTL_LINE_LEN];
+         int sock;
+         
+         /* Let a running daemon list its cards */
+         if ((sock = ctl_connect()) >= 0)
+         {
+            info_num = 1 ;
+            err = ctl_command(sock, "info", print_card_line, reply, sizeof(reply));
+            close(sock);
+            if (err != 0) printf("crelay daemon: %s\n", reply+4);
+            if (err == 0 && info_num == 1) printf("No compatible device detected.\n");
+            free_config();
+            exit((err == 0 && info_num > 1) ? EXIT_SUCCESS : EXIT_FAILURE);
+         }
+         
          /* Detect all cards connected to the system */
          if (crelay_detect_all_relay_cards(&relay_info) == -1)
          {
@@ -1767,22 +3466,19 @@ int main(int argc, char *argv[])
                printf("Therefore it might not be able to access your relay card communication port.\n");
                printf("Consider invoking the program from the root account or use \"sudo ...\"\n");
             }
-            free(relay_info) ;
+            crelay_free_relay_info(relay_info) ;
             crelay_free_static_mem() ;
             crelay_close() ;
             free_config() ;
             return -1;
          }
          printf("\nDetected relay cards:\n");
-         while (relay_info->next != NULL)
+         for (current_relay_info = relay_info; current_relay_info->next != NULL; current_relay_info = current_relay_info->next)
          {
-            crelay_get_relay_card_name(relay_info->relay_type, cname);
-            printf("  #%d\t%s (serial %s)\n", i++ ,cname, relay_info->serial);
-            prev_relay_info = relay_info ;   // JLP ADD
-            relay_info = relay_info->next;
-            free(prev_relay_info) ;          // JLP ADD
+            crelay_get_relay_card_name(current_relay_info->relay_type, cname);
+            printf("  #%d\t%s (serial %s)\n", i++ ,cname, current_relay_info->serial);
          }
-         free(relay_info);
+         crelay_free_relay_info(relay_info);
          free_config();
          crelay_free_static_mem() ;
          crelay_close() ;
@@ -1807,74 +3503,53 @@ int main(int argc, char *argv[])
          }
       }
 
-      if (crelay_detect_relay_card(com_port, &num_relays, serial, NULL,0) == -1)
+      /* Operations from the command line, a script file is read in place */
+      ops = calloc(CLI_MAX_OPS, sizeof(cli_op_t));
+      for (i=argn; i<argc && nops>=0; i++)
       {
-         printf("No compatible device detected.\n");
-         
-         if(geteuid() != 0)
+         if (!strcmp(argv[i], "--from-file") || !strcmp(argv[i], "-f"))
          {
-            printf("\nWarning: this program is currently not running with root privileges !\n");
-            printf("Therefore it might not be able to access your relay card communication port.\n");
-            printf("Consider invoking the program from the root account or use \"sudo ...\"\n");
+            if (i+1 >= argc || read_cli_script(argv[++i], &tok, &ntok) != 0)
+               nops = -1;
+         }
+         else
+         {
+            tok = realloc(tok, (ntok+1) * sizeof(char *));
+            tok[ntok++] = strdup(argv[i]);
          }
-         free(serial);
-         free_config();
-         crelay_free_static_mem() ;
-         crelay_close() ;
-         exit(EXIT_FAILURE);
       }
-
-      switch (argc)
+      for (i=0; i<ntok && nops>=0; i+=err)
       {
-         case 2:
-         case 4:
-            /* GET current relay state */
-            if (crelay_get_relay(com_port, atoi(argv[argn]), &rstate, serial) == 0)
-               printf("Relay %d is %s\n", atoi(argv[argn]), (rstate==ON)?"on":"off");
-            else
-            {
-               free(serial);
-               free_config();
-               crelay_free_static_mem() ;
-               crelay_close() ;
-               exit(EXIT_FAILURE);
-            }
-            break;
-            
-         case 3:
-         case 5:
-            /* SET new relay state */
-            if (!strcmp(argv[argn+1],"on") || !strcmp(argv[argn+1],"ON"))
-               err = crelay_set_relay(com_port, atoi(argv[argn]), ON, serial);
-            else if (!strcmp(argv[argn+1],"off") || !strcmp(argv[argn+1],"OFF"))
-               err = crelay_set_relay(com_port, atoi(argv[argn]), OFF, serial);
-            else 
-            {
-               print_usage();
-               free(serial);
-               free_config();
-               crelay_free_static_mem() ;
-               crelay_close() ;
-               exit(EXIT_FAILURE);
-            }
-            if (err)
-            {
-               free(serial);
-               free_config();
-               crelay_free_static_mem() ;
-               crelay_close() ;
-               exit(EXIT_FAILURE);
-            }
+         if (nops == CLI_MAX_OPS || (err = parse_cli_op(&tok[i], ntok-i, &ops[nops])) < 0)
+         {
+            fprintf(stderr, "invalid operation: %s\n", tok[i]);
+            nops = -1;
             break;
-            
-         default:
-            print_usage();
+         }
+         nops++;
       }
+      
+      if (nops <= 0)
+      {
+         print_usage();
+         err = -1;
+      }
+      else if ((err = open_cli_session(&sess, serial)) == 0)
+      {
+         /* All operations over one detection and one open card */
+         err = run_cli_ops(&sess, ops, nops);
+         if (sess.sock >= 0) close(sess.sock);
+      }
+      
+      for (i=0; i<ntok; i++) free(tok[i]);
+      free(tok);
+      free(ops);
+      free(serial);
+      free_config();
+      crelay_free_static_mem() ;
+      crelay_close() ;
+      exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
    }
-   
-   free(serial);
-   free_config();
-   crelay_free_static_mem() ;
-   crelay_close() ;
-   exit(EXIT_SUCCESS);
 }
+
+#endif
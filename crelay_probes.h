@@ -0,0 +1,83 @@
+/******************************************************************************
+ *
+ * Relay card control utility: USDT static probes
+ *
+ * Description:
+ *   Static tracepoints (provider "crelay") for perf, bpftrace and
+ *   systemtap. With <sys/sdt.h> (systemtap-sdt-dev) available each
+ *   probe is a single NOP plus an ELF note describing its arguments,
+ *   the tracer patches the NOP only while it is attached. Without the
+ *   header, or when built with -DCRELAY_NO_USDT, the probes compile
+ *   to nothing.
+ *
+ *   Probes (arguments in order):
+ *     request__start      fd
+ *     request__end        fd, route, error
+ *     route               url, route
+ *     response__write     status
+ *     detect__start       serial, model
+ *     detect__end         serial, relay type (0 = not found)
+ *     detect_all__start
+ *     detect_all__end     result
+ *     get__entry          type, serial, relay
+ *     get__return         type, serial, relay, result, state
+ *     set__entry          type, serial, relay, state
+ *     set__return         type, serial, relay, result
+ *     set_mask__entry     type, serial, mask, values
+ *     set_mask__return    type, serial, mask, result
+ *     set_all__entry      type, serial, state
+ *     set_all__return     type, serial, result
+ *     get_mask__entry     type, serial
+ *     get_mask__return    type, serial, result, values
+ *     usb__submit         endpoint (control: bmRequestType), length, control
+ *     usb__done           endpoint, result, control
+ *
+ *   Example:
+ *     bpftrace -e 'usdt:/usr/local/bin/crelay:crelay:get__entry { @t[tid] = nsecs; }
+ *                  usdt:/usr/local/bin/crelay:crelay:get__return /@t[tid]/
+ *                  { @us = hist((nsecs - @t[tid]) / 1000); delete(@t[tid]); }'
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef crelay_probes_h
+#define crelay_probes_h
+
+#if !defined(CRELAY_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CRELAY_USDT 1
+#endif
+#endif
+
+#ifdef CRELAY_USDT
+#define CRELAY_PROBE0(name)                   DTRACE_PROBE(crelay, name)
+#define CRELAY_PROBE1(name, a)                DTRACE_PROBE1(crelay, name, a)
+#define CRELAY_PROBE2(name, a, b)             DTRACE_PROBE2(crelay, name, a, b)
+#define CRELAY_PROBE3(name, a, b, c)          DTRACE_PROBE3(crelay, name, a, b, c)
+#define CRELAY_PROBE4(name, a, b, c, d)       DTRACE_PROBE4(crelay, name, a, b, c, d)
+#define CRELAY_PROBE5(name, a, b, c, d, e)    DTRACE_PROBE5(crelay, name, a, b, c, d, e)
+#else
+#define CRELAY_PROBE0(name)                   do { } while (0)
+#define CRELAY_PROBE1(name, a)                do { } while (0)
+#define CRELAY_PROBE2(name, a, b)             do { } while (0)
+#define CRELAY_PROBE3(name, a, b, c)          do { } while (0)
+#define CRELAY_PROBE4(name, a, b, c, d)       do { } while (0)
+#define CRELAY_PROBE5(name, a, b, c, d, e)    do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,111 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Shared memory state snapshot reader
+ *
+ * Description:
+ *   Reader side of the state snapshot, see crelay_shm.h. It only
+ *   depends on libc, so monitoring agents can link it alone.
+ *
+ * Build instructions:
+ *   make libcrelay_shm.a
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "crelay_shm.h"
+
+/* Attempts of crelay_shm_read(), the processor is yielded after
+   CRELAY_SHM_SPINS of them */
+#define CRELAY_SHM_RETRIES 10000
+#define CRELAY_SHM_SPINS   100
+
+
+const crelay_shm_t *crelay_shm_open(const char *name)
+{
+   const crelay_shm_t *shm;
+   struct stat st;
+   void *p;
+   int fd;
+
+   if (name == NULL && ((name = getenv(CRELAY_SHM_ENV)) == NULL || name[0] == '\0'))
+      name = CRELAY_SHM_DEFAULT_NAME;
+   if ((fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0)) < 0)
+      return NULL;
+   if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(crelay_shm_t))
+   {
+      close(fd);
+      errno = EPROTO;
+      return NULL;
+   }
+   p = mmap(NULL, sizeof(crelay_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED)
+      return NULL;
+
+   shm = p;
+   if (memcmp(shm->magic, CRELAY_SHM_MAGIC, sizeof(shm->magic)) || shm->version != CRELAY_SHM_VERSION ||
+       shm->size != sizeof(crelay_shm_t))
+   {
+      munmap(p, sizeof(crelay_shm_t));
+      errno = EPROTO;
+      return NULL;
+   }
+   return shm;
+}
+
+int crelay_shm_read(const crelay_shm_t *shm, crelay_shm_t *snap)
+{
+   uint32_t seq, n;
+   int i;
+
+   for (i=0; i<CRELAY_SHM_RETRIES; i++)
+   {
+      if (i >= CRELAY_SHM_SPINS)
+         sched_yield();
+      seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+      if (seq & 1)
+         continue;
+      n = shm->num_cards;
+      if (n > CRELAY_SHM_MAX_CARDS)
+         n = CRELAY_SHM_MAX_CARDS;
+      memcpy(snap, shm, offsetof(crelay_shm_t, card) + n * sizeof(crelay_shm_card_t));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+      {
+         snap->num_cards = n;
+         return 0;
+      }
+   }
+   errno = EAGAIN;
+   return -1;
+}
+
+void crelay_shm_close(const crelay_shm_t *shm)
+{
+   if (shm != NULL)
+      munmap((void *)shm, sizeof(crelay_shm_t));
+}
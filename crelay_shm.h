@@ -0,0 +1,113 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Shared memory state snapshot
+ *
+ * Description:
+ *   The daemon publishes its boards and the last known relay states in
+ *   the POSIX shared memory segment CRELAY_SHM_DEFAULT_NAME, so local
+ *   readers get them without a request to the daemon. This header
+ *   describes the segment and the reader library (libcrelay_shm.a).
+ *
+ *   The segment is protected by a sequence lock: the daemon makes seq
+ *   odd before it changes the table and even again afterwards. A reader
+ *   copies the table and retries if seq was odd or changed meanwhile,
+ *   which crelay_shm_read() does.
+ *
+ *   Relay states are those the daemon last wrote or read, bits of the
+ *   relays it has not seen yet are cleared in known.
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef crelay_shm_h
+#define crelay_shm_h
+
+#include <stdint.h>
+
+#define CRELAY_SHM_DEFAULT_NAME "/crelay"
+/* Segment name of the readers, if set */
+#define CRELAY_SHM_ENV          "CRELAY_SHM"
+
+#define CRELAY_SHM_MAGIC        "CRLYSHM"
+#define CRELAY_SHM_VERSION      1
+#define CRELAY_SHM_MAX_CARDS    32
+#define CRELAY_SHM_SERIAL_LEN   32
+#define CRELAY_SHM_NAME_LEN     64
+
+typedef struct
+{
+   uint64_t state;          /* relays switched on, bit 0 is relay 1 */
+   uint64_t known;          /* relays with a known state */
+   uint64_t update_ns;      /* CLOCK_REALTIME of the last change */
+   uint16_t card_id;        /* board number, 0 if not in the board list */
+   uint8_t  type;           /* relay card type, 0 if not detected yet */
+   uint8_t  num_relays;
+   uint32_t reserved;
+   char     serial[CRELAY_SHM_SERIAL_LEN];
+   char     name[CRELAY_SHM_NAME_LEN];   /* card name */
+} crelay_shm_card_t;
+
+typedef struct
+{
+   char     magic[8];
+   uint32_t version;
+   uint32_t size;           /* sizeof(crelay_shm_t) of the daemon */
+   uint32_t seq;            /* odd while the daemon updates the table */
+   uint32_t num_cards;
+   int32_t  pid;            /* of the daemon */
+   uint32_t reserved;
+   uint64_t update_ns;      /* CLOCK_REALTIME of the last change */
+   crelay_shm_card_t card[CRELAY_SHM_MAX_CARDS];
+} crelay_shm_t;
+
+/**********************************************************
+ * Function crelay_shm_open()
+ *
+ * Description: Map the segment of the daemon read-only
+ *
+ * Parameters: name (in) - segment name, NULL for the
+ *                         CRELAY_SHM environment variable
+ *                         or the default name
+ *
+ * Return:   segment, NULL on failure (errno set, ENOENT
+ *           if the daemon does not run)
+ *********************************************************/
+const crelay_shm_t *crelay_shm_open(const char *name);
+
+/**********************************************************
+ * Function crelay_shm_read()
+ *
+ * Description: Copy a consistent snapshot of the segment,
+ *              only the num_cards first cards are copied
+ *
+ * Parameters: shm (in)   - segment
+ *             snap (out) - snapshot
+ *
+ * Return:   0 - success
+ *          -1 - the daemon kept the table locked (errno
+ *               EAGAIN)
+ *********************************************************/
+int crelay_shm_read(const crelay_shm_t *shm, crelay_shm_t *snap);
+
+/**********************************************************
+ * Function crelay_shm_close()
+ *
+ * Description: Unmap a segment returned by crelay_shm_open()
+ *********************************************************/
+void crelay_shm_close(const crelay_shm_t *shm);
+
+#endif
@@ -0,0 +1,132 @@
+/******************************************************************************
+ *
+ * Relay card control utility: State snapshot reader
+ *
+ * Description:
+ *   Prints the boards and relay states the crelay daemon publishes in
+ *   shared memory, without a request to the daemon. The output lists
+ *   one card per line, or the whole snapshot as JSON with -j.
+ *
+ * Build instructions:
+ *   make crelay-state
+ *
+ * Usage:
+ *   crelay-state [-n <segment>] [-j]
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "crelay_shm.h"
+
+static crelay_shm_t snap;
+
+
+static void print_usage(const char *prog)
+{
+   printf("Usage: %s [-n <segment>] [-j]\n", prog);
+   printf("  -n <segment>  shared memory segment (default $%s or %s)\n", CRELAY_SHM_ENV, CRELAY_SHM_DEFAULT_NAME);
+   printf("  -j            JSON output\n");
+}
+
+static void print_text(const crelay_shm_t *s)
+{
+   const crelay_shm_card_t *c;
+   uint32_t i;
+   int r;
+
+   printf("crelay daemon pid %d, %u card(s)\n", (int)s->pid, s->num_cards);
+   for (i=0, c=s->card; i<s->num_cards; i++, c++)
+   {
+      if (c->card_id != 0)
+         printf("board %-3u ", c->card_id);
+      else
+         printf("board -   ");
+      printf("%-20s %s\n", c->serial, c->name[0] ? c->name : "(not detected)");
+      printf("          ");
+      for (r=0; r<c->num_relays && r<64; r++)
+      {
+         if (!(c->known & (1ULL << r)))
+            printf(" %d:?", r+1);
+         else
+            printf(" %d:%s", r+1, (c->state & (1ULL << r)) ? "on" : "off");
+      }
+      printf("\n");
+   }
+}
+
+static void print_json(const crelay_shm_t *s)
+{
+   const crelay_shm_card_t *c;
+   uint32_t i;
+
+   printf("{ \"pid\": %d, \"update_ns\": %" PRIu64 ", \"cards\": [", (int)s->pid, s->update_ns);
+   for (i=0, c=s->card; i<s->num_cards; i++, c++)
+   {
+      printf("%s\n  { \"board\": %u, \"serial\": \"%s\", \"type\": %u, \"name\": \"%s\", \"num_relays\": %u, "
+             "\"state\": \"%" PRIx64 "\", \"known\": \"%" PRIx64 "\", \"update_ns\": %" PRIu64 " }",
+             i ? "," : "", c->card_id, c->serial, c->type, c->name, c->num_relays,
+             c->state, c->known, c->update_ns);
+   }
+   printf(" ] }\n");
+}
+
+int main(int argc, char *argv[])
+{
+   const crelay_shm_t *shm;
+   const char *name = NULL;
+   int json = 0;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "n:jh")) != -1)
+   {
+      switch (opt)
+      {
+         case 'n': name = optarg; break;
+         case 'j': json = 1; break;
+         default:
+            print_usage(argv[0]);
+            exit((opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE);
+      }
+   }
+
+   if ((shm = crelay_shm_open(name)) == NULL)
+   {
+      fprintf(stderr, "Can't open the crelay state snapshot: %s\n",
+              (errno == ENOENT) ? "daemon not running" : strerror(errno));
+      exit(EXIT_FAILURE);
+   }
+   if (crelay_shm_read(shm, &snap) != 0)
+   {
+      fprintf(stderr, "Can't read the crelay state snapshot: %s\n", strerror(errno));
+      crelay_shm_close(shm);
+      exit(EXIT_FAILURE);
+   }
+   crelay_shm_close(shm);
+
+   if (json)
+      print_json(&snap);
+   else
+      print_text(&snap);
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,520 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Daemon control socket
+ *
+ * Description:
+ *   The daemon serves the control clients from its main loop, like the
+ *   HTTP requests. The client sockets are non-blocking and part of the
+ *   poll set: a wakeup reads what is available and executes the complete
+ *   lines, the replies are buffered until the client reads them. While
+ *   replies are pending the client is not read, so a client which never
+ *   reads stalls only itself. With all slots taken, a new client replaces
+ *   the one idle for the longest time.
+ *
+ * Build instructions:
+ *   gcc -c ctl.c
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ctl.h"
+#include "relay_drv.h"
+#include "arena.h"
+#include "logger.h"
+
+/* Replies of one command, the command runs when all previous replies
+   are sent */
+#define CTL_OUT_LEN (CTL_LINE_LEN*32)
+
+/* Line buffered reader of a socket */
+typedef struct
+{
+   int  sock;
+   int  len;
+   char buf[CTL_LINE_LEN*4];
+} reader_t;
+
+/* Connection of a control client */
+typedef struct
+{
+   reader_t in;
+   int      used;
+   int      eof;            /* the client closed its sending side */
+   int      failed;         /* close the connection */
+   int      out_pos;
+   int      out_len;
+   char     out[CTL_OUT_LEN];
+   unsigned long active;    /* last activity, for the replacement */
+} client_t;
+
+static client_t clients[CTL_MAX_CLIENTS];
+static unsigned long activity = 0;
+
+
+static int make_addr(const char *path, struct sockaddr_un *addr)
+{
+   memset(addr, 0, sizeof(*addr));
+   addr->sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof(addr->sun_path))
+      return -1;
+   strcpy(addr->sun_path, path);
+   return 0;
+}
+
+/* Take one buffered line without the newline, returns its length or
+   -1 if no complete line is buffered */
+static int take_line(reader_t *r, char *line, int size)
+{
+   char *nl;
+   int n;
+
+   if ((nl = memchr(r->buf, '\n', r->len)) == NULL)
+      return -1;
+   n = nl - r->buf;
+   if (n >= size) n = size-1;
+   memcpy(line, r->buf, n);
+   line[n] = '\0';
+   r->len -= nl - r->buf + 1;
+   memmove(r->buf, nl+1, r->len);
+   return n;
+}
+
+/* Read one line without the newline, returns its length or -1 */
+static int read_line(reader_t *r, char *line, int size)
+{
+   int n;
+
+   for (;;)
+   {
+      if ((n = take_line(r, line, size)) >= 0)
+         return n;
+      if (r->len == sizeof(r->buf))
+         return -1;   /* line too long */
+      n = recv(r->sock, r->buf + r->len, sizeof(r->buf) - r->len, 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return -1;
+      r->len += n;
+   }
+}
+
+static int format_line(char *line, int size, const char *fmt, va_list ap)
+{
+   int n;
+
+   n = vsnprintf(line, size-1, fmt, ap);
+   if (n > size-2) n = size-2;
+   line[n++] = '\n';
+   return n;
+}
+
+static int send_line(int sock, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static int send_line(int sock, const char *fmt, ...)
+{
+   char line[CTL_LINE_LEN];
+   va_list ap;
+   int n;
+
+   va_start(ap, fmt);
+   n = format_line(line, sizeof(line), fmt, ap);
+   va_end(ap);
+   return (send(sock, line, n, MSG_NOSIGNAL) == n) ? 0 : -1;
+}
+
+static void reply(client_t *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* Queue a reply line to a client */
+static void reply(client_t *c, const char *fmt, ...)
+{
+   char line[CTL_LINE_LEN];
+   va_list ap;
+   int n;
+
+   va_start(ap, fmt);
+   n = format_line(line, sizeof(line), fmt, ap);
+   va_end(ap);
+   if (c->out_len + n > CTL_OUT_LEN)
+   {
+      crelay_log(LOGGER_CTL, LOG_WARNING, "control reply too long, closing the connection");
+      c->failed = 1;
+      return;
+   }
+   memcpy(c->out + c->out_len, line, n);
+   c->out_len += n;
+}
+
+/* Detect the card with this serial, "-" selects the first card */
+static int select_card(const char *sarg, char *com_port, uint8_t *num_relays, char *serial)
+{
+   if (!strcmp(sarg, "-"))
+      return crelay_detect_first_relay_card(com_port, num_relays, serial);
+
+   snprintf(serial, MAX_SERIAL_LEN, "%s", sarg);
+   return crelay_detect_relay_card(com_port, num_relays, serial, NULL, NO_RELAY_TYPE);
+}
+
+static void cmd_info(client_t *c)
+{
+   relay_info_t *relay_info, *card;
+   char cname[MAX_RELAY_CARD_NAME_LEN];
+   int n = 0;
+
+   if (crelay_detect_all_relay_cards(&relay_info) == -2)
+   {
+      crelay_free_relay_info(relay_info);
+      reply(c, "err pool full");
+      return;
+   }
+   for (card = relay_info; card->next != NULL; card = card->next)
+   {
+      crelay_get_relay_card_name(card->relay_type, cname);
+      reply(c, "card %s\t%s", cname, card->serial);
+      n++;
+   }
+   crelay_free_relay_info(relay_info);
+   reply(c, "ok %d", n);
+}
+
+static void cmd_relay(client_t *c, int set, const char *sarg, const char *rarg, const char *varg)
+{
+   char com_port[MAX_COM_PORT_NAME_LEN];
+   char serial[MAX_SERIAL_LEN];
+   uint8_t num_relays = FIRST_RELAY;
+   relay_state_t rstate;
+   relay_mask_t values;
+   int relay = 0;
+   int all;
+
+   if (sarg == NULL || rarg == NULL || (set && varg == NULL))
+   {
+      reply(c, "err missing parameter");
+      return;
+   }
+   if (set)
+   {
+      if (!strcasecmp(varg, "on")) rstate = ON;
+      else if (!strcasecmp(varg, "off")) rstate = OFF;
+      else
+      {
+         reply(c, "err invalid state %s", varg);
+         return;
+      }
+   }
+   if (select_card(sarg, com_port, &num_relays, serial) == -1)
+   {
+      reply(c, "err no compatible device detected");
+      return;
+   }
+   all = !strcmp(rarg, "all");
+   if (!all)
+   {
+      relay = atoi(rarg);
+      if (relay < FIRST_RELAY || relay > num_relays)
+      {
+         reply(c, "err invalid relay %s", rarg);
+         return;
+      }
+   }
+
+   if (all && set)
+   {
+      if (crelay_set_all_relays(com_port, num_relays, rstate, serial) != 0)
+         reply(c, "err set all relays failed");
+      else
+         reply(c, "ok all %s", (rstate == ON) ? "on" : "off");
+   }
+   else if (all)
+   {
+      if (crelay_get_relay_mask(com_port, num_relays, &values, serial) != 0)
+         reply(c, "err get all relays failed");
+      else
+         reply(c, "ok %d %" PRIx64, num_relays, (uint64_t)values);
+   }
+   else if (set)
+   {
+      if (crelay_set_relay(com_port, relay, rstate, serial) != 0)
+         reply(c, "err set relay %d failed", relay);
+      else
+         reply(c, "ok %d %s", relay, (rstate == ON) ? "on" : "off");
+   }
+   else
+   {
+      if (crelay_get_relay(com_port, relay, &rstate, serial) != 0)
+         reply(c, "err get relay %d failed", relay);
+      else
+         reply(c, "ok %d %s", relay, (rstate == ON) ? "on" : "off");
+   }
+}
+
+int ctl_listen(const char *path)
+{
+   struct sockaddr_un addr;
+   int sock;
+
+   if (make_addr(path, &addr) != 0)
+   {
+      crelay_log(LOGGER_CTL, LOG_ERR, "Control socket path too long: %s", path);
+      return -1;
+   }
+   if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+      return -1;
+
+   unlink(path);
+   if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 8) != 0)
+   {
+      crelay_log(LOGGER_CTL, LOG_WARNING, "Failed to create control socket %s : %s", path, strerror(errno));
+      close(sock);
+      return -1;
+   }
+   /* Relay control is restricted to the owner and group of the daemon */
+   chmod(path, 0660);
+   crelay_log(LOGGER_CTL, LOG_NOTICE, "Control socket listening on %s\n", path);
+   return sock;
+}
+
+static void drop_client(client_t *c)
+{
+   close(c->in.sock);
+   c->used = 0;
+}
+
+/* Send the pending replies as far as the socket takes them */
+static void flush_client(client_t *c)
+{
+   ssize_t n;
+
+   while (c->out_pos < c->out_len)
+   {
+      n = send(c->in.sock, c->out + c->out_pos, c->out_len - c->out_pos, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n < 0)
+      {
+         if (errno == EINTR) continue;
+         if (errno != EAGAIN && errno != EWOULDBLOCK) c->failed = 1;
+         return;
+      }
+      c->out_pos += n;
+   }
+   c->out_pos = c->out_len = 0;
+}
+
+/* Execute one command, its relay info lists live in the arena until
+   the command is done */
+static void run_command(client_t *c, char *line, arena_t *arena)
+{
+   char *cmd, *a1, *a2, *a3, *save;
+
+   crelay_log(LOGGER_CTL, LOG_DEBUG, "control command: %s", line);
+   cmd = strtok_r(line, " \t\r", &save);
+   a1 = strtok_r(NULL, " \t\r", &save);
+   a2 = strtok_r(NULL, " \t\r", &save);
+   a3 = strtok_r(NULL, " \t\r", &save);
+
+   if (cmd == NULL)
+      return;
+   crelay_set_info_arena(arena);
+   if (!strcmp(cmd, "get"))
+      cmd_relay(c, 0, a1, a2, NULL);
+   else if (!strcmp(cmd, "set"))
+      cmd_relay(c, 1, a1, a2, a3);
+   else if (!strcmp(cmd, "info"))
+      cmd_info(c);
+   else
+      reply(c, "err unknown command %s", cmd);
+   crelay_set_info_arena(NULL);
+   if (arena != NULL)
+      arena_reset(arena);
+}
+
+/* Read what the client sent and execute the complete lines, as long as
+   their replies are sent */
+static void serve_client(client_t *c, short revents, arena_t *arena)
+{
+   char line[CTL_LINE_LEN];
+   ssize_t n;
+
+   if (revents & POLLNVAL)
+      c->failed = 1;
+   else if (revents & (POLLOUT | POLLHUP | POLLERR))
+      flush_client(c);
+   if ((revents & (POLLIN | POLLHUP | POLLERR)) && !c->eof && c->out_len == 0)
+   {
+      n = recv(c->in.sock, c->in.buf + c->in.len, sizeof(c->in.buf) - c->in.len, MSG_DONTWAIT);
+      if (n > 0)
+         c->in.len += n;
+      else if (n == 0)
+         c->eof = 1;
+      else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+         c->failed = 1;
+      c->active = ++activity;
+   }
+
+   while (!c->failed && c->out_len == 0 && take_line(&c->in, line, sizeof(line)) >= 0)
+   {
+      run_command(c, line, arena);
+      flush_client(c);
+   }
+
+   /* Line too long, or nothing left to do after the end of input */
+   if (c->out_len == 0 && (c->in.len == sizeof(c->in.buf) || c->eof))
+      c->failed = 1;
+   if (c->failed)
+      drop_client(c);
+}
+
+void ctl_accept(int lsock)
+{
+   client_t *c = NULL;
+   int sock, i;
+
+   if ((sock = accept4(lsock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+      return;
+
+   for (i=0; i<CTL_MAX_CLIENTS; i++)
+   {
+      if (!clients[i].used)
+      {
+         c = &clients[i];
+         break;
+      }
+      if (c == NULL || clients[i].active < c->active)
+         c = &clients[i];
+   }
+   if (c->used)
+   {
+      crelay_log(LOGGER_CTL, LOG_WARNING, "too many control clients, closing the one idle for the longest time");
+      drop_client(c);
+   }
+
+   memset(c, 0, offsetof(client_t, out));
+   c->in.sock = sock;
+   c->used = 1;
+   c->active = ++activity;
+}
+
+int ctl_poll_fds(struct pollfd *pfd)
+{
+   int i, n = 0;
+
+   for (i=0; i<CTL_MAX_CLIENTS; i++)
+   {
+      if (!clients[i].used)
+         continue;
+      pfd[n].fd = clients[i].in.sock;
+      /* Nothing more is read before the replies are sent */
+      pfd[n].events = (clients[i].out_len > 0) ? POLLOUT : POLLIN;
+      pfd[n].revents = 0;
+      n++;
+   }
+   return n;
+}
+
+void ctl_serve(const struct pollfd *pfd, int n, arena_t *arena)
+{
+   int i, k;
+
+   for (k=0; k<n; k++)
+   {
+      if (pfd[k].revents == 0)
+         continue;
+      for (i=0; i<CTL_MAX_CLIENTS; i++)
+      {
+         if (clients[i].used && clients[i].in.sock == pfd[k].fd)
+         {
+            serve_client(&clients[i], pfd[k].revents, arena);
+            break;
+         }
+      }
+   }
+}
+
+void ctl_close(int lsock, const char *path)
+{
+   int i;
+
+   for (i=0; i<CTL_MAX_CLIENTS; i++)
+   {
+      if (clients[i].used)
+         drop_client(&clients[i]);
+   }
+   if (lsock >= 0)
+   {
+      close(lsock);
+      if (path != NULL)
+         unlink(path);
+   }
+}
+
+/* Reply reader of the client, one connection per process */
+static reader_t client;
+
+int ctl_connect()
+{
+   struct sockaddr_un addr;
+   const char *path = getenv(CTL_PATH_ENV);
+   int sock;
+
+   if (path == NULL || path[0] == '\0')
+      path = CTL_DEFAULT_PATH;
+   if (make_addr(path, &addr) != 0)
+      return -1;
+   if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+      return -1;
+   if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+   {
+      close(sock);
+      return -1;
+   }
+   client.sock = sock;
+   client.len = 0;
+   return sock;
+}
+
+int ctl_command(int sock, const char *cmd, void (*line_cb)(const char *), char *reply, size_t len)
+{
+   char line[CTL_LINE_LEN];
+
+   if (send_line(sock, "%s", cmd) != 0)
+      return -1;
+   while (read_line(&client, line, sizeof(line)) >= 0)
+   {
+      if (!strncmp(line, "ok", 2) || !strncmp(line, "err", 3))
+      {
+         snprintf(reply, len, "%s", line);
+         return (line[0] == 'o') ? 0 : -1;
+      }
+      if (line_cb != NULL)
+         line_cb(line);
+   }
+   snprintf(reply, len, "err connection to daemon lost");
+   return -1;
+}
@@ -0,0 +1,138 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Daemon control socket
+ *
+ * Description:
+ *   Unix domain socket of the daemon, used by the command line mode
+ *   to forward commands to a running daemon instead of opening the
+ *   USB device itself.
+ *
+ *   Line protocol, one command per line, the client closes its
+ *   sending side after the last command:
+ *     get <serial|-> <relay>          -> "ok <relay> on|off"
+ *     set <serial|-> <relay> on|off   -> "ok <relay> on|off"
+ *     get <serial|-> all              -> "ok <number of relays> <hex mask>"
+ *     set <serial|-> all on|off       -> "ok all on|off"
+ *     info                            -> "card <name>\t<serial>"...
+ *                                        "ok <number of cards>"
+ *   A serial of "-" selects the first detected card. Failures are
+ *   answered with "err <message>".
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef ctl_h
+#define ctl_h
+
+#include <stddef.h>
+#include <poll.h>
+#include "arena.h"
+
+#define CTL_DEFAULT_PATH "/run/crelay.sock"
+/* Environment variable overriding the socket path of the client */
+#define CTL_PATH_ENV     "CRELAY_SOCKET"
+#define CTL_LINE_LEN     128
+/* Clients connected at the same time */
+#define CTL_MAX_CLIENTS  16
+
+/**********************************************************
+ * Function ctl_listen()
+ *
+ * Description: Create the listening control socket, a stale
+ *              socket file is replaced
+ *
+ * Parameters: path (in) - socket path
+ *
+ * Return:   socket fd, -1 on failure
+ *********************************************************/
+int ctl_listen(const char *path);
+
+/**********************************************************
+ * Function ctl_accept()
+ *
+ * Description: Accept a client on the control socket
+ *
+ * Parameters: lsock (in) - listening socket
+ *********************************************************/
+void ctl_accept(int lsock);
+
+/**********************************************************
+ * Function ctl_poll_fds()
+ *
+ * Description: Add the connected clients to a poll set
+ *
+ * Parameters: pfd (out) - CTL_MAX_CLIENTS entries
+ *
+ * Return:   number of entries used
+ *********************************************************/
+int ctl_poll_fds(struct pollfd *pfd);
+
+/**********************************************************
+ * Function ctl_serve()
+ *
+ * Description: Serve the clients after poll(): read what is
+ *              available, execute the complete command lines
+ *              and send the replies
+ *
+ * Parameters: pfd (in)   - entries filled by ctl_poll_fds()
+ *             n (in)     - number of entries
+ *             arena (in) - arena of the relay info lists,
+ *                          reset after each command, NULL
+ *                          for the heap
+ *********************************************************/
+void ctl_serve(const struct pollfd *pfd, int n, arena_t *arena);
+
+/**********************************************************
+ * Function ctl_close()
+ *
+ * Description: Close the clients and the control socket and
+ *              remove its file
+ *
+ * Parameters: lsock (in) - listening socket
+ *             path (in)  - socket path, NULL to keep the file
+ *********************************************************/
+void ctl_close(int lsock, const char *path);
+
+/**********************************************************
+ * Function ctl_connect()
+ *
+ * Description: Connect to a running daemon, the path is taken
+ *              from CRELAY_SOCKET or the default path
+ *
+ * Return:   socket fd, -1 if no daemon is listening
+ *********************************************************/
+int ctl_connect();
+
+/**********************************************************
+ * Function ctl_command()
+ *
+ * Description: Send a command and read the reply lines up to
+ *              the final "ok" or "err" line
+ *
+ * Parameters: sock (in)  - connected socket
+ *             cmd (in)   - command line without newline
+ *             line_cb(in)- called for every reply line
+ *                          before the final one, can be NULL
+ *             reply (out)- final reply line
+ *             len (in)   - size of reply
+ *
+ * Return:   0 - "ok" reply
+ *          -1 - "err" reply or connection failure
+ *********************************************************/
+int ctl_command(int sock, const char *cmd, void (*line_cb)(const char *), char *reply, size_t len);
+
+#endif
@@ -38,7 +38,17 @@ LITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
 #ifndef data_types_h
 #define data_types_h
 
+#include "arena.h"
+
 #define MAX_SERIAL_LEN 32
+#define SAMPLE_MAX_CARDS 16
+
+/* Relay labels, sized to the highest relay configured */
+typedef struct
+{
+    const char** label;      /* label of relay n at [n-1], NULL = default */
+    uint8_t num;             /* size of label */
+} label_list_t;
 
 /* Config data struct */
 typedef struct
@@ -46,8 +56,31 @@ typedef struct
     /* [HTTP server] */
     const char*  server_iface;
     uint16_t server_port;
-    const char* relay_label[16] ;
+    label_list_t relay_label;
     uint8_t pulse_duration;
+    uint32_t slow_log_ms;
+    const char* slow_log_file;
+    
+    /* [Logging] */
+    const char* log_output;
+    const char* log_file;
+    const char* log_level;
+    const char* log_modules;
+    
+    /* [Control] */
+    const char* ctl_socket;
+    
+    /* [Memory] */
+    uint8_t mem_fixed;
+    uint32_t config_pool_kb;
+    uint32_t request_pool_kb;
+    
+    /* [State] */
+    const char* state_journal;
+    uint32_t state_journal_kb;
+    uint32_t state_sync_ms;
+    uint8_t state_reapply;
+    const char* state_snapshot;
     
     /* [GPIO drv] */
     uint8_t gpio_num_relays;
@@ -63,13 +96,37 @@ typedef struct
     
     /* [Sainsmart drv] */
     uint8_t sainsmart_num_relays;
+    uint16_t sainsmart_coalesce_ms;
+    
+    /* [Sample drv] */
+    uint8_t sample_cards;
+    uint8_t sample_num_relays;
+    const char* sample_serial[SAMPLE_MAX_CARDS];
+    uint8_t sample_card_num_relays[SAMPLE_MAX_CARDS];
+    uint32_t sample_latency_us;
+    uint32_t sample_jitter_us;
+    const char* sample_latency_dist;
+    double sample_fail_rate;
+    double sample_unplug_rate;
+    uint32_t sample_unplug_ms;
     
     /* [Boards] */
-    uint8_t number;
+    uint16_t number;
     
     /* [Board list] */
     struct card_info *card_list;
     
+    /* Strings, boards and labels of this configuration */
+    arena_t arena;
+    
+    /* Compiled image the strings may be in (confcache.h) */
+    const void* image;
+    size_t image_size;
+    
+    /* AUTO and FIRST boards not resolved yet, the main loop probes
+       the cards when it is idle */
+    int probe_pending;
+    
 } config_t;
 
 typedef enum
@@ -81,11 +138,12 @@ typedef enum
 
 typedef struct card_info
 {
-    uint8_t card_id;
+    uint16_t card_id;
     const char* serial;
+    char resolved_serial[MAX_SERIAL_LEN];   /* serial found for AUTO/FIRST */
     serial_type_t serial_type;
     uint8_t num_relays;
-    const char* relay_label[16] ;
+    label_list_t relay_label;
     const char* comment;
     uint8_t model ;
     struct card_info *next;
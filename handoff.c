@@ -0,0 +1,288 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Upgrade handoff
+ *
+ * Description:
+ *   The handoff socket is a SOCK_SEQPACKET socket pair, the listening
+ *   sockets travel as SCM_RIGHTS with the header and relay states in a
+ *   single message. The new process is started with fork() and execve()
+ *   only, the environment is prepared before the fork because the log
+ *   thread may hold the malloc lock.
+ *
+ * Build instructions:
+ *   gcc -c handoff.c
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "handoff.h"
+
+#define HANDOFF_READY 'R'
+
+extern char **environ;
+
+typedef struct
+{
+   char     magic[8];
+   uint32_t version;
+   int32_t  pid;            /* of the old process */
+   uint32_t fd_mask;        /* bit n: fds[n] is part of the message */
+   uint32_t nstates;
+} handoff_hdr_t;
+
+typedef struct
+{
+   handoff_hdr_t   hdr;
+   handoff_state_t states[HANDOFF_MAX_STATES];
+} handoff_msg_t;
+
+
+/* Wait for input or the end of the connection */
+static int wait_input(int sock)
+{
+   struct pollfd pfd;
+   int r;
+
+   pfd.fd = sock;
+   pfd.events = POLLIN;
+   while ((r = poll(&pfd, 1, HANDOFF_TIMEOUT_MS)) < 0 && errno == EINTR)
+      ;
+   return (r > 0) ? 0 : -1;
+}
+
+int handoff_exec(const char *path, char *const argv[], pid_t *pid)
+{
+   struct rlimit rl;
+   char fd_var[32];
+   char **envp;
+   int sv[2];
+   int n, i, fd, max_fd;
+
+   if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0)
+      return -1;
+
+   /* Environment of the new process, without an older handoff fd */
+   for (n=0; environ[n] != NULL; n++)
+      ;
+   if ((envp = malloc((n+2) * sizeof(char *))) == NULL)
+   {
+      close(sv[0]);
+      close(sv[1]);
+      return -1;
+   }
+   snprintf(fd_var, sizeof(fd_var), "%s=%d", HANDOFF_FD_ENV, sv[1]);
+   for (i=0, n=0; environ[i] != NULL; i++)
+   {
+      if (strncmp(environ[i], HANDOFF_FD_ENV "=", sizeof(HANDOFF_FD_ENV)))
+         envp[n++] = environ[i];
+   }
+   envp[n++] = fd_var;
+   envp[n] = NULL;
+   max_fd = (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < 65536) ?
+            (int)rl.rlim_cur : 65536;
+
+   if ((*pid = fork()) == 0)
+   {
+      /* Only the handoff socket is inherited, the others are sent */
+      for (fd=3; fd<max_fd; fd++)
+      {
+         if (fd != sv[1])
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+      fcntl(sv[1], F_SETFD, 0);
+      execve(path, argv, envp);
+      _exit(127);
+   }
+   free(envp);
+   close(sv[1]);
+   if (*pid < 0)
+   {
+      close(sv[0]);
+      return -1;
+   }
+   return sv[0];
+}
+
+int handoff_send(int sock, const int *fds, int nfds, const handoff_state_t *states, int nstates)
+{
+   handoff_msg_t msg;
+   struct msghdr mh;
+   struct iovec iov;
+   struct cmsghdr *cmsg;
+   union
+   {
+      char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+      struct cmsghdr align;
+   } ctl;
+   int sent[HANDOFF_MAX_FDS];
+   int i, n;
+
+   if (nfds > HANDOFF_MAX_FDS || nstates > HANDOFF_MAX_STATES)
+      return -1;
+
+   memset(&msg.hdr, 0, sizeof(msg.hdr));
+   memcpy(msg.hdr.magic, HANDOFF_MAGIC, sizeof(msg.hdr.magic));
+   msg.hdr.version = HANDOFF_VERSION;
+   msg.hdr.pid = getpid();
+   msg.hdr.nstates = nstates;
+   for (i=0, n=0; i<nfds; i++)
+   {
+      if (fds[i] >= 0)
+      {
+         msg.hdr.fd_mask |= 1u << i;
+         sent[n++] = fds[i];
+      }
+   }
+   memcpy(msg.states, states, nstates * sizeof(handoff_state_t));
+
+   memset(&mh, 0, sizeof(mh));
+   iov.iov_base = &msg;
+   iov.iov_len = sizeof(handoff_hdr_t) + nstates * sizeof(handoff_state_t);
+   mh.msg_iov = &iov;
+   mh.msg_iovlen = 1;
+   if (n > 0)
+   {
+      memset(&ctl, 0, sizeof(ctl));
+      mh.msg_control = ctl.buf;
+      mh.msg_controllen = CMSG_SPACE(n * sizeof(int));
+      cmsg = CMSG_FIRSTHDR(&mh);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+      memcpy(CMSG_DATA(cmsg), sent, n * sizeof(int));
+   }
+   return (sendmsg(sock, &mh, MSG_NOSIGNAL) == (ssize_t)iov.iov_len) ? 0 : -1;
+}
+
+int handoff_wait(int sock)
+{
+   char c;
+
+   if (wait_input(sock) != 0)
+      return -1;
+   return (recv(sock, &c, 1, 0) == 1 && c == HANDOFF_READY) ? 0 : -1;
+}
+
+int handoff_fd()
+{
+   const char *val = getenv(HANDOFF_FD_ENV);
+   char *end;
+   long fd;
+
+   if (val == NULL)
+      return -1;
+   fd = strtol(val, &end, 10);
+   unsetenv(HANDOFF_FD_ENV);
+   if (*end != '\0' || fd < 3 || fd > 65535 || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0)
+      return -1;
+   return fd;
+}
+
+int handoff_receive(int sock, int *fds, handoff_state_t *states, int *nstates, pid_t *old_pid)
+{
+   handoff_msg_t msg;
+   struct msghdr mh;
+   struct iovec iov;
+   struct cmsghdr *cmsg;
+   union
+   {
+      char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+      struct cmsghdr align;
+   } ctl;
+   int recvd[HANDOFF_MAX_FDS];
+   ssize_t len;
+   int i, n = 0;
+
+   for (i=0; i<HANDOFF_MAX_FDS; i++)
+      fds[i] = -1;
+   if (wait_input(sock) != 0)
+      return -1;
+
+   memset(&mh, 0, sizeof(mh));
+   iov.iov_base = &msg;
+   iov.iov_len = sizeof(msg);
+   mh.msg_iov = &iov;
+   mh.msg_iovlen = 1;
+   mh.msg_control = ctl.buf;
+   mh.msg_controllen = sizeof(ctl.buf);
+   if ((len = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) < 0)
+      return -1;
+
+   for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg))
+   {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      {
+         n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+         if (n > HANDOFF_MAX_FDS)
+            n = HANDOFF_MAX_FDS;
+         memcpy(recvd, CMSG_DATA(cmsg), n * sizeof(int));
+      }
+   }
+
+   if ((size_t)len < sizeof(handoff_hdr_t) || memcmp(msg.hdr.magic, HANDOFF_MAGIC, sizeof(msg.hdr.magic)) ||
+       msg.hdr.version != HANDOFF_VERSION || msg.hdr.nstates > HANDOFF_MAX_STATES ||
+       (msg.hdr.fd_mask >> HANDOFF_MAX_FDS) != 0 ||
+       (size_t)len != sizeof(handoff_hdr_t) + msg.hdr.nstates * sizeof(handoff_state_t) ||
+       (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || __builtin_popcount(msg.hdr.fd_mask) != n)
+   {
+      for (i=0; i<n; i++)
+         close(recvd[i]);
+      errno = EPROTO;
+      return -1;
+   }
+
+   for (i=0, n=0; i<HANDOFF_MAX_FDS; i++)
+   {
+      if (msg.hdr.fd_mask & (1u << i))
+         fds[i] = recvd[n++];
+   }
+   for (i=0; i<(int)msg.hdr.nstates; i++)
+   {
+      states[i] = msg.states[i];
+      states[i].serial[MAX_SERIAL_LEN-1] = '\0';
+   }
+   *nstates = msg.hdr.nstates;
+   *old_pid = msg.hdr.pid;
+   return 0;
+}
+
+int handoff_ready(int sock)
+{
+   char c = HANDOFF_READY;
+
+   return (send(sock, &c, 1, MSG_NOSIGNAL) == 1) ? 0 : -1;
+}
+
+int handoff_wait_release(int sock)
+{
+   char c;
+
+   if (wait_input(sock) != 0)
+      return -1;
+   return (recv(sock, &c, 1, 0) == 0) ? 0 : -1;
+}
@@ -0,0 +1,157 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Upgrade handoff
+ *
+ * Description:
+ *   On SIGUSR2 the daemon executes its binary again and hands its
+ *   listening sockets and the relay states of the cards which can't be
+ *   read back over to the new process, so an upgrade neither refuses
+ *   connections nor loses states:
+ *
+ *     old                                new
+ *     handoff_exec()        ------>      handoff_fd()
+ *     handoff_send()        -fds,states> handoff_receive()
+ *     handoff_wait()        <--ready---  handoff_ready()
+ *     releases its journal,
+ *     snapshot and sockets,
+ *     closes the handoff    --EOF----->  handoff_wait_release()
+ *     socket and exits                   serves the sockets
+ *
+ *   The connections arriving meanwhile wait in the listen queue. If the
+ *   new process fails before it is ready, the old one keeps serving.
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef handoff_h
+#define handoff_h
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "relay_drv.h"
+
+/* Handoff socket of the new process */
+#define HANDOFF_FD_ENV     "CRELAY_HANDOFF_FD"
+#define HANDOFF_MAGIC      "CRLYHOFF"
+#define HANDOFF_VERSION    1
+
+/* Sockets handed over: HTTP and control socket */
+#define HANDOFF_MAX_FDS    2
+#define HANDOFF_MAX_STATES 32
+/* Time the new process has to get ready, and the old one to release
+   its resources */
+#define HANDOFF_TIMEOUT_MS 10000
+
+typedef struct
+{
+   uint8_t  type;           /* relay_type_t */
+   uint8_t  reserved[7];
+   uint64_t state;          /* relays switched on */
+   char     serial[MAX_SERIAL_LEN];
+} handoff_state_t;
+
+/**********************************************************
+ * Function handoff_exec()
+ *
+ * Description: Start the new process with a handoff socket
+ *
+ * Parameters: path (in) - binary to execute
+ *             argv (in) - its arguments
+ *             pid (out) - pid of the new process
+ *
+ * Return:   handoff socket, -1 on failure
+ *********************************************************/
+int handoff_exec(const char *path, char *const argv[], pid_t *pid);
+
+/**********************************************************
+ * Function handoff_send()
+ *
+ * Description: Send the listening sockets and the relay
+ *              states to the new process
+ *
+ * Parameters: sock (in)    - handoff socket
+ *             fds (in)     - sockets, -1 for a missing one
+ *             nfds (in)    - number of fds
+ *             states (in)  - relay states
+ *             nstates (in) - number of states
+ *
+ * Return:   0 - success, -1 - failure
+ *********************************************************/
+int handoff_send(int sock, const int *fds, int nfds, const handoff_state_t *states, int nstates);
+
+/**********************************************************
+ * Function handoff_wait()
+ *
+ * Description: Wait until the new process is ready
+ *
+ * Parameters: sock (in) - handoff socket
+ *
+ * Return:   0 - ready
+ *          -1 - the new process failed or timed out
+ *********************************************************/
+int handoff_wait(int sock);
+
+/**********************************************************
+ * Function handoff_fd()
+ *
+ * Description: Handoff socket of a process started by
+ *              handoff_exec(), removed from the environment
+ *
+ * Return:   socket, -1 for a normal start
+ *********************************************************/
+int handoff_fd();
+
+/**********************************************************
+ * Function handoff_receive()
+ *
+ * Description: Receive the sockets and relay states
+ *
+ * Parameters: sock (in)       - handoff socket
+ *             fds (out)       - HANDOFF_MAX_FDS sockets,
+ *                               -1 for a missing one
+ *             states (out)    - HANDOFF_MAX_STATES states
+ *             nstates (out)   - number of states
+ *             old_pid (out)   - pid of the old process
+ *
+ * Return:   0 - success, -1 - failure
+ *********************************************************/
+int handoff_receive(int sock, int *fds, handoff_state_t *states, int *nstates, pid_t *old_pid);
+
+/**********************************************************
+ * Function handoff_ready()
+ *
+ * Description: Tell the old process to release everything
+ *
+ * Parameters: sock (in) - handoff socket
+ *
+ * Return:   0 - success, -1 - failure
+ *********************************************************/
+int handoff_ready(int sock);
+
+/**********************************************************
+ * Function handoff_wait_release()
+ *
+ * Description: Wait until the old process closed the
+ *              handoff socket
+ *
+ * Parameters: sock (in) - handoff socket
+ *
+ * Return:   0 - released, -1 - timeout
+ *********************************************************/
+int handoff_wait_release(int sock);
+
+#endif
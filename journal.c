@@ -0,0 +1,373 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Relay state journal
+ *
+ * Description:
+ *   The state table in memory is the reference, the journal only
+ *   replays into it at startup. Records are appended under a mutex by
+ *   the driver threads, the main loop syncs and compacts the journal
+ *   from crelay_flush(), so no relay change waits for the disk.
+ *
+ * Build instructions:
+ *   gcc -c journal.c
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "journal.h"
+#include "confcache.h"
+#include "metrics.h"
+#include "logger.h"
+
+#define JOURNAL_DEFAULT_SIZE (64*1024)
+/* Room for a compacted journal and as many changes */
+#define JOURNAL_MIN_SIZE     (sizeof(journal_hdr_t) + 2*JOURNAL_MAX_CARDS*sizeof(journal_rec_t))
+
+#define RECORDS(p) ((journal_rec_t *)((char *)(p) + sizeof(journal_hdr_t)))
+
+typedef struct
+{
+   uint8_t type;
+   char serial[MAX_SERIAL_LEN];
+   relay_mask_t state;
+} card_state_t;
+
+static card_state_t cards[JOURNAL_MAX_CARDS];
+static int num_cards = 0;
+
+static char journal_path[PATH_MAX];
+static int active = 0;             /* state table kept, with or without a file */
+static char *map = NULL;           /* mapped journal, NULL if closed */
+static size_t map_size = 0;
+static uint32_t num_recs = 0;      /* record slots of the file */
+static uint32_t next_rec = 0;      /* first free slot */
+static int compact_pending = 0;
+static int dirty = 0;              /* records not synced yet */
+static uint64_t dirty_ns = 0;      /* time of the first of them */
+static int sync_delay_ms = 0;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint32_t rec_checksum(const journal_rec_t *r)
+{
+   return confcache_hash(0, r, offsetof(journal_rec_t, checksum));
+}
+
+static void fill_rec(journal_rec_t *r, uint32_t seq, uint8_t type, const char *serial,
+                     relay_mask_t mask, relay_mask_t values)
+{
+   memset(r, 0, sizeof(*r));
+   r->seq = seq;
+   r->type = type;
+   r->mask = mask;
+   r->values = values;
+   snprintf(r->serial, sizeof(r->serial), "%s", serial);
+   r->checksum = rec_checksum(r);
+}
+
+/* Card of the state table, added if create is set and there is room */
+static card_state_t *find_card(uint8_t type, const char *serial, int create)
+{
+   int i;
+
+   for (i=0; i<num_cards; i++)
+   {
+      if (cards[i].type == type && !strcmp(cards[i].serial, serial))
+         return &cards[i];
+   }
+   if (!create || num_cards == JOURNAL_MAX_CARDS || strlen(serial) >= MAX_SERIAL_LEN)
+      return NULL;
+   cards[num_cards].type = type;
+   strcpy(cards[num_cards].serial, serial);
+   cards[num_cards].state = 0;
+   return &cards[num_cards++];
+}
+
+/**********************************************************
+ * Internal function replay()
+ *
+ * Description: Apply the valid records of an existing
+ *              journal to the state table
+ *********************************************************/
+static void replay(const char *path)
+{
+   const journal_hdr_t *h;
+   const journal_rec_t *r;
+   card_state_t *card;
+   struct stat st;
+   uint32_t i, n;
+   void *p;
+   int fd;
+
+   if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+      return;
+   if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(journal_hdr_t) ||
+       (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+   {
+      close(fd);
+      return;
+   }
+   close(fd);
+
+   h = p;
+   if (!memcmp(h->magic, JOURNAL_MAGIC, sizeof(h->magic)) && h->version == JOURNAL_VERSION &&
+       h->rec_size == sizeof(journal_rec_t))
+   {
+      n = (st.st_size - sizeof(journal_hdr_t)) / sizeof(journal_rec_t);
+      for (i=0, r=RECORDS(p); i<n; i++, r++)
+      {
+         if (r->seq != i+1 || r->checksum != rec_checksum(r) ||
+             memchr(r->serial, '\0', sizeof(r->serial)) == NULL)
+            break;
+         if ((card = find_card(r->type, r->serial, 1)) != NULL)
+            card->state = (card->state & ~r->mask) | (r->values & r->mask);
+      }
+   }
+   munmap(p, st.st_size);
+}
+
+/**********************************************************
+ * Internal function compact()
+ *
+ * Description: Write the state table as a new journal and
+ *              map it in place of the current one. Must be
+ *              called with journal_lock held or before the
+ *              journal is published.
+ *
+ * Return:   0 - success, -1 - failure (current journal kept)
+ *********************************************************/
+static int compact(size_t size)
+{
+   char tmp[PATH_MAX+8];
+   char dir[PATH_MAX];
+   journal_hdr_t *h;
+   char *p;
+   int fd, i;
+
+   snprintf(tmp, sizeof(tmp), "%s.tmp", journal_path);
+   if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+      return -1;
+   if (ftruncate(fd, size) != 0 ||
+       (p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+   {
+      close(fd);
+      unlink(tmp);
+      return -1;
+   }
+
+   h = (journal_hdr_t *)p;
+   memcpy(h->magic, JOURNAL_MAGIC, sizeof(h->magic));
+   h->version = JOURNAL_VERSION;
+   h->rec_size = sizeof(journal_rec_t);
+   for (i=0; i<num_cards; i++)
+      fill_rec(&RECORDS(p)[i], i+1, cards[i].type, cards[i].serial, ~(relay_mask_t)0, cards[i].state);
+
+   /* The new journal must be complete on the disk before it replaces
+      the old one */
+   if (fsync(fd) != 0 || rename(tmp, journal_path) != 0)
+   {
+      close(fd);
+      munmap(p, size);
+      unlink(tmp);
+      return -1;
+   }
+   close(fd);
+   snprintf(dir, sizeof(dir), "%s", journal_path);
+   if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0)
+   {
+      fsync(fd);
+      close(fd);
+   }
+
+   if (map != NULL)
+      munmap(map, map_size);
+   map = p;
+   map_size = size;
+   num_recs = (size - sizeof(journal_hdr_t)) / sizeof(journal_rec_t);
+   next_rec = num_cards;
+   compact_pending = 0;
+   dirty = 0;
+   return 0;
+}
+
+int journal_open(const char *path, size_t size, int sync_ms)
+{
+   int ret;
+
+   if (path != NULL && (path[0] == '\0' || strlen(path) >= sizeof(journal_path)))
+      return -1;
+   if (size == 0)
+      size = JOURNAL_DEFAULT_SIZE;
+   if (size < JOURNAL_MIN_SIZE)
+      size = JOURNAL_MIN_SIZE;
+
+   pthread_mutex_lock(&journal_lock);
+   if (map != NULL)
+   {
+      munmap(map, map_size);
+      map = NULL;
+   }
+   num_cards = 0;
+   if (path == NULL)
+   {
+      /* State table only */
+      journal_path[0] = '\0';
+      ret = 0;
+   }
+   else
+   {
+      snprintf(journal_path, sizeof(journal_path), "%s", path);
+      sync_delay_ms = (sync_ms > 0) ? sync_ms : 0;
+
+      /* Start with a compacted copy, so the whole file is free for new
+         records */
+      replay(path);
+      ret = (compact(size) == 0) ? num_cards : -1;
+   }
+   active = (ret >= 0);
+   pthread_mutex_unlock(&journal_lock);
+   return ret;
+}
+
+int journal_restore(relay_type_t type, const char *serial, relay_mask_t *state)
+{
+   card_state_t *card;
+   int ret;
+
+   pthread_mutex_lock(&journal_lock);
+   if (!active)
+      ret = -1;
+   else if (serial != NULL && (card = find_card(type, serial, 0)) != NULL)
+   {
+      *state = card->state;
+      ret = 1;
+   }
+   else
+      ret = 0;
+   pthread_mutex_unlock(&journal_lock);
+   return ret;
+}
+
+void journal_record(relay_type_t type, const char *serial, relay_mask_t mask, relay_mask_t values)
+{
+   card_state_t *card;
+   int known;
+
+   if (serial == NULL || mask == 0)
+      return;
+
+   pthread_mutex_lock(&journal_lock);
+   known = num_cards;
+   if (active && (card = find_card(type, serial, 1)) != NULL &&
+       (num_cards != known || (card->state & mask) != (values & mask)))
+   {
+      card->state = (card->state & ~mask) | (values & mask);
+      if (map == NULL)
+         ;  /* state table only */
+      else if (next_rec < num_recs)
+      {
+         fill_rec(&RECORDS(map)[next_rec], next_rec+1, type, serial, mask, values);
+         next_rec++;
+      }
+      else
+         compact_pending = 1;
+      if (map != NULL && !dirty)
+      {
+         dirty = 1;
+         dirty_ns = metrics_now();
+      }
+   }
+   pthread_mutex_unlock(&journal_lock);
+}
+
+void journal_foreach(void (*fun)(relay_type_t type, const char *serial, relay_mask_t state, void *user_data),
+                     void *user_data)
+{
+   card_state_t copy[JOURNAL_MAX_CARDS];
+   int i, n;
+
+   /* The callback may change relays, which records them */
+   pthread_mutex_lock(&journal_lock);
+   n = num_cards;
+   memcpy(copy, cards, n * sizeof(card_state_t));
+   pthread_mutex_unlock(&journal_lock);
+
+   for (i=0; i<n; i++)
+      (*fun)(copy[i].type, copy[i].serial, copy[i].state, user_data);
+}
+
+int journal_sync(int force)
+{
+   uint64_t due, now;
+   size_t len;
+
+   pthread_mutex_lock(&journal_lock);
+   if (map == NULL || (!dirty && !compact_pending))
+   {
+      pthread_mutex_unlock(&journal_lock);
+      return -1;
+   }
+   if (compact_pending)
+   {
+      /* Journal full, the state table has all the changes */
+      if (compact(map_size) != 0)
+         crelay_log(LOGGER_MAIN, LOG_WARNING, "Can't compact the state journal %s: %s", journal_path, strerror(errno));
+      pthread_mutex_unlock(&journal_lock);
+      return -1;
+   }
+   due = dirty_ns + (uint64_t)sync_delay_ms * 1000000;
+   now = metrics_now();
+   if (!force && now < due)
+   {
+      pthread_mutex_unlock(&journal_lock);
+      return (due - now + 999999) / 1000000;
+   }
+   dirty = 0;
+   len = sizeof(journal_hdr_t) + next_rec * sizeof(journal_rec_t);
+   pthread_mutex_unlock(&journal_lock);
+
+   /* Only the main loop replaces the mapping, it stays valid here */
+   msync(map, len, MS_SYNC);
+   return -1;
+}
+
+void journal_close()
+{
+   journal_sync(1);
+   pthread_mutex_lock(&journal_lock);
+   if (map != NULL)
+   {
+      munmap(map, map_size);
+      map = NULL;
+   }
+   num_cards = 0;
+   active = 0;
+   pthread_mutex_unlock(&journal_lock);
+}
@@ -0,0 +1,149 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Relay state journal
+ *
+ * Description:
+ *   Append-only journal of the relay changes of the drivers which can't
+ *   read the relay states back from the card, so the daemon restores
+ *   them after a restart. The file is mapped shared, recording a change
+ *   only writes a record to memory; the records reach the disk when the
+ *   journal is synced, at most sync_ms after the change.
+ *
+ *   Layout (native byte order):
+ *     journal_hdr_t
+ *     journal_rec_t records[]     up to the end of the file
+ *
+ *   A record is valid when its sequence number follows the previous one
+ *   and its checksum matches, the replay stops at the first other
+ *   record, which is where a crash interrupted the writes. A full
+ *   journal is compacted into one record per card, written to a new
+ *   file which replaces the old one.
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef journal_h
+#define journal_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "relay_drv.h"
+
+#define JOURNAL_MAGIC     "CRLYJRNL"
+#define JOURNAL_VERSION   1
+
+/* Cards the journal keeps the state of */
+#define JOURNAL_MAX_CARDS 32
+
+typedef struct
+{
+   char     magic[8];
+   uint32_t version;
+   uint32_t rec_size;       /* sizeof(journal_rec_t) of the writer */
+} journal_hdr_t;
+
+typedef struct
+{
+   uint32_t seq;            /* 1 for the first record of the file */
+   uint8_t  type;           /* relay_type_t */
+   uint8_t  reserved[3];
+   uint64_t mask;           /* relays changed */
+   uint64_t values;         /* their new states (1 = ON) */
+   char     serial[MAX_SERIAL_LEN];
+   uint32_t reserved2;
+   uint32_t checksum;       /* FNV-1a of the fields above */
+} journal_rec_t;
+
+/**********************************************************
+ * Function journal_open()
+ *
+ * Description: Map the journal, create it if needed, and
+ *              replay it into the state table. Without a
+ *              file the table is only kept in memory, for
+ *              an upgrade handoff.
+ *
+ * Parameters: path (in)    - journal file, NULL for none
+ *             size (in)    - file size, 0 for the default
+ *             sync_ms (in) - delay of the sync after a
+ *                            change
+ *
+ * Return:   number of cards restored, -1 on failure
+ *********************************************************/
+int journal_open(const char *path, size_t size, int sync_ms);
+
+/**********************************************************
+ * Function journal_restore()
+ *
+ * Description: Get the last recorded state of a card
+ *
+ * Parameters: type (in)    - relay type
+ *             serial (in)  - serial number
+ *             state (out)  - relay states, unchanged if the
+ *                            card is not in the journal
+ *
+ * Return:   1 - restored, 0 - unknown card,
+ *          -1 - no journal open (yet)
+ *********************************************************/
+int journal_restore(relay_type_t type, const char *serial, relay_mask_t *state);
+
+/**********************************************************
+ * Function journal_record()
+ *
+ * Description: Record a relay change written to a card.
+ *              Does no I/O, a full journal is compacted by
+ *              the next journal_sync().
+ *
+ * Parameters: type (in)    - relay type
+ *             serial (in)  - serial number
+ *             mask (in)    - relays changed
+ *             values (in)  - new states of the relays in mask
+ *********************************************************/
+void journal_record(relay_type_t type, const char *serial, relay_mask_t mask, relay_mask_t values);
+
+/**********************************************************
+ * Function journal_foreach()
+ *
+ * Description: Call fun for each card of the journal
+ *
+ * Parameters: fun (in)      - callback
+ *             user_data (in)- passed to fun
+ *********************************************************/
+void journal_foreach(void (*fun)(relay_type_t type, const char *serial, relay_mask_t state, void *user_data),
+                     void *user_data);
+
+/**********************************************************
+ * Function journal_sync()
+ *
+ * Description: Flush the recorded changes to the disk when
+ *              they are due, compact a full journal
+ *
+ * Parameters: force - 1: flush now
+ *                     0: flush only if due
+ *
+ * Return:   ms until the next sync is due
+ *          -1 - nothing pending
+ *********************************************************/
+int journal_sync(int force);
+
+/**********************************************************
+ * Function journal_close()
+ *
+ * Description: Flush and unmap the journal
+ *********************************************************/
+void journal_close();
+
+#endif
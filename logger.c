@@ -0,0 +1,362 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Asynchronous logging
+ *
+ * Description:
+ *   The ring buffer is a bounded multi-producer queue: a producer
+ *   claims a slot by advancing the head with a compare-and-swap, fills
+ *   it and publishes it through the slot sequence number. The writer
+ *   thread is the only consumer. When the ring is full the message is
+ *   dropped and counted, a request thread never waits for the log
+ *   output.
+ *
+ *   The writer thread sleeps on an eventfd, producers only write to it
+ *   when the thread has announced that it is idle.
+ *
+ * Build instructions:
+ *   gcc -c logger.c
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "logger.h"
+
+#define RING_MASK (LOGGER_RING_SIZE - 1)
+/* Maximum number of messages written between two flushes */
+#define BATCH_SIZE 64
+
+typedef struct
+{
+   uint32_t seq;                  /* == position: free, position+1: filled */
+   uint8_t  module;
+   uint8_t  prio;
+   struct timespec ts;
+   char     msg[LOGGER_MSG_LEN];
+} slot_t;
+
+int8_t logger_level[LOGGER_NUM_MODULES] = { LOG_NOTICE, LOG_NOTICE, LOG_NOTICE, LOG_NOTICE, LOG_NOTICE };
+
+static slot_t ring[LOGGER_RING_SIZE];
+static uint32_t head = 0;         /* next position to claim (producers) */
+static uint32_t tail = 0;         /* next position to write (writer thread) */
+static uint64_t dropped = 0;
+
+static logger_output_t output = LOGGER_SYSLOG;
+static FILE *log_file = NULL;
+
+static pthread_t writer;
+static int running = 0;
+static int stopping = 0;
+static int idle = 0;
+static int wake_fd = -1;
+
+static const char *module_name[LOGGER_NUM_MODULES] = { "main", "config", "http", "trace", "ctl" };
+static const char *prio_name[LOG_DEBUG+1] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+
+
+static void output_msg(int module, int prio, const struct timespec *ts, const char *msg)
+{
+   FILE *f = (output == LOGGER_FILE && log_file != NULL) ? log_file : stderr;
+   char stamp[32];
+   struct tm tm;
+
+   if (output == LOGGER_SYSLOG)
+   {
+      syslog(LOG_DAEMON | prio, "%s", msg);
+      return;
+   }
+   localtime_r(&ts->tv_sec, &tm);
+   strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+   fprintf(f, "%s.%03ld %s %s: %s\n", stamp, ts->tv_nsec/1000000, module_name[module], prio_name[prio], msg);
+}
+
+static void flush_output()
+{
+   if (output == LOGGER_FILE && log_file != NULL)
+      fflush(log_file);
+   else if (output == LOGGER_STDERR)
+      fflush(stderr);
+}
+
+static void format_msg(char *msg, const char *fmt, va_list ap)
+{
+   int n = vsnprintf(msg, LOGGER_MSG_LEN, fmt, ap);
+
+   /* Most messages were written for syslog and end with a newline */
+   if (n > LOGGER_MSG_LEN-1) n = LOGGER_MSG_LEN-1;
+   while (n > 0 && msg[n-1] == '\n') msg[--n] = '\0';
+}
+
+void logger_write(logger_module_t module, int prio, const char *fmt, ...)
+{
+   uint32_t pos, seq;
+   slot_t *slot;
+   va_list ap;
+
+   if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+   {
+      char msg[LOGGER_MSG_LEN];
+      struct timespec ts;
+
+      clock_gettime(CLOCK_REALTIME, &ts);
+      va_start(ap, fmt);
+      format_msg(msg, fmt, ap);
+      va_end(ap);
+      output_msg(module, prio, &ts, msg);
+      flush_output();
+      return;
+   }
+
+   /* Claim a slot */
+   pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+   for (;;)
+   {
+      slot = &ring[pos & RING_MASK];
+      seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      if (seq == pos)
+      {
+         if (__atomic_compare_exchange_n(&head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+      }
+      else if ((int32_t)(seq - pos) < 0)
+      {
+         /* Full, the writer thread has not freed this slot yet */
+         __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+         return;
+      }
+      else
+      {
+         pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+      }
+   }
+
+   slot->module = module;
+   slot->prio = prio;
+   clock_gettime(CLOCK_REALTIME, &slot->ts);
+   va_start(ap, fmt);
+   format_msg(slot->msg, fmt, ap);
+   va_end(ap);
+   __atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+
+   /* Wake up the writer thread if it is waiting */
+   if (__atomic_exchange_n(&idle, 0, __ATOMIC_SEQ_CST))
+   {
+      uint64_t one = 1;
+
+      if (write(wake_fd, &one, sizeof(one)) < 0) { }
+   }
+}
+
+/* Write up to BATCH_SIZE messages, returns the number written */
+static int write_batch()
+{
+   uint64_t n;
+   int i;
+
+   for (i=0; i<BATCH_SIZE; i++)
+   {
+      slot_t *slot = &ring[tail & RING_MASK];
+
+      if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != tail+1)
+         break;
+      output_msg(slot->module, slot->prio, &slot->ts, slot->msg);
+      __atomic_store_n(&slot->seq, tail + LOGGER_RING_SIZE, __ATOMIC_RELEASE);
+      tail++;
+   }
+
+   if ((n = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED)) != 0)
+   {
+      char msg[LOGGER_MSG_LEN];
+      struct timespec ts;
+
+      clock_gettime(CLOCK_REALTIME, &ts);
+      snprintf(msg, sizeof(msg), "%llu log messages dropped", (unsigned long long)n);
+      output_msg(LOGGER_MAIN, LOG_WARNING, &ts, msg);
+   }
+   if (i > 0) flush_output();
+   return i;
+}
+
+static int ring_empty()
+{
+   return __atomic_load_n(&ring[tail & RING_MASK].seq, __ATOMIC_SEQ_CST) != tail+1;
+}
+
+static void *writer_thread(void *arg)
+{
+   struct pollfd pfd;
+   uint64_t cnt;
+
+   pfd.fd = wake_fd;
+   pfd.events = POLLIN;
+
+   for (;;)
+   {
+      if (write_batch() > 0)
+         continue;
+
+      /* Announce the idle state, then check again for a message
+         published before the announcement was visible */
+      __atomic_store_n(&idle, 1, __ATOMIC_SEQ_CST);
+      if (!ring_empty())
+      {
+         __atomic_store_n(&idle, 0, __ATOMIC_SEQ_CST);
+         continue;
+      }
+      if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+         break;
+
+      if (poll(&pfd, 1, 1000) > 0)
+      {
+         if (read(wake_fd, &cnt, sizeof(cnt)) < 0) { }
+      }
+      __atomic_store_n(&idle, 0, __ATOMIC_SEQ_CST);
+   }
+   return NULL;
+}
+
+static int parse_level(const char *s)
+{
+   int i;
+
+   if (!strcmp(s, "off")) return -1;
+   for (i=LOG_ERR; i<=LOG_DEBUG; i++)
+      if (!strcmp(s, prio_name[i])) return i;
+   if (!strcmp(s, "error")) return LOG_ERR;
+   return -2;
+}
+
+int logger_configure(const char *out, const char *file, const char *level, const char *modules)
+{
+   int was_running = running;
+   int err = 0;
+   int i, l;
+
+   if (was_running) logger_stop();
+
+   if (log_file != NULL)
+   {
+      fclose(log_file);
+      log_file = NULL;
+   }
+   if (out != NULL)
+   {
+      if (!strcmp(out, "syslog")) output = LOGGER_SYSLOG;
+      else if (!strcmp(out, "stderr")) output = LOGGER_STDERR;
+      else if (!strcmp(out, "file")) output = LOGGER_FILE;
+      else err = -1;
+   }
+   if (output == LOGGER_FILE)
+   {
+      if (file == NULL || (log_file = fopen(file, "a")) == NULL)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Can't open log file %s, using syslog", file ? file : "(none)");
+         output = LOGGER_SYSLOG;
+         err = -1;
+      }
+   }
+
+   l = (level != NULL) ? parse_level(level) : LOG_NOTICE;
+   if (l == -2)
+   {
+      l = LOG_NOTICE;
+      err = -1;
+   }
+   for (i=0; i<LOGGER_NUM_MODULES; i++)
+      logger_level[i] = l;
+
+   if (modules != NULL)
+   {
+      char *list = strdup(modules);
+      char *tok, *save, *sep;
+
+      for (tok = strtok_r(list, ", ", &save); tok != NULL; tok = strtok_r(NULL, ", ", &save))
+      {
+         if ((sep = strchr(tok, ':')) == NULL)
+         {
+            err = -1;
+            continue;
+         }
+         *sep++ = '\0';
+         for (i=0; i<LOGGER_NUM_MODULES; i++)
+            if (!strcmp(tok, module_name[i])) break;
+         if (i == LOGGER_NUM_MODULES || (l = parse_level(sep)) == -2)
+         {
+            err = -1;
+            continue;
+         }
+         logger_level[i] = l;
+      }
+      free(list);
+   }
+
+   if (was_running) logger_start();
+   return err;
+}
+
+int logger_start()
+{
+   int i;
+
+   if (running) return 0;
+
+   for (i=0; i<LOGGER_RING_SIZE; i++)
+      ring[i].seq = i;
+   head = tail = 0;
+   idle = stopping = 0;
+
+   if ((wake_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+      return -1;
+   if (pthread_create(&writer, NULL, writer_thread, NULL) != 0)
+   {
+      close(wake_fd);
+      wake_fd = -1;
+      return -1;
+   }
+   __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+   return 0;
+}
+
+void logger_stop()
+{
+   uint64_t one = 1;
+
+   if (running)
+   {
+      /* New messages are written synchronously from now on */
+      __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+      __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+      if (write(wake_fd, &one, sizeof(one)) < 0) { }
+      pthread_join(writer, NULL);
+      close(wake_fd);
+      wake_fd = -1;
+      /* Messages of threads that saw the writer still running */
+      while (write_batch() > 0);
+   }
+   flush_output();
+}
@@ -0,0 +1,127 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Asynchronous logging
+ *
+ * Description:
+ *   Log messages with a syslog priority (LOG_ERR .. LOG_DEBUG) and a
+ *   module. Each module has its own level, messages above it are
+ *   skipped before any formatting. Enabled messages are formatted by
+ *   the caller into a lock-free ring buffer, a background thread
+ *   writes them in batches to syslog, a file or stderr.
+ *
+ *   Until logger_start() is called (and after logger_stop()) the
+ *   messages are written synchronously.
+ *
+ *   Build with -DCRELAY_LOG_MAX_LEVEL=LOG_INFO (or lower) to compile
+ *   the debug messages out completely.
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef logger_h
+#define logger_h
+
+#include <stdint.h>
+#include <syslog.h>
+
+#ifndef CRELAY_LOG_MAX_LEVEL
+#define CRELAY_LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+/* Number of messages the ring buffer holds, power of 2 */
+#define LOGGER_RING_SIZE 256
+/* Maximum length of a message */
+#define LOGGER_MSG_LEN   240
+
+typedef enum
+{
+   LOGGER_MAIN = 0,     /* daemon start, stop and configuration */
+   LOGGER_CONFIG,       /* config file parser */
+   LOGGER_HTTP,         /* HTTP request handling */
+   LOGGER_TRACE,        /* slow request log */
+   LOGGER_CTL,          /* control socket */
+   LOGGER_NUM_MODULES
+} logger_module_t;
+
+typedef enum
+{
+   LOGGER_SYSLOG = 0,
+   LOGGER_STDERR,
+   LOGGER_FILE
+} logger_output_t;
+
+/* Current level of each module, -1 = module disabled */
+extern int8_t logger_level[LOGGER_NUM_MODULES];
+
+/**********************************************************
+ * Macro crelay_log()
+ *
+ * Description: Log a message, the arguments are only
+ *              evaluated when the module level enables it
+ *
+ * Parameters: module (in) - logger_module_t
+ *             prio (in)   - syslog priority
+ *             ...  (in)   - printf style format and args
+ *********************************************************/
+#define crelay_log(module, prio, ...) \
+   do { \
+      if ((prio) <= CRELAY_LOG_MAX_LEVEL && (prio) <= logger_level[module]) \
+         logger_write((module), (prio), __VA_ARGS__); \
+   } while (0)
+
+void logger_write(logger_module_t module, int prio, const char *fmt, ...)
+   __attribute__((format(printf, 3, 4)));
+
+/**********************************************************
+ * Function logger_configure()
+ *
+ * Description: Set the output and the levels
+ *
+ * Parameters: output (in)  - "syslog", "stderr" or "file",
+ *                            NULL keeps the current output
+ *             file (in)    - log file for the "file" output
+ *             level (in)   - level of all modules ("err",
+ *                            "warning", "notice", "info",
+ *                            "debug" or "off"), NULL = notice
+ *             modules (in) - per module levels overriding
+ *                            level, e.g. "http:debug,trace:off"
+ *
+ * Return:   0 - success
+ *          -1 - invalid parameter (the others are applied)
+ *********************************************************/
+int logger_configure(const char *output, const char *file, const char *level, const char *modules);
+
+/**********************************************************
+ * Function logger_start()
+ *
+ * Description: Start the background writer thread. Must be
+ *              called after daemon() since threads do not
+ *              survive a fork.
+ *
+ * Return:   0 - success, -1 - failure (logging stays synchronous)
+ *********************************************************/
+int logger_start();
+
+/**********************************************************
+ * Function logger_stop()
+ *
+ * Description: Write the pending messages and stop the
+ *              thread, later messages are written synchronously
+ *********************************************************/
+void logger_stop();
+
+#endif
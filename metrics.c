@@ -0,0 +1,436 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Runtime metrics
+ *
+ * Description:
+ *   Request, driver, card and USB transfer counters and latency
+ *   histograms, exported in the Prometheus text format.
+ *
+ *   Each thread owns a shard with all counters, created on its first
+ *   update and kept after the thread exits. Only the owning thread
+ *   writes a shard (relaxed atomic stores, no read-modify-write), the
+ *   scrape sums up all shards with relaxed loads. The hot path is
+ *   therefore a clock read and a few plain stores.
+ *
+ * Build instructions:
+ *   gcc -c metrics.c
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metrics.h"
+#include "trace.h"
+
+/* Histogram bucket upper bounds in ns (100us .. 10s) */
+#define NUM_BUCKETS 16
+static const uint64_t bucket_ns[NUM_BUCKETS] =
+{
+   100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000,
+   50000000, 100000000, 250000000, 500000000, 1000000000, 2500000000ULL,
+   5000000000ULL, 10000000000ULL
+};
+
+typedef struct
+{
+   uint64_t bucket[NUM_BUCKETS+1];   /* last one is +Inf */
+   uint64_t count;
+   uint64_t sum_ns;
+} hist_t;
+
+/* Counters of one thread */
+typedef struct shard
+{
+   hist_t   http[METRICS_NUM_ROUTES];
+   uint64_t http_errors[METRICS_NUM_ROUTES];
+   int64_t  in_flight;
+   hist_t   detect_all;
+   hist_t   driver[LAST_RELAY_TYPE][METRICS_NUM_OPS];
+   uint64_t driver_errors[LAST_RELAY_TYPE][METRICS_NUM_OPS];
+   hist_t   card[METRICS_MAX_CARDS][METRICS_NUM_CARD_KINDS];
+   uint64_t card_errors[METRICS_MAX_CARDS][METRICS_NUM_CARD_KINDS];
+   hist_t   usb[METRICS_NUM_USB];
+   uint64_t usb_errors[METRICS_NUM_USB];
+   uint64_t usb_timeouts[METRICS_NUM_USB];
+   struct shard *next;
+} shard_t;
+
+/* Cards known to the metrics, slots are never reused */
+typedef struct
+{
+   relay_type_t type;
+   char serial[MAX_SERIAL_LEN];
+} card_slot_t;
+
+static shard_t *all_shards = NULL;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread shard_t *my_shard = NULL;
+
+static card_slot_t cards[METRICS_MAX_CARDS];
+static int num_cards = 0;
+static pthread_mutex_t cards_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Current HTTP request of the thread */
+static __thread metrics_route_t http_route = METRICS_ROUTE_OTHER;
+static __thread uint64_t http_start = 0;
+
+static const char *route_name[METRICS_NUM_ROUTES] =
+   { "other", "/", "/api/info", "/api/card", "/api/board", "/api/serial", "/api/metrics", "/quit", "/api/debug" };
+
+static const char *op_name[METRICS_NUM_OPS] =
+   { "detect", "get", "set", "set_mask", "set_all", "get_mask" };
+
+static const char *card_kind_name[METRICS_NUM_CARD_KINDS] =
+   { "open", "transfer" };
+
+static const char *usb_name[METRICS_NUM_USB] =
+   { "control", "bulk" };
+
+static const char *driver_name[LAST_RELAY_TYPE] =
+   { "none", "conrad", "sainsmart", "hidapi", "sainsmart16", "sainsmart16_ch340", "cge8", "gpio", "sample" };
+
+
+/* Single writer update, readers may run concurrently */
+static inline void add(uint64_t *p, uint64_t v)
+{
+   __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t get(const uint64_t *p)
+{
+   return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static shard_t *shard()
+{
+   shard_t *s = my_shard;
+
+   if (s == NULL)
+   {
+      if ((s = calloc(1, sizeof(shard_t))) == NULL)
+         return NULL;
+      pthread_mutex_lock(&shards_lock);
+      s->next = all_shards;
+      __atomic_store_n(&all_shards, s, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&shards_lock);
+      my_shard = s;
+   }
+   return s;
+}
+
+static void observe(hist_t *h, uint64_t ns)
+{
+   int i;
+
+   for (i=0; i<NUM_BUCKETS && ns > bucket_ns[i]; i++)
+      ;
+   add(&h->bucket[i], 1);
+   add(&h->count, 1);
+   add(&h->sum_ns, ns);
+}
+
+/**********************************************************
+ * Internal function card_slot()
+ *
+ * Description: Find the slot of a card, allocate one for a
+ *              new card if create is set. Lookups are lock
+ *              free, slots are published with a release store
+ *              of num_cards.
+ *
+ * Return:   slot index
+ *           -1 - unknown card or no slot left
+ *********************************************************/
+static int card_slot(relay_type_t type, const char *serial, int create)
+{
+   const char *key = (serial != NULL) ? serial : "";
+   int i, n;
+
+   n = __atomic_load_n(&num_cards, __ATOMIC_ACQUIRE);
+   for (i=0; i<n; i++)
+   {
+      if (cards[i].type == type && !strcmp(cards[i].serial, key))
+         return i;
+   }
+   if (!create)
+      return -1;
+
+   pthread_mutex_lock(&cards_lock);
+   for (i=0; i<num_cards; i++)
+   {
+      if (cards[i].type == type && !strcmp(cards[i].serial, key))
+         break;
+   }
+   if (i == num_cards)
+   {
+      if (i < METRICS_MAX_CARDS)
+      {
+         cards[i].type = type;
+         snprintf(cards[i].serial, MAX_SERIAL_LEN, "%s", key);
+         __atomic_store_n(&num_cards, i+1, __ATOMIC_RELEASE);
+      }
+      else
+      {
+         i = -1;
+      }
+   }
+   pthread_mutex_unlock(&cards_lock);
+   return i;
+}
+
+
+uint64_t metrics_now()
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_http_begin()
+{
+   http_route = METRICS_ROUTE_OTHER;
+   http_start = metrics_now();
+   trace_request_begin();
+}
+
+void metrics_http_route(metrics_route_t route)
+{
+   http_route = route;
+}
+
+void metrics_http_error()
+{
+   shard_t *s = shard();
+
+   if (s) add(&s->http_errors[http_route], 1);
+   trace_request_error();
+}
+
+void metrics_http_end()
+{
+   shard_t *s = shard();
+
+   if (s) observe(&s->http[http_route], metrics_now() - http_start);
+   trace_request_end();
+}
+
+void metrics_connection(int delta)
+{
+   shard_t *s = shard();
+
+   if (s) add((uint64_t *)&s->in_flight, (uint64_t)(int64_t)delta);
+}
+
+void metrics_detect_all(uint64_t ns)
+{
+   shard_t *s = shard();
+
+   if (s) observe(&s->detect_all, ns);
+}
+
+void metrics_driver_op(relay_type_t type, metrics_op_t op, uint64_t ns, int err)
+{
+   shard_t *s = shard();
+
+   trace_phase((op == METRICS_OP_DETECT) ? TRACE_DETECT : TRACE_TRANSFER, ns);
+   if (s == NULL || type <= NO_RELAY_TYPE || type >= LAST_RELAY_TYPE) return;
+   observe(&s->driver[type][op], ns);
+   if (err) add(&s->driver_errors[type][op], 1);
+}
+
+void metrics_card(relay_type_t type, const char *serial, metrics_card_kind_t kind, uint64_t ns, int err)
+{
+   shard_t *s = shard();
+   int i;
+
+   if (kind == METRICS_CARD_OPEN) trace_phase(TRACE_OPEN, ns);
+
+   /* Failures do not create a slot, so probing serial numbers which
+      do not belong to the driver can not use up the slots */
+   if (s == NULL || (i = card_slot(type, serial, !err)) < 0) return;
+   observe(&s->card[i][kind], ns);
+   if (err) add(&s->card_errors[i][kind], 1);
+}
+
+void metrics_usb_transfer(metrics_usb_t kind, uint64_t ns, int result, int timeout)
+{
+   shard_t *s = shard();
+
+   if (s == NULL) return;
+   observe(&s->usb[kind], ns);
+   if (result < 0) add(&s->usb_errors[kind], 1);
+   if (timeout) add(&s->usb_timeouts[kind], 1);
+}
+
+
+/**********************************************************
+ * Scrape: sum up the shards and format the output
+ *********************************************************/
+static void sum_hist(hist_t *dst, const hist_t *src)
+{
+   int i;
+
+   for (i=0; i<=NUM_BUCKETS; i++) dst->bucket[i] += get(&src->bucket[i]);
+   dst->count += get(&src->count);
+   dst->sum_ns += get(&src->sum_ns);
+}
+
+static void write_hist(FILE *f, const char *name, const char *labels, const hist_t *h)
+{
+   uint64_t cum = 0;
+   int i;
+
+   for (i=0; i<NUM_BUCKETS; i++)
+   {
+      cum += h->bucket[i];
+      fprintf(f, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, labels[0] ? "," : "",
+              bucket_ns[i]/1e9, (unsigned long long)cum);
+   }
+   cum += h->bucket[NUM_BUCKETS];
+   fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, labels[0] ? "," : "", (unsigned long long)cum);
+   if (labels[0])
+   {
+      fprintf(f, "%s_sum{%s} %.9f\n", name, labels, h->sum_ns/1e9);
+      fprintf(f, "%s_count{%s} %llu\n", name, labels, (unsigned long long)h->count);
+   }
+   else
+   {
+      fprintf(f, "%s_sum %.9f\n", name, h->sum_ns/1e9);
+      fprintf(f, "%s_count %llu\n", name, (unsigned long long)h->count);
+   }
+}
+
+static void write_header(FILE *f, const char *name, const char *type, const char *help)
+{
+   fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_write(FILE *f)
+{
+   /* Sum of the shards, static since only the HTTP server writes */
+   static shard_t sum_buf;
+   shard_t *sum = &sum_buf, *s;
+   char labels[128];
+   int i, j, n;
+
+   memset(sum, 0, sizeof(*sum));
+
+   for (s = __atomic_load_n(&all_shards, __ATOMIC_ACQUIRE); s != NULL; s = s->next)
+   {
+      for (i=0; i<METRICS_NUM_ROUTES; i++)
+      {
+         sum_hist(&sum->http[i], &s->http[i]);
+         sum->http_errors[i] += get(&s->http_errors[i]);
+      }
+      sum->in_flight += (int64_t)get((uint64_t *)&s->in_flight);
+      sum_hist(&sum->detect_all, &s->detect_all);
+      for (i=0; i<LAST_RELAY_TYPE; i++)
+         for (j=0; j<METRICS_NUM_OPS; j++)
+         {
+            sum_hist(&sum->driver[i][j], &s->driver[i][j]);
+            sum->driver_errors[i][j] += get(&s->driver_errors[i][j]);
+         }
+      for (i=0; i<METRICS_MAX_CARDS; i++)
+         for (j=0; j<METRICS_NUM_CARD_KINDS; j++)
+         {
+            sum_hist(&sum->card[i][j], &s->card[i][j]);
+            sum->card_errors[i][j] += get(&s->card_errors[i][j]);
+         }
+      for (i=0; i<METRICS_NUM_USB; i++)
+      {
+         sum_hist(&sum->usb[i], &s->usb[i]);
+         sum->usb_errors[i] += get(&s->usb_errors[i]);
+         sum->usb_timeouts[i] += get(&s->usb_timeouts[i]);
+      }
+   }
+
+   /* HTTP requests */
+   write_header(f, "crelay_http_request_duration_seconds", "histogram", "HTTP request duration by route");
+   for (i=0; i<METRICS_NUM_ROUTES; i++)
+   {
+      snprintf(labels, sizeof(labels), "route=\"%s\"", route_name[i]);
+      write_hist(f, "crelay_http_request_duration_seconds", labels, &sum->http[i]);
+   }
+   write_header(f, "crelay_http_errors_total", "counter", "HTTP requests answered with an error");
+   for (i=0; i<METRICS_NUM_ROUTES; i++)
+      fprintf(f, "crelay_http_errors_total{route=\"%s\"} %llu\n", route_name[i], (unsigned long long)sum->http_errors[i]);
+   write_header(f, "crelay_http_connections_in_flight", "gauge", "HTTP connections being served");
+   fprintf(f, "crelay_http_connections_in_flight %lld\n", (long long)sum->in_flight);
+
+   /* Card detection */
+   write_header(f, "crelay_detect_all_duration_seconds", "histogram", "Duration of crelay_detect_all_relay_cards() calls");
+   write_hist(f, "crelay_detect_all_duration_seconds", "", &sum->detect_all);
+
+   /* Driver operations, only drivers which were used */
+   write_header(f, "crelay_driver_op_duration_seconds", "histogram", "Relay driver operation duration");
+   for (i=1; i<LAST_RELAY_TYPE; i++)
+      for (j=0; j<METRICS_NUM_OPS; j++)
+      {
+         if (sum->driver[i][j].count == 0) continue;
+         snprintf(labels, sizeof(labels), "driver=\"%s\",op=\"%s\"", driver_name[i], op_name[j]);
+         write_hist(f, "crelay_driver_op_duration_seconds", labels, &sum->driver[i][j]);
+      }
+   write_header(f, "crelay_driver_errors_total", "counter", "Failed relay driver operations");
+   for (i=1; i<LAST_RELAY_TYPE; i++)
+      for (j=0; j<METRICS_NUM_OPS; j++)
+      {
+         if (sum->driver[i][j].count == 0) continue;
+         fprintf(f, "crelay_driver_errors_total{driver=\"%s\",op=\"%s\"} %llu\n", driver_name[i], op_name[j],
+                 (unsigned long long)sum->driver_errors[i][j]);
+      }
+
+   /* Cards */
+   n = __atomic_load_n(&num_cards, __ATOMIC_ACQUIRE);
+   write_header(f, "crelay_card_duration_seconds", "histogram", "USB open and transfer duration per card");
+   for (i=0; i<n; i++)
+      for (j=0; j<METRICS_NUM_CARD_KINDS; j++)
+      {
+         if (sum->card[i][j].count == 0) continue;
+         snprintf(labels, sizeof(labels), "driver=\"%s\",serial=\"%s\",kind=\"%s\"",
+                  driver_name[cards[i].type], cards[i].serial, card_kind_name[j]);
+         write_hist(f, "crelay_card_duration_seconds", labels, &sum->card[i][j]);
+      }
+   write_header(f, "crelay_card_errors_total", "counter", "Failed USB opens and transfers per card");
+   for (i=0; i<n; i++)
+      for (j=0; j<METRICS_NUM_CARD_KINDS; j++)
+      {
+         if (sum->card[i][j].count == 0) continue;
+         fprintf(f, "crelay_card_errors_total{driver=\"%s\",serial=\"%s\",kind=\"%s\"} %llu\n",
+                 driver_name[cards[i].type], cards[i].serial, card_kind_name[j],
+                 (unsigned long long)sum->card_errors[i][j]);
+      }
+
+   /* libusb transfers */
+   write_header(f, "crelay_usb_transfer_duration_seconds", "histogram", "libusb transfer duration");
+   for (i=0; i<METRICS_NUM_USB; i++)
+   {
+      snprintf(labels, sizeof(labels), "type=\"%s\"", usb_name[i]);
+      write_hist(f, "crelay_usb_transfer_duration_seconds", labels, &sum->usb[i]);
+   }
+   write_header(f, "crelay_usb_transfer_errors_total", "counter", "Failed libusb transfers");
+   for (i=0; i<METRICS_NUM_USB; i++)
+      fprintf(f, "crelay_usb_transfer_errors_total{type=\"%s\"} %llu\n", usb_name[i], (unsigned long long)sum->usb_errors[i]);
+   write_header(f, "crelay_usb_transfer_timeouts_total", "counter", "Timed out libusb transfers");
+   for (i=0; i<METRICS_NUM_USB; i++)
+      fprintf(f, "crelay_usb_transfer_timeouts_total{type=\"%s\"} %llu\n", usb_name[i], (unsigned long long)sum->usb_timeouts[i]);
+}
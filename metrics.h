@@ -0,0 +1,183 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Runtime metrics
+ *
+ * Description:
+ *   Request, driver, card and USB transfer counters and latency
+ *   histograms, exported in the Prometheus text format by the
+ *   /api/metrics HTTP API call.
+ *
+ *   Every thread updates its own set of counters without locking,
+ *   the sets of all threads are summed up when the metrics are read.
+ *
+ *   The HTTP request and driver hooks also feed the request phase
+ *   trace (trace.h).
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef metrics_h
+#define metrics_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include "relay_drv.h"
+
+/* Maximum number of cards with their own histograms */
+#define METRICS_MAX_CARDS 32
+
+typedef enum
+{
+   METRICS_ROUTE_OTHER = 0,
+   METRICS_ROUTE_WEBUI,
+   METRICS_ROUTE_INFO,
+   METRICS_ROUTE_CARD,
+   METRICS_ROUTE_BOARD,
+   METRICS_ROUTE_SERIAL,
+   METRICS_ROUTE_METRICS,
+   METRICS_ROUTE_QUIT,
+   METRICS_ROUTE_DEBUG,
+   METRICS_NUM_ROUTES
+} metrics_route_t;
+
+typedef enum
+{
+   METRICS_OP_DETECT = 0,
+   METRICS_OP_GET,
+   METRICS_OP_SET,
+   METRICS_OP_SET_MASK,
+   METRICS_OP_SET_ALL,
+   METRICS_OP_GET_MASK,
+   METRICS_NUM_OPS
+} metrics_op_t;
+
+typedef enum
+{
+   METRICS_CARD_OPEN = 0,     /* open the USB device */
+   METRICS_CARD_TRANSFER,     /* get/set operation on the card */
+   METRICS_NUM_CARD_KINDS
+} metrics_card_kind_t;
+
+typedef enum
+{
+   METRICS_USB_CONTROL = 0,
+   METRICS_USB_BULK,
+   METRICS_NUM_USB
+} metrics_usb_t;
+
+
+/**********************************************************
+ * Function metrics_now()
+ *
+ * Description: Monotonic time stamp for the durations
+ *
+ * Return:   time in ns
+ *********************************************************/
+uint64_t metrics_now();
+
+/**********************************************************
+ * Function metrics_http_begin()
+ *
+ * Description: Start timing an HTTP request of the calling
+ *              thread, the route is METRICS_ROUTE_OTHER
+ *              until metrics_http_route() is called
+ *********************************************************/
+void metrics_http_begin();
+void metrics_http_route(metrics_route_t route);
+
+/**********************************************************
+ * Function metrics_http_error()
+ *
+ * Description: Count an error response of the current
+ *              HTTP request
+ *********************************************************/
+void metrics_http_error();
+
+/**********************************************************
+ * Function metrics_http_end()
+ *
+ * Description: Record the duration of the current HTTP
+ *              request
+ *********************************************************/
+void metrics_http_end();
+
+/**********************************************************
+ * Function metrics_connection()
+ *
+ * Description: Track the connections in flight
+ *
+ * Parameters: delta (in) - +1 accepted, -1 closed
+ *********************************************************/
+void metrics_connection(int delta);
+
+/**********************************************************
+ * Function metrics_detect_all()
+ *
+ * Description: Record a crelay_detect_all_relay_cards() call
+ *
+ * Parameters: ns (in)  - duration
+ *********************************************************/
+void metrics_detect_all(uint64_t ns);
+
+/**********************************************************
+ * Function metrics_driver_op()
+ *
+ * Description: Record a driver operation
+ *
+ * Parameters: type (in)  - relay card type
+ *             op (in)    - operation
+ *             ns (in)    - duration
+ *             err (in)   - operation failed
+ *********************************************************/
+void metrics_driver_op(relay_type_t type, metrics_op_t op, uint64_t ns, int err);
+
+/**********************************************************
+ * Function metrics_card()
+ *
+ * Description: Record an open or transfer of one card
+ *
+ * Parameters: type (in)   - relay card type
+ *             serial (in) - serial number (NULL = first card)
+ *             kind (in)   - open or transfer
+ *             ns (in)     - duration
+ *             err (in)    - operation failed
+ *********************************************************/
+void metrics_card(relay_type_t type, const char *serial, metrics_card_kind_t kind, uint64_t ns, int err);
+
+/**********************************************************
+ * Function metrics_usb_transfer()
+ *
+ * Description: Record a completed libusb transfer
+ *
+ * Parameters: kind (in)   - control or bulk
+ *             ns (in)     - duration
+ *             result (in) - bytes transferred or libusb error
+ *             timeout (in)- transfer timed out
+ *********************************************************/
+void metrics_usb_transfer(metrics_usb_t kind, uint64_t ns, int result, int timeout);
+
+/**********************************************************
+ * Function metrics_write()
+ *
+ * Description: Write all metrics in the Prometheus text
+ *              exposition format
+ *
+ * Parameters: f (in) - output stream
+ *********************************************************/
+void metrics_write(FILE *f);
+
+#endif
@@ -37,6 +37,10 @@
 #include <stdint.h>
 
 #include "relay_drv.h"
+#include "metrics.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "crelay_probes.h"
 
 /* Card driver specific include files */
 #include "relay_drv_conrad.h"
@@ -46,15 +50,30 @@
 #include "relay_drv_sainsmart16_CH340.h"
 #include "relay_drv_cge8.h"
 #include "relay_drv_gpio.h"
+#include "relay_drv_sample.h"
+#ifdef USB_ENGINE
+#include "relay_usb.h"
+#endif
 
 
 static relay_type_t relay_type=NO_RELAY_TYPE;
 
+/* Arena of the relay info lists, NULL for the heap */
+static arena_t *info_arena = NULL;
+/* An allocation of the card list failed */
+static int info_failed = 0;
+/* Card list returned when not even its first element is allocated */
+static relay_info_t no_relay_info;
+
 /*
  *  Table which holds the specific relay card data:
  *    - function to detect the communication port
  *    - function to get the current relay state
  *    - function to set the new relay state
+ *    - function to close the card / free driver memory
+ *    - function to set several relays in one transfer (optional)
+ *    - function to switch all relays in one transfer (optional)
+ *    - function to write pending (coalesced) relay changes (optional)
  *    - card name string
  *    - number of relays on the card
  * 
@@ -63,7 +82,7 @@ static relay_type_t relay_type=NO_RELAY_TYPE;
 static relay_data_t relay_data[LAST_RELAY_TYPE] =
 { 
    {  // NO_RELAY_TYPE (dummy entry)
-      NULL, NULL, NULL, NULL, NULL, ""
+      NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, ""
    },
 #ifdef DRV_CONRAD
    {  // CONRAD_4CHANNEL_USB_RELAY_TYPE
@@ -72,11 +91,15 @@ static relay_data_t relay_data[LAST_RELAY_TYPE] =
       set_relay_conrad_4chan,
       close_conrad_4chan,
       free_static_mem_conrad_4chan,
+      set_relay_mask_conrad_4chan,
+      NULL,
+      NULL,
+      get_relay_mask_conrad_4chan,
       CONRAD_4CHANNEL_USB_NAME
    },
 #else
    {
-      NULL, NULL, NULL, NULL, NULL, ""
+      NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, ""
    },
 #endif
 #ifdef DRV_SAINSMART
@@ -86,11 +109,15 @@ static relay_data_t relay_data[LAST_RELAY_TYPE] =
       set_relay_sainsmart_4_8chan,
       close_sainsmart_4_8chan,
       free_static_mem_sainsmart_4_8chan,
+      set_relay_mask_sainsmart_4_8chan,
+      set_all_relays_sainsmart_4_8chan,
+      flush_sainsmart_4_8chan,
+      get_relay_mask_sainsmart_4_8chan,
       SAINSMART_USB_NAME
    },
 #else
    {
-      NULL, NULL, NULL, NULL, NULL, ""
+      NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, ""
    },
 #endif
 #ifdef DRV_HIDAPI
@@ -100,11 +127,15 @@ static relay_data_t relay_data[LAST_RELAY_TYPE] =
       set_relay_hidapi,
       close_hidapi,
       free_static_mem_hidapi,
+      set_relay_mask_hidapi,
+      set_all_relays_hidapi,
+      NULL,
+      get_relay_mask_hidapi,
       HID_API_RELAY_NAME
    },
 #else
    {
-      NULL, NULL, NULL, NULL, NULL, ""
+      NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, ""
    },
 #endif
 #ifdef DRV_SAINSMART16
@@ -114,11 +145,15 @@ static relay_data_t relay_data[LAST_RELAY_TYPE] =
       set_relay_sainsmart_16chan,
       close_sainsmart_16chan,
       free_static_mem_sainsmart_16chan,
+      set_relay_mask_sainsmart_16chan,
+      set_all_relays_sainsmart_16chan,
+      NULL,
+      get_relay_mask_sainsmart_16chan,
       SAINSMART16_USB_NAME
    },
 #else
    {
-      NULL, NULL, NULL, NULL, NULL, ""
+      NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, ""
    },
 #endif
 #ifdef DRV_SAINSMART16_CH340
@@ -128,11 +163,15 @@ static relay_data_t relay_data[LAST_RELAY_TYPE] =
       set_relay_sainsmart_16chan_CH340,
       close_sainsmart_16chan_CH340,
       free_static_mem_sainsmart_16chan_CH340,
+      set_relay_mask_sainsmart_16chan_CH340,
+      set_all_relays_sainsmart_16chan_CH340,
+      NULL,
+      get_relay_mask_sainsmart_16chan_CH340,
       SAINSMART16_CH340_NAME
    },
 #else
    {
-      NULL, NULL, NULL, NULL, NULL, ""
+      NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, ""
    },
 #endif
 #ifdef DRV_CGE8
@@ -142,11 +181,15 @@ static relay_data_t relay_data[LAST_RELAY_TYPE] =
       set_relay_cge_usb_8chan,
       close_cge_usb_8chan,
       free_static_mem_cge_usb_8chan,
+      set_relay_mask_cge_usb_8chan,
+      set_all_relays_cge_usb_8chan,
+      NULL,
+      get_relay_mask_cge_usb_8chan,
       CGE8_USB_NAME
    },
 #else
    {
-      NULL, NULL, NULL, NULL, NULL, ""
+      NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, ""
    },
 #endif
 #ifndef BUILD_LIB
@@ -156,17 +199,54 @@ static relay_data_t relay_data[LAST_RELAY_TYPE] =
       set_relay_generic_gpio,
       close_generic_gpio,
       free_static_mem_generic_gpio,
+      NULL,
+      NULL,
+      NULL,
+      NULL,
       GENERIC_GPIO_NAME
+   },
+#else
+   {
+      NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, ""
+   },
+#endif
+#ifdef DRV_SAMPLE
+   {  // SAMPLE_RELAY_TYPE
+      detect_relay_card_sample,
+      get_relay_sample,
+      set_relay_sample,
+      close_sample,
+      free_static_mem_sample,
+      set_relay_mask_sample,
+      set_all_relays_sample,
+      NULL,
+      get_relay_mask_sample,
+      SAMPLE_NAME
    }
 #else
    {
-      NULL, NULL, NULL, NULL, NULL, ""
+      NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, ""
    }
 #endif
 };
 
 
 
+/**********************************************************
+ * Internal function record_op()
+ * 
+ * Description: Record the duration of a driver operation
+ *              on the current card in the metrics
+ *********************************************************/
+static void record_op(metrics_op_t op, uint64_t t0, int r, char *serial)
+{
+   uint64_t ns = metrics_now() - t0;
+   
+   metrics_driver_op(relay_type, op, ns, r != 0);
+   metrics_card(relay_type, serial, METRICS_CARD_TRANSFER, ns, r != 0);
+}
+
+
 /**********************************************************
  * Function crelay_detect_all_relay_cards()
  * 
@@ -177,28 +257,50 @@ static relay_data_t relay_data[LAST_RELAY_TYPE] =
  * 
  * Return:  0 - success
  *         -1 - fail, no relay card found
+ *         -2 - fail, out of memory, the list holds the
+ *              cards found so far
  *********************************************************/
 int crelay_detect_all_relay_cards(relay_info_t** relay_info)
 {
    int i;
    relay_info_t* my_relay_info;
+   relay_info_t* card;
+   uint64_t t0, t1;
   
-   /* Create first list element */
-   my_relay_info = malloc(sizeof(relay_info_t));
-   my_relay_info->next = NULL;
+   CRELAY_PROBE0(detect_all__start);
+   t0 = metrics_now();
+
+   /* Create first list element, the empty list without memory */
+   info_failed = 0;
+   if ((my_relay_info = crelay_new_relay_info()) == NULL)
+   {
+      *relay_info = &no_relay_info;
+      CRELAY_PROBE1(detect_all__end, -2);
+      return -2;
+   }
    
    *relay_info = my_relay_info;
 
    /* Return pointer to first element to caller */
-   for (i=1; i<LAST_RELAY_TYPE; i++)
+   for (i=1; i<LAST_RELAY_TYPE && !info_failed; i++)
    {
       if (relay_data[i].detect_relay_card_fun != NULL)
       /* Create new list element with related info for each detected card */
       {
+         t1 = metrics_now();
          (*relay_data[i].detect_relay_card_fun)(NULL, NULL, NULL, &my_relay_info);
-
+         metrics_driver_op(i, METRICS_OP_DETECT, metrics_now() - t1, 0);
       }
    }
+   metrics_detect_all(metrics_now() - t0);
+   for (card = *relay_info; card->next != NULL; card = card->next)
+      snapshot_card(card->relay_type, card->serial, card->num_relays);
+   if (info_failed)
+   {
+      CRELAY_PROBE1(detect_all__end, -2);
+      return -2;
+   }
+   CRELAY_PROBE1(detect_all__end, (*relay_info)->next == NULL ? -1 : 0);
    
    if ((*relay_info)->next == NULL)
       return -1;
@@ -224,26 +326,97 @@ int crelay_detect_all_relay_cards(relay_info_t** relay_info)
  *********************************************************/
 int crelay_detect_relay_card(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info, relay_type_t model)
 {
-   int i;
+   int i, r;
+   uint64_t t0;
 
+   CRELAY_PROBE2(detect__start, serial, model);
    for (i=1; i<LAST_RELAY_TYPE; i++)
    {
 //      printf("i=%i -- ",i) ;
-      if (relay_data[i].detect_relay_card_fun != NULL && (model == NO_RELAY_TYPE || model == i))
-         if (serial != NULL && (*relay_data[i].detect_relay_card_fun)(portname, num_relays, serial, NULL) == 0)
+      if (relay_data[i].detect_relay_card_fun != NULL && (model == NO_RELAY_TYPE || model == i) && serial != NULL)
+      {
+         t0 = metrics_now();
+         r = (*relay_data[i].detect_relay_card_fun)(portname, num_relays, serial, NULL);
+         metrics_driver_op(i, METRICS_OP_DETECT, metrics_now() - t0, 0);
+         if (r == 0)
          { 
 //            printf("Trouvé\n") ;
             relay_type=i;
+            snapshot_card(i, serial, num_relays ? *num_relays : 0);
+            CRELAY_PROBE2(detect__end, serial, i);
             return 0;
          }       
+      }
 //      printf("NON\n") ;  
    }
    
    relay_type = NO_RELAY_TYPE;
+   CRELAY_PROBE2(detect__end, serial, 0);
    return -1;   
 }
 
 
+/**********************************************************
+ * Function crelay_detect_first_relay_card()
+ * 
+ * Description: Detect the first relay card of the system
+ * 
+ * Parameters: portname (out) - detected com port
+ *             num_relays(out)- pointer to number of relays
+ *             serial (out)   - serial number of the card
+ * 
+ * Return:  0 - success
+ *         -1 - fail, no relay card found
+ *********************************************************/
+int crelay_detect_first_relay_card(char* portname, uint8_t* num_relays, char* serial)
+{
+   relay_info_t *relay_info;
+   int r = -1;
+
+   if (crelay_detect_all_relay_cards(&relay_info) == 0)
+   {
+      snprintf(serial, MAX_SERIAL_LEN, "%s", relay_info->serial);
+      r = crelay_detect_relay_card(portname, num_relays, serial, NULL, relay_info->relay_type);
+   }
+   crelay_free_relay_info(relay_info);
+   return r;
+}
+
+
+void crelay_set_info_arena(arena_t *arena)
+{
+   info_arena = arena;
+}
+
+
+relay_info_t *crelay_new_relay_info()
+{
+   relay_info_t *rinfo;
+
+   if (info_arena != NULL)
+      rinfo = arena_alloc(info_arena, sizeof(relay_info_t));
+   else
+      rinfo = calloc(1, sizeof(relay_info_t));
+   if (rinfo == NULL)
+      info_failed = 1;
+   return rinfo;
+}
+
+
+void crelay_free_relay_info(relay_info_t *relay_info)
+{
+   relay_info_t *next;
+
+   if (info_arena != NULL || relay_info == &no_relay_info)
+      return;
+   for (; relay_info != NULL; relay_info = next)
+   {
+      next = relay_info->next;
+      free(relay_info);
+   }
+}
+
+
 /**********************************************************
  * Function crelay_get_relay()
  * 
@@ -258,9 +431,19 @@ int crelay_detect_relay_card(char* portname, uint8_t* num_relays, char* serial,
  *********************************************************/
 int crelay_get_relay(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial)
 {
+   uint64_t t0;
+   int r;
+
    if (relay_type != NO_RELAY_TYPE)
    {
-      return (*relay_data[relay_type].get_relay_fun)(portname, relay, relay_state, serial);
+      CRELAY_PROBE3(get__entry, relay_type, serial, relay);
+      t0 = metrics_now();
+      r = (*relay_data[relay_type].get_relay_fun)(portname, relay, relay_state, serial);
+      record_op(METRICS_OP_GET, t0, r, serial);
+      if (r == 0 && (*relay_state == ON || *relay_state == OFF))
+         snapshot_relays(relay_type, serial, RELAY_BIT(relay), (*relay_state == ON) ? RELAY_BIT(relay) : 0);
+      CRELAY_PROBE5(get__return, relay_type, serial, relay, r, (r == 0) ? (int)*relay_state : -1);
+      return r;
    }
    else
    {   
@@ -283,9 +466,19 @@ int crelay_get_relay(char* portname, uint8_t relay, relay_state_t* relay_state,
  *********************************************************/
 int crelay_set_relay(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
 {
+   uint64_t t0;
+   int r;
+
    if (relay_type != NO_RELAY_TYPE)
    {
-      return (*relay_data[relay_type].set_relay_fun)(portname, relay, relay_state, serial);
+      CRELAY_PROBE4(set__entry, relay_type, serial, relay, relay_state);
+      t0 = metrics_now();
+      r = (*relay_data[relay_type].set_relay_fun)(portname, relay, relay_state, serial);
+      record_op(METRICS_OP_SET, t0, r, serial);
+      if (r == 0)
+         snapshot_relays(relay_type, serial, RELAY_BIT(relay), (relay_state == ON) ? RELAY_BIT(relay) : 0);
+      CRELAY_PROBE4(set__return, relay_type, serial, relay, r);
+      return r;
    }
    else
    {   
@@ -294,6 +487,161 @@ int crelay_set_relay(char* portname, uint8_t relay, relay_state_t relay_state, c
 }
 
 
+/**********************************************************
+ * Function crelay_get_relay_mask()
+ *
+ * Description: Get the state of all relays of a card.
+ *              Drivers which support it do this in a
+ *              single transfer, otherwise the relays are
+ *              read one after the other.
+ *
+ * Parameters: portname (in)     - communication port
+ *             num_relays (in)   - number of relays on the card
+ *             values (out)      - relay states (1 = ON)
+ *             serial (in)       - serial number
+ *
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int crelay_get_relay_mask(char* portname, uint8_t num_relays, relay_mask_t* values, char* serial)
+{
+   relay_state_t rstate;
+   uint64_t t0;
+   int i;
+   int err = 0;
+
+   if (relay_type == NO_RELAY_TYPE)
+   {
+      return -1;
+   }
+
+   CRELAY_PROBE2(get_mask__entry, relay_type, serial);
+   t0 = metrics_now();
+   *values = 0;
+   if (relay_data[relay_type].get_relay_mask_fun != NULL)
+   {
+      err = (*relay_data[relay_type].get_relay_mask_fun)(portname, values, serial);
+   }
+   else
+   {
+      for (i=0; i<num_relays && i<MAX_NUM_RELAYS; i++)
+      {
+         if ((*relay_data[relay_type].get_relay_fun)(portname, i+FIRST_RELAY, &rstate, serial) != 0)
+         {
+            err = -1;
+            break;
+         }
+         if (rstate == ON) *values |= RELAY_BIT(i+FIRST_RELAY);
+      }
+   }
+   record_op(METRICS_OP_GET_MASK, t0, err, serial);
+   if (err == 0)
+      snapshot_relays(relay_type, serial, RELAY_MASK_ALL(num_relays), *values);
+   CRELAY_PROBE4(get_mask__return, relay_type, serial, err, *values);
+   return err;
+}
+
+
+/**********************************************************
+ * Function crelay_set_relay_mask()
+ *
+ * Description: Set the state of several relays at once.
+ *              Drivers which support it do this in a
+ *              single transfer, otherwise the relays are
+ *              set one after the other.
+ *
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change (bit 0
+ *                                 is relay 1)
+ *             values (in)       - new states of the relays
+ *                                 selected by mask (1 = ON)
+ *             serial (in)       - serial number
+ *
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int crelay_set_relay_mask(char* portname, relay_mask_t mask, relay_mask_t values, char* serial)
+{
+   int i;
+   int err = 0;
+   uint64_t t0;
+
+   if (relay_type == NO_RELAY_TYPE)
+   {
+      return -1;
+   }
+
+   CRELAY_PROBE4(set_mask__entry, relay_type, serial, mask, values);
+   t0 = metrics_now();
+   if (relay_data[relay_type].set_relay_mask_fun != NULL)
+   {
+      err = (*relay_data[relay_type].set_relay_mask_fun)(portname, mask, values, serial);
+      record_op(METRICS_OP_SET_MASK, t0, err, serial);
+      if (err == 0)
+         snapshot_relays(relay_type, serial, mask, values);
+      CRELAY_PROBE4(set_mask__return, relay_type, serial, mask, err);
+      return err;
+   }
+
+   for (i=0; i<MAX_NUM_RELAYS; i++)
+   {
+      if (mask & RELAY_BIT(i+FIRST_RELAY))
+      {
+         if ((*relay_data[relay_type].set_relay_fun)(portname, i+FIRST_RELAY, (values & RELAY_BIT(i+FIRST_RELAY)) ? ON : OFF, serial) != 0)
+            err = -1;
+      }
+   }
+   record_op(METRICS_OP_SET_MASK, t0, err, serial);
+   if (err == 0)
+      snapshot_relays(relay_type, serial, mask, values);
+   CRELAY_PROBE4(set_mask__return, relay_type, serial, mask, err);
+   return err;
+}
+
+
+/**********************************************************
+ * Function crelay_set_all_relays()
+ *
+ * Description: Switch all relays of a card on or off
+ *
+ * Parameters: portname (in)     - communication port
+ *             num_relays (in)   - number of relays on the card
+ *             relay_state (in)  - new state (ON or OFF)
+ *             serial (in)       - serial number
+ *
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int crelay_set_all_relays(char* portname, uint8_t num_relays, relay_state_t relay_state, char* serial)
+{
+   relay_mask_t mask;
+
+   if (relay_type == NO_RELAY_TYPE)
+   {
+      return -1;
+   }
+
+   if (relay_data[relay_type].set_all_relays_fun != NULL)
+   {
+      uint64_t t0;
+      int r;
+
+      CRELAY_PROBE3(set_all__entry, relay_type, serial, relay_state);
+      t0 = metrics_now();
+      r = (*relay_data[relay_type].set_all_relays_fun)(portname, relay_state, serial);
+      record_op(METRICS_OP_SET_ALL, t0, r, serial);
+      if (r == 0)
+         snapshot_relays(relay_type, serial, RELAY_MASK_ALL(num_relays), (relay_state == ON) ? RELAY_MASK_ALL(num_relays) : 0);
+      CRELAY_PROBE3(set_all__return, relay_type, serial, r);
+      return r;
+   }
+
+   mask = RELAY_MASK_ALL(num_relays);
+
+   return crelay_set_relay_mask(portname, mask, (relay_state == ON) ? mask : 0, serial);
+}
+
+
 /**********************************************************
  * Function crelay_get_relay_card_type()
  * 
@@ -335,6 +683,37 @@ int crelay_get_relay_card_name(relay_type_t rtype, char* card_name)
    }  
 }
 
+/**********************************************************
+ * Function crelay_flush()
+ * 
+ * Description: Write pending relay changes of drivers which
+ *              coalesce writes and sync the state journal
+ * 
+ * Parameters: force - 1: write all pending changes
+ *                     0: write only the changes which are due
+ * 
+ * Return:   ms until the next pending change is due
+ *          -1 - nothing pending
+ *********************************************************/
+int crelay_flush(int force)
+{
+   int i, ms, next = -1;
+   
+   for (i=1; i<LAST_RELAY_TYPE; i++)
+   {
+      if (relay_data[i].flush_fun != NULL)
+      {
+         ms = (*relay_data[i].flush_fun)(force);
+         if (ms >= 0 && (next < 0 || ms < next))
+            next = ms;
+      }
+   }
+   ms = journal_sync(force);
+   if (ms >= 0 && (next < 0 || ms < next))
+      next = ms;
+   return next;
+}
+
 int crelay_close()
 {
    for (int i=1; i<LAST_RELAY_TYPE; i++)
@@ -352,6 +731,9 @@ int crelay_free_static_mem()
       if (relay_data[i].free_static_mem_fun != NULL)
          (*relay_data[i].free_static_mem_fun)() ;
    }
+#ifdef USB_ENGINE
+   relay_usb_exit() ;
+#endif
    return 0 ;
 }
 
@@ -34,6 +34,8 @@
 #ifndef relay_drv_h
 #define relay_drv_h
 
+#include "arena.h"
+
 /* Conrad 4 channel USB relay card */
 #define CONRAD_4CHANNEL_USB_NAME       "Conrad USB 4-channel relay card"
 #define CONRAD_4CHANNEL_USB_NUM_RELAYS 4
@@ -62,13 +64,26 @@
 #define GENERIC_GPIO_NAME              "Generic GPIO relays"
 #define GENERIC_GPIO_NUM_RELAYS        8
 
+/* Simulated relay cards (sample driver) */
+#define SAMPLE_NAME                    "Simulated relay card"
+#define SAMPLE_NUM_RELAYS              8
+
 
 #define FIRST_RELAY    1
-#define MAX_NUM_RELAYS 16
+/* Largest relay bank, limited by the width of relay_mask_t */
+#define MAX_NUM_RELAYS 64
 #define MAX_RELAY_CARD_NAME_LEN 40
 #define MAX_COM_PORT_NAME_LEN 32
 #define MAX_SERIAL_LEN 32
 
+/* Bit mask of relays, bit 0 is relay 1 */
+typedef uint64_t relay_mask_t;
+
+/* Bit of relay r (FIRST_RELAY..MAX_NUM_RELAYS) */
+#define RELAY_BIT(r)      ((relay_mask_t)1 << ((r)-FIRST_RELAY))
+/* Bits of the relays of a card with n relays */
+#define RELAY_MASK_ALL(n) (((n) >= MAX_NUM_RELAYS) ? ~(relay_mask_t)0 : ((relay_mask_t)1 << (n)) - 1)
+
 
 typedef enum
 {
@@ -81,7 +96,8 @@ typedef enum
    SAINSMART16_CH340_RELAY_TYPE = 5,     /* Sainsmart USB-HID relay card */
    CGE8_USB_RELAY_TYPE = 6,              /* CGE USB 8-channel relay card */
    GENERIC_GPIO_RELAY_TYPE = 7,        /* Relays connected directly via GPIO pins */
-   LAST_RELAY_TYPE = 8
+   SAMPLE_RELAY_TYPE = 8,              /* Simulated relay cards */
+   LAST_RELAY_TYPE = 9
 
 } relay_type_t;
 
@@ -110,6 +126,10 @@ typedef struct
    int (*set_relay_fun)(char*, uint8_t, relay_state_t, char*);  /* function to set the new relay state */
    int (*close_fun)();  /* function to set the new relay state */
    int (*free_static_mem_fun)();  /* function to set the new relay state */
+   int (*set_relay_mask_fun)(char*, relay_mask_t, relay_mask_t, char*); /* function to set several relays in one transfer */
+   int (*set_all_relays_fun)(char*, relay_state_t, char*);  /* function to switch all relays in one transfer */
+   int (*flush_fun)(int);                                     /* function to write pending (coalesced) changes */
+   int (*get_relay_mask_fun)(char*, relay_mask_t*, char*);   /* function to read all relays in one transfer */
    char *card_name;                                           /* card name string */
 }
 relay_data_t;
@@ -127,6 +147,8 @@ relay_data_t;
  * 
  * Return:  0 - success
  *         -1 - fail, no relay card found
+ *         -2 - fail, out of memory, the list holds the
+ *              cards found so far
  *********************************************************/
 int crelay_detect_all_relay_cards(relay_info_t** relay_info);
 
@@ -145,6 +167,56 @@ int crelay_detect_all_relay_cards(relay_info_t** relay_info);
  *********************************************************/
 int crelay_detect_relay_card(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info, relay_type_t model);
 
+/**********************************************************
+ * Function crelay_detect_first_relay_card()
+ * 
+ * Description: Detect the first relay card of the system,
+ *              in the order of crelay_detect_all_relay_cards()
+ * 
+ * Parameters: portname (out) - detected com port
+ *             num_relays(out)- pointer to number of relays
+ *             serial (out)   - serial number of the card,
+ *                              MAX_SERIAL_LEN bytes
+ * 
+ * Return:  0 - success
+ *         -1 - fail, no relay card found
+ *********************************************************/
+int crelay_detect_first_relay_card(char* portname, uint8_t* num_relays, char* serial);
+
+/**********************************************************
+ * Function crelay_set_info_arena()
+ * 
+ * Description: Allocate the relay info lists in an arena
+ *              instead of the heap, for the transient lists
+ *              of a request. The lists must be released
+ *              before the arena is reset.
+ * 
+ * Parameters: arena (in) - arena, NULL to use the heap
+ *********************************************************/
+void crelay_set_info_arena(arena_t *arena);
+
+/**********************************************************
+ * Function crelay_new_relay_info()
+ * 
+ * Description: Allocate an empty relay info list element,
+ *              used by the detect functions of the drivers.
+ *              A driver stops listing when it gets NULL.
+ * 
+ * Return:   element, NULL if out of memory
+ *********************************************************/
+relay_info_t *crelay_new_relay_info();
+
+/**********************************************************
+ * Function crelay_free_relay_info()
+ * 
+ * Description: Release a list returned by
+ *              crelay_detect_all_relay_cards(), nothing to
+ *              do when it is in the arena
+ * 
+ * Parameters: relay_info (in) - first list element
+ *********************************************************/
+void crelay_free_relay_info(relay_info_t *relay_info);
+
 /**********************************************************
  * Function crelay_get_relay()
  * 
@@ -173,6 +245,54 @@ int crelay_get_relay(char* portname, uint8_t relay, relay_state_t* relay_state,
  *********************************************************/
 int crelay_set_relay(char* portname, uint8_t relay, relay_state_t relay_state, char* serial);
 
+/**********************************************************
+ * Function crelay_get_relay_mask()
+ * 
+ * Description: Get the state of all relays of a card
+ * 
+ * Parameters: portname (in)     - communication port
+ *             num_relays (in)   - number of relays on the card
+ *             values (out)      - relay states (bit 0 is
+ *                                 relay 1, 1 = ON)
+ *             serial (in)       - serial number
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int crelay_get_relay_mask(char* portname, uint8_t num_relays, relay_mask_t* values, char* serial);
+
+/**********************************************************
+ * Function crelay_set_relay_mask()
+ * 
+ * Description: Set the state of several relays at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change (bit 0
+ *                                 is relay 1)
+ *             values (in)       - new states of the relays
+ *                                 selected by mask (1 = ON)
+ *             serial (in)       - serial number
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int crelay_set_relay_mask(char* portname, relay_mask_t mask, relay_mask_t values, char* serial);
+
+/**********************************************************
+ * Function crelay_set_all_relays()
+ * 
+ * Description: Switch all relays of a card on or off
+ * 
+ * Parameters: portname (in)     - communication port
+ *             num_relays (in)   - number of relays on the card
+ *             relay_state (in)  - new state (ON or OFF)
+ *             serial (in)       - serial number
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int crelay_set_all_relays(char* portname, uint8_t num_relays, relay_state_t relay_state, char* serial);
+
 /**********************************************************
  * Function crelay_get_relay_card_type()
  * 
@@ -195,6 +315,20 @@ relay_type_t crelay_get_relay_card_type();
  *********************************************************/
 int crelay_get_relay_card_name(relay_type_t rtype, char* card_name);
 
+/**********************************************************
+ * Function crelay_flush()
+ * 
+ * Description: Write pending relay changes of drivers which
+ *              coalesce writes
+ * 
+ * Parameters: force - 1: write all pending changes
+ *                     0: write only the changes which are due
+ * 
+ * Return:   ms until the next pending change is due
+ *          -1 - nothing pending
+ *********************************************************/
+int crelay_flush(int force);
+
 int crelay_close();
 
 int crelay_free_static_mem() ;
@@ -44,6 +44,21 @@
  * Communication protocol description
  * ==================================
  * 
+ * The card is driven through an FTDI serial port. Each relay command is
+ * a 5 byte ASCII frame:
+ * 
+ *   'R' 'L' 'Y' <n> <v>
+ * 
+ *   <n>: relay number '1'..'8'
+ *   <v>: '0' relay off, '1' relay on
+ * 
+ * Several frames can be sent back to back in one write. The card does
+ * not answer, so the relay states are memorized by the driver.
+ * 
+ * Driver operation:
+ * -----------------
+ * The FTDI context of each card stays open. A mask or all relays change
+ * sends one frame per relay in a single ftdi_write_data().
  * 
  *****************************************************************************/ 
 
@@ -55,6 +70,10 @@
 #include <libusb-1.0/libusb.h>
 
 #include "relay_drv.h"
+#include "metrics.h"
+#include "journal.h"
+#include "relay_usb.h"
+#include "relay_drv_cge8.h"
 
 #define VENDOR_ID 0x0403
 #define DEVICE_ID 0x6001
@@ -65,17 +84,30 @@
 extern config_t config;
 #endif
 
-static struct ftdi_context *ftdi = NULL;
+#define FRAME_LEN  5
+
 static uint8_t g_num_relays=CGE8_USB_NUM_RELAYS;
 
 typedef struct mem_state {
     char * serial ;
-    relay_state_t state[16] ;
+    relay_mask_t state ;             /* relays switched on */
+    struct ftdi_context *ftdi ;      /* open FTDI context, NULL if closed */
+    int restored ;                   /* state taken from the journal */
     struct mem_state *next ;
 } mem_state_t ; 
 
 static mem_state_t *all_states = NULL ;
 
+static void close_card(mem_state_t *mystate)
+{
+   if (mystate->ftdi != NULL)
+   {
+      ftdi_usb_close(mystate->ftdi);
+      ftdi_free(mystate->ftdi);
+      mystate->ftdi = NULL ;
+   }
+}
+
 int free_static_mem_cge_usb_8chan()
 {
    mem_state_t * current ;
@@ -85,6 +117,7 @@ int free_static_mem_cge_usb_8chan()
       current = all_states ;
       all_states = (mem_state_t *)all_states->next ;
 
+      close_card(current) ;
       free((char*)current->serial) ;
       free(current) ;
    }
@@ -94,17 +127,19 @@ int free_static_mem_cge_usb_8chan()
 
 int close_cge_usb_8chan()
 {
-   if (ftdi != NULL)
-   {
-      ftdi_free(ftdi);
-      ftdi = NULL ;
-   }
+   mem_state_t *mystate ;
+   
+   for (mystate = all_states; mystate != NULL; mystate = mystate->next)
+      close_card(mystate) ;
    return 0 ;
 }
 
-static void save_serial_in_state(char *serial)
+static mem_state_t *save_serial_in_state(char *serial)
 {
     mem_state_t **mystate ;
+    
+    if (serial == NULL) serial = "" ;
+    
     mystate = &all_states ;
     while ( (*mystate) != NULL)
     {
@@ -118,21 +153,29 @@ static void save_serial_in_state(char *serial)
     {
         (*mystate) = malloc(sizeof(mem_state_t));
         (*mystate)->serial = strdup(serial) ;
-        for (int k=0; k<16; k++) (*mystate)->state[k] = OFF ;
+        (*mystate)->state = 0 ;
+        (*mystate)->ftdi = NULL ;
+        (*mystate)->restored = 0 ;
         (*mystate)->next = NULL ;
     }
+    /* The card can't be read, start from the last recorded state */
+    if (!(*mystate)->restored)
+        (*mystate)->restored = (journal_restore(CGE8_USB_RELAY_TYPE, serial, &(*mystate)->state) >= 0) ;
+    return *mystate ;
 }
 
 static relay_state_t get_state(char *serial, uint8_t n_relay)
 {
     mem_state_t *mystate ;
     
+    if (serial == NULL) serial = "" ;
+    
     mystate = all_states ;
     while ( mystate != NULL)
     {
         if (!strcmp(mystate->serial, serial))
         {
-            return mystate->state[n_relay-1] ;
+            return (mystate->state & RELAY_BIT(n_relay)) ? ON : OFF ;
             break ;
         }
         mystate = (mem_state_t *)mystate->next ;
@@ -140,21 +183,103 @@ static relay_state_t get_state(char *serial, uint8_t n_relay)
     return INVALID ;
 }
 
-static void set_state(char *serial, uint8_t n_relay, relay_state_t state)
+/**********************************************************
+ * Internal function open_card()
+ * 
+ * Description: Open the FTDI context of a card if it is not
+ *              open yet.
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+static int open_card(mem_state_t *mystate, unsigned int *chipid)
 {
-    mem_state_t *mystate ;
+   char *serial = (mystate->serial[0] != 0) ? mystate->serial : NULL ;
+   uint64_t t0;
+   int r;
+   
+   if (mystate->ftdi != NULL)
+   {
+      if (chipid) ftdi_read_chipid(mystate->ftdi, chipid);
+      return 0;
+   }
+   
+   if ((mystate->ftdi = ftdi_new()) == 0)
+   {
+      fprintf(stderr, "ftdi_new failed\n");
+      return -1;
+   }
+   
+   /* Try to open FTDI USB device */
+   t0 = metrics_now();
+   r = ftdi_usb_open_desc(mystate->ftdi, VENDOR_ID, DEVICE_ID, NULL, serial);
+   metrics_card(CGE8_USB_RELAY_TYPE, serial, METRICS_CARD_OPEN, metrics_now() - t0, r < 0);
+   if (r < 0)
+   {
+      ftdi_free(mystate->ftdi);
+      mystate->ftdi = NULL ;
+      return -1;
+   }
     
-    mystate = all_states ;
-    while ( mystate != NULL)
-    {
-        if (!strcmp(mystate->serial, serial))
-        {
-            mystate->state[n_relay-1] = state ;
-            break ;
+   /* Check if this is an R type chip */
+   if (mystate->ftdi->type != TYPE_R)
+   {
+      fprintf(stderr, "unable to continue, not an R-type chip\n");
+      close_card(mystate) ; 
+      return -1;
+   }
+   
+   /* Read out FTDI Chip-ID of R type chips */
+   if (chipid) ftdi_read_chipid(mystate->ftdi, chipid);
+   
+   return 0;
+}
 
-        }
-        mystate = (mem_state_t *)mystate->next ;
-    }
+/**********************************************************
+ * Internal function write_frames()
+ * 
+ * Description: Write the changes of several relays of a
+ *              card in a single transfer
+ * 
+ * Parameters: mystate (in) - card
+ *             mask (in)    - relays to change
+ *             values (in)  - new relay states (1 = ON)
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+static int write_frames(mem_state_t *mystate, relay_mask_t mask, relay_mask_t values)
+{
+   unsigned char buf[MAX_NUM_RELAYS*FRAME_LEN];
+   int len = 0;
+   int k;
+   
+   /* Build one 'RLY<n><v>' frame per changed relay */
+   for (k=0; k<g_num_relays; k++)
+   {
+      if (!(mask & RELAY_BIT(k+1))) continue;
+      buf[len++] = 'R';
+      buf[len++] = 'L';
+      buf[len++] = 'Y';
+      buf[len++] = '1' + k;
+      buf[len++] = (values & RELAY_BIT(k+1)) ? '1' : '0';
+   }
+   
+   if (open_card(mystate, NULL) < 0)
+   {
+      fprintf(stderr, "unable to open ftdi device\n");
+      return -2;
+   }
+   if (ftdi_write_data(mystate->ftdi, buf, len) < 0)
+   {
+      fprintf(stderr,"write failed for %.*s, error %s\n", len, buf, ftdi_get_error_string(mystate->ftdi));
+      close_card(mystate);
+      return -4;
+   }
+   
+   mystate->state = (mystate->state & ~mask) | (values & mask);
+   journal_record(CGE8_USB_RELAY_TYPE, mystate->serial, mask, values);
+   return 0;
 }
 
 /**********************************************************
@@ -183,7 +308,7 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
    
    // Get a list of all connected USB devices
    //printf("libusb_get_device_list()\n");
-   devnum = libusb_get_device_list(NULL, &devices);
+   devnum = libusb_get_device_list(relay_usb_context(), &devices);
    //printf("devnum=%d\n", (int)devnum);
    
    if (devnum <= LIBUSB_SUCCESS)
@@ -247,13 +372,16 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
       if (relay_info != NULL)
       {
          //printf("Device %d; save serial\n", i);
+         // Allocate new struct, stop listing when out of memory
+         if ((rinfo = crelay_new_relay_info()) == NULL)
+         {
+            libusb_close(dev);
+            break;
+         }
          // Save serial number and type in current relay info struct
          (*relay_info)->relay_type = CGE8_USB_RELAY_TYPE;
          (*relay_info)->num_relays = g_num_relays ;
          strcpy((*relay_info)->serial, (char *)sernum);
-         // Allocate new struct
-         rinfo = malloc(sizeof(relay_info_t));
-         rinfo->next = NULL;
          // Link current to new struct
          (*relay_info)->next = rinfo;
          // Move pointer to new struct
@@ -298,46 +426,23 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
  *********************************************************/
 int detect_relay_card_cge_usb_8chan(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info)
 {
-    unsigned int chipid;
+   unsigned int chipid;
+   mem_state_t *mystate;
    
    /* Find all connected devices, if requested */
    if (relay_info)
    { 
-      libusb_init(NULL);
       open_device_with_vid_pid_serial(VENDOR_ID, DEVICE_ID, NULL, relay_info);
-      libusb_exit(NULL);
       return -1;
    }
    
-   close_cge_usb_8chan() ; 
-
-   if ((ftdi = ftdi_new()) == 0)
+   /* Open the card, or reuse it if it is already open */
+   mystate = save_serial_in_state(serial) ;
+   if (open_card(mystate, &chipid) < 0)
    {
-      fprintf(stderr, "ftdi_new failed\n");
       return -1;
    }
    
-   /* Try to open FTDI USB device */
-   if ((ftdi_usb_open_desc(ftdi, VENDOR_ID, DEVICE_ID, NULL, serial)) < 0)
-   {
-      close_cge_usb_8chan() ; 
-      return -1;
-   }
-    
-   /* Check if this is an R type chip */
-   if (ftdi->type != TYPE_R)
-   {
-      fprintf(stderr, "unable to continue, not an R-type chip\n");
-      ftdi_usb_close(ftdi);
-      close_cge_usb_8chan() ; 
-      return -1;
-   }
-   
-   /* Read out FTDI Chip-ID of R type chips */
-   ftdi_read_chipid(ftdi, &chipid);
-   
-   save_serial_in_state(serial) ;
-   
    /* Return parameters */
    if (num_relays) 
       *num_relays = g_num_relays;
@@ -345,8 +450,6 @@ int detect_relay_card_cge_usb_8chan(char* portname, uint8_t* num_relays, char* s
       sprintf(portname, "FTDI chipid %X", chipid);
    //printf("DBG: portname %s\n", portname);
    
-   ftdi_usb_close(ftdi);
-   
    return 0;
 }
 
@@ -384,42 +487,80 @@ int get_relay_cge_usb_8chan(char* portname, uint8_t relay, relay_state_t* relay_
  *********************************************************/
 int set_relay_cge_usb_8chan(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
 {
-   unsigned char buf[10];
-   
    if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
    {  
       fprintf(stderr, "ERROR: Relay number out of range\n");
       return -1;      
    }
    
-   /* Open FTDI USB device */
-   if ((ftdi_usb_open_desc(ftdi, VENDOR_ID, DEVICE_ID, NULL, serial)) < 0)
-   {
-      fprintf(stderr, "unable to open ftdi device: (%s)\n", ftdi_get_error_string(ftdi));
-      return -2;
-   }
+   return set_relay_mask_cge_usb_8chan(portname, RELAY_BIT(relay), (relay_state == OFF) ? 0 : RELAY_BIT(relay), serial);
+}
+
 
-   buf[0] = 0x52;
-   buf[1] = 0x4C;
-   buf[2] = 0x59;
-   buf[3] = (0x30 + relay);
-   if (relay_state == OFF)
-      buf[4] = 0x30;
-   else
-      buf[4] = 0x31;
-   buf[5] = '\0';
-
-//   fprintf(stderr,"write %s\n",buf);
-   /* Set relay on the card */
-   if (ftdi_write_data(ftdi, buf, 5) < 0)
+/**********************************************************
+ * Function get_relay_mask_cge_usb_8chan()
+ * 
+ * Description: Get the state of all relays
+ * 
+ * Parameters: portname (in)     - communication port
+ *             values (out)      - relay states (1 = ON)
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int get_relay_mask_cge_usb_8chan(char* portname, relay_mask_t* values, char* serial)
+{
+   relay_mask_t mask = 0 ;
+   relay_state_t state ;
+   
+   for (int k=0; k<g_num_relays; k++)
    {
-      fprintf(stderr,"write failed for %s, error %s\n",buf, ftdi_get_error_string(ftdi));
-      return -4;
+      if ((state = get_state(serial, k+1)) == INVALID)
+         return -1;
+      if (state == ON) mask |= RELAY_BIT(k+1) ;
    }
-   
-   set_state(serial,relay,relay_state) ;
-   
-   ftdi_usb_close(ftdi);
+   *values = mask ;
    return 0;
 }
 
+
+/**********************************************************
+ * Function set_relay_mask_cge_usb_8chan()
+ * 
+ * Description: Set the state of several relays, all frames
+ *              go out in one write
+ * 
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change
+ *             values (in)       - new relay states (1 = ON)
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int set_relay_mask_cge_usb_8chan(char* portname, relay_mask_t mask, relay_mask_t values, char* serial)
+{
+   mask &= RELAY_MASK_ALL(g_num_relays);
+   if (mask == 0)
+      return 0;
+   
+   return write_frames(save_serial_in_state(serial), mask, values);
+}
+
+
+/**********************************************************
+ * Function set_all_relays_cge_usb_8chan()
+ * 
+ * Description: Switch all relays on or off in one write
+ * 
+ * Parameters: portname (in)     - communication port
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int set_all_relays_cge_usb_8chan(char* portname, relay_state_t relay_state, char* serial)
+{
+   relay_mask_t all = RELAY_MASK_ALL(g_num_relays);
+   
+   return set_relay_mask_cge_usb_8chan(portname, all, (relay_state == OFF) ? 0 : all, serial);
+}
@@ -82,6 +82,7 @@
 #include <libusb-1.0/libusb.h>
 
 #include "relay_drv.h"
+#include "relay_usb.h"
 
 /* USB IDs */
 #define VENDOR_ID 0x10C4
@@ -138,7 +139,7 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
    relay_info_t* rinfo;
 
    // Get a list of all connected USB devices
-   devnum = libusb_get_device_list(NULL, &devices);
+   devnum = libusb_get_device_list(relay_usb_context(), &devices);
    if (devnum <= LIBUSB_SUCCESS)
    {
       if (devnum == LIBUSB_SUCCESS)
@@ -205,12 +206,15 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
       if (relay_info != NULL)
       {
          //printf("Device %d; save serial\n", i);
+         // Allocate new struct, stop listing when out of memory
+         if ((rinfo = crelay_new_relay_info()) == NULL)
+         {
+            libusb_close(dev);
+            break;
+         }
          // Save serial number and type in current relay info struct
          (*relay_info)->relay_type = CONRAD_4CHANNEL_USB_RELAY_TYPE;
          strcpy((*relay_info)->serial, (char *)sernum);
-         // Allocate new struct
-         rinfo = malloc(sizeof(relay_info_t));
-         rinfo->next = NULL;
          // Link current to new struct
          (*relay_info)->next = rinfo;
          // Move pointer to new struct
@@ -258,13 +262,10 @@ int detect_relay_card_conrad_4chan(char* portname, uint8_t* num_relays, char* se
    else
       sernum[0]=0;
    
-   libusb_init(NULL);
-
    /* Try to open Conrad CP2104 USB device */
    dev = open_device_with_vid_pid_serial(VENDOR_ID, DEVICE_ID, sernum, relay_info);
    if (dev == NULL)
    {
-      libusb_exit(NULL);
       return -1;
    }
    
@@ -275,7 +276,6 @@ int detect_relay_card_conrad_4chan(char* portname, uint8_t* num_relays, char* se
    if (num_relays!=NULL) *num_relays = CONRAD_4CHANNEL_USB_NUM_RELAYS;
    sprintf(portname, "Serial number %s", sernum);
    libusb_close(dev);
-   libusb_exit(NULL);
       
    return 0;
 }
@@ -304,8 +304,6 @@ int get_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t* relay_s
       fprintf(stderr, "ERROR: Relay number out of range\n");
       return -1;      
    }
-
-   libusb_init(NULL);
    
    /* Open USB device */
    //r = libusb_open(device, &dev);
@@ -314,12 +312,11 @@ int get_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t* relay_s
    if (dev == NULL)
    {
       fprintf(stderr, "unable to open CP2104 device\n");
-      libusb_exit(NULL);
       return -2;
    }
    
    /* Get relay state from the card */ 
-   r = libusb_control_transfer (
+   r = relay_usb_control (
                 dev,                    // libusb_device_handle *  dev_handle,
                 REQTYPE_DEVICE_TO_HOST, // uint8_t         bmRequestType,
                 CP210X_VENDOR_SPECIFIC, // uint8_t         bRequest,
@@ -331,9 +328,8 @@ int get_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t* relay_s
 
    if (r < 0) 
    {
-      fprintf(stderr, "libusb_control_transfer error (%s)\n", libusb_error_name(r));
+      fprintf(stderr, "control transfer error (%s)\n", libusb_error_name(r));
       libusb_close(dev);
-      libusb_exit(NULL);
       return -3;
    }
 
@@ -341,7 +337,6 @@ int get_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t* relay_s
    *relay_state = (gpio & (0x0001<<relay)) ? OFF : ON;
       
    libusb_close(dev);
-   libusb_exit(NULL);
    return 0;
 }
 
@@ -370,8 +365,6 @@ int set_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t relay_st
       return -1;      
    }
    
-   libusb_init(NULL);
-   
    /* Open USB device */
    //r = libusb_open(device, &dev);
    //if (r < 0)
@@ -379,7 +372,6 @@ int set_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t relay_st
    if (dev == NULL)
    {
       fprintf(stderr, "unable to open CP2104 device\n");
-      libusb_exit(NULL);
       return -2;
    }
    
@@ -391,7 +383,111 @@ int set_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t relay_st
    gpio = gpio | (0x0001<<relay);
 
    /* Set relay state on the card */ 
-   r = libusb_control_transfer (
+   r = relay_usb_control (
+                dev,                    // libusb_device_handle *  dev_handle,
+                REQTYPE_HOST_TO_DEVICE, // uint8_t         bmRequestType,
+                CP210X_VENDOR_SPECIFIC, // uint8_t         bRequest,
+                CP210X_WRITE_LATCH,     // uint16_t        wValue,
+                gpio,                   // uint16_t        wIndex,
+                NULL,                   // unsigned char * data,
+                0,                      // uint16_t        wLength,
+                0);                     // unsigned int    timeout
+   
+   if (r < 0) 
+   {
+      fprintf(stderr, "control transfer error (%s)\n", libusb_error_name(r));
+      libusb_close(dev);
+      return -3;
+   }
+
+   libusb_close(dev);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function get_relay_mask_conrad_4chan()
+ * 
+ * Description: Get the state of all relays with one
+ *              read of the GPIO latch
+ * 
+ * Parameters: portname (in)     - communication port
+ *             values (out)      - relay states (1 = ON)
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int get_relay_mask_conrad_4chan(char* portname, relay_mask_t* values, char* serial)
+{
+   struct libusb_device_handle *dev = NULL; 
+   int r;  
+   uint8_t gpio=0;
+   
+   /* Open USB device */
+   dev = open_device_with_vid_pid_serial(VENDOR_ID, DEVICE_ID, serial, NULL);
+   if (dev == NULL)
+   {
+      fprintf(stderr, "unable to open CP2104 device\n");
+      return -2;
+   }
+   
+   /* Get relay states from the card */ 
+   r = relay_usb_control(dev, REQTYPE_DEVICE_TO_HOST, CP210X_VENDOR_SPECIFIC, CP210X_READ_LATCH, 
+                         0, &gpio, 1, 0);
+   if (r < 0) 
+   {
+      fprintf(stderr, "control transfer error (%s)\n", libusb_error_name(r));
+      libusb_close(dev);
+      return -3;
+   }
+
+   /* The GPIO outputs are active low */
+   *values = ~gpio & RELAY_MASK_ALL(CONRAD_4CHANNEL_USB_NUM_RELAYS);
+      
+   libusb_close(dev);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_mask_conrad_4chan()
+ * 
+ * Description: Set the state of several relays with one
+ *              write latch request
+ * 
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change
+ *             values (in)       - new relay states (1 = ON)
+ *             serial (in)       - serial number
+ * 
+ * Return:   o - success
+ *          -1 - fail
+ *********************************************************/
+int set_relay_mask_conrad_4chan(char* portname, relay_mask_t mask, relay_mask_t values, char* serial)
+{
+   struct libusb_device_handle *dev = NULL; 
+   int r;  
+   uint16_t gpio=0;
+   
+   mask &= RELAY_MASK_ALL(CONRAD_4CHANNEL_USB_NUM_RELAYS);
+   if (mask == 0)
+   {
+      return 0;
+   }
+   
+   /* Open USB device */
+   dev = open_device_with_vid_pid_serial(VENDOR_ID, DEVICE_ID, serial, NULL);
+   if (dev == NULL)
+   {
+      fprintf(stderr, "unable to open CP2104 device\n");
+      return -2;
+   }
+   
+   /* Relay state bits are active low, relay bit mask selects the relays to change */
+   gpio = ((~values & mask) << RSTATES_BITOFFSET) | mask;
+
+   /* Set relay states on the card */ 
+   r = relay_usb_control (
                 dev,                    // libusb_device_handle *  dev_handle,
                 REQTYPE_HOST_TO_DEVICE, // uint8_t         bmRequestType,
                 CP210X_VENDOR_SPECIFIC, // uint8_t         bRequest,
@@ -403,13 +499,11 @@ int set_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t relay_st
    
    if (r < 0) 
    {
-      fprintf(stderr, "libusb_control_transfer error (%s)\n", libusb_error_name(r));
+      fprintf(stderr, "control transfer error (%s)\n", libusb_error_name(r));
       libusb_close(dev);
-      libusb_exit(NULL);
       return -3;
    }
 
    libusb_close(dev);
-   libusb_exit(NULL);
    return 0;
 }
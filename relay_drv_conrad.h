@@ -77,6 +77,33 @@ int get_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t* relay_s
  *********************************************************/
 int set_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t relay_state, char* serial);
 
+/**********************************************************
+ * Function get_relay_mask_conrad_4chan()
+ * 
+ * Description: Get the state of all relays at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             values (out)      - relay states (1 = ON)
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int get_relay_mask_conrad_4chan(char* portname, relay_mask_t* values, char* serial);
+
+/**********************************************************
+ * Function set_relay_mask_conrad_4chan()
+ * 
+ * Description: Set the state of several relays at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change
+ *             values (in)       - new relay states (1 = ON)
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int set_relay_mask_conrad_4chan(char* portname, relay_mask_t mask, relay_mask_t values, char* serial);
+
 int close_conrad_4chan() ;
 
 int free_static_mem_conrad_4chan() ;
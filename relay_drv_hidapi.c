@@ -108,6 +108,8 @@
 
 static uint8_t g_num_relays=HID_API_NUM_RELAYS;
 
+int set_all_relays_hidapi(char* portname, relay_state_t relay_state, char* serial);
+
 int close_hidapi() 
 {
    return 0 ;
@@ -179,12 +181,14 @@ int detect_relay_card_hidapi(char* portname, uint8_t* num_relays, char* serial,
       
       if (relay_info != NULL)
       {
+         // Allocate new struct, stop listing when out of memory
+         if ((rinfo = crelay_new_relay_info()) == NULL)
+         {
+            break;
+         }
          // Save serial number and type in current relay info struct
          (*relay_info)->relay_type = HID_API_RELAY_TYPE;
          strcpy((*relay_info)->serial, (char *)buf);
-         // Allocate new struct
-         rinfo = malloc(sizeof(relay_info_t));
-         rinfo->next = NULL;
          // Link current to new struct
          (*relay_info)->next = rinfo;
          // Move pointer to new struct
@@ -314,3 +318,137 @@ int set_relay_hidapi(char* portname, uint8_t relay, relay_state_t relay_state, c
    hid_close(hid_dev);
    return 0;
 }
+
+
+/**********************************************************
+ * Function get_relay_mask_hidapi()
+ * 
+ * Description: Get the state of all relays with one
+ *              feature report
+ * 
+ * Parameters: portname (in)     - communication port
+ *             values (out)      - relay states (1 = ON)
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int get_relay_mask_hidapi(char* portname, relay_mask_t* values, char* serial)
+{
+   hid_device *hid_dev;
+   unsigned char buf[REPORT_LEN];  
+
+   /* Open HID API device */
+   if ((hid_dev = hid_open_path(portname)) == NULL)
+   {
+      fprintf(stderr, "unable to open HID API device %s\n", portname);
+      return -2;
+   }
+
+   /* Read relay states requesting a feature report with Id 0x01 */
+   buf[0] = 0x01;
+   if (hid_get_feature_report(hid_dev, buf, sizeof(buf)) != REPORT_LEN)
+   {
+      fprintf(stderr, "unable to read feature report from device %s (%ls)\n", portname, hid_error(hid_dev));
+      hid_close(hid_dev);
+      return -3;
+   }
+   *values = buf[REPORT_RDDAT_OFFSET];
+   
+   hid_close(hid_dev);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_mask_hidapi()
+ * 
+ * Description: Set the state of several relays over one
+ *              device session. If all relays get the same
+ *              state the all on/off command is used.
+ * 
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change
+ *             values (in)       - new relay states (1 = ON)
+ *             serial (in)       - serial number [not used]
+ *
+ * Return:   o - success
+ *          -1 - fail
+ *********************************************************/
+int set_relay_mask_hidapi(char* portname, relay_mask_t mask, relay_mask_t values, char* serial)
+{ 
+   hid_device *hid_dev;
+   unsigned char buf[REPORT_LEN];  
+   relay_mask_t all = RELAY_MASK_ALL(g_num_relays);
+   uint8_t relay;
+
+   mask &= all;
+   if (mask == all && ((values & all) == all || (values & all) == 0))
+   {
+      return set_all_relays_hidapi(portname, (values & all) ? ON : OFF, serial);
+   }
+
+   /* Open HID API device */
+   if ((hid_dev = hid_open_path(portname)) == NULL)
+   {
+      fprintf(stderr, "unable to open HID API device %s\n", portname);
+      return -2;
+   }
+
+   for (relay=FIRST_RELAY; relay<FIRST_RELAY+g_num_relays; relay++)
+   {
+      if (!(mask & (1<<(relay-1))))
+         continue;
+      
+      memset(buf, 0, sizeof(buf));
+      buf[REPORT_WRCMD_OFFSET] = (values & (1<<(relay-1))) ? CMD_ON : CMD_OFF;
+      buf[REPORT_WRREL_OFFSET] = relay;
+      if (hid_write(hid_dev, buf, sizeof(buf)) < 0)
+      {
+         fprintf(stderr, "unable to write output report to device %s (%ls)\n", portname, hid_error(hid_dev));
+         hid_close(hid_dev);
+         return -3;
+      }
+   }
+   
+   hid_close(hid_dev);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_all_relays_hidapi()
+ * 
+ * Description: Switch all relays on or off with a single
+ *              output report
+ * 
+ * Parameters: portname (in)     - communication port
+ *             relay_state (in)  - new relay state
+ *             serial (in)       - serial number [not used]
+ *
+ * Return:   o - success
+ *          -1 - fail
+ *********************************************************/
+int set_all_relays_hidapi(char* portname, relay_state_t relay_state, char* serial)
+{ 
+   hid_device *hid_dev;
+   unsigned char buf[REPORT_LEN];  
+
+   /* Open HID API device */
+   if ((hid_dev = hid_open_path(portname)) == NULL)
+   {
+      fprintf(stderr, "unable to open HID API device %s\n", portname);
+      return -2;
+   }
+
+   memset(buf, 0, sizeof(buf));
+   buf[REPORT_WRCMD_OFFSET] = (relay_state==ON) ? CMD_ALL_ON : CMD_ALL_OFF;
+   if (hid_write(hid_dev, buf, sizeof(buf)) < 0)
+   {
+      fprintf(stderr, "unable to write output report to device %s (%ls)\n", portname, hid_error(hid_dev));
+      hid_close(hid_dev);
+      return -3;
+   }
+   
+   hid_close(hid_dev);
+   return 0;
+}
@@ -79,6 +79,46 @@ int get_relay_hidapi(char* portname, uint8_t relay, relay_state_t* relay_state,
  *********************************************************/
 int set_relay_hidapi(char* portname, uint8_t relay, relay_state_t relay_state, char* serial);
 
+/**********************************************************
+ * Function get_relay_mask_hidapi()
+ * 
+ * Description: Get the state of all relays at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             values (out)      - relay states (1 = ON)
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int get_relay_mask_hidapi(char* portname, relay_mask_t* values, char* serial);
+
+/**********************************************************
+ * Function set_relay_mask_hidapi()
+ * 
+ * Description: Set the state of several relays at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change
+ *             values (in)       - new relay states (1 = ON)
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int set_relay_mask_hidapi(char* portname, relay_mask_t mask, relay_mask_t values, char* serial);
+
+/**********************************************************
+ * Function set_all_relays_hidapi()
+ * 
+ * Description: Switch all relays on or off at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int set_all_relays_hidapi(char* portname, relay_state_t relay_state, char* serial);
+
 int close_hidapi() ;
 
 int free_static_mem_hidapi() ;
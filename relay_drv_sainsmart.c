@@ -63,16 +63,29 @@
  *  0: NO contact open, NC contact closed, led is off
  *  1: NO contact closed, NC contact open, led is on
  * 
+ * Driver operation:
+ * -----------------
+ * The FTDI context of each card is kept open in bitbang mode once its
+ * relays are accessed and the output byte is kept as shadow, so a relay
+ * change is a single one byte write. The CGE8 cards have the same
+ * VID/PID, detection only probes a card and closes it again. With [Sainsmart drv] coalesce_ms > 0 the write is delayed by up
+ * to that time and all relay changes done meanwhile go out in the same
+ * write (see flush_sainsmart_4_8chan()).
+ * 
  *****************************************************************************/ 
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <ftdi.h>
 #include <libusb-1.0/libusb.h>
 
 #include "relay_drv.h"
+#include "metrics.h"
+#include "relay_usb.h"
+#include "relay_drv_sainsmart.h"
 
 #define VENDOR_ID 0x0403
 #define DEVICE_ID 0x6001
@@ -83,25 +96,320 @@
 extern config_t config;
 #endif
 
-static struct ftdi_context *ftdi = NULL;
+/* Latency timer (ms) and write chunk size for single byte writes */
+#define FTDI_LATENCY_MS   1
+#define FTDI_CHUNK_SIZE   64
+
+/* Open card */
+typedef struct ftdi_card
+{
+   char *serial;                  /* serial number, "" for first card found */
+   struct ftdi_context *ftdi;     /* open FTDI context in bitbang mode */
+   unsigned int chipid;           /* FTDI chip id */
+   uint8_t shadow;                /* relay output byte */
+   uint8_t dirty;                 /* shadow not yet written to the card */
+   struct timespec dirty_since;   /* time of first unwritten change */
+   struct ftdi_card *next;
+} ftdi_card_t;
+
+static ftdi_card_t *all_cards = NULL;
 static uint8_t g_num_relays=SAINSMART_USB_NUM_RELAYS;
+static unsigned int g_coalesce_ms=0;
 
 
-int free_static_mem_sainsmart_4_8chan()
+static long elapsed_ms(struct timespec *since)
 {
-    return 0 ;
+   struct timespec now;
+   
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - since->tv_sec)*1000 + (now.tv_nsec - since->tv_nsec)/1000000;
 }
 
-int close_sainsmart_4_8chan()
+/**********************************************************
+ * Internal function drop_card()
+ * 
+ * Description: Close the FTDI context of a card, it will be
+ *              opened again on next access
+ *********************************************************/
+static void drop_card(ftdi_card_t *card)
 {
-   if (ftdi != NULL)
+   if (card->ftdi != NULL)
    {
+      ftdi_usb_close(card->ftdi);
+      ftdi_free(card->ftdi);
+      card->ftdi = NULL;
+   }
+   card->dirty = 0;
+}
+
+/**********************************************************
+ * Internal function write_card()
+ * 
+ * Description: Write the shadow byte to the card
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+static int write_card(ftdi_card_t *card)
+{
+   unsigned char buf[1];
+   
+   buf[0] = card->shadow;
+   //printf("DBG: Writing GPIO bits %02X\n", buf[0]);
+   if (ftdi_write_data(card->ftdi, buf, 1) < 0)
+   {
+      fprintf(stderr,"write failed for 0x%x, error %s\n",buf[0], ftdi_get_error_string(card->ftdi));
+      drop_card(card);
+      return -4;
+   }
+   card->dirty = 0;
+   return 0;
+}
+
+/**********************************************************
+ * Internal function update_card()
+ * 
+ * Description: Write the shadow byte to the card now or,
+ *              if write coalescing is enabled, when the
+ *              coalescing window of the first pending
+ *              change has expired
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+static int update_card(ftdi_card_t *card)
+{
+   if (g_coalesce_ms == 0)
+   {
+      return write_card(card);
+   }
+   
+   if (!card->dirty)
+   {
+      card->dirty = 1;
+      clock_gettime(CLOCK_MONOTONIC, &card->dirty_since);
+   }
+   else if (elapsed_ms(&card->dirty_since) >= g_coalesce_ms)
+   {
+      return write_card(card);
+   }
+   return 0;
+}
+
+/**********************************************************
+ * Internal function open_ftdi()
+ * 
+ * Description: Open the FTDI USB device with the given serial
+ *              number and check that it is an R type chip
+ * 
+ * Parameters: serial (in) - serial number, NULL for the
+ *                           first card found
+ * 
+ * Return:   FTDI context - success
+ *           NULL         - fail
+ *********************************************************/
+static struct ftdi_context *open_ftdi(char *serial)
+{
+   struct ftdi_context *ftdi;
+   uint64_t t0;
+   int r;
+   
+   if ((ftdi = ftdi_new()) == 0)
+   {
+      fprintf(stderr, "ftdi_new failed\n");
+      return NULL;
+   }
+   
+   /* Try to open FTDI USB device */
+   t0 = metrics_now();
+   r = ftdi_usb_open_desc(ftdi, VENDOR_ID, DEVICE_ID, NULL, serial);
+   metrics_card(SAINSMART_USB_RELAY_TYPE, serial, METRICS_CARD_OPEN, metrics_now() - t0, r < 0);
+   if (r < 0)
+   {
+      ftdi_free(ftdi);
+      return NULL;
+   }
+    
+   /* Check if this is an R type chip */
+   if (ftdi->type != TYPE_R)
+   {
+      fprintf(stderr, "unable to continue, not an R-type chip\n");
+      ftdi_usb_close(ftdi);
+      ftdi_free(ftdi);
+      return NULL;
+   }
+   return ftdi;
+}
+
+#ifndef BUILD_LIB
+/**********************************************************
+ * Internal function other_model()
+ * 
+ * Description: Check if a board with the given serial number
+ *              is configured for another card model, such a
+ *              card is not probed
+ *********************************************************/
+static int other_model(const char *serial)
+{
+   card_info_t *board;
+   
+   for (board = config.card_list; board != NULL; board = board->next)
+   {
+      if (board->serial != NULL && !strcmp(board->serial, serial) &&
+          board->model != NO_RELAY_TYPE && board->model != SAINSMART_USB_RELAY_TYPE)
+         return 1;
+   }
+   return 0;
+}
+#endif
+
+/**********************************************************
+ * Internal function find_card()
+ * 
+ * Description: Return the card with the given serial number
+ *              if it has been opened before
+ *********************************************************/
+static ftdi_card_t *find_card(const char *key)
+{
+   ftdi_card_t *card;
+   
+   for (card = all_cards; card != NULL; card = card->next)
+   {
+      if (!strcmp(card->serial, key))
+         break;
+   }
+   return card;
+}
+
+/**********************************************************
+ * Internal function open_card()
+ * 
+ * Description: Return the card with the given serial number,
+ *              open it and set it to bitbang mode if not yet
+ *              done. Only called to access the relays, the
+ *              card type is known then.
+ * 
+ * Parameters: serial (in) - serial number, NULL for the
+ *                           first card found
+ * 
+ * Return:   card - success
+ *           NULL - fail
+ *********************************************************/
+static ftdi_card_t *open_card(char *serial)
+{
+   ftdi_card_t *card;
+   struct ftdi_context *ftdi;
+   const char *key = (serial != NULL) ? serial : "";
+   unsigned char buf[1];
+   
+   card = find_card(key);
+   if (card != NULL && card->ftdi != NULL)
+   {
+      return card;
+   }
+   
+   if ((ftdi = open_ftdi(serial)) == NULL)
+   {
+      return NULL;
+   }
+   
+   /* Set FTDI chip to bitbang mode, once for the lifetime of the context */
+   if (ftdi_set_bitmode(ftdi, 0xFF, BITMODE_BITBANG) < 0)
+   {
+      fprintf(stderr, "unable to set bitbang mode: (%s)\n", ftdi_get_error_string(ftdi));
+      ftdi_usb_close(ftdi);
       ftdi_free(ftdi);
-      ftdi = NULL ;
+      return NULL;
+   }
+   
+   /* Tune for single byte transfers */
+   ftdi_set_latency_timer(ftdi, FTDI_LATENCY_MS);
+   ftdi_write_data_set_chunksize(ftdi, FTDI_CHUNK_SIZE);
+   
+   /* Initialize the shadow byte with the current relay states */
+   if (ftdi_read_pins(ftdi, buf) < 0)
+   {
+      fprintf(stderr,"read failed, error %s\n", ftdi_get_error_string(ftdi));
+      ftdi_usb_close(ftdi);
+      ftdi_free(ftdi);
+      return NULL;
+   }
+   
+   /* Remember the card once it is open */
+   if (card == NULL)
+   {
+      if ((card = malloc(sizeof(ftdi_card_t))) == NULL ||
+          (card->serial = strdup(key)) == NULL)
+      {
+         free(card);
+         ftdi_usb_close(ftdi);
+         ftdi_free(ftdi);
+         return NULL;
+      }
+      card->next = all_cards;
+      all_cards = card;
+   }
+   card->ftdi = ftdi;
+   card->dirty = 0;
+   card->shadow = buf[0];
+   
+   /* Read out FTDI Chip-ID of R type chips */
+   ftdi_read_chipid(ftdi, &card->chipid);
+   
+   return card;
+}
+
+
+int flush_sainsmart_4_8chan(int force)
+{
+   ftdi_card_t *card;
+   long left;
+   int next = -1;
+   
+   for (card = all_cards; card != NULL; card = card->next)
+   {
+      if (!card->dirty || card->ftdi == NULL)
+         continue;
+      
+      left = g_coalesce_ms - elapsed_ms(&card->dirty_since);
+      if (force || left <= 0)
+      {
+         write_card(card);
+      }
+      else if (next < 0 || left < next)
+      {
+         next = left;
+      }
+   }
+   return next;
+}
+
+int close_sainsmart_4_8chan()
+{
+   ftdi_card_t *card;
+   
+   flush_sainsmart_4_8chan(1);
+   for (card = all_cards; card != NULL; card = card->next)
+   {
+      drop_card(card);
    }
    return 0 ;
 }
 
+int free_static_mem_sainsmart_4_8chan()
+{
+   ftdi_card_t *card;
+   
+   close_sainsmart_4_8chan();
+   while (all_cards != NULL)
+   {
+      card = all_cards;
+      all_cards = all_cards->next;
+      free(card->serial);
+      free(card);
+   }
+   return 0 ;
+}
 
 
 /**********************************************************
@@ -130,7 +438,7 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
    
    // Get a list of all connected USB devices
    //printf("libusb_get_device_list()\n");
-   devnum = libusb_get_device_list(NULL, &devices);
+   devnum = libusb_get_device_list(relay_usb_context(), &devices);
    //printf("devnum=%d\n", (int)devnum);
    
    if (devnum <= LIBUSB_SUCCESS)
@@ -194,13 +502,16 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
       if (relay_info != NULL)
       {
          //printf("Device %d; save serial\n", i);
+         // Allocate new struct, stop listing when out of memory
+         if ((rinfo = crelay_new_relay_info()) == NULL)
+         {
+            libusb_close(dev);
+            break;
+         }
          // Save serial number and type in current relay info struct
          (*relay_info)->relay_type = SAINSMART_USB_RELAY_TYPE;
          (*relay_info)->num_relays = 4 ;         // TODO : DISTINGUER 4 et 8 relais
          strcpy((*relay_info)->serial, (char *)sernum);
-         // Allocate new struct
-         rinfo = malloc(sizeof(relay_info_t));
-         rinfo->next = NULL;
          // Link current to new struct
          (*relay_info)->next = rinfo;
          // Move pointer to new struct
@@ -243,53 +554,42 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
  *********************************************************/
 int detect_relay_card_sainsmart_4_8chan(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info)
 {
-    unsigned int chipid;
+   ftdi_card_t *card;
+   struct ftdi_context *ftdi;
+   unsigned int chipid;
    
    /* Find all connected devices, if requested */
    if (relay_info)
    { 
-      libusb_init(NULL);
       open_device_with_vid_pid_serial(VENDOR_ID, DEVICE_ID, NULL, relay_info);
-      libusb_exit(NULL);
       return -1;
    }
    
-   close_sainsmart_4_8chan() ; 
-
-   if ((ftdi = ftdi_new()) == 0)
+#ifndef BUILD_LIB
+   if (serial != NULL && other_model(serial))
    {
-      fprintf(stderr, "ftdi_new failed\n");
       return -1;
    }
+#endif
    
-   /* Try to open FTDI USB device */
-   if ((ftdi_usb_open_desc(ftdi, VENDOR_ID, DEVICE_ID, NULL, serial)) < 0)
+   /* Reuse the card if it is already open. Otherwise only probe it,
+      other drivers use the same VID/PID and must be able to open
+      their cards. */
+   if ((card = find_card((serial != NULL) ? serial : "")) != NULL && card->ftdi != NULL)
    {
-      close_sainsmart_4_8chan() ; 
-      return -1;
+      chipid = card->chipid;
    }
-    
-   /* Set FTDI chip to bitbang mode */
-   if (ftdi_set_bitmode(ftdi, 0xFF, BITMODE_BITBANG) < 0)
+   else if ((ftdi = open_ftdi(serial)) != NULL)
    {
-      fprintf(stderr, "unable to set bitbang mode: (%s)\n", ftdi_get_error_string(ftdi));
+      ftdi_read_chipid(ftdi, &chipid);
       ftdi_usb_close(ftdi);
-      close_sainsmart_4_8chan() ; 
-      return -1;
+      ftdi_free(ftdi);
    }
-   
-   /* Check if this is an R type chip */
-   if (ftdi->type != TYPE_R)
+   else
    {
-      fprintf(stderr, "unable to continue, not an R-type chip\n");
-      ftdi_usb_close(ftdi);
-      close_sainsmart_4_8chan() ; 
       return -1;
    }
    
-   /* Read out FTDI Chip-ID of R type chips */
-   ftdi_read_chipid(ftdi, &chipid);
-   
 #ifdef BUILD_LIB
    g_num_relays = SAINSMART_USB_NUM_RELAYS;
 #else
@@ -298,6 +598,7 @@ int detect_relay_card_sainsmart_4_8chan(char* portname, uint8_t* num_relays, cha
    {
       g_num_relays = config.sainsmart_num_relays;
    }
+   g_coalesce_ms = config.sainsmart_coalesce_ms;
 #endif   
    /* Return parameters */
    if (num_relays) 
@@ -306,8 +607,6 @@ int detect_relay_card_sainsmart_4_8chan(char* portname, uint8_t* num_relays, cha
       sprintf(portname, "FTDI chipid %X", chipid);
    //printf("DBG: portname %s\n", portname);
    
-   ftdi_usb_close(ftdi);
-   
    return 0;
 }
 
@@ -326,7 +625,7 @@ int detect_relay_card_sainsmart_4_8chan(char* portname, uint8_t* num_relays, cha
  *********************************************************/
 int get_relay_sainsmart_4_8chan(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial)
 {
-   unsigned char buf[1];
+   ftdi_card_t *card;
    
    if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
    {  
@@ -334,24 +633,18 @@ int get_relay_sainsmart_4_8chan(char* portname, uint8_t relay, relay_state_t* re
       return -1;      
    }
 
-   /* Open FTDI USB device */
-   if ((ftdi_usb_open_desc(ftdi, VENDOR_ID, DEVICE_ID, NULL, serial)) < 0)
+   /* Get open FTDI USB device */
+   if ((card = open_card(serial)) == NULL)
    {
-      fprintf(stderr, "unable to open ftdi device: (%s)\n", ftdi_get_error_string(ftdi));
+      fprintf(stderr, "unable to open ftdi device\n");
       return -2;
    }
    
-   /* Get relay state from the card */
-   if (ftdi_read_pins(ftdi, &buf[0]) < 0)
-   {
-      fprintf(stderr,"read failed for 0x%x, error %s\n",buf[0], ftdi_get_error_string(ftdi));
-      return -3;
-   }
-   //printf("DBG: Read GPIO bits %02X\n", buf[0]);
+   /* The outputs are only driven by us, the shadow byte is the relay state */
+   //printf("DBG: Read GPIO bits %02X\n", card->shadow);
    relay = relay-1;
-   *relay_state = (buf[0] & (0x01<<relay)) ? ON : OFF;
+   *relay_state = (card->shadow & (0x01<<relay)) ? ON : OFF;
 
-   ftdi_usb_close(ftdi);
    return 0;
 }
 
@@ -370,51 +663,94 @@ int get_relay_sainsmart_4_8chan(char* portname, uint8_t relay, relay_state_t* re
  *********************************************************/
 int set_relay_sainsmart_4_8chan(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
 {
-   unsigned char buf[1];
-   
    if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
    {  
       fprintf(stderr, "ERROR: Relay number out of range\n");
       return -1;      
    }
    
-   /* Open FTDI USB device */
-   if ((ftdi_usb_open_desc(ftdi, VENDOR_ID, DEVICE_ID, NULL, serial)) < 0)
-   {
-      fprintf(stderr, "unable to open ftdi device: (%s)\n", ftdi_get_error_string(ftdi));
-      return -2;
-   }
+   relay = relay-1;
+   return set_relay_mask_sainsmart_4_8chan(portname, 0x01<<relay, (relay_state == OFF) ? 0 : 0x01<<relay, serial);
+}
 
-   /* Get relay state from the card */
-   if (ftdi_read_pins(ftdi, buf) < 0)
-   {
-      fprintf(stderr,"read failed for 0x%x, error %s\n",buf[0], ftdi_get_error_string(ftdi));
-      return -3;
-   }
+
+/**********************************************************
+ * Function get_relay_mask_sainsmart_4_8chan()
+ * 
+ * Description: Get the state of all relays, like
+ *              get_relay_sainsmart_4_8chan() from the
+ *              shadow byte
+ * 
+ * Parameters: portname (in)     - communication port
+ *             values (out)      - relay states (1 = ON)
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int get_relay_mask_sainsmart_4_8chan(char* portname, relay_mask_t* values, char* serial)
+{
+   ftdi_card_t *card;
    
-   /* Set the new relay state bit */
-   relay = relay-1;
-   if (relay_state == OFF) 
+   /* Get open FTDI USB device */
+   if ((card = open_card(serial)) == NULL)
    {
-      /* Clear the relay bit in mask */
-      buf[0] = buf[0] & ~(0x01<<relay);
-   }
-   else
-   {
-      /* Set the relay bit in mask */
-      buf[0] = buf[0] | (0x01<<relay);
+      fprintf(stderr, "unable to open ftdi device\n");
+      return -2;
    }
    
-   //printf("DBG: Writing GPIO bits %02X\n", buf[0]);
+   *values = card->shadow;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_mask_sainsmart_4_8chan()
+ * 
+ * Description: Set the state of several relays with a 
+ *              single bitbang write
+ * 
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change
+ *             values (in)       - new relay states (1 = ON)
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int set_relay_mask_sainsmart_4_8chan(char* portname, relay_mask_t mask, relay_mask_t values, char* serial)
+{
+   ftdi_card_t *card;
+   
+   mask &= RELAY_MASK_ALL(g_num_relays);
    
-   /* Set relay on the card */
-   if (ftdi_write_data(ftdi, buf, 1) < 0)
+   /* Get open FTDI USB device */
+   if ((card = open_card(serial)) == NULL)
    {
-      fprintf(stderr,"read failed for 0x%x, error %s\n",buf[0], ftdi_get_error_string(ftdi));
-      return -4;
+      fprintf(stderr, "unable to open ftdi device\n");
+      return -2;
    }
+
+   /* Replace the selected relay bits */
+   card->shadow = (card->shadow & ~mask) | (values & mask);
    
-   ftdi_usb_close(ftdi);
-   return 0;
+   return update_card(card);
 }
 
+
+/**********************************************************
+ * Function set_all_relays_sainsmart_4_8chan()
+ * 
+ * Description: Switch all relays on or off with a single
+ *              bitbang write
+ * 
+ * Parameters: portname (in)     - communication port
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int set_all_relays_sainsmart_4_8chan(char* portname, relay_state_t relay_state, char* serial)
+{
+   relay_mask_t all = RELAY_MASK_ALL(g_num_relays);
+   
+   return set_relay_mask_sainsmart_4_8chan(portname, all, (relay_state == OFF) ? 0 : all, serial);
+}
@@ -77,6 +77,60 @@ int get_relay_sainsmart_4_8chan(char* portname, uint8_t relay, relay_state_t* re
  *********************************************************/
 int set_relay_sainsmart_4_8chan(char* portname, uint8_t relay, relay_state_t relay_state, char* serial);
 
+/**********************************************************
+ * Function get_relay_mask_sainsmart_4_8chan()
+ * 
+ * Description: Get the state of all relays at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             values (out)      - relay states (1 = ON)
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int get_relay_mask_sainsmart_4_8chan(char* portname, relay_mask_t* values, char* serial);
+
+/**********************************************************
+ * Function set_relay_mask_sainsmart_4_8chan()
+ * 
+ * Description: Set the state of several relays at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change
+ *             values (in)       - new relay states (1 = ON)
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int set_relay_mask_sainsmart_4_8chan(char* portname, relay_mask_t mask, relay_mask_t values, char* serial);
+
+/**********************************************************
+ * Function set_all_relays_sainsmart_4_8chan()
+ * 
+ * Description: Switch all relays on or off at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int set_all_relays_sainsmart_4_8chan(char* portname, relay_state_t relay_state, char* serial);
+
+/**********************************************************
+ * Function flush_sainsmart_4_8chan()
+ * 
+ * Description: Write pending (coalesced) relay changes
+ * 
+ * Parameters: force (in)  - 1: write all pending changes
+ *                           0: write only changes whose
+ *                              coalescing window expired
+ * 
+ * Return:   ms until the next pending change is due
+ *          -1 - nothing pending
+ *********************************************************/
+int flush_sainsmart_4_8chan(int force);
+
 int close_sainsmart_4_8chan() ;
 
 int free_static_mem_sainsmart_4_8chan() ;
@@ -107,6 +107,7 @@
 #include <hidapi/hidapi.h>
 
 #include "relay_drv.h"
+#include "relay_drv_sainsmart16.h"
 
 //#define VENDOR_ID 0x0416
 //#define DEVICE_ID 0x5020
@@ -118,6 +119,9 @@
 #define CMD_WRITE 0xC3
 #define CMD_SIGNATURE "HIDC"
 
+/* Max time to wait for the answer to a read command */
+#define READ_TIMEOUT_MS 100
+
 
 /* USB HID message structure */
 typedef struct
@@ -130,21 +134,119 @@ typedef struct
    uint16_t chksum;       // 16 bit checksum 
 } hid_msg_t;
 
+/* Open card: the device handle is kept open between calls and the last
+ * relay states read or written are kept as shadow bitmap, so that a set
+ * does not need to read the card first.
+ */
+typedef struct hid_card
+{
+   char *path;
+   hid_device *handle;
+   uint16_t shadow;
+   uint8_t shadow_valid;
+   struct hid_card *next;
+} hid_card_t;
+
 /* Association between relay number (array index) and bit position */
 static uint8_t relay_bit_pos[] = {7 , 8 , 6 , 9 , 5 , 10, 4 , 11, 3 , 12, 2 , 13, 1 , 14, 0 , 15};
 
 static uint8_t g_num_relays=SAINSMART16_USB_NUM_RELAYS;
 
-int free_static_mem_sainsmart_16chan()
+static hid_card_t *all_cards = NULL;
+
+int close_sainsmart_16chan() 
 {
+   hid_card_t *card;
+
+   for (card = all_cards; card != NULL; card = card->next)
+   {
+      if (card->handle != NULL)
+      {
+         hid_close(card->handle);
+         card->handle = NULL;
+      }
+      card->shadow_valid = 0;
+   }
    return 0 ;
 }
 
-int close_sainsmart_16chan() 
+int free_static_mem_sainsmart_16chan()
 {
+   hid_card_t *card;
+
+   close_sainsmart_16chan();
+   while (all_cards != NULL)
+   {
+      card = all_cards;
+      all_cards = all_cards->next;
+      free(card->path);
+      free(card);
+   }
    return 0 ;
 }
 
+/**********************************************************
+ * Internal function get_card()
+ * 
+ * Description: Return the open card for the given path,
+ *              open the device if not yet done
+ * 
+ * Parameters: portname (in)     - HID device path
+ * 
+ * Return:   card - success
+ *           NULL - fail
+ *********************************************************/
+static hid_card_t *get_card(char *portname)
+{
+   hid_card_t *card;
+
+   for (card = all_cards; card != NULL; card = card->next)
+   {
+      if (!strcmp(card->path, portname))
+         break;
+   }
+   
+   if (card == NULL)
+   {
+      if ((card = malloc(sizeof(hid_card_t))) == NULL ||
+          (card->path = strdup(portname)) == NULL)
+      {
+         free(card);
+         return NULL;
+      }
+      card->handle = NULL;
+      card->shadow_valid = 0;
+      card->next = all_cards;
+      all_cards = card;
+   }
+   
+   if (card->handle == NULL)
+   {
+      if ((card->handle = hid_open_path(portname)) == NULL)
+      {
+         fprintf(stderr, "unable to open HID API device %s\n", portname);
+         return NULL;
+      }
+      card->shadow_valid = 0;
+   }
+   
+   return card;
+}
+
+/**********************************************************
+ * Internal function drop_card()
+ * 
+ * Description: Close the device after an I/O error, it will
+ *              be opened again on next access (e.g. after
+ *              the card has been unplugged)
+ *********************************************************/
+static void drop_card(hid_card_t *card)
+{
+   hid_close(card->handle);
+   card->handle = NULL;
+   card->shadow_valid = 0;
+}
+
 static void init_hid_msg(hid_msg_t *hid_msg, uint8_t cmd, uint16_t bitmap)
 {
    int i;
@@ -168,7 +270,7 @@ static void init_hid_msg(hid_msg_t *hid_msg, uint8_t cmd, uint16_t bitmap)
 }
 
 
-static int get_mask(hid_device *handle, uint16_t *bitmap)
+static int get_mask(hid_card_t *card, uint16_t *bitmap)
 {
   int i;
   hid_msg_t  hid_msg;
@@ -176,13 +278,13 @@ static int get_mask(hid_device *handle, uint16_t *bitmap)
   
   init_hid_msg(&hid_msg, CMD_READ, 0x1111);
 
-  if (hid_write(handle, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
+  if (hid_write(card->handle, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
   {
     return -1;
   }
-  usleep(1000);
   
-  if (hid_read(handle, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
+  /* Wait for the answer instead of sleeping a fixed time */
+  if (hid_read_timeout(card->handle, (unsigned char *)&hid_msg, sizeof(hid_msg), READ_TIMEOUT_MS) <= 0)
   {
     return -2;
   }
@@ -196,25 +298,46 @@ static int get_mask(hid_device *handle, uint16_t *bitmap)
 
   /* printf("DBG: get_mask = 0x%04x\n", hid_msg.bitmap); */
   *bitmap = mask;
+  card->shadow = mask;
+  card->shadow_valid = 1;
 
   return 0;
 }
 
 
-static int set_mask(hid_device *handle, uint16_t bitmap) 
+static int set_mask(hid_card_t *card, uint16_t bitmap) 
 {
   hid_msg_t  hid_msg;
 
   /* printf("DBG: set_mask = 0x%04x\n", bitmap); */
   init_hid_msg(&hid_msg, CMD_WRITE, bitmap);
-  if (hid_write(handle, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
+  if (hid_write(card->handle, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
   {
     return -1;
   }
+  card->shadow = bitmap;
+  card->shadow_valid = 1;
   return 0;
 }
 
 
+/**********************************************************
+ * Internal function get_shadow_mask()
+ * 
+ * Description: Get the relay states from the shadow bitmap,
+ *              read them from the card only if unknown
+ *********************************************************/
+static int get_shadow_mask(hid_card_t *card, uint16_t *bitmap)
+{
+   if (card->shadow_valid)
+   {
+      *bitmap = card->shadow;
+      return 0;
+   }
+   return get_mask(card, bitmap);
+}
+
+
 /**********************************************************
  * Function detect_relay_card_sainsmart_16chan()
  * 
@@ -253,12 +376,14 @@ int detect_relay_card_sainsmart_16chan(char* portname, uint8_t* num_relays, char
    {
       if (relay_info != NULL)
       {
+         // Allocate new struct, stop listing when out of memory
+         if ((rinfo = crelay_new_relay_info()) == NULL)
+         {
+            break;
+         }
          // Save serial number and type in current relay info struct
          (*relay_info)->relay_type = SAINSMART16_USB_RELAY_TYPE;
          strcpy((*relay_info)->serial, nextdev->path);
-         // Allocate new struct
-         rinfo = malloc(sizeof(relay_info_t));
-         rinfo->next = NULL;
          // Link current to new struct
          (*relay_info)->next = rinfo;
          // Move pointer to new struct
@@ -305,7 +430,7 @@ int detect_relay_card_sainsmart_16chan(char* portname, uint8_t* num_relays, char
  *********************************************************/
 int get_relay_sainsmart_16chan(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial)
 {
-   hid_device *hid_dev;
+   hid_card_t *card;
    uint16_t bitmap, bit;
    
    if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
@@ -314,17 +439,17 @@ int get_relay_sainsmart_16chan(char* portname, uint8_t relay, relay_state_t* rel
       return -1;      
    }
    
-   /* Open HID API device */
-   if ((hid_dev = hid_open_path(portname)) == NULL)
+   /* Get open HID API device */
+   if ((card = get_card(portname)) == NULL)
    {
-      fprintf(stderr, "unable to open HID API device %s\n", portname);
       return -2;
    }
    
    /* Read relay states */
-   if (get_mask(hid_dev, &bitmap) < 0)
+   if (get_mask(card, &bitmap) < 0)
    {
-      fprintf(stderr, "unable to read data from device %s (%ls)\n", portname, hid_error(hid_dev));
+      fprintf(stderr, "unable to read data from device %s (%ls)\n", portname, hid_error(card->handle));
+      drop_card(card);
       return -3;
    }
    
@@ -335,7 +460,6 @@ int get_relay_sainsmart_16chan(char* portname, uint8_t relay, relay_state_t* rel
      *relay_state = OFF;
 
    /* printf("DBG: get: portname=%s, relay=%d, state=%d\n", portname, relay, (int)*relay_state); */
-   hid_close(hid_dev);
    return 0;
 }
 
@@ -354,52 +478,133 @@ int get_relay_sainsmart_16chan(char* portname, uint8_t relay, relay_state_t* rel
  *********************************************************/
 int set_relay_sainsmart_16chan(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
 { 
-   hid_device *hid_dev;
-   uint16_t     bitmap;
-   
    if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
    {  
       fprintf(stderr, "ERROR: Relay number out of range\n");
       return -1;      
    }
    
-   /* Open HID API device */
-   if ((hid_dev = hid_open_path(portname)) == NULL)
-   {
-      fprintf(stderr, "unable to open HID API device %s\n", portname);
-      return -2;
-   }
-
    /*
    printf("DBG: Sain16 USB: portname=%s, relay=%d, state=%s\n",
           portname, relay, relay_state == ON? "ON" : "OFF");
    */
+   return set_relay_mask_sainsmart_16chan(portname, 1<<(relay-1), (relay_state == OFF) ? 0 : 1<<(relay-1), serial);
+}
+
+
+/**********************************************************
+ * Function get_relay_mask_sainsmart_16chan()
+ * 
+ * Description: Get the state of all relays with one
+ *              report
+ * 
+ * Parameters: portname (in)     - communication port
+ *             values (out)      - relay states (1 = ON)
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int get_relay_mask_sainsmart_16chan(char* portname, relay_mask_t* values, char* serial)
+{
+   hid_card_t *card;
+   uint16_t bitmap;
+   
+   /* Get open HID API device */
+   if ((card = get_card(portname)) == NULL)
+   {
+      return -2;
+   }
+   
    /* Read relay states */
-   if (get_mask(hid_dev, &bitmap) < 0)
+   if (get_mask(card, &bitmap) < 0)
    {
-      fprintf(stderr, "unable to read data from device %s (%ls)\n", portname, hid_error(hid_dev));
+      fprintf(stderr, "unable to read data from device %s (%ls)\n", portname, hid_error(card->handle));
+      drop_card(card);
       return -3;
    }
    
-   /* Set the new relay state bit */
-   if (relay_state == OFF) 
+   *values = bitmap;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_mask_sainsmart_16chan()
+ * 
+ * Description: Set the state of several relays with one
+ *              write command. The card is only read if the
+ *              relay states are not yet known.
+ * 
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change
+ *             values (in)       - new relay states (1 = ON)
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_sainsmart_16chan(char* portname, relay_mask_t mask, relay_mask_t values, char* serial)
+{ 
+   hid_card_t *card;
+   uint16_t     bitmap;
+   
+   /* Get open HID API device */
+   if ((card = get_card(portname)) == NULL)
    {
-      /* Clear the relay bit in mask */
-      bitmap &= ~(1<<(relay-1));
+      return -2;
    }
-   else
+
+   /* Get relay states */
+   if (get_shadow_mask(card, &bitmap) < 0)
    {
-      /* Set the relay bit in mask */
-      bitmap |= (1<<(relay-1));
+      fprintf(stderr, "unable to read data from device %s (%ls)\n", portname, hid_error(card->handle));
+      drop_card(card);
+      return -3;
    }
    
+   /* Replace the selected relay bits */
+   bitmap = (bitmap & ~mask) | (values & mask);
+   
    /* Write relay states */
-   if (set_mask(hid_dev, bitmap) < 0)
+   if (set_mask(card, bitmap) < 0)
+   {
+      fprintf(stderr, "unable to write data to device %s (%ls)\n", portname, hid_error(card->handle));
+      drop_card(card);
+      return -4;
+   }
+  
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_all_relays_sainsmart_16chan()
+ * 
+ * Description: Switch all relays on or off with a single
+ *              write command
+ * 
+ * Parameters: portname (in)     - communication port
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_all_relays_sainsmart_16chan(char* portname, relay_state_t relay_state, char* serial)
+{ 
+   hid_card_t *card;
+   
+   /* Get open HID API device */
+   if ((card = get_card(portname)) == NULL)
+   {
+      return -2;
+   }
+
+   /* All bits are written, no need to read the current states */
+   if (set_mask(card, (relay_state == OFF) ? 0x0000 : 0xFFFF) < 0)
    {
-      fprintf(stderr, "unable to write data to device %s (%ls)\n", portname, hid_error(hid_dev));
+      fprintf(stderr, "unable to write data to device %s (%ls)\n", portname, hid_error(card->handle));
+      drop_card(card);
       return -4;
    }
   
-   hid_close(hid_dev);
    return 0;
 }
@@ -4,7 +4,7 @@
  * control module:
  * 
  * Note:
- *   libusb
+ *   libusb-1.0, through the shared context of relay_usb.c
  * 
  * Description:
  *   This 16-channel module is used for USB control of the Sainsmart 16-channel
@@ -46,13 +46,33 @@
  * Communication protocol description
  * ==================================
  * 
+ * The card is driven with Modbus ASCII frames (slave address 0xFE) which
+ * are sent with a bulk write to endpoint 2:
+ * 
+ *   ':' AD FC DATA... LRC CR LF
+ * 
+ *   AD:  slave address ("FE")
+ *   FC:  function code
+ *   LRC: two's complement of the sum of all bytes from AD to the last
+ *        data byte, in hex ASCII
+ * 
  * Read command
  * ------------
  * 
+ *   FC 01 (read coils), start 0x0000, count 0x0010. The answer is not
+ *   read by this driver, the relay states are kept in memory instead.
  * 
  * Write command
  * -------------
  * 
+ *   Single relay: FC 05 (write single coil)
+ *     ':' FE 05 00 RR SS 00 LRC CR LF
+ *     RR: relay number - 1, SS: FF = ON, 00 = OFF
+ * 
+ *   All relays:   FC 0F (write multiple coils)
+ *     ':' FE 0F 00 00 00 10 02 LO HI LRC CR LF
+ *     LO: states of relays 1..8, HI: states of relays 9..16 (bit 0 first)
+ * 
  *****************************************************************************/ 
 
 #include <stdio.h>
@@ -60,9 +80,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
-#include <usb.h>
+#include <libusb-1.0/libusb.h>
 
 #include "relay_drv.h"
+#include "metrics.h"
+#include "journal.h"
+#include "relay_usb.h"
 
 #ifndef __OPENDEVICE_H_INCLUDED__
 #define __OPENDEVICE_H_INCLUDED__
@@ -92,12 +115,15 @@ static uint8_t g_num_relays=SAINSMART16_CH340_NUM_RELAYS ;
 
 typedef struct mem_state {
     char * serial ;
-    relay_state_t state[16] ;
+    relay_mask_t state ;             /* relays switched on */
+    int restored ;                   /* state taken from the journal */
     struct mem_state *next ;
 } mem_state_t ; 
 
 static mem_state_t *all_states = NULL ;
 
+#define CMD_WRITE_COILS_LEN 23
+
 static char l_command[34][17] = {
  {58, 70, 69, 48, 53, 48, 48, 48, 48, 70, 70, 48, 48, 70, 69, 13, 10},
  {58, 70, 69, 48, 53, 48, 48, 48, 48, 48, 48, 48, 48, 70, 68, 13, 10},
@@ -139,8 +165,6 @@ static char l_command[34][17] = {
 int free_static_mem_sainsmart_16chan_CH340()
 {
     mem_state_t * current ;
-    struct usb_bus      *bus, *next_bus;
-    struct usb_device   *dev, *next_dev;
 
     while ( all_states != NULL)
     {
@@ -151,19 +175,6 @@ int free_static_mem_sainsmart_16chan_CH340()
         free(current) ;
     }
     
-    bus = usb_get_busses();
-    while (bus != NULL){
-        dev = bus->devices; 
-        while (dev != NULL){
-            next_dev = dev->next ;
-            usb_free_dev(dev) ;
-            dev = next_dev ;
-        }
-        next_bus = bus->next ;
-        usb_free_bus(bus) ;
-        bus = next_bus ;
-    }
-    
     return 0 ;
 }
 
@@ -172,34 +183,6 @@ int close_sainsmart_16chan_CH340()
    return 0 ;
 }
 
-int usbGetStringAscii(usb_dev_handle *dev, int index, char *buf, int buflen)
-{
-char    buffer[256];
-int     rval, i;
-
-    if((rval = usb_get_string_simple(dev, index, buf, buflen)) >= 0) /* use libusb version if it works */
-        return rval;
-    if((rval = usb_control_msg(dev, USB_ENDPOINT_IN, USB_REQ_GET_DESCRIPTOR, (USB_DT_STRING << 8) + index, 0x0409, buffer, sizeof(buffer), 5000)) < 0)
-        return rval;
-    if(buffer[1] != USB_DT_STRING){
-        *buf = 0;
-        return 0; 
-    }
-    if((unsigned char)buffer[0] < rval)
-        rval = (unsigned char)buffer[0];
-    rval /= 2;
-    /* lossy conversion to ISO Latin1: */
-    for(i=1;i<rval;i++){
-        if(i > buflen)              /* destination buffer overflow */
-            break;
-        buf[i-1] = buffer[2 * i];
-        if(buffer[2 * i + 1] != 0)  /* outside of ISO Latin1 range */
-            buf[i-1] = '?';
-    }
-    buf[i-1] = 0;
-    return i-1;
-}
-
 static void save_serial_in_state(char *serial)
 {
     mem_state_t **mystate ;
@@ -216,9 +199,13 @@ static void save_serial_in_state(char *serial)
     {
         (*mystate) = malloc(sizeof(mem_state_t));
         (*mystate)->serial = strdup(serial) ;
-        for (int k=0; k<16; k++) (*mystate)->state[k] = OFF ;
+        (*mystate)->state = 0 ;
+        (*mystate)->restored = 0 ;
         (*mystate)->next = NULL ;
     }
+    /* The card can't be read, start from the last recorded state */
+    if (!(*mystate)->restored)
+        (*mystate)->restored = (journal_restore(SAINSMART16_CH340_RELAY_TYPE, serial, &(*mystate)->state) >= 0) ;
 }
 
 static relay_state_t get_state(char *serial, uint8_t n_relay)
@@ -230,7 +217,7 @@ static relay_state_t get_state(char *serial, uint8_t n_relay)
     {
         if (!strcmp(mystate->serial, serial))
         {
-            return mystate->state[n_relay-1] ;
+            return (mystate->state & RELAY_BIT(n_relay)) ? ON : OFF ;
             break ;
         }
         mystate = (mem_state_t *)mystate->next ;
@@ -247,120 +234,160 @@ static void set_state(char *serial, uint8_t n_relay, relay_state_t state)
     {
         if (!strcmp(mystate->serial, serial))
         {
-            mystate->state[n_relay-1] = state ;
+            if (state == ON)
+                mystate->state |= RELAY_BIT(n_relay) ;
+            else
+                mystate->state &= ~RELAY_BIT(n_relay) ;
+            journal_record(SAINSMART16_CH340_RELAY_TYPE, serial, RELAY_BIT(n_relay), (state == ON) ? RELAY_BIT(n_relay) : 0) ;
+            break ;
+        }
+        mystate = (mem_state_t *)mystate->next ;
+    }
+}
+
+static void set_all_states(char *serial, relay_mask_t mask, relay_mask_t values)
+{
+    mem_state_t *mystate ;
+    
+    mystate = all_states ;
+    while ( mystate != NULL)
+    {
+        if (!strcmp(mystate->serial, serial))
+        {
+            mask &= RELAY_MASK_ALL(g_num_relays) ;
+            mystate->state = (mystate->state & ~mask) | (values & mask) ;
+            journal_record(SAINSMART16_CH340_RELAY_TYPE, serial, mask, values) ;
             break ;
         }
         mystate = (mem_state_t *)mystate->next ;
     }
 }
 
-int usbOpenDevice(usb_dev_handle **device, int vendorID, int productID, char *my_serial, relay_info_t** relay_info)
+static relay_mask_t get_all_states(char *serial)
 {
-    struct usb_bus      *bus;
-    struct usb_device   *dev;
-    usb_dev_handle      *handle = NULL;
-    //int                 errorCode = USBOPEN_ERR_NOTFOUND;
-    char                s_value[64] ; 
-    relay_info_t        *rinfo ;
-                    
-    usb_find_busses();
-    usb_find_devices();
-    for(bus = usb_get_busses(); bus; bus = bus->next)
+    mem_state_t *mystate ;
+    relay_mask_t values = 0 ;
+    
+    mystate = all_states ;
+    while ( mystate != NULL)
     {
-        for(dev = bus->devices; dev; dev = dev->next)
-        {  /* iterate over all devices on all busses */
-            if(dev->descriptor.idVendor == vendorID && dev->descriptor.idProduct == productID)
+        if (!strcmp(mystate->serial, serial))
+        {
+            values = mystate->state & RELAY_MASK_ALL(g_num_relays) ;
+            break ;
+        }
+        mystate = (mem_state_t *)mystate->next ;
+    }
+    return values ;
+}
+
+/* Build a Modbus ASCII "write multiple coils" frame for all 16 relays */
+static void build_write_coils(char *frame, relay_mask_t values)
+{
+    static const char hex[] = "0123456789ABCDEF" ;
+    uint8_t bytes[9] = {0xFE, 0x0F, 0x00, 0x00, 0x00, 0x10, 0x02, values & 0xFF, (values >> 8) & 0xFF} ;
+    uint8_t lrc = 0 ;
+    int n = 0 ;
+    
+    frame[n++] = ':' ;
+    for (int k=0; k<9; k++)
+    {
+        lrc += bytes[k] ;
+        frame[n++] = hex[bytes[k] >> 4] ;
+        frame[n++] = hex[bytes[k] & 0x0F] ;
+    }
+    lrc = (uint8_t)(-lrc) ;
+    frame[n++] = hex[lrc >> 4] ;
+    frame[n++] = hex[lrc & 0x0F] ;
+    frame[n++] = 13 ;
+    frame[n++] = 10 ;
+}
+
+/**********************************************************
+ * Function usbOpenDevice()
+ * 
+ * Description: Find the CH340 cards, their serial is built
+ *              from VID, PID and USB device address
+ * 
+ * Parameters: device (out)    - handle of the matching card
+ *                               (NULL: only check presence)
+ *             vendorID (in)   - Vendor Id
+ *             productID (in)  - Product Id
+ *             my_serial (in)  - serial number to look for
+ *             relay_info (out)- list of found cards, if not NULL
+ * 
+ * Return:  1 - matching card found
+ *          0 - not found
+ *********************************************************/
+int usbOpenDevice(libusb_device_handle **device, int vendorID, int productID, char *my_serial, relay_info_t** relay_info)
+{
+    libusb_device               **devices;
+    libusb_device_handle        *handle = NULL;
+    struct libusb_device_descriptor devdesc;
+    relay_info_t                *rinfo ;
+    ssize_t                     devnum;
+    int                         found = 0;
+    
+    devnum = libusb_get_device_list(relay_usb_context(), &devices);
+    if (devnum < 0)
+    {
+        fprintf(stderr, "Unable to list USB devices (%s)\n", libusb_error_name(devnum));
+        return 0;
+    }
+    
+    for (int i = 0; i < devnum && !found; i++)
+    {  /* iterate over all devices on all busses */
+        char    serial[32] ;
+        int     r;
+        
+        if (libusb_get_device_descriptor(devices[i], &devdesc) < 0)
+            continue;
+        if (devdesc.idVendor != vendorID || devdesc.idProduct != productID)
+            continue;
+        
+        r = libusb_open(devices[i], &handle); /* check that we can access the device */
+        if (r < 0)
+        {
+            fprintf(stderr, "Warning: cannot open VID=0x%04x PID=0x%04x: %s\n", devdesc.idVendor, devdesc.idProduct, libusb_error_name(r));
+            continue;
+        }
+        
+        sprintf(serial, "%04x:%04x:%d", vendorID, productID, libusb_get_device_address(devices[i])) ;
+        
+        if (relay_info != NULL)
+        {
+            // Allocate new struct, stop listing when out of memory
+            if ((rinfo = crelay_new_relay_info()) == NULL)
+            {
+                libusb_close(handle);
+                break;
+            }
+            // Save serial number and type in current relay info struct
+            (*relay_info)->relay_type = SAINSMART16_CH340_RELAY_TYPE;
+            (*relay_info)->num_relays = g_num_relays ;
+            strcpy((*relay_info)->serial, (char *)serial) ;
+            // Link current to new struct
+            (*relay_info)->next = rinfo;
+            // Move pointer to new struct
+            *relay_info = rinfo;
+              
+            save_serial_in_state((char *)serial) ;
+        }
+        else if (!strcmp(my_serial,serial))
+        {
+            found = 1 ;
+            if (device != NULL)
             {
-                char    vendor[256], product[256], serial[256] ;
-                int     len;
-                
-                handle = usb_open(dev); /* we need to open the device in order to query strings */
-                if(!handle)
-                {
-//                    errorCode = USBOPEN_ERR_ACCESS;
-                    fprintf(stderr, "Warning: cannot open VID=0x%04x PID=0x%04x: %s\n", dev->descriptor.idVendor, dev->descriptor.idProduct, usb_strerror());
-                    continue;
-                }
-                /* now check whether the names match: */
-                len = vendor[0] = 0;
-                if(dev->descriptor.iManufacturer > 0)
-                {
-                    len = usbGetStringAscii(handle, dev->descriptor.iManufacturer, vendor, sizeof(vendor));
-                }
-                if(len < 0)
-                {
-//                    errorCode = USBOPEN_ERR_ACCESS;
-                    fprintf(stderr, "Warning: cannot query manufacturer for VID=0x%04x PID=0x%04x: %s\n", dev->descriptor.idVendor, dev->descriptor.idProduct, usb_strerror());
-                }
-                else
-                {
-//                    errorCode = USBOPEN_ERR_NOTFOUND;
-                    len = product[0] = 0;
-                    if(dev->descriptor.iProduct > 0)
-                    {
-                        len = usbGetStringAscii(handle, dev->descriptor.iProduct, product, sizeof(product));
-                    }
-                    if(len < 0)
-                    {
-    //                    errorCode = USBOPEN_ERR_ACCESS;
-                        fprintf(stderr, "Warning: cannot query product for VID=0x%04x PID=0x%04x: %s\n", dev->descriptor.idVendor, dev->descriptor.idProduct, usb_strerror());
-                    }
-                    else
-                    {
-    //                        errorCode = USBOPEN_ERR_NOTFOUND;                          
-                        s_value[0] = '\0' ;
-                        sprintf((char *)s_value,"%04x",vendorID) ;
-                        strcpy((char *)serial, (char *)s_value);
-                        strcat((char *)serial, ":");
-                        sprintf((char *)s_value,"%04x",productID) ;
-                        strcat((char *)serial, (char *)s_value);
-                        strcat((char *)serial, ":");
-                        sprintf((char *)s_value,"%d",dev->devnum) ;
-                        strcat((char *)serial, s_value) ;
-                        
-                        if (relay_info != NULL)
-                        {
-                            //printf("Device %d; save serial\n", i);
-                            // Save serial number and type in current relay info struct
-                            (*relay_info)->relay_type = SAINSMART16_CH340_RELAY_TYPE;
-                            (*relay_info)->num_relays = g_num_relays ;
-                            strcpy((*relay_info)->serial, (char *)serial) ;
-                            // Allocate new struct
-                            rinfo = malloc(sizeof(relay_info_t));
-                            rinfo->next = NULL;
-                            // Link current to new struct
-                            (*relay_info)->next = rinfo;
-                            // Move pointer to new struct
-                            *relay_info = rinfo;
-                              
-                            save_serial_in_state((char *)serial) ;
-                        }
-                        else
-                        {
-                            if (!strcmp(my_serial,serial))
-                            {
-                                if (device != NULL)
-                                {
-                                    *device = handle;
-                                    return 1 ;
-                                }
-                                else
-                                {
-                                    usb_close(handle);
-                                    handle = NULL;
-                                    return 1 ;
-                                }
-                            }
-                        }
-                    }
-                }
-                usb_close(handle);
-                handle = NULL;
+                *device = handle;
+                continue;
             }
         }
+        libusb_close(handle);
+        handle = NULL;
     }
-
-    return 0;
+    
+    libusb_free_device_list(devices, 1);
+    return found;
 }
 
 
@@ -382,7 +409,6 @@ int detect_relay_card_sainsmart_16chan_CH340(char* portname, uint8_t* num_relays
    /* Find all connected devices, if requested */
    if (relay_info != NULL)
    { 
-      usb_init();
       usbOpenDevice(NULL, VENDOR_ID,DEVICE_ID, NULL, relay_info) ;
       
       return -1;
@@ -390,7 +416,6 @@ int detect_relay_card_sainsmart_16chan_CH340(char* portname, uint8_t* num_relays
    
    close_sainsmart_16chan_CH340() ; 
 
-   usb_init();
    if (usbOpenDevice(NULL, VENDOR_ID,DEVICE_ID, serial, NULL) == 1)
    {
        save_serial_in_state(serial) ;
@@ -427,6 +452,60 @@ int get_relay_sainsmart_16chan_CH340(char* portname, uint8_t relay, relay_state_
 }
 
 
+/**********************************************************
+ * Internal function open_card()
+ * 
+ * Description: Open the card with the given serial and
+ *              claim its interface
+ * 
+ * Parameters: serial (in)       - serial number
+ * 
+ * Return:   device handle - success
+ *           NULL          - fail
+ *********************************************************/
+static libusb_device_handle *open_card(char* serial)
+{
+   libusb_device_handle *handle = NULL;
+   int r ;
+   uint64_t t0;
+   int  usbConfiguration = 1;
+   int  usbInterface = 0;
+
+   /* Open CH340 USB device */
+   t0 = metrics_now();
+   r = usbOpenDevice(&handle, VENDOR_ID,DEVICE_ID, serial, NULL);
+   metrics_card(SAINSMART16_CH340_RELAY_TYPE, serial, METRICS_CARD_OPEN, metrics_now() - t0, r != 1);
+   if (r != 1)
+   {
+      fprintf(stderr, "unable to open device\n") ;
+      return NULL;
+   }
+
+   /* The ch341 serial driver may be bound to the interface */
+   if (libusb_kernel_driver_active(handle, usbInterface) == 1)
+   {
+      if ((r = libusb_detach_kernel_driver(handle, usbInterface)) < 0)
+         fprintf(stderr, "Warning: could not detach kernel driver: %s\n", libusb_error_name(r));
+   }
+   
+   if ((r = libusb_set_configuration(handle, usbConfiguration)) < 0)
+      fprintf(stderr, "Warning: could not set configuration: %s\n", libusb_error_name(r));
+
+   if ((r = libusb_claim_interface(handle, usbInterface)) < 0)
+      fprintf(stderr, "Warning: could not claim interface: %s\n", libusb_error_name(r));
+   
+   return handle;
+}
+
+static void close_card(libusb_device_handle *handle)
+{
+   int  usbInterface = 0;
+
+   libusb_release_interface(handle, usbInterface);
+   libusb_close(handle);
+}
+
+
 /**********************************************************
  * Function set_relay_sainsmart_16chan_CH340()
  * 
@@ -441,12 +520,8 @@ int get_relay_sainsmart_16chan_CH340(char* portname, uint8_t relay, relay_state_
  *********************************************************/
 int set_relay_sainsmart_16chan_CH340(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
 { 
-   usb_dev_handle  *handle = NULL;
-   int retries = 1;
-   int len ;
+   libusb_device_handle *handle = NULL;
    int  usbTimeout = 5000;
-   int  usbConfiguration = 1;
-   int  usbInterface = 0;
 
    if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
    {  
@@ -454,40 +529,102 @@ int set_relay_sainsmart_16chan_CH340(char* portname, uint8_t relay, relay_state_
       return -1;      
    }
    
-   /* Open FTDI USB device */
-   usb_init();
-   if (usbOpenDevice(&handle, VENDOR_ID,DEVICE_ID, serial, NULL) != 1)
+   if ((handle = open_card(serial)) == NULL)
    {
-      fprintf(stderr, "unable to open device\n") ;
       return -2;
    }
 
-   if(usb_set_configuration(handle, usbConfiguration)){
-            fprintf(stderr, "Warning: could not set configuration: %s\n", usb_strerror());
-        }
-
-   while((len = usb_claim_interface(handle, usbInterface)) != 0 && retries-- > 0){
-#ifdef LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
-            if(usb_detach_kernel_driver_np(handle, 0) < 0 ){
-                fprintf(stderr, "Warning: could not detach kernel driver: %s\n", usb_strerror());
-            }
-#endif
-   }
-   if(len != 0)
-            fprintf(stderr, "Warning: could not claim interface: %s\n", usb_strerror());
-   
    if (relay_state == OFF)
    {
-      len = usb_bulk_write(handle, 2, (char *)l_command[(relay-1)*2+1], 17, usbTimeout);
+      relay_usb_bulk(handle, 2, (unsigned char *)l_command[(relay-1)*2+1], 17, usbTimeout);
    }
    else
    {
-      len = usb_bulk_write(handle, 2, (char *)l_command[(relay-1)*2], 17, usbTimeout);
+      relay_usb_bulk(handle, 2, (unsigned char *)l_command[(relay-1)*2], 17, usbTimeout);
    }
    
    set_state(serial,relay,relay_state) ;
    
-   usb_release_interface(handle, usbInterface);
-   usb_close(handle);
+   close_card(handle);
    return 0;
 }
+
+
+/**********************************************************
+ * Function get_relay_mask_sainsmart_16chan_CH340()
+ * 
+ * Description: Get the state of all relays
+ * 
+ * Parameters: portname (in)     - communication port
+ *             values (out)      - relay states (1 = ON)
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int get_relay_mask_sainsmart_16chan_CH340(char* portname, relay_mask_t* values, char* serial)
+{
+   *values = get_all_states(serial) ;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_mask_sainsmart_16chan_CH340()
+ * 
+ * Description: Set the state of several relays with one
+ *              "write multiple coils" frame. The relays not
+ *              selected by mask keep their memorized state.
+ * 
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change
+ *             values (in)       - new relay states (1 = ON)
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_sainsmart_16chan_CH340(char* portname, relay_mask_t mask, relay_mask_t values, char* serial)
+{ 
+   libusb_device_handle *handle = NULL;
+   char frame[CMD_WRITE_COILS_LEN];
+   int  usbTimeout = 5000;
+   int  r;
+
+   if ((handle = open_card(serial)) == NULL)
+   {
+      return -2;
+   }
+
+   values = (get_all_states(serial) & ~mask) | (values & mask) ;
+   build_write_coils(frame, values) ;
+   if ((r = relay_usb_bulk(handle, 2, (unsigned char *)frame, CMD_WRITE_COILS_LEN, usbTimeout)) < 0)
+   {
+      fprintf(stderr, "unable to write to device: %s\n", libusb_error_name(r));
+      close_card(handle);
+      return -3;
+   }
+   
+   set_all_states(serial, mask, values) ;
+   
+   close_card(handle);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_all_relays_sainsmart_16chan_CH340()
+ * 
+ * Description: Switch all relays on or off with one
+ *              "write multiple coils" frame
+ * 
+ * Parameters: portname (in)     - communication port
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_all_relays_sainsmart_16chan_CH340(char* portname, relay_state_t relay_state, char* serial)
+{ 
+   relay_mask_t all = RELAY_MASK_ALL(g_num_relays);
+
+   return set_relay_mask_sainsmart_16chan_CH340(portname, all, (relay_state == ON) ? all : 0, serial);
+}
@@ -85,6 +85,46 @@ int get_relay_sainsmart_16chan_CH340(char* portname, uint8_t relay, relay_state_
  *********************************************************/
 int set_relay_sainsmart_16chan_CH340(char* portname, uint8_t relay, relay_state_t relay_state, char* serial);
 
+/**********************************************************
+ * Function get_relay_mask_sainsmart_16chan_CH340()
+ * 
+ * Description: Get the state of all relays at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             values (out)      - relay states (1 = ON)
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int get_relay_mask_sainsmart_16chan_CH340(char* portname, relay_mask_t* values, char* serial);
+
+/**********************************************************
+ * Function set_relay_mask_sainsmart_16chan_CH340()
+ * 
+ * Description: Set the state of several relays at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change
+ *             values (in)       - new relay states (1 = ON)
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int set_relay_mask_sainsmart_16chan_CH340(char* portname, relay_mask_t mask, relay_mask_t values, char* serial);
+
+/**********************************************************
+ * Function set_all_relays_sainsmart_16chan_CH340()
+ * 
+ * Description: Switch all relays on or off at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int set_all_relays_sainsmart_16chan_CH340(char* portname, relay_state_t relay_state, char* serial);
+
 int close_sainsmart_16chan_CH340() ;
 
 int free_static_mem_sainsmart_16chan_CH340() ;
@@ -1,21 +1,22 @@
 /******************************************************************************
- * 
- * Relay card control utility: Driver for <XYZ> relay card
- *   <Link to relay cards product web page>
- * 
+ *
+ * Relay card control utility: Driver for simulated relay cards
+ *
  * Description:
- *   <Short description of what is implemented in this file>
- * 
+ *   This driver simulates a number of relay cards without any hardware.
+ *   The cards, their serial numbers and relay counts, the latency of each
+ *   operation and failure/unplug injection are set in the [Sample drv]
+ *   section of crelay.conf. It is used to test and benchmark the daemon
+ *   (including the SERIAL_AUTO board assignment) on any Linux box.
+ *   It also serves as a template for new drivers.
+ *
  * Build instructions:
- *   gcc -c relay_drv_sample.c
- * 
- * Last modified:
- *   <date>
- * 
+ *   make DRV_SAMPLE=y
+ *
  * Copyright 2015, <your name>
- * 
+ *
  * This file is part of crelay.
- * 
+ *
  * crelay is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation, either version 3 of the License, or
@@ -29,76 +30,473 @@
  * You should have received a copy of the GNU General Public License
  * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
  *
- *****************************************************************************/ 
+ *****************************************************************************/
 
 /******************************************************************************
  * Communication protocol description
  * ==================================
- * 
- * < Describe here how the communication between the host and the card
- *   works, how the relay states are read and how the relays are set >
- * 
- *****************************************************************************/ 
+ *
+ * There is no communication. Each simulated card keeps its relay states
+ * in a bit mask (bit 0 = relay 1), get reads back this mask.
+ *
+ * Every operation first waits for the configured latency:
+ *   latency_dist = fixed    latency_us
+ *                  uniform  latency_us +/- jitter_us
+ *                  normal   latency_us + jitter_us * N(0,1)
+ *                  exp      latency_us + exponential with mean jitter_us
+ *
+ * Then it fails with probability fail_rate, or the card is unplugged
+ * with probability unplug_rate. An unplugged card fails all operations
+ * and is not detected for unplug_ms.
+ *
+ *****************************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "relay_drv.h"
+#include "relay_drv_sample.h"
+
+#ifndef BUILD_LIB
+#include "data_types.h"
+extern config_t config;
+#else
+#define SAMPLE_MAX_CARDS 16
+#endif
+
+#define SAMPLE_DEFAULT_CARDS      1
+#define SAMPLE_DEFAULT_UNPLUG_MS  1000
+
+typedef enum
+{
+   DIST_FIXED=0,
+   DIST_UNIFORM,
+   DIST_NORMAL,
+   DIST_EXP
+} latency_dist_t;
+
+typedef struct sample_card
+{
+   char serial[MAX_SERIAL_LEN];
+   uint8_t num_relays;
+   relay_mask_t relays;           /* relay states, bit 0 = relay 1 */
+   struct timespec unplugged_until;
+} sample_card_t;
+
+static sample_card_t *cards = NULL;
+static int g_num_cards = 0;
+static uint32_t g_latency_us = 0;
+static uint32_t g_jitter_us = 0;
+static latency_dist_t g_dist = DIST_FIXED;
+static double g_fail_rate = 0;
+static double g_unplug_rate = 0;
+static uint32_t g_unplug_ms = SAMPLE_DEFAULT_UNPLUG_MS;
+static unsigned short g_rand_state[3] = { 0x1234, 0x5678, 0x9abc };
+static pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Uniform random number in [0,1), must be called with sample_lock held */
+static double random_01()
+{
+   return erand48(g_rand_state);
+}
+
+/**********************************************************
+ * Internal function init_cards()
+ *
+ * Description: Create the simulated cards from the
+ *              configuration, on first use
+ *********************************************************/
+static void init_cards()
+{
+   uint8_t num_relays = SAMPLE_NUM_RELAYS;
+   int k;
+
+   if (cards != NULL)
+      return;
+
+   g_num_cards = SAMPLE_DEFAULT_CARDS;
+#ifndef BUILD_LIB
+   if (config.sample_cards > 0)
+      g_num_cards = (config.sample_cards <= SAMPLE_MAX_CARDS) ? config.sample_cards : SAMPLE_MAX_CARDS;
+   if (config.sample_num_relays >= FIRST_RELAY && config.sample_num_relays <= MAX_NUM_RELAYS)
+      num_relays = config.sample_num_relays;
+   g_latency_us = config.sample_latency_us;
+   g_jitter_us = config.sample_jitter_us;
+   if (config.sample_latency_dist != NULL)
+   {
+      if (!strcmp(config.sample_latency_dist, "uniform"))
+         g_dist = DIST_UNIFORM;
+      else if (!strcmp(config.sample_latency_dist, "normal"))
+         g_dist = DIST_NORMAL;
+      else if (!strcmp(config.sample_latency_dist, "exp"))
+         g_dist = DIST_EXP;
+   }
+   g_fail_rate = config.sample_fail_rate;
+   g_unplug_rate = config.sample_unplug_rate;
+   if (config.sample_unplug_ms > 0)
+      g_unplug_ms = config.sample_unplug_ms;
+#endif
+
+   cards = calloc(g_num_cards, sizeof(sample_card_t));
+   for (k=0; k<g_num_cards; k++)
+   {
+      sprintf(cards[k].serial, "SIM%04d", k+1);
+      cards[k].num_relays = num_relays;
+#ifndef BUILD_LIB
+      if (config.sample_serial[k] != NULL)
+         snprintf(cards[k].serial, MAX_SERIAL_LEN, "%s", config.sample_serial[k]);
+      if (config.sample_card_num_relays[k] >= FIRST_RELAY && config.sample_card_num_relays[k] <= MAX_NUM_RELAYS)
+         cards[k].num_relays = config.sample_card_num_relays[k];
+#endif
+   }
+}
+
+/**********************************************************
+ * Internal function simulate_latency()
+ *
+ * Description: Wait for the configured operation latency
+ *********************************************************/
+static void simulate_latency()
+{
+   struct timespec ts;
+   double us = g_latency_us;
+   double u1, u2;
+
+   if (g_latency_us == 0 && g_jitter_us == 0)
+      return;
+
+   pthread_mutex_lock(&sample_lock);
+   u1 = random_01();
+   u2 = random_01();
+   pthread_mutex_unlock(&sample_lock);
+
+   switch (g_dist)
+   {
+      case DIST_UNIFORM:
+         us += g_jitter_us * (2*u1 - 1);
+         break;
+      case DIST_NORMAL:
+         us += g_jitter_us * sqrt(-2*log(1-u1)) * cos(2*M_PI*u2);
+         break;
+      case DIST_EXP:
+         us += -(double)g_jitter_us * log(1-u1);
+         break;
+      default:
+         break;
+   }
+   if (us <= 0)
+      return;
+
+   ts.tv_sec = (time_t)(us / 1000000);
+   ts.tv_nsec = (long)(us - ts.tv_sec*1000000.0) * 1000;
+   nanosleep(&ts, NULL);
+}
+
+static int is_unplugged(sample_card_t *card)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec < card->unplugged_until.tv_sec ||
+           (now.tv_sec == card->unplugged_until.tv_sec && now.tv_nsec < card->unplugged_until.tv_nsec));
+}
+
+/**********************************************************
+ * Internal function find_card()
+ *
+ * Description: Find a plugged card by serial number
+ *
+ * Parameters: serial (in) - serial number, NULL or "" for
+ *                           the first card
+ *
+ * Return:   card - success
+ *           NULL - no such card
+ *********************************************************/
+static sample_card_t *find_card(char *serial)
+{
+   int k;
+
+   init_cards();
+   for (k=0; k<g_num_cards; k++)
+   {
+      if (is_unplugged(&cards[k]))
+         continue;
+      if (serial == NULL || serial[0] == 0 || !strcmp(serial, cards[k].serial))
+         return &cards[k];
+   }
+   return NULL;
+}
+
+/**********************************************************
+ * Internal function start_operation()
+ *
+ * Description: Simulate the latency and inject failures for
+ *              one operation on a card
+ *
+ * Return:   card - success
+ *           NULL - card not present or operation failed
+ *********************************************************/
+static sample_card_t *start_operation(char *serial)
+{
+   sample_card_t *card;
+   struct timespec now;
+   double r;
+
+   simulate_latency();
+
+   if ((card = find_card(serial)) == NULL)
+   {
+      fprintf(stderr, "unable to open simulated card %s\n", serial ? serial : "");
+      return NULL;
+   }
+
+   pthread_mutex_lock(&sample_lock);
+   r = random_01();
+   pthread_mutex_unlock(&sample_lock);
+
+   if (r < g_unplug_rate)
+   {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      now.tv_sec += g_unplug_ms / 1000;
+      now.tv_nsec += (g_unplug_ms % 1000) * 1000000L;
+      if (now.tv_nsec >= 1000000000L)
+      {
+         now.tv_sec++;
+         now.tv_nsec -= 1000000000L;
+      }
+      card->unplugged_until = now;
+      fprintf(stderr, "simulated card %s unplugged\n", card->serial);
+      return NULL;
+   }
+   if (r < g_unplug_rate + g_fail_rate)
+   {
+      fprintf(stderr, "simulated I/O error on card %s\n", card->serial);
+      return NULL;
+   }
+   return card;
+}
 
 
 /**********************************************************
  * Function detect_relay_card_sample()
- * 
- * Description: Detect the port used for communicating 
- *              with the sample relay card
- * 
+ *
+ * Description: Detect the simulated relay cards
+ *
  * Parameters: portname (out) - pointer to a string where
  *                              the detected com port will
  *                              be stored
  *             num_relays(out)- pointer to number of relays
- * 
+ *             serial         - serial number, "" returns
+ *                              the serial of the first card
+ *             relay_info     - list of all detected cards
+ *
  * Return:  0 - success
  *         -1 - fail, no relay card found
  *********************************************************/
-int detect_relay_card_sample(char* portname, uint8_t* num_relays, char* serial)
+int detect_relay_card_sample(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info)
 {
+   sample_card_t *card;
+   relay_info_t* rinfo;
+   int k;
+
+   init_cards();
+
+   /* Find all simulated cards, if requested */
+   if (relay_info)
+   {
+      for (k=0; k<g_num_cards; k++)
+      {
+         if (is_unplugged(&cards[k]))
+            continue;
+         // Allocate new struct, stop listing when out of memory
+         if ((rinfo = crelay_new_relay_info()) == NULL)
+         {
+            break;
+         }
+         // Save serial number and type in current relay info struct
+         (*relay_info)->relay_type = SAMPLE_RELAY_TYPE;
+         (*relay_info)->num_relays = cards[k].num_relays;
+         strcpy((*relay_info)->serial, cards[k].serial);
+         // Link current to new struct
+         (*relay_info)->next = rinfo;
+         // Move pointer to new struct
+         *relay_info = rinfo;
+      }
+      return -1;
+   }
+
+   if ((card = find_card(serial)) == NULL)
+   {
+      return -1;
+   }
+
+   /* Return parameters */
+   if (serial != NULL && serial[0] == 0)
+      strcpy(serial, card->serial);
+   if (num_relays)
+      *num_relays = card->num_relays;
+   if (portname)
+      sprintf(portname, "Simulated %s", card->serial);
+
    return 0;
 }
 
 
 /**********************************************************
  * Function get_relay_sample()
- * 
+ *
  * Description: Get the current relay state
- * 
+ *
  * Parameters: portname (in)     - communication port
  *             relay (in)        - relay number
  *             relay_state (out) - current relay state
- * 
+ *
  * Return:   0 - success
- *          -1 - fail
+ *          <0 - fail
  *********************************************************/
 int get_relay_sample(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial)
 {
+   sample_card_t *card;
+
+   if ((card = start_operation(serial)) == NULL)
+   {
+      return -2;
+   }
+
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+card->num_relays-1))
+   {
+      fprintf(stderr, "ERROR: Relay number out of range\n");
+      return -1;
+   }
+
+   *relay_state = (card->relays & RELAY_BIT(relay)) ? ON : OFF;
    return 0;
 }
 
 
 /**********************************************************
  * Function set_relay_sample()
- * 
+ *
  * Description: Set new relay state
- * 
+ *
  * Parameters: portname (in)     - communication port
  *             relay (in)        - relay number
  *             relay_state (in)  - current relay state
- * 
- * Return:   o - success
- *          -1 - fail
+ *
+ * Return:   0 - success
+ *          <0 - fail
  *********************************************************/
 int set_relay_sample(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
-{ 
+{
+   sample_card_t *card;
+
+   if ((card = start_operation(serial)) == NULL)
+   {
+      return -2;
+   }
+
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+card->num_relays-1))
+   {
+      fprintf(stderr, "ERROR: Relay number out of range\n");
+      return -1;
+   }
+
+   pthread_mutex_lock(&sample_lock);
+   if (relay_state == OFF)
+      card->relays &= ~RELAY_BIT(relay);
+   else
+      card->relays |= RELAY_BIT(relay);
+   pthread_mutex_unlock(&sample_lock);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function get_relay_mask_sample()
+ * 
+ * Description: Get the state of all relays
+ * 
+ * Parameters: portname (in)     - communication port
+ *             values (out)      - relay states (1 = ON)
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int get_relay_mask_sample(char* portname, relay_mask_t* values, char* serial)
+{
+   sample_card_t *card;
+
+   if ((card = start_operation(serial)) == NULL)
+   {
+      return -2;
+   }
+
+   *values = card->relays;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_mask_sample()
+ *
+ * Description: Set the state of several relays at once
+ *
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change
+ *             values (in)       - new relay states (1 = ON)
+ *
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_sample(char* portname, relay_mask_t mask, relay_mask_t values, char* serial)
+{
+   sample_card_t *card;
+
+   if ((card = start_operation(serial)) == NULL)
+   {
+      return -2;
+   }
+
+   mask &= RELAY_MASK_ALL(card->num_relays);
+
+   pthread_mutex_lock(&sample_lock);
+   card->relays = (card->relays & ~mask) | (values & mask);
+   pthread_mutex_unlock(&sample_lock);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_all_relays_sample()
+ *
+ * Description: Switch all relays on or off at once
+ *
+ * Parameters: portname (in)     - communication port
+ *             relay_state (in)  - new relay state
+ *
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_all_relays_sample(char* portname, relay_state_t relay_state, char* serial)
+{
+   return set_relay_mask_sample(portname, (relay_mask_t)~0, (relay_state == OFF) ? 0 : (relay_mask_t)~0, serial);
+}
+
+int close_sample()
+{
+   return 0;
+}
+
+int free_static_mem_sample()
+{
+   free(cards);
+   cards = NULL;
+   g_num_cards = 0;
    return 0;
 }
- 
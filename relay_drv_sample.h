@@ -1,16 +1,10 @@
 /******************************************************************************
  * 
- * Relay card control utility: Driver for <XYZ> relay card
- *   <Link to relay cards product web page>
+ * Relay card control utility: Driver for simulated relay cards
  * 
  * Description:
- *   <Short description of what is implemented in this file>
- * 
- * Build instructions:
- *   gcc -c relay_drv_sample.c
- * 
- * Last modified:
- *   <date>
+ *   This software is used to simulate relay cards for testing.
+ *   This file contains the declarations of the specific functions.
  * 
  * Copyright 2015, <your name>
  * 
@@ -37,8 +31,7 @@
 /**********************************************************
  * Function detect_relay_card_sample()
  * 
- * Description: Detect the port used for communicating 
- *              with the sample relay card
+ * Description: Detect the simulated relay cards
  * 
  * Parameters: portname (out) - pointer to a string where
  *                              the detected com port will
@@ -48,8 +41,7 @@
  * Return:  0 - success
  *         -1 - fail, no relay card found
  *********************************************************/
-int detect_relay_card_sample(char* portname, uint8_t* num_relays, char* serial)
-
+int detect_relay_card_sample(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info);
 
 /**********************************************************
  * Function get_relay_sample()
@@ -65,7 +57,6 @@ int detect_relay_card_sample(char* portname, uint8_t* num_relays, char* serial)
  *********************************************************/
 int get_relay_sample(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial);
 
-
 /**********************************************************
  * Function set_relay_sample()
  * 
@@ -80,4 +71,48 @@ int get_relay_sample(char* portname, uint8_t relay, relay_state_t* relay_state,
  *********************************************************/
 int set_relay_sample(char* portname, uint8_t relay, relay_state_t relay_state, char* serial);
 
+/**********************************************************
+ * Function get_relay_mask_sample()
+ * 
+ * Description: Get the state of all relays at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             values (out)      - relay states (1 = ON)
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int get_relay_mask_sample(char* portname, relay_mask_t* values, char* serial);
+
+/**********************************************************
+ * Function set_relay_mask_sample()
+ * 
+ * Description: Set the state of several relays at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             mask (in)         - relays to change
+ *             values (in)       - new relay states (1 = ON)
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int set_relay_mask_sample(char* portname, relay_mask_t mask, relay_mask_t values, char* serial);
+
+/**********************************************************
+ * Function set_all_relays_sample()
+ * 
+ * Description: Switch all relays on or off at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int set_all_relays_sample(char* portname, relay_state_t relay_state, char* serial);
+
+int close_sample() ;
+
+int free_static_mem_sample() ;
+
 #endif
@@ -0,0 +1,103 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Shared libusb-1.0 context
+ *
+ * Description:
+ *   All libusb-1.0 based drivers use one libusb context, created on
+ *   first use. The requests are served on the main thread, so the
+ *   transfers are synchronous libusb calls on that context, wrapped to
+ *   feed the USB metrics and probes.
+ *
+ * Build instructions:
+ *   gcc -c relay_usb.c
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <libusb-1.0/libusb.h>
+
+#include "relay_usb.h"
+#include "metrics.h"
+#include "crelay_probes.h"
+
+static libusb_context *usb_ctx = NULL;
+
+
+libusb_context *relay_usb_context()
+{
+   int r;
+
+   if (usb_ctx == NULL && (r = libusb_init(&usb_ctx)) < 0)
+   {
+      fprintf(stderr, "unable to init libusb (%s)\n", libusb_error_name(r));
+      usb_ctx = NULL;
+   }
+   return usb_ctx;
+}
+
+
+void relay_usb_exit()
+{
+   if (usb_ctx != NULL)
+   {
+      libusb_exit(usb_ctx);
+      usb_ctx = NULL;
+   }
+}
+
+
+/**********************************************************
+ * Internal function transfer_done()
+ *
+ * Description: Account a finished transfer in the metrics
+ *              and the probes
+ *********************************************************/
+static void transfer_done(int control, unsigned char ep, uint64_t start_ns, int result)
+{
+   metrics_usb_transfer(control ? METRICS_USB_CONTROL : METRICS_USB_BULK, metrics_now() - start_ns,
+                        result, result == LIBUSB_ERROR_TIMEOUT);
+   CRELAY_PROBE3(usb__done, ep, result, control);
+}
+
+
+int relay_usb_control(libusb_device_handle *dev, uint8_t reqtype, uint8_t request, uint16_t value, uint16_t index,
+                      unsigned char *data, uint16_t len, unsigned int timeout)
+{
+   uint64_t t0 = metrics_now();
+   int r;
+
+   CRELAY_PROBE3(usb__submit, reqtype, len, 1);
+   r = libusb_control_transfer(dev, reqtype, request, value, index, data, len, timeout);
+   transfer_done(1, reqtype, t0, r);
+   return r;
+}
+
+
+int relay_usb_bulk(libusb_device_handle *dev, unsigned char endpoint, unsigned char *data, int len, unsigned int timeout)
+{
+   uint64_t t0 = metrics_now();
+   int transferred = 0;
+   int r;
+
+   CRELAY_PROBE3(usb__submit, endpoint, len, 0);
+   r = libusb_bulk_transfer(dev, endpoint, data, len, &transferred, timeout);
+   if (r == 0)
+      r = transferred;
+   transfer_done(0, endpoint, t0, r);
+   return r;
+}
@@ -0,0 +1,75 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Shared libusb-1.0 context
+ *
+ * Description:
+ *   All libusb-1.0 based drivers use one libusb context instead of
+ *   initializing libusb around each detection, and do their transfers
+ *   through wrappers which feed the USB metrics and probes.
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef relay_usb_h
+#define relay_usb_h
+
+#include <stdint.h>
+#include <libusb-1.0/libusb.h>
+
+/**********************************************************
+ * Function relay_usb_context()
+ *
+ * Description: Get the shared libusb context, create it on
+ *              first use
+ *
+ * Parameters: none
+ *
+ * Return:   libusb context
+ *           NULL - fail
+ *********************************************************/
+libusb_context *relay_usb_context();
+
+/**********************************************************
+ * Function relay_usb_control()
+ *
+ * Description: Control transfer (same semantics as
+ *              libusb_control_transfer)
+ *
+ * Return:  >=0 - number of bytes transferred
+ *          <0  - libusb error code
+ *********************************************************/
+int relay_usb_control(libusb_device_handle *dev, uint8_t reqtype, uint8_t request, uint16_t value, uint16_t index,
+                      unsigned char *data, uint16_t len, unsigned int timeout);
+
+/**********************************************************
+ * Function relay_usb_bulk()
+ *
+ * Description: Bulk transfer
+ *
+ * Return:  >=0 - number of bytes transferred
+ *          <0  - libusb error code
+ *********************************************************/
+int relay_usb_bulk(libusb_device_handle *dev, unsigned char endpoint, unsigned char *data, int len, unsigned int timeout);
+
+/**********************************************************
+ * Function relay_usb_exit()
+ *
+ * Description: Release the shared libusb context
+ *********************************************************/
+void relay_usb_exit();
+
+#endif
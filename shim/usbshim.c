@@ -0,0 +1,852 @@
+/******************************************************************************
+ *
+ * Relay card control utility: USB library shim for driver tests
+ *
+ * Description:
+ *   LD_PRELOAD library which replaces the entry points of libusb-1.0,
+ *   libftdi and hidapi used by the crelay drivers with virtual devices.
+ *   Each emulated card implements enough of its protocol for the drivers
+ *   to detect it and to read back the relay states they set. Every call
+ *   can be logged and is counted, and transfers get a configurable
+ *   latency, so the open/transfer count and the time per API call of
+ *   each driver can be measured without hardware.
+ *
+ * Build instructions:
+ *   make shim
+ *
+ * Usage:
+ *   CRELAY_SHIM_DEVICES=<dev>[,<dev>...] LD_PRELOAD=shim/libusbshim.so crelay ...
+ *
+ *   <dev> is one of
+ *     ftdi:<serial>          FTDI 0403:6001 (Sainsmart 4/8, CGE8)
+ *     cp2104:<serial>        CP2104 10c4:ea60 (Conrad 4 channel)
+ *     ch340                  CH340 1a86:7523 (Sainsmart 16 CH340)
+ *     hidrelay:<id>:<n>      HID relay 16c0:05df with <n> relays
+ *     sainsmart16            Sainsmart 16 channel USB-HID 045e:0040
+ *
+ *   Environment:
+ *     CRELAY_SHIM_LATENCY_US  latency of each transfer (default 0)
+ *     CRELAY_SHIM_OPEN_US     latency of each device open (default 0)
+ *     CRELAY_SHIM_LOG         file where each call is logged ("-" for
+ *                             stderr), the call counts are appended at exit
+ *     CRELAY_SHIM_STATS       if set, print the call counts to stderr at exit
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <wchar.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <libusb-1.0/libusb.h>
+#include <ftdi.h>
+#include <hidapi/hidapi.h>
+
+#define SHIM_MAX_DEVS   32
+#define SHIM_MAX_FUNCS  64
+
+typedef enum
+{
+   DEV_FTDI=0,
+   DEV_CP2104,
+   DEV_CH340,
+   DEV_HIDRELAY,
+   DEV_SAINSMART16
+} shim_kind_t;
+
+typedef struct shim_dev
+{
+   shim_kind_t kind;
+   uint16_t vid;
+   uint16_t pid;
+   char serial[32];
+   int num_relays;
+   uint16_t state;                /* relay bits or FTDI pins / CP2104 latch */
+   unsigned char bitmode;         /* FTDI bitmode */
+   unsigned char response[16];    /* pending HID read data */
+   int response_len;
+} shim_dev_t;
+
+/* Call counters */
+typedef struct
+{
+   const char *name;
+   unsigned long count;
+} shim_func_t;
+
+static shim_dev_t devs[SHIM_MAX_DEVS];
+static int num_devs = 0;
+static unsigned int latency_us = 0;
+static unsigned int open_us = 0;
+static FILE *log_file = NULL;
+static int print_stats = 0;
+static shim_func_t funcs[SHIM_MAX_FUNCS];
+static int num_funcs = 0;
+static pthread_mutex_t shim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Sainsmart 16 channel read bitmap position of each relay */
+static const uint8_t relay_bit_pos[] = {7 , 8 , 6 , 9 , 5 , 10, 4 , 11, 3 , 12, 2 , 13, 1 , 14, 0 , 15};
+
+
+/**********************************************************
+ * Internal function shim_call()
+ *
+ * Description: Count a call and write it to the log
+ *********************************************************/
+static void shim_call(const char *name, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void shim_call(const char *name, const char *fmt, ...)
+{
+   struct timespec ts;
+   va_list ap;
+   int k;
+
+   pthread_mutex_lock(&shim_lock);
+   for (k=0; k<num_funcs; k++)
+   {
+      if (funcs[k].name == name || !strcmp(funcs[k].name, name))
+         break;
+   }
+   if (k == num_funcs && num_funcs < SHIM_MAX_FUNCS)
+   {
+      funcs[k].name = name;
+      funcs[k].count = 0;
+      num_funcs++;
+   }
+   if (k < SHIM_MAX_FUNCS)
+      funcs[k].count++;
+
+   if (log_file != NULL)
+   {
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      fprintf(log_file, "%ld.%06ld %s ", (long)ts.tv_sec, ts.tv_nsec/1000, name);
+      va_start(ap, fmt);
+      vfprintf(log_file, fmt, ap);
+      va_end(ap);
+      fputc('\n', log_file);
+      fflush(log_file);
+   }
+   pthread_mutex_unlock(&shim_lock);
+}
+
+static void shim_sleep(unsigned int us)
+{
+   struct timespec ts;
+
+   if (us == 0)
+      return;
+   ts.tv_sec = us / 1000000;
+   ts.tv_nsec = (us % 1000000) * 1000L;
+   while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+      ;
+}
+
+__attribute__((constructor))
+static void shim_init()
+{
+   char *spec, *item, *save = NULL;
+   char *env;
+   shim_dev_t *dev;
+
+   if ((env = getenv("CRELAY_SHIM_LATENCY_US")) != NULL)
+      latency_us = atoi(env);
+   if ((env = getenv("CRELAY_SHIM_OPEN_US")) != NULL)
+      open_us = atoi(env);
+   if ((env = getenv("CRELAY_SHIM_LOG")) != NULL)
+      log_file = strcmp(env, "-") ? fopen(env, "w") : stderr;
+   print_stats = (getenv("CRELAY_SHIM_STATS") != NULL);
+
+   if ((env = getenv("CRELAY_SHIM_DEVICES")) == NULL)
+      return;
+
+   spec = strdup(env);
+   for (item = strtok_r(spec, ",", &save); item != NULL && num_devs < SHIM_MAX_DEVS; item = strtok_r(NULL, ",", &save))
+   {
+      dev = &devs[num_devs];
+      memset(dev, 0, sizeof(shim_dev_t));
+      dev->num_relays = 8;
+      if (!strncmp(item, "ftdi:", 5))
+      {
+         dev->kind = DEV_FTDI; dev->vid = 0x0403; dev->pid = 0x6001;
+         snprintf(dev->serial, sizeof(dev->serial), "%s", item+5);
+      }
+      else if (!strncmp(item, "cp2104:", 7))
+      {
+         dev->kind = DEV_CP2104; dev->vid = 0x10c4; dev->pid = 0xea60;
+         snprintf(dev->serial, sizeof(dev->serial), "%s", item+7);
+         dev->num_relays = 4;
+         dev->state = 0xff;      /* latch bits are active low */
+      }
+      else if (!strcmp(item, "ch340"))
+      {
+         dev->kind = DEV_CH340; dev->vid = 0x1a86; dev->pid = 0x7523;
+         dev->num_relays = 16;
+      }
+      else if (!strncmp(item, "hidrelay:", 9))
+      {
+         dev->kind = DEV_HIDRELAY; dev->vid = 0x16c0; dev->pid = 0x05df;
+         snprintf(dev->serial, 6, "%.*s", (int)strcspn(item+9, ":"), item+9);
+         if (strchr(item+9, ':') != NULL)
+            dev->num_relays = atoi(strchr(item+9, ':')+1);
+      }
+      else if (!strcmp(item, "sainsmart16"))
+      {
+         dev->kind = DEV_SAINSMART16; dev->vid = 0x045e; dev->pid = 0x0040;
+         dev->num_relays = 16;
+      }
+      else
+      {
+         fprintf(stderr, "usbshim: unknown device '%s'\n", item);
+         continue;
+      }
+      num_devs++;
+   }
+   free(spec);
+}
+
+__attribute__((destructor))
+static void shim_fini()
+{
+   int k;
+
+   for (k=0; k<num_funcs; k++)
+   {
+      if (log_file != NULL)
+         fprintf(log_file, "calls %s %lu\n", funcs[k].name, funcs[k].count);
+      if (print_stats)
+         fprintf(stderr, "usbshim: %-36s %lu\n", funcs[k].name, funcs[k].count);
+   }
+   if (log_file != NULL && log_file != stderr)
+      fclose(log_file);
+}
+
+static int is_usb_kind(shim_dev_t *dev)
+{
+   return (dev->kind == DEV_FTDI || dev->kind == DEV_CP2104 || dev->kind == DEV_CH340);
+}
+
+
+/******************************************************************************
+ * libusb-1.0
+ *****************************************************************************/
+
+struct libusb_context
+{
+   int refs;
+};
+
+struct libusb_device
+{
+   shim_dev_t *dev;
+};
+
+struct libusb_device_handle
+{
+   struct libusb_device *device;
+};
+
+static struct libusb_device usb_devices[SHIM_MAX_DEVS];
+
+/**********************************************************
+ * Internal function usb_control()
+ *
+ * Description: Emulate a control request, only the CP2104
+ *              GPIO latch requests have an effect
+ *
+ * Return: number of bytes transferred
+ *********************************************************/
+static int usb_control(shim_dev_t *dev, uint8_t reqtype, uint8_t request, uint16_t value, uint16_t index,
+                       unsigned char *data, uint16_t len)
+{
+   uint8_t mask, states;
+
+   if (dev->kind == DEV_CP2104 && request == 0xFF)
+   {
+      if (value == 0x37E1)
+      {
+         /* Write latch: wIndex = states << 8 | mask */
+         mask = index & 0xff;
+         states = index >> 8;
+         dev->state = (dev->state & ~mask) | (states & mask);
+         return 0;
+      }
+      if (value == 0x00C2 && len >= 1)
+      {
+         data[0] = dev->state & 0xff;
+         return 1;
+      }
+   }
+   if (reqtype & LIBUSB_ENDPOINT_IN)
+      memset(data, 0, len);
+   return len;
+}
+
+int libusb_init(libusb_context **ctx)
+{
+   shim_call("libusb_init", "%p", (void *)ctx);
+   if (ctx != NULL)
+      *ctx = calloc(1, sizeof(libusb_context));
+   return 0;
+}
+
+void libusb_exit(libusb_context *ctx)
+{
+   shim_call("libusb_exit", "%p", (void *)ctx);
+   free(ctx);
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+   ssize_t n = 0;
+   int k;
+
+   shim_call("libusb_get_device_list", "%p", (void *)ctx);
+   shim_sleep(open_us);
+   *list = calloc(num_devs+1, sizeof(libusb_device *));
+   for (k=0; k<num_devs; k++)
+   {
+      if (!is_usb_kind(&devs[k]))
+         continue;
+      usb_devices[k].dev = &devs[k];
+      (*list)[n++] = &usb_devices[k];
+   }
+   return n;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref)
+{
+   shim_call("libusb_free_device_list", "%d", unref);
+   free(list);
+}
+
+libusb_device *libusb_ref_device(libusb_device *dev)
+{
+   return dev;
+}
+
+void libusb_unref_device(libusb_device *dev)
+{
+}
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+   shim_call("libusb_get_device_descriptor", "%04x:%04x", dev->dev->vid, dev->dev->pid);
+   memset(desc, 0, sizeof(*desc));
+   desc->bLength = 18;
+   desc->idVendor = dev->dev->vid;
+   desc->idProduct = dev->dev->pid;
+   desc->iManufacturer = 1;
+   desc->iProduct = 2;
+   desc->iSerialNumber = 3;
+   return 0;
+}
+
+uint8_t libusb_get_device_address(libusb_device *dev)
+{
+   return (uint8_t)(dev - usb_devices) + 1;
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev)
+{
+   return 1;
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle)
+{
+   return dev_handle->device;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **handle)
+{
+   shim_call("libusb_open", "%04x:%04x %s", dev->dev->vid, dev->dev->pid, dev->dev->serial);
+   shim_sleep(open_us);
+   *handle = calloc(1, sizeof(libusb_device_handle));
+   (*handle)->device = dev;
+   return 0;
+}
+
+void libusb_close(libusb_device_handle *handle)
+{
+   shim_call("libusb_close", "%s", handle->device->dev->serial);
+   free(handle);
+}
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle *handle, uint8_t desc_index, unsigned char *data, int length)
+{
+   const char *s;
+
+   shim_call("libusb_get_string_descriptor_ascii", "%u", desc_index);
+   shim_sleep(latency_us);
+   switch (desc_index)
+   {
+      case 1:  s = "crelay shim"; break;
+      case 2:  s = "virtual relay card"; break;
+      default: s = handle->device->dev->serial; break;
+   }
+   snprintf((char *)data, length, "%s", s);
+   return strlen((char *)data);
+}
+
+const char *libusb_error_name(int errcode)
+{
+   switch (errcode)
+   {
+      case LIBUSB_SUCCESS:             return "LIBUSB_SUCCESS";
+      case LIBUSB_ERROR_IO:            return "LIBUSB_ERROR_IO";
+      case LIBUSB_ERROR_NO_DEVICE:     return "LIBUSB_ERROR_NO_DEVICE";
+      case LIBUSB_ERROR_NOT_FOUND:     return "LIBUSB_ERROR_NOT_FOUND";
+      case LIBUSB_ERROR_TIMEOUT:       return "LIBUSB_ERROR_TIMEOUT";
+      case LIBUSB_ERROR_PIPE:          return "LIBUSB_ERROR_PIPE";
+      case LIBUSB_ERROR_INTERRUPTED:   return "LIBUSB_ERROR_INTERRUPTED";
+      case LIBUSB_ERROR_NO_MEM:        return "LIBUSB_ERROR_NO_MEM";
+      default:                         return "LIBUSB_ERROR_OTHER";
+   }
+}
+
+int libusb_set_configuration(libusb_device_handle *handle, int configuration)
+{
+   shim_call("libusb_set_configuration", "%d", configuration);
+   return 0;
+}
+
+int libusb_claim_interface(libusb_device_handle *handle, int interface_number)
+{
+   shim_call("libusb_claim_interface", "%d", interface_number);
+   return 0;
+}
+
+int libusb_release_interface(libusb_device_handle *handle, int interface_number)
+{
+   shim_call("libusb_release_interface", "%d", interface_number);
+   return 0;
+}
+
+int libusb_kernel_driver_active(libusb_device_handle *handle, int interface_number)
+{
+   return 0;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle *handle, int interface_number)
+{
+   shim_call("libusb_detach_kernel_driver", "%d", interface_number);
+   return 0;
+}
+
+int libusb_set_auto_detach_kernel_driver(libusb_device_handle *handle, int enable)
+{
+   return 0;
+}
+
+int libusb_control_transfer(libusb_device_handle *handle, uint8_t request_type, uint8_t bRequest, uint16_t wValue,
+                            uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+   int r;
+
+   shim_call("libusb_control_transfer", "%02x %02x %04x %04x %u", request_type, bRequest, wValue, wIndex, wLength);
+   shim_sleep(latency_us);
+   pthread_mutex_lock(&shim_lock);
+   r = usb_control(handle->device->dev, request_type, bRequest, wValue, wIndex, data, wLength);
+   pthread_mutex_unlock(&shim_lock);
+   return r;
+}
+
+int libusb_bulk_transfer(libusb_device_handle *handle, unsigned char endpoint, unsigned char *data, int length,
+                         int *actual_length, unsigned int timeout)
+{
+   shim_call("libusb_bulk_transfer", "%02x %d", endpoint, length);
+   shim_sleep(latency_us);
+   if (endpoint & LIBUSB_ENDPOINT_IN)
+      memset(data, 0, length);
+   if (actual_length)
+      *actual_length = length;
+   return 0;
+}
+
+
+/******************************************************************************
+ * libftdi
+ *****************************************************************************/
+
+struct ftdi_context *ftdi_new(void)
+{
+   shim_call("ftdi_new", "%s", "");
+   return calloc(1, sizeof(struct ftdi_context));
+}
+
+void ftdi_free(struct ftdi_context *ftdi)
+{
+   shim_call("ftdi_free", "%s", "");
+   if (ftdi != NULL && ftdi->usb_dev != NULL)
+      free(ftdi->usb_dev);
+   free(ftdi);
+}
+
+int ftdi_usb_open_desc(struct ftdi_context *ftdi, int vendor, int product, const char* description, const char* serial)
+{
+   int k;
+
+   shim_call("ftdi_usb_open_desc", "%04x:%04x %s", vendor, product, serial ? serial : "(first)");
+   shim_sleep(open_us);
+   for (k=0; k<num_devs; k++)
+   {
+      if (devs[k].kind == DEV_FTDI && devs[k].vid == vendor && devs[k].pid == product &&
+          (serial == NULL || !strcmp(serial, devs[k].serial)))
+      {
+         usb_devices[k].dev = &devs[k];
+         ftdi->usb_dev = calloc(1, sizeof(libusb_device_handle));
+         ftdi->usb_dev->device = &usb_devices[k];
+         ftdi->type = TYPE_R;
+         return 0;
+      }
+   }
+   return -3;
+}
+
+int ftdi_usb_close(struct ftdi_context *ftdi)
+{
+   shim_call("ftdi_usb_close", "%s", "");
+   free(ftdi->usb_dev);
+   ftdi->usb_dev = NULL;
+   return 0;
+}
+
+static shim_dev_t *ftdi_dev(struct ftdi_context *ftdi)
+{
+   return (ftdi != NULL && ftdi->usb_dev != NULL) ? ftdi->usb_dev->device->dev : NULL;
+}
+
+int ftdi_set_bitmode(struct ftdi_context *ftdi, unsigned char bitmask, unsigned char mode)
+{
+   shim_dev_t *dev = ftdi_dev(ftdi);
+
+   shim_call("ftdi_set_bitmode", "%02x %u", bitmask, mode);
+   if (dev == NULL)
+      return -2;
+   shim_sleep(latency_us);
+   dev->bitmode = mode;
+   return 0;
+}
+
+int ftdi_read_pins(struct ftdi_context *ftdi, unsigned char *pins)
+{
+   shim_dev_t *dev = ftdi_dev(ftdi);
+
+   shim_call("ftdi_read_pins", "%s", "");
+   if (dev == NULL)
+      return -2;
+   shim_sleep(latency_us);
+   *pins = dev->state & 0xff;
+   return 0;
+}
+
+int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size)
+{
+   shim_dev_t *dev = ftdi_dev(ftdi);
+   int k, relay;
+
+   shim_call("ftdi_write_data", "%d", size);
+   if (dev == NULL)
+      return -666;
+   shim_sleep(latency_us);
+
+   pthread_mutex_lock(&shim_lock);
+   if (dev->bitmode != BITMODE_RESET)
+   {
+      /* Bitbang: the last byte written drives the pins */
+      if (size > 0)
+         dev->state = buf[size-1];
+   }
+   else
+   {
+      /* CGE8: 'R' 'L' 'Y' <n> <v> frames */
+      for (k=0; k+5<=size; k+=5)
+      {
+         if (memcmp(buf+k, "RLY", 3))
+            continue;
+         relay = buf[k+3] - '1';
+         if (relay < 0 || relay > 15)
+            continue;
+         if (buf[k+4] == '1')
+            dev->state |= 1 << relay;
+         else
+            dev->state &= ~(1 << relay);
+      }
+   }
+   pthread_mutex_unlock(&shim_lock);
+   return size;
+}
+
+int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+   shim_call("ftdi_read_data", "%d", size);
+   shim_sleep(latency_us);
+   return 0;
+}
+
+int ftdi_read_chipid(struct ftdi_context *ftdi, unsigned int *chipid)
+{
+   shim_dev_t *dev = ftdi_dev(ftdi);
+
+   shim_call("ftdi_read_chipid", "%s", "");
+   if (dev == NULL)
+      return -2;
+   *chipid = 0x5A000000 + (unsigned int)(dev - devs);
+   return 0;
+}
+
+char *ftdi_get_error_string(struct ftdi_context *ftdi)
+{
+   return "usbshim: device not open";
+}
+
+int ftdi_set_latency_timer(struct ftdi_context *ftdi, unsigned char latency)
+{
+   shim_call("ftdi_set_latency_timer", "%u", latency);
+   return 0;
+}
+
+int ftdi_write_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize)
+{
+   shim_call("ftdi_write_data_set_chunksize", "%u", chunksize);
+   return 0;
+}
+
+
+/******************************************************************************
+ * hidapi
+ *****************************************************************************/
+
+struct hid_device_
+{
+   shim_dev_t *dev;
+};
+
+int hid_init(void)
+{
+   shim_call("hid_init", "%s", "");
+   return 0;
+}
+
+int hid_exit(void)
+{
+   shim_call("hid_exit", "%s", "");
+   return 0;
+}
+
+static wchar_t *to_wcs(const char *s)
+{
+   size_t n = strlen(s) + 1;
+   wchar_t *w = malloc(n * sizeof(wchar_t));
+
+   mbstowcs(w, s, n);
+   return w;
+}
+
+struct hid_device_info *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+   struct hid_device_info *first = NULL, **last = &first, *info;
+   char buf[32];
+   int k;
+
+   shim_call("hid_enumerate", "%04x:%04x", vendor_id, product_id);
+   shim_sleep(open_us);
+   for (k=0; k<num_devs; k++)
+   {
+      if (devs[k].kind != DEV_HIDRELAY && devs[k].kind != DEV_SAINSMART16)
+         continue;
+      if ((vendor_id != 0 && vendor_id != devs[k].vid) || (product_id != 0 && product_id != devs[k].pid))
+         continue;
+      info = calloc(1, sizeof(struct hid_device_info));
+      sprintf(buf, "shim-hid-%d", k);
+      info->path = strdup(buf);
+      info->vendor_id = devs[k].vid;
+      info->product_id = devs[k].pid;
+      info->serial_number = to_wcs(devs[k].serial);
+      if (devs[k].kind == DEV_HIDRELAY)
+         sprintf(buf, "USBRelay%d", devs[k].num_relays);
+      else
+         sprintf(buf, "Sainsmart16");
+      info->product_string = to_wcs(buf);
+      *last = info;
+      last = &info->next;
+   }
+   return first;
+}
+
+void hid_free_enumeration(struct hid_device_info *devs_list)
+{
+   struct hid_device_info *next;
+
+   shim_call("hid_free_enumeration", "%s", "");
+   while (devs_list != NULL)
+   {
+      next = devs_list->next;
+      free(devs_list->path);
+      free(devs_list->serial_number);
+      free(devs_list->product_string);
+      free(devs_list);
+      devs_list = next;
+   }
+}
+
+hid_device *hid_open_path(const char *path)
+{
+   hid_device *hid;
+   int k;
+
+   shim_call("hid_open_path", "%s", path);
+   shim_sleep(open_us);
+   if (sscanf(path, "shim-hid-%d", &k) != 1 || k < 0 || k >= num_devs)
+      return NULL;
+   hid = calloc(1, sizeof(hid_device));
+   hid->dev = &devs[k];
+   return hid;
+}
+
+hid_device *hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+   hid_device *hid;
+   char serial[32];
+   int k;
+
+   shim_call("hid_open", "%04x:%04x", vendor_id, product_id);
+   shim_sleep(open_us);
+   if (serial_number != NULL)
+      wcstombs(serial, serial_number, sizeof(serial));
+   for (k=0; k<num_devs; k++)
+   {
+      if (devs[k].vid == vendor_id && devs[k].pid == product_id &&
+          (serial_number == NULL || !strcmp(serial, devs[k].serial)))
+      {
+         hid = calloc(1, sizeof(hid_device));
+         hid->dev = &devs[k];
+         return hid;
+      }
+   }
+   return NULL;
+}
+
+void hid_close(hid_device *hid)
+{
+   shim_call("hid_close", "%s", "");
+   free(hid);
+}
+
+int hid_write(hid_device *hid, const unsigned char *data, size_t length)
+{
+   shim_dev_t *dev = hid->dev;
+   uint16_t bitmap;
+   int k;
+
+   shim_call("hid_write", "%zu", length);
+   shim_sleep(latency_us);
+
+   pthread_mutex_lock(&shim_lock);
+   if (dev->kind == DEV_HIDRELAY && length >= 3)
+   {
+      /* 00 S R: S = ff on, fe all on, fd off, fc all off */
+      switch (data[1])
+      {
+         case 0xff: dev->state |= 1 << (data[2]-1); break;
+         case 0xfd: dev->state &= ~(1 << (data[2]-1)); break;
+         case 0xfe: dev->state = (1 << dev->num_relays) - 1; break;
+         case 0xfc: dev->state = 0; break;
+      }
+   }
+   else if (dev->kind == DEV_SAINSMART16 && length >= 4)
+   {
+      if (data[0] == 0xD2)
+      {
+         /* Read command: answer with the interleaved bitmap */
+         bitmap = 0;
+         for (k=0; k<16; k++)
+         {
+            if (dev->state & (1 << k))
+               bitmap |= 1 << relay_bit_pos[k];
+         }
+         memset(dev->response, 0, sizeof(dev->response));
+         dev->response[2] = bitmap & 0xff;
+         dev->response[3] = bitmap >> 8;
+         dev->response_len = sizeof(dev->response);
+      }
+      else if (data[0] == 0xC3)
+      {
+         dev->state = data[2] | (data[3] << 8);
+      }
+   }
+   pthread_mutex_unlock(&shim_lock);
+   return length;
+}
+
+int hid_read_timeout(hid_device *hid, unsigned char *data, size_t length, int milliseconds)
+{
+   shim_dev_t *dev = hid->dev;
+   int n;
+
+   shim_call("hid_read_timeout", "%zu %d", length, milliseconds);
+   pthread_mutex_lock(&shim_lock);
+   n = dev->response_len;
+   if (n > 0)
+   {
+      if ((size_t)n > length)
+         n = length;
+      memcpy(data, dev->response, n);
+      dev->response_len = 0;
+   }
+   pthread_mutex_unlock(&shim_lock);
+
+   if (n == 0 && milliseconds > 0)
+      shim_sleep(milliseconds * 1000);
+   return n;
+}
+
+int hid_read(hid_device *hid, unsigned char *data, size_t length)
+{
+   return hid_read_timeout(hid, data, length, 0);
+}
+
+int hid_get_feature_report(hid_device *hid, unsigned char *data, size_t length)
+{
+   shim_dev_t *dev = hid->dev;
+
+   shim_call("hid_get_feature_report", "%zu", length);
+   shim_sleep(latency_us);
+   if (dev->kind != DEV_HIDRELAY || length < 9)
+      return -1;
+
+   /* C C C C C 0 ? S ? */
+   memset(data, 0, length);
+   memcpy(data, dev->serial, 5);
+   data[7] = dev->state & 0xff;
+   return 9;
+}
+
+int hid_send_feature_report(hid_device *hid, const unsigned char *data, size_t length)
+{
+   shim_call("hid_send_feature_report", "%zu", length);
+   shim_sleep(latency_us);
+   return length;
+}
+
+const wchar_t* hid_error(hid_device *hid)
+{
+   return L"usbshim error";
+}
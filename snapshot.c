@@ -0,0 +1,263 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Shared memory state snapshot
+ *
+ * Description:
+ *   The writers are serialized by a mutex, the sequence lock of the
+ *   segment only protects the readers of other processes. A change
+ *   which leaves the table as it is does not touch the segment, so
+ *   the HTTP pages reading all relays don't make the readers retry.
+ *
+ * Build instructions:
+ *   gcc -c snapshot.c
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "snapshot.h"
+#include "crelay_shm.h"
+
+static crelay_shm_t *shm = NULL;
+static char shm_name[NAME_MAX];
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint64_t now_ns()
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/* Make seq odd, the readers retry until write_end() */
+static void write_begin()
+{
+   uint32_t seq = shm->seq;
+
+   __atomic_store_n(&shm->seq, seq | 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end()
+{
+   shm->update_ns = now_ns();
+   __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Card of the table. A board without a type stands for any card
+   with its serial. */
+static crelay_shm_card_t *find_card(uint8_t type, const char *serial)
+{
+   crelay_shm_card_t *c;
+   uint32_t i;
+
+   for (i=0, c=shm->card; i<shm->num_cards; i++, c++)
+   {
+      if (!strcmp(c->serial, serial) && (c->type == type || c->type == 0 || type == 0))
+         return c;
+   }
+   return NULL;
+}
+
+/* Add a card, must be called between write_begin() and write_end() */
+static crelay_shm_card_t *add_card(uint8_t type, const char *serial)
+{
+   crelay_shm_card_t *c;
+
+   if (shm->num_cards == CRELAY_SHM_MAX_CARDS || strlen(serial) >= CRELAY_SHM_SERIAL_LEN)
+      return NULL;
+   c = &shm->card[shm->num_cards];
+   memset(c, 0, sizeof(*c));
+   strcpy(c->serial, serial);
+   shm->num_cards++;
+   return c;
+}
+
+static void set_type(crelay_shm_card_t *c, uint8_t type)
+{
+   /* Some card names are longer than MAX_RELAY_CARD_NAME_LEN */
+   char cname[CRELAY_SHM_NAME_LEN];
+
+   c->type = type;
+   if (type == NO_RELAY_TYPE || crelay_get_relay_card_name(type, cname) != 0)
+      c->name[0] = '\0';
+   else
+      snprintf(c->name, sizeof(c->name), "%s", cname);
+}
+
+int snapshot_open(const char *name, int keep)
+{
+   crelay_shm_t *p;
+   int fd;
+
+   if (strlen(name) >= sizeof(shm_name))
+      return -1;
+   if ((fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+      return -1;
+   fchmod(fd, 0644);
+   if (ftruncate(fd, sizeof(crelay_shm_t)) != 0 ||
+       (p = mmap(NULL, sizeof(crelay_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+   {
+      close(fd);
+      return -1;
+   }
+   close(fd);
+
+   /* The segment of a previous daemon may still be mapped by readers,
+      the table of the process handing over stays valid */
+   pthread_mutex_lock(&snapshot_lock);
+   shm = p;
+   snprintf(shm_name, sizeof(shm_name), "%s", name);
+   write_begin();
+   if (!keep || memcmp(shm->magic, CRELAY_SHM_MAGIC, sizeof(shm->magic)) ||
+       shm->version != CRELAY_SHM_VERSION || shm->size != sizeof(crelay_shm_t) ||
+       shm->num_cards > CRELAY_SHM_MAX_CARDS)
+   {
+      memcpy(shm->magic, CRELAY_SHM_MAGIC, sizeof(shm->magic));
+      shm->version = CRELAY_SHM_VERSION;
+      shm->size = sizeof(crelay_shm_t);
+      shm->num_cards = 0;
+      memset(shm->card, 0, sizeof(shm->card));
+   }
+   shm->pid = getpid();
+   write_end();
+   pthread_mutex_unlock(&snapshot_lock);
+   return 0;
+}
+
+void snapshot_card(relay_type_t type, const char *serial, uint8_t num_relays)
+{
+   crelay_shm_card_t *c;
+
+   if (shm == NULL || serial == NULL)
+      return;
+
+   pthread_mutex_lock(&snapshot_lock);
+   if (shm != NULL && ((c = find_card(type, serial)) == NULL || c->type != type ||
+                       (num_relays != 0 && c->num_relays != num_relays)))
+   {
+      write_begin();
+      if (c != NULL || (c = add_card(type, serial)) != NULL)
+      {
+         if (c->type != type)
+            set_type(c, type);
+         if (num_relays != 0)
+            c->num_relays = num_relays;
+      }
+      write_end();
+   }
+   pthread_mutex_unlock(&snapshot_lock);
+}
+
+void snapshot_relays(relay_type_t type, const char *serial, relay_mask_t mask, relay_mask_t values)
+{
+   crelay_shm_card_t *c;
+
+   if (shm == NULL || serial == NULL || mask == 0)
+      return;
+
+   values &= mask;
+   pthread_mutex_lock(&snapshot_lock);
+   if (shm != NULL && ((c = find_card(type, serial)) == NULL || c->type != type ||
+                       (c->known & mask) != mask || (c->state & mask) != values))
+   {
+      write_begin();
+      if (c != NULL || (c = add_card(type, serial)) != NULL)
+      {
+         if (c->type != type)
+            set_type(c, type);
+         c->state = (c->state & ~mask) | values;
+         c->known |= mask;
+         c->update_ns = now_ns();
+      }
+      write_end();
+   }
+   pthread_mutex_unlock(&snapshot_lock);
+}
+
+void snapshot_clear_boards()
+{
+   uint32_t i;
+
+   pthread_mutex_lock(&snapshot_lock);
+   if (shm != NULL)
+   {
+      write_begin();
+      for (i=0; i<shm->num_cards; i++)
+         shm->card[i].card_id = 0;
+      write_end();
+   }
+   pthread_mutex_unlock(&snapshot_lock);
+}
+
+void snapshot_board(uint16_t card_id, relay_type_t model, const char *serial, uint8_t num_relays)
+{
+   crelay_shm_card_t *c;
+
+   if (shm == NULL || serial == NULL)
+      return;
+
+   pthread_mutex_lock(&snapshot_lock);
+   if (shm != NULL)
+   {
+      write_begin();
+      if ((c = find_card(model, serial)) != NULL || (c = add_card(model, serial)) != NULL)
+      {
+         if (c->type == NO_RELAY_TYPE && model != NO_RELAY_TYPE)
+            set_type(c, model);
+         c->card_id = card_id;
+         if (c->num_relays == 0)
+            c->num_relays = num_relays;
+      }
+      write_end();
+   }
+   pthread_mutex_unlock(&snapshot_lock);
+}
+
+void snapshot_detach()
+{
+   pthread_mutex_lock(&snapshot_lock);
+   if (shm != NULL)
+   {
+      munmap(shm, sizeof(crelay_shm_t));
+      shm = NULL;
+   }
+   pthread_mutex_unlock(&snapshot_lock);
+}
+
+void snapshot_close()
+{
+   pthread_mutex_lock(&snapshot_lock);
+   if (shm != NULL)
+   {
+      munmap(shm, sizeof(crelay_shm_t));
+      shm = NULL;
+      shm_unlink(shm_name);
+   }
+   pthread_mutex_unlock(&snapshot_lock);
+}
@@ -0,0 +1,110 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Shared memory state snapshot
+ *
+ * Description:
+ *   Writer side of the snapshot described in crelay_shm.h. The driver
+ *   layer reports the detected cards and the relay states it writes
+ *   or reads, the daemon reports its boards. Without an open segment
+ *   (command line mode) all the calls do nothing.
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef snapshot_h
+#define snapshot_h
+
+#include <stdint.h>
+#include "relay_drv.h"
+
+/**********************************************************
+ * Function snapshot_open()
+ *
+ * Description: Create the shared memory segment, a segment
+ *              left by a previous daemon is reused
+ *
+ * Parameters: name (in) - segment name
+ *             keep (in) - keep the cards and relay states of
+ *                         a valid segment, for a process
+ *                         started by an upgrade
+ *
+ * Return:   0 - success, -1 - failure (errno set)
+ *********************************************************/
+int snapshot_open(const char *name, int keep);
+
+/**********************************************************
+ * Function snapshot_card()
+ *
+ * Description: Publish a detected card
+ *
+ * Parameters: type (in)       - relay card type
+ *             serial (in)     - serial number
+ *             num_relays (in) - number of relays, 0 if
+ *                               unknown
+ *********************************************************/
+void snapshot_card(relay_type_t type, const char *serial, uint8_t num_relays);
+
+/**********************************************************
+ * Function snapshot_relays()
+ *
+ * Description: Publish relay states written to or read from
+ *              a card
+ *
+ * Parameters: type (in)    - relay card type
+ *             serial (in)  - serial number
+ *             mask (in)    - relays concerned
+ *             values (in)  - their states (1 = ON)
+ *********************************************************/
+void snapshot_relays(relay_type_t type, const char *serial, relay_mask_t mask, relay_mask_t values);
+
+/**********************************************************
+ * Function snapshot_clear_boards()
+ *
+ * Description: Unbind all cards from their board number,
+ *              before the boards of a new configuration are
+ *              published
+ *********************************************************/
+void snapshot_clear_boards();
+
+/**********************************************************
+ * Function snapshot_board()
+ *
+ * Description: Publish a board of the configuration
+ *
+ * Parameters: card_id (in)    - board number
+ *             model (in)      - relay card type, 0 for any
+ *             serial (in)     - serial number
+ *             num_relays (in) - number of relays
+ *********************************************************/
+void snapshot_board(uint16_t card_id, relay_type_t model, const char *serial, uint8_t num_relays);
+
+/**********************************************************
+ * Function snapshot_detach()
+ *
+ * Description: Unmap the segment without removing it, the
+ *              daemon an upgrade hands over to reuses it
+ *********************************************************/
+void snapshot_detach();
+
+/**********************************************************
+ * Function snapshot_close()
+ *
+ * Description: Unmap and remove the segment
+ *********************************************************/
+void snapshot_close();
+
+#endif
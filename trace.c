@@ -0,0 +1,222 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Request phase tracing
+ *
+ * Description:
+ *   The phases of the request served by a thread are summed up in a
+ *   thread local record, only the finished request is copied into the
+ *   ring buffer under a short lock. The durations come from the
+ *   metrics hook points, so tracing adds no clock reads of its own to
+ *   the driver paths.
+ *
+ * Build instructions:
+ *   gcc -c trace.c
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "metrics.h"
+#include "logger.h"
+
+#define TRACE_URL_LEN 64
+
+/* One traced request */
+typedef struct
+{
+   struct timespec wall;                 /* start time */
+   uint64_t start_ns;
+   uint64_t total_ns;
+   uint64_t parse_ns;
+   uint64_t phase_ns[TRACE_NUM_PHASES];
+   uint32_t phase_calls[TRACE_NUM_PHASES];
+   int error;
+   char url[TRACE_URL_LEN];
+} trace_rec_t;
+
+static trace_rec_t ring[TRACE_RING_SIZE];
+static trace_rec_t ring_copy[TRACE_RING_SIZE];
+static unsigned int ring_next = 0;       /* total number of requests stored */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread trace_rec_t cur;
+static __thread int active = 0;
+static __thread uint64_t nested_ns = 0;  /* USB open time not yet subtracted */
+
+static uint64_t slow_ns = 0;
+static FILE *slow_file = NULL;
+
+static const char *phase_name[TRACE_NUM_PHASES] = { "detect", "open", "transfer" };
+
+
+void trace_request_begin()
+{
+   memset(&cur, 0, sizeof(cur));
+   clock_gettime(CLOCK_REALTIME, &cur.wall);
+   cur.start_ns = metrics_now();
+   nested_ns = 0;
+   active = 1;
+}
+
+void trace_request_url(const char *url)
+{
+   if (!active) return;
+   snprintf(cur.url, TRACE_URL_LEN, "%s", url);
+   cur.parse_ns = metrics_now() - cur.start_ns;
+}
+
+void trace_request_error()
+{
+   cur.error = 1;
+}
+
+void trace_phase(trace_phase_t phase, uint64_t ns)
+{
+   if (!active) return;
+
+   if (phase == TRACE_OPEN)
+   {
+      nested_ns += ns;
+   }
+   else
+   {
+      ns = (ns > nested_ns) ? ns - nested_ns : 0;
+      nested_ns = 0;
+   }
+   cur.phase_ns[phase] += ns;
+   cur.phase_calls[phase]++;
+}
+
+static uint64_t response_ns(const trace_rec_t *r)
+{
+   uint64_t busy = r->parse_ns;
+   int i;
+
+   for (i=0; i<TRACE_NUM_PHASES; i++) busy += r->phase_ns[i];
+   return (r->total_ns > busy) ? r->total_ns - busy : 0;
+}
+
+static void write_slow_log(const trace_rec_t *r)
+{
+   char line[512];
+   char stamp[32];
+   int i, n;
+
+   n = snprintf(line, sizeof(line), "slow request %s total=%.3fms parse=%.3fms", r->url,
+                r->total_ns/1e6, r->parse_ns/1e6);
+   for (i=0; i<TRACE_NUM_PHASES && n < sizeof(line); i++)
+      n += snprintf(line+n, sizeof(line)-n, " %s=%.3fms(%u)", phase_name[i], r->phase_ns[i]/1e6, r->phase_calls[i]);
+   if (n < sizeof(line))
+      snprintf(line+n, sizeof(line)-n, " response=%.3fms%s", response_ns(r)/1e6, r->error ? " error" : "");
+
+   if (slow_file != NULL)
+   {
+      strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&r->wall.tv_sec));
+      fprintf(slow_file, "%s.%03ld %s\n", stamp, r->wall.tv_nsec/1000000, line);
+   }
+   else
+   {
+      crelay_log(LOGGER_TRACE, LOG_WARNING, "%s", line);
+   }
+}
+
+void trace_request_end()
+{
+   if (!active) return;
+   active = 0;
+   cur.total_ns = metrics_now() - cur.start_ns;
+
+   pthread_mutex_lock(&ring_lock);
+   ring[ring_next % TRACE_RING_SIZE] = cur;
+   ring_next++;
+   pthread_mutex_unlock(&ring_lock);
+
+   if (slow_ns > 0 && cur.total_ns >= slow_ns)
+      write_slow_log(&cur);
+}
+
+void trace_set_slow_log(uint32_t ms, const char *file)
+{
+   trace_close();
+   slow_ns = (uint64_t)ms * 1000000;
+   if (ms > 0 && file != NULL)
+   {
+      if ((slow_file = fopen(file, "a")) == NULL)
+         crelay_log(LOGGER_TRACE, LOG_ERR, "Can't open slow log %s, using the log", file);
+      else
+         setvbuf(slow_file, NULL, _IOLBF, 0);
+   }
+}
+
+void trace_write_json(FILE *f)
+{
+   trace_rec_t *copy;
+   unsigned int first, n, i;
+   char stamp[32];
+   int k;
+
+   /* Copy the ring so the lock is not held while writing, static
+      since only the HTTP server writes */
+   copy = ring_copy;
+   pthread_mutex_lock(&ring_lock);
+   n = (ring_next < TRACE_RING_SIZE) ? ring_next : TRACE_RING_SIZE;
+   first = ring_next - n;
+   for (i=0; i<n; i++)
+      copy[i] = ring[(first+i) % TRACE_RING_SIZE];
+   pthread_mutex_unlock(&ring_lock);
+
+   fprintf(f, "{ \"meta\": { \"size\": %d, \"total\": %u }, \"data\": [ ", TRACE_RING_SIZE, first + n);
+   for (i=0; i<n; i++)
+   {
+      trace_rec_t *r = &copy[i];
+
+      strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", gmtime(&r->wall.tv_sec));
+      fprintf(f, "%s{ \"time\": \"%s.%06ldZ\", \"url\": \"", i ? " , " : "", stamp, r->wall.tv_nsec/1000);
+      /* The URL comes from the client, escape it for JSON */
+      for (k=0; r->url[k]; k++)
+      {
+         unsigned char c = r->url[k];
+
+         if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+         else if (c < 0x20) fprintf(f, "\\u%04x", c);
+         else fputc(c, f);
+      }
+      fprintf(f, "\", \"error\": %d, \"total_us\": %llu, \"parse_us\": %llu", r->error,
+              (unsigned long long)(r->total_ns/1000), (unsigned long long)(r->parse_ns/1000));
+      for (k=0; k<TRACE_NUM_PHASES; k++)
+         fprintf(f, ", \"%s_us\": %llu, \"%s_calls\": %u", phase_name[k],
+                 (unsigned long long)(r->phase_ns[k]/1000), phase_name[k], r->phase_calls[k]);
+      fprintf(f, ", \"response_us\": %llu }", (unsigned long long)(response_ns(r)/1000));
+   }
+   fprintf(f, " ] }");
+}
+
+void trace_close()
+{
+   if (slow_file != NULL)
+   {
+      fclose(slow_file);
+      slow_file = NULL;
+   }
+}
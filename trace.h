@@ -0,0 +1,118 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Request phase tracing
+ *
+ * Description:
+ *   Breaks down the time of each HTTP request into phases (parsing,
+ *   card detection, USB open, transfers, response) and keeps the
+ *   last requests in a fixed-size ring buffer, dumped by the
+ *   /api/debug/trace HTTP API call. Requests slower than a
+ *   configurable threshold are written to the slow log.
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef trace_h
+#define trace_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Number of requests kept in the ring buffer */
+#define TRACE_RING_SIZE 128
+
+typedef enum
+{
+   TRACE_DETECT = 0,    /* card detection, without USB opens */
+   TRACE_OPEN,          /* USB device open */
+   TRACE_TRANSFER,      /* get/set transfers, without USB opens */
+   TRACE_NUM_PHASES
+} trace_phase_t;
+
+/**********************************************************
+ * Function trace_request_begin()
+ *
+ * Description: Start tracing a request on the calling thread
+ *********************************************************/
+void trace_request_begin();
+
+/**********************************************************
+ * Function trace_request_url()
+ *
+ * Description: Set the URL of the current request, ends the
+ *              parse phase
+ *********************************************************/
+void trace_request_url(const char *url);
+
+/**********************************************************
+ * Function trace_request_error()
+ *
+ * Description: Mark the current request as failed
+ *********************************************************/
+void trace_request_error();
+
+/**********************************************************
+ * Function trace_request_end()
+ *
+ * Description: Finish the current request, store it in the
+ *              ring buffer and write it to the slow log if it
+ *              took longer than the threshold. The time not
+ *              spent in any phase is the response phase
+ *              (formatting and writing).
+ *********************************************************/
+void trace_request_end();
+
+/**********************************************************
+ * Function trace_phase()
+ *
+ * Description: Add time to a phase of the current request,
+ *              ignored when the thread has no request. USB
+ *              opens are nested in detection or transfers and
+ *              are subtracted from the enclosing phase.
+ *
+ * Parameters: phase (in) - phase
+ *             ns (in)    - duration
+ *********************************************************/
+void trace_phase(trace_phase_t phase, uint64_t ns);
+
+/**********************************************************
+ * Function trace_set_slow_log()
+ *
+ * Description: Configure the slow log
+ *
+ * Parameters: ms (in)   - threshold, 0 disables the log
+ *             file (in) - log file, NULL for the crelay log
+ *********************************************************/
+void trace_set_slow_log(uint32_t ms, const char *file);
+
+/**********************************************************
+ * Function trace_write_json()
+ *
+ * Description: Write the ring buffer, oldest request first
+ *
+ * Parameters: f (in) - output stream
+ *********************************************************/
+void trace_write_json(FILE *f);
+
+/**********************************************************
+ * Function trace_close()
+ *
+ * Description: Close the slow log file
+ *********************************************************/
+void trace_close();
+
+#endif